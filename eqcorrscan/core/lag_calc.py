@@ -20,7 +20,7 @@ from obspy.core.event import Catalog
 from obspy.core.event import Event, Pick, WaveformStreamID
 from obspy.core.event import ResourceIdentifier, Comment
 
-from eqcorrscan.utils.correlate import get_stream_xcorr
+from eqcorrscan.utils.correlate import batch_normxcorr, get_stream_xcorr
 from eqcorrscan.core.match_filter.family import Family
 from eqcorrscan.core.match_filter.template import Template
 from eqcorrscan.utils.plotting import plot_repicked
@@ -108,7 +108,10 @@ def _concatenate_and_correlate(streams, template, cores):
     Concatenate a list of streams into one stream and correlate that with a
     template.
 
-    All traces in a stream must have the same length.
+    All traces in a stream must have the same length. When the template has
+    one trace per channel each channel of each stream is correlated as a job
+    of :func:`eqcorrscan.utils.correlate.batch_normxcorr`, otherwise the
+    concatenated stream is correlated with the fftw backend.
     """
     UsedChannel = namedtuple("UsedChannel", "channel used")
 
@@ -125,8 +128,8 @@ def _concatenate_and_correlate(streams, template, cores):
         Logger.debug("Multiple lengths of stream found, using the longest")
     channel_length = sorted(list(channel_length))[-1]
     # pre-define stream for efficiency
-    chans = {tr.id for st in streams for tr in st}.intersection(
-        {tr.id for tr in template})
+    chans = sorted({tr.id for st in streams for tr in st}.intersection(
+        {tr.id for tr in template}))
     data = np.zeros((len(chans), channel_length * len(streams)),
                     dtype=np.float32)
 
@@ -158,6 +161,10 @@ def _concatenate_and_correlate(streams, template, cores):
     for tr in template:
         if tr.id in chans:
             _template += tr
+    if len(_template) == len(chans):
+        return _batch_correlate(
+            data, _template, chans, used_chans, channel_length,
+            template_length, cores), used_chans
     # Do correlations
     xcorr_func = get_stream_xcorr(name_or_func="fftw")
     ccc, _, chan_order = xcorr_func(
@@ -187,6 +194,36 @@ def _concatenate_and_correlate(streams, template, cores):
     return ccc_out, used_chans
 
 
+def _batch_correlate(data, template, chans, used_chans, channel_length,
+                     template_length, cores):
+    """
+    Correlate the template with the window of each stream on each channel.
+
+    :return: Correlations, (n_streams, n_channels, n_lags)
+    """
+    templates = [template.select(id=chan)[0].data for chan in chans]
+    windows, pairs, positions = [], [], []
+    for i, stream_chans in enumerate(used_chans):
+        for j, chan in enumerate(stream_chans):
+            if not chan.used:
+                continue
+            pairs.append((j, len(windows)))
+            positions.append((i, j))
+            windows.append(
+                data[j][i * channel_length:(i + 1) * channel_length])
+    ccc_out = np.zeros((len(used_chans), len(chans),
+                        channel_length - template_length + 1),
+                       dtype=np.float32)
+    if len(pairs) == 0:
+        return ccc_out
+    _, _, correlations = batch_normxcorr(
+        templates, windows, pairs=pairs, cores=cores,
+        return_correlations=True)
+    for (i, j), correlation in zip(positions, correlations):
+        ccc_out[i][j] = correlation
+    return ccc_out
+
+
 def xcorr_pick_family(family, stream, shift_len=0.2, min_cc=0.4,
                       min_cc_from_mean_cc_factor=None,
                       horizontal_chans=['E', 'N', '1', '2'],
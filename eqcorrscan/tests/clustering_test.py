@@ -7,10 +7,13 @@ import numpy as np
 import os
 import glob
 import logging
+from unittest import mock
 
 from obspy.clients.fdsn import Client
-from obspy import UTCDateTime, read, Trace
+from obspy import UTCDateTime, read, Trace, Catalog
+from obspy.core.event import Event, Origin
 from obspy.clients.fdsn.header import FDSNException
+from scipy.spatial.distance import squareform
 
 from eqcorrscan.tutorials.template_creation import mktemplates
 from eqcorrscan.utils.mag_calc import dist_calc
@@ -18,7 +21,8 @@ from eqcorrscan.utils import clustering
 from eqcorrscan.utils.clustering import (
     cross_chan_correlation, distance_matrix, cluster, group_delays, svd,
     empirical_svd, svd_to_stream, corr_cluster, dist_mat_km, catalog_cluster,
-    space_time_cluster, remove_unclustered)
+    space_time_cluster, remove_unclustered, dist_array_km, dist_pairs_km,
+    neighbour_counts_km)
 from eqcorrscan.helpers.mock_logger import MockLoggingHandler
 
 
@@ -159,6 +163,28 @@ class ClusteringTests(unittest.TestCase):
         for j, key in enumerate(shift_dict.keys()):
             self.assertEqual(len(shift_dict[key]), len(stream_list[j]))
 
+    def test_batch_distance_matrix_matches_streams(self):
+        """Check the batched correlations against the per-stream ones."""
+        state = np.random.RandomState(3)
+        stream_list = []
+        for shift in range(6):
+            st = self.st1.copy()
+            for tr in st:
+                tr.data = np.roll(tr.data, 2 * shift) + state.randn(
+                    tr.stats.npts) * 50
+            stream_list.append(st)
+        for shift_len in (0, 0.2):
+            batch = distance_matrix(
+                stream_list=[st.copy() for st in stream_list],
+                shift_len=shift_len, allow_individual_trace_shifts=False)
+            with mock.patch.object(
+                    clustering, "_batch_trace_ids", return_value=None):
+                streams = distance_matrix(
+                    stream_list=[st.copy() for st in stream_list],
+                    shift_len=shift_len, allow_individual_trace_shifts=False)
+            np.testing.assert_allclose(batch[0], streams[0], atol=1e-5)
+            np.testing.assert_allclose(batch[1], streams[1])
+
     def test_unclustered(self):
         """Test clustering on unclustered data..."""
         testing_path = os.path.join(self.testing_path, 'WAV', 'TEST_')
@@ -498,6 +524,104 @@ class DistanceClusterTests(unittest.TestCase):
                         self.assertGreater(separation, self.distance_threshold)
 
 
+class DistanceArrayTests(unittest.TestCase):
+    """ Condensed and sparse distances of a synthetic catalog. """
+    @classmethod
+    def setUpClass(cls):
+        rng = np.random.RandomState(42)
+        cls.cat = Catalog()
+        for i in range(300):
+            # Include some very close pairs and some near antipodes
+            if i % 10 == 1:
+                lat, lon = (cls.cat[-1].origins[0].latitude + 1e-3,
+                            cls.cat[-1].origins[0].longitude)
+            else:
+                lat, lon = rng.uniform(-89, 89), rng.uniform(-180, 180)
+            cls.cat.append(Event(origins=[Origin(
+                latitude=lat, longitude=lon,
+                depth=rng.uniform(0, 50000))]))
+        cls.expected = np.zeros((len(cls.cat), len(cls.cat)))
+        for i, master in enumerate(cls.cat):
+            master_ori = master.origins[0]
+            for j, slave in enumerate(cls.cat):
+                slave_ori = slave.origins[0]
+                if i == j:
+                    continue
+                cls.expected[i, j] = dist_calc(
+                    (master_ori.latitude, master_ori.longitude,
+                     master_ori.depth / 1000),
+                    (slave_ori.latitude, slave_ori.longitude,
+                     slave_ori.depth / 1000))
+
+    def test_condensed(self):
+        dist_vec = dist_array_km(self.cat, num_threads=2)
+        self.assertEqual(dist_vec.dtype, np.float32)
+        self.assertEqual(
+            len(dist_vec), len(self.cat) * (len(self.cat) - 1) // 2)
+        np.testing.assert_allclose(
+            squareform(dist_vec), self.expected, rtol=1e-5, atol=1e-2)
+
+    def test_condensed_float16(self):
+        dist_vec = dist_array_km(self.cat, dtype=np.float16)
+        self.assertEqual(dist_vec.dtype, np.float16)
+        np.testing.assert_allclose(
+            squareform(dist_vec).astype(np.float64), self.expected,
+            rtol=1e-3, atol=1e-2)
+
+    def test_linkage_matches_pdist(self):
+        """ The condensed matrix should be usable directly by linkage. """
+        from scipy.cluster.hierarchy import linkage
+        np.testing.assert_allclose(
+            linkage(dist_array_km(self.cat)),
+            linkage(squareform(self.expected, checks=False)),
+            rtol=1e-4, atol=1e-2)
+
+    def test_dist_mat_km_square(self):
+        dist_mat = dist_mat_km(self.cat)
+        self.assertTrue(np.all(dist_mat.diagonal() == 0))
+        self.assertTrue(np.all(dist_mat == dist_mat.T))
+        np.testing.assert_allclose(
+            dist_mat, self.expected, rtol=1e-5, atol=1e-2)
+
+    def test_pairs(self):
+        for cutoff in [10., 1000., 30000.]:
+            rows, cols, dists = dist_pairs_km(
+                self.cat, cutoff=cutoff, num_threads=2)
+            expected_rows, expected_cols = np.where(
+                np.triu(self.expected <= cutoff, k=1))
+            np.testing.assert_array_equal(rows, expected_rows)
+            np.testing.assert_array_equal(cols, expected_cols)
+            np.testing.assert_allclose(
+                dists, self.expected[rows, cols], rtol=1e-5, atol=1e-2)
+
+    def test_pairs_none(self):
+        rows, cols, dists = dist_pairs_km(self.cat[0:1], cutoff=100.)
+        self.assertEqual(len(rows), 0)
+        self.assertEqual(len(dists), 0)
+
+    def test_bad_dtype(self):
+        with self.assertRaises(NotImplementedError):
+            dist_array_km(self.cat, dtype=np.float64)
+
+    def test_neighbour_counts(self):
+        for cutoff in [0., 10., 1000., 30000.]:
+            counts = neighbour_counts_km(
+                self.cat, cutoff=cutoff, num_threads=2)
+            expected = (self.expected <= cutoff).sum(axis=1) - 1
+            np.testing.assert_array_equal(counts, expected)
+
+    def test_remove_unclustered_matches_brute_force(self):
+        for cutoff in [1., 500.]:
+            cat_back = remove_unclustered(
+                self.cat.copy(), cutoff, num_threads=2)
+            expected = self.expected + np.eye(len(self.cat)) * cutoff
+            keep = np.any(expected < cutoff, axis=1)
+            self.assertEqual(len(cat_back), keep.sum())
+            self.assertEqual(
+                [ev.resource_id for ev in cat_back],
+                [ev.resource_id for ev, k in zip(self.cat, keep) if k])
+
+
 @pytest.mark.network
 class ClusteringTestWarnings(unittest.TestCase):
     """Main testing routines"""
@@ -1,6 +1,7 @@
 import copy
 import itertools
 import logging
+import os
 from collections import defaultdict
 from functools import wraps
 from os.path import join
@@ -776,6 +777,1024 @@ class TestStreamCorrelateFunctionsUnstacked:
                 assert np.allclose(cc_1, cc, atol=self.atol * 100)
 
 
+@pytest.mark.serial
+class TestFFTWContext:
+    """ Check that persistent fftw contexts give the same answers """
+    atol = TestArrayCorrelateFunctions.atol
+
+    def test_context_reuse(self, multichannel_templates, multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        cc_expected, no_chans, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1)
+        with corr.FFTWContext() as context:
+            for _ in range(2):
+                cc, _no_chans, _ = func(
+                    multichannel_templates, multichannel_stream.copy(),
+                    cores=1, fftw_context=context)
+                assert len(context) == 1
+                assert np.allclose(cc, cc_expected, atol=self.atol)
+                assert np.all(_no_chans == no_chans)
+        assert len(context) == 0
+
+    def test_context_unstacked(self, multichannel_templates,
+                               multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        stream = multichannel_stream.copy()
+        for tr in stream:
+            tr.data = tr.data[0:unstacked_stream_len]
+        cc_expected, _, _ = func(
+            multichannel_templates, stream.copy(), cores=1, stack=False)
+        with corr.FFTWContext() as context:
+            for _ in range(2):
+                cc, _, _ = func(
+                    multichannel_templates, stream.copy(), cores=1,
+                    stack=False, fftw_context=context)
+                assert np.allclose(cc, cc_expected, atol=self.atol)
+
+    def test_new_templates_new_context(self, multichannel_templates,
+                                       multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        with corr.FFTWContext() as context:
+            func(multichannel_templates, multichannel_stream.copy(),
+                 cores=1, fftw_context=context)
+            func(multichannel_templates[0:5], multichannel_stream.copy(),
+                 cores=1, fftw_context=context)
+            assert len(context) == 2
+
+    def test_moments_shared(self, multichannel_templates,
+                            multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        cc_expected, _, _ = func(
+            multichannel_templates[5:], multichannel_stream.copy(), cores=1)
+        n_chans = len(multichannel_templates[0])
+        stream = multichannel_stream.copy()
+        with corr.FFTWContext() as context:
+            func(multichannel_templates[0:5], stream, cores=1,
+                 fftw_context=context)
+            held = dict(context._moments)
+            assert len(held) == n_chans
+            # Same data and template length: the moments are re-used
+            cc, _, _ = func(multichannel_templates[5:], stream, cores=1,
+                            fftw_context=context)
+            assert dict(context._moments) == held
+            assert np.allclose(cc, cc_expected, atol=self.atol)
+            # New data are kept as well
+            reversed_stream = stream.copy()
+            for tr in reversed_stream:
+                tr.data = tr.data[::-1].copy()
+            func(multichannel_templates[5:], reversed_stream, cores=1,
+                 fftw_context=context)
+            assert len(context._moments) == 2 * n_chans
+        assert len(context._moments) == 0
+        assert context._moments_bytes == 0
+
+    @pytest.mark.parametrize("n_held", [0, 1, "all"])
+    def test_moments_memory(self, multichannel_templates,
+                            multichannel_stream, n_held):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        n_chans = len(multichannel_templates[0])
+        n_held = n_chans if n_held == "all" else n_held
+        channel_bytes = 17 * (stream_len - template_len + 1)
+        stream = multichannel_stream.copy()
+        reversed_stream = stream.copy()
+        for tr in reversed_stream:
+            tr.data = tr.data[::-1].copy()
+        cc_expected, _, _ = func(
+            multichannel_templates, reversed_stream.copy(), cores=1)
+        with corr.FFTWContext(
+                moments_memory=n_held * channel_bytes) as context:
+            func(multichannel_templates, stream, cores=1,
+                 fftw_context=context)
+            held = set(context._moments)
+            assert len(held) == n_held
+            # The least recently used moments make room for new data
+            cc, _, _ = func(multichannel_templates, reversed_stream,
+                            cores=1, fftw_context=context)
+            assert len(context._moments) == n_held
+            assert not held.intersection(context._moments)
+            assert context._moments_bytes <= n_held * channel_bytes
+        assert np.allclose(cc, cc_expected, atol=self.atol)
+
+    def test_moments_not_cached(self, multichannel_templates,
+                                multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        cc_expected, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1)
+        with corr.FFTWContext(cache_moments=False) as context:
+            cc, _, _ = func(
+                multichannel_templates, multichannel_stream.copy(), cores=1,
+                fftw_context=context)
+            assert len(context._moments) == 0
+        assert np.allclose(cc, cc_expected, atol=self.atol)
+
+    def test_spectra_saved_and_loaded(self, tmpdir, monkeypatch,
+                                      multichannel_templates,
+                                      multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        spectra_dir = join(str(tmpdir), "spectra")
+        cc_expected, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1)
+        with corr.FFTWContext(spectra_dir=spectra_dir) as context:
+            func(multichannel_templates, multichannel_stream.copy(),
+                 cores=1, fftw_context=context)
+        saved = os.listdir(spectra_dir)
+        assert len(saved) == 1 and saved[0].endswith(".spectra")
+
+        def _no_create(*args, **kwargs):
+            raise AssertionError("Saved spectra should be loaded")
+
+        with corr.FFTWContext(spectra_dir=spectra_dir) as context:
+            monkeypatch.setattr(context, "_create", _no_create)
+            cc, _, _ = func(
+                multichannel_templates, multichannel_stream.copy(),
+                cores=2, fftw_context=context)
+            assert len(context) == 1
+        assert np.allclose(cc, cc_expected, atol=self.atol)
+
+    def test_bad_spectra_recomputed(self, tmpdir, multichannel_templates,
+                                    multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        spectra_dir = join(str(tmpdir), "spectra")
+        cc_expected, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1)
+        with corr.FFTWContext(spectra_dir=spectra_dir) as context:
+            func(multichannel_templates, multichannel_stream.copy(),
+                 cores=1, fftw_context=context)
+        filename = join(spectra_dir, os.listdir(spectra_dir)[0])
+        size = os.path.getsize(filename)
+        with open(filename, "r+b") as f:
+            f.truncate(size // 2)
+        with corr.FFTWContext(spectra_dir=spectra_dir) as context:
+            cc, _, _ = func(
+                multichannel_templates, multichannel_stream.copy(),
+                cores=1, fftw_context=context)
+        assert np.allclose(cc, cc_expected, atol=self.atol)
+        # Re-written when computed again
+        assert os.path.getsize(filename) == size
+
+
+class TestFFTWOuterThreading:
+    """ Check that threading over and within channels gives the same ccs """
+    atol = TestArrayCorrelateFunctions.atol
+
+    def test_outer_threads_match(self, multichannel_templates,
+                                 multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        cc_inner, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=2,
+            cores_outer=1)
+        cc_outer, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=2)
+        assert np.allclose(cc_inner, cc_outer, atol=self.atol)
+
+    def test_inner_threaded_chunks_match(self, multichannel_templates,
+                                         multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        cc_serial, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=1, fft_len=2 ** 10)
+        cc_chunked, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=4,
+            cores_outer=1, fft_len=2 ** 10)
+        assert np.allclose(cc_serial, cc_chunked, atol=self.atol)
+
+    def test_private_stacks_match(self, multichannel_templates,
+                                  multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        cc_atomic, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=4, fftw_stack_memory=0)
+        cc_private, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=4)
+        assert np.allclose(cc_atomic, cc_private, atol=self.atol)
+
+    def test_tiled_stacks_match(self, multichannel_templates,
+                                multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        n_templates = len(multichannel_templates)
+        cc_atomic, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=4, fftw_stack_memory=0, fft_len=2 ** 10)
+        # Room for tiles of about 16 chunks per thread
+        cc_tiled, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=4, fft_len=2 ** 10,
+            fftw_stack_memory=4 * 4 * n_templates * 2 ** 14)
+        assert np.allclose(cc_atomic, cc_tiled, atol=self.atol)
+
+    def test_outer_threads_unstacked(self, multichannel_templates,
+                                     multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        cc_inner, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=1, stack=False)
+        cc_outer, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=4, stack=False)
+        assert np.allclose(cc_inner, cc_outer, atol=self.atol)
+
+    def test_numa_layout_matches(self, multichannel_templates,
+                                 multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        cc_expected, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=2,
+            cores_outer=2)
+        try:
+            pinned = corr.set_numa_layout(domains=2, pin=True)
+            cc, _, _ = func(
+                multichannel_templates, multichannel_stream.copy(), cores=2,
+                cores_outer=2)
+            # Contexts cache the spectra, with a copy for each domain
+            with corr.FFTWContext() as context:
+                cc_context, _, _ = func(
+                    multichannel_templates, multichannel_stream.copy(),
+                    cores=2, cores_outer=2, fftw_context=context)
+        finally:
+            corr.set_numa_layout()
+        assert isinstance(pinned, bool)
+        assert np.allclose(cc, cc_expected, atol=self.atol)
+        assert np.allclose(cc_context, cc_expected, atol=self.atol)
+
+    def test_bad_numa_layout_raises(self):
+        with pytest.raises(ValueError):
+            corr.set_numa_layout(domains=0)
+
+
+class TestFFTWOutputDtypes:
+    """ Check that compact outputs match converting float32 outputs """
+    @pytest.mark.parametrize("stack,dtype", [(True, np.float16),
+                                             (False, np.float16),
+                                             (False, np.int16)])
+    def test_compact_matches_float32(self, multichannel_templates,
+                                     multichannel_stream, stack, dtype):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        stream = multichannel_stream.copy()
+        if not stack:
+            for tr in stream:
+                tr.data = tr.data[0:unstacked_stream_len]
+        cc_float, _, _ = func(
+            multichannel_templates, stream.copy(), cores=1, cores_outer=2,
+            stack=stack)
+        cc_compact, _, _ = func(
+            multichannel_templates, stream.copy(), cores=1, cores_outer=2,
+            stack=stack, fftw_output_dtype=dtype, fft_len=2 ** 10,
+            fftw_stack_memory=2 ** 16)
+        assert cc_compact.dtype == dtype
+        if dtype == np.int16:
+            assert np.all(np.abs(
+                cc_compact / corr.INT16_SCALE - cc_float) <= 1.0 /
+                corr.INT16_SCALE)
+        else:
+            assert np.allclose(cc_compact, cc_float, rtol=1e-3, atol=1e-3)
+
+    def test_stacked_int16_fails(self, multichannel_templates,
+                                 multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        with pytest.raises(NotImplementedError):
+            func(multichannel_templates, multichannel_stream.copy(), cores=1,
+                 fftw_output_dtype=np.int16)
+
+
+class TestFFTWOutputFile:
+    """ Check that memory-mapped outputs match in-memory outputs """
+    @pytest.mark.parametrize("stack,flush", [(False, None), (False, 0.001),
+                                             (True, 0.001)])
+    def test_memmap_matches_memory(self, tmpdir, multichannel_templates,
+                                   multichannel_stream, stack, flush):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        stream = multichannel_stream.copy()
+        if not stack:
+            for tr in stream:
+                tr.data = tr.data[0:unstacked_stream_len]
+        filename = join(str(tmpdir), "ccs", "ccs.dat")
+        cc_memory, _, _ = func(
+            multichannel_templates, stream.copy(), cores=1, cores_outer=2,
+            stack=stack)
+        cc_file, _, _ = func(
+            multichannel_templates, stream.copy(), cores=1, cores_outer=2,
+            stack=stack, fftw_output_file=filename, fftw_output_flush=flush)
+        assert isinstance(cc_file, np.memmap)
+        assert os.path.getsize(filename) == cc_file.nbytes
+        assert np.array_equal(cc_memory, cc_file)
+        reloaded = np.memmap(filename, dtype=np.float32, mode="r",
+                             shape=cc_file.shape)
+        assert np.array_equal(cc_memory, reloaded)
+
+
+class TestFFTWTemplateBatching:
+    """ Check that templates correlated in batches give the same ccs """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.mark.parametrize("stack", [True, False])
+    def test_batches_match(self, multichannel_templates, multichannel_stream,
+                           stack):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        fft_len = 2 ** 10
+        cc_all, _, chans_all = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=2, fft_len=fft_len, stack=stack)
+        # Workspaces for three templates on two threads: uneven batches
+        n_channels = len(multichannel_stream)
+        per_template = 2 * 2 * (fft_len * 4 + (fft_len // 2 + 1) * 8) + (
+            n_channels * ((fft_len // 2 + 1) * 8 + 4))
+        cc_batched, _, chans_batched = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=2, fft_len=fft_len, stack=stack,
+            fftw_memory_limit=3 * per_template)
+        assert chans_all == chans_batched
+        assert np.allclose(cc_all, cc_batched, atol=self.atol)
+
+
+class TestFFTWStats:
+    """ Check that timings and counts of fftw correlations are returned """
+    @pytest.mark.parametrize("stack", [True, False])
+    def test_stats_filled(self, multichannel_templates, multichannel_stream,
+                          stack):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        fftw_stats = dict()
+        func(multichannel_templates, multichannel_stream.copy(), cores=1,
+             cores_outer=2, stack=stack, fftw_stats=fftw_stats)
+        assert fftw_stats["total"] > 0
+        assert fftw_stats["n_chunks"] > 0
+        assert fftw_stats["bytes_allocated"] > 0
+        for stage in ("template_fft", "moments", "image_fft", "multiply",
+                      "inverse_fft", "normalise", "stack"):
+            assert fftw_stats[stage] >= 0
+        assert fftw_stats["n_out_of_range"] == sum(
+            fftw_stats["out_of_range"].values())
+        seed_ids = {tr.id for tr in multichannel_stream}
+        assert set(fftw_stats["out_of_range"]).issubset(seed_ids)
+        assert isinstance(fftw_stats["warnings"], list)
+
+    def test_memory_limit_warning(self, multichannel_templates,
+                                  multichannel_stream):
+        """ A memory limit below one template is reported, not printed """
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        fftw_stats = dict()
+        _log_handler.reset()
+        func(multichannel_templates, multichannel_stream.copy(), cores=1,
+             fft_len=2 ** 12, fftw_memory_limit=1, fftw_stats=fftw_stats)
+        assert "memory_limit" in fftw_stats["warnings"]
+        assert any("fftw_memory_limit" in message
+                   for message in log_messages['warning'])
+
+    def test_stream_push_stats(self, multichannel_templates,
+                               multichannel_stream):
+        stream_dict, template_dict, pad_dict, seed_ids = corr._get_array_dicts(
+            multichannel_templates, multichannel_stream.copy(), stack=True)
+        fftw_stats = dict()
+        with corr.FFTWStreamCorrelator(template_dict, pad_dict, seed_ids,
+                                       block_len=1000) as streamer:
+            streamer.push({seed_id: data[0:1000]
+                           for seed_id, data in stream_dict.items()},
+                          fftw_stats=fftw_stats)
+        assert fftw_stats["total"] > 0
+        assert fftw_stats["n_chunks"] > 0
+
+
+class TestFFTWStreamCorrelator:
+    """ Check that streamed correlations match correlating all the data """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.mark.parametrize("stack", [True, False])
+    def test_stream_matches_full(self, multichannel_templates,
+                                 multichannel_stream, stack):
+        stream = multichannel_stream.copy()
+        if not stack:
+            for tr in stream:
+                tr.data = tr.data[0:unstacked_stream_len]
+        stream_dict, template_dict, pad_dict, seed_ids = corr._get_array_dicts(
+            multichannel_templates, stream, stack=stack)
+        if stack:
+            pad_dict = {seed_id: [(i + j) % 7 for j in range(n_templates)]
+                        for i, seed_id in enumerate(seed_ids)}
+        max_pad = max(max(pads) for pads in pad_dict.values())
+        templates = {seed_id: t.copy() for seed_id, t in template_dict.items()}
+        cc_full, used_full = corr.fftw_multi_normxcorr(
+            template_dict, {seed_id: data.copy() for seed_id, data
+                            in stream_dict.items()},
+            pad_dict, seed_ids, cores_inner=1, stack=stack)
+        n_samples = len(stream_dict[seed_ids[0]])
+        pushed = []
+        with corr.FFTWStreamCorrelator(templates, pad_dict, seed_ids,
+                                       stack=stack, block_len=1000,
+                                       cores_outer=2) as streamer:
+            start = 0
+            for block_len in itertools.cycle([1000, 37, 2500]):
+                if start >= n_samples:
+                    break
+                cccs, used_chans = streamer.push(
+                    {seed_id: data[start:start + block_len]
+                     for seed_id, data in stream_dict.items()})
+                pushed.append(cccs)
+                start += block_len
+        cc_stream = np.concatenate(pushed, axis=-1)
+        assert cc_stream.shape[-1] == n_samples - template_len + 1 - max_pad
+        assert np.allclose(cc_stream, cc_full[..., 0:cc_stream.shape[-1]],
+                           atol=self.atol)
+        assert np.all(np.array(used_chans) == np.array(used_full))
+
+    def test_zero_mean_window_at_push(self):
+        """ Zero-mean windows are not normalised at the start of a push """
+        rng = np.random.RandomState(42)
+        seed_ids = ["NZ.A..HHZ"]
+        data = rng.randn(8000).astype(np.float32)
+        # Alternating samples: variance but no mean in any window
+        data[2500:5000] = np.tile(np.float32([1e-3, -1e-3]), 1250)
+        templates = {seed_ids[0]: rng.randn(1, template_len).astype(
+            np.float32)}
+        pads = {seed_ids[0]: [0]}
+        cc_full, _ = corr.fftw_multi_normxcorr(
+            {k: t.copy() for k, t in templates.items()},
+            {seed_ids[0]: data.copy()}, pads, seed_ids, cores_inner=1)
+        pushed = []
+        with corr.FFTWStreamCorrelator(templates, pads, seed_ids,
+                                       block_len=3000) as streamer:
+            for start in (0, 3000):
+                cccs, _ = streamer.push(
+                    {seed_ids[0]: data[start:start + 3000]})
+                pushed.append(cccs)
+        # The second push starts with a window inside the alternating samples
+        assert pushed[0].shape[-1] == 3000 - template_len + 1
+        cc_stream = np.concatenate(pushed, axis=-1)
+        assert np.all(cc_stream[:, pushed[0].shape[-1]] == 0)
+        assert np.allclose(cc_stream, cc_full[..., 0:cc_stream.shape[-1]],
+                           atol=TestArrayCorrelateFunctions.atol)
+
+
+class TestFFTWPeaks:
+    """ Check that fused peak-finding matches finding peaks in the cccsums """
+    @pytest.mark.parametrize("threshold_type,stack_memory",
+                             [("MAD", corr.FFTW_STACK_MEMORY), ("MAD", 0),
+                              ("absolute", 0)])
+    def test_peaks_match_full(self, multichannel_templates,
+                              multichannel_stream, threshold_type,
+                              stack_memory):
+        from eqcorrscan.utils.findpeaks import multi_find_peaks
+
+        stream_dict, template_dict, pad_dict, seed_ids = corr._get_array_dicts(
+            multichannel_templates, multichannel_stream.copy(), stack=True)
+        templates = {seed_id: t.copy() for seed_id, t in template_dict.items()}
+        cc_full, used_full = corr.fftw_multi_normxcorr(
+            template_dict, {seed_id: data.copy() for seed_id, data
+                            in stream_dict.items()},
+            pad_dict, seed_ids, cores_inner=1, stack=True)
+        if threshold_type == "MAD":
+            threshold = 4.0
+        else:
+            threshold = float(0.5 * np.abs(cc_full).max())
+        peaks, thresholds, used_chans = corr.fftw_multi_normxcorr_peaks(
+            templates, stream_dict, pad_dict, seed_ids, threshold=threshold,
+            threshold_type=threshold_type, trig_int=20, cores_outer=2,
+            fftw_stack_memory=stack_memory)
+        if threshold_type == "MAD":
+            assert np.allclose(
+                thresholds, threshold * np.median(np.abs(cc_full), axis=-1),
+                rtol=2e-3)
+        else:
+            assert np.all(thresholds == np.float32(threshold))
+        full_peaks = multi_find_peaks(
+            arr=cc_full, thresh=thresholds, trig_int=20, cores=1)
+        assert len(peaks) == len(full_peaks)
+        for _peaks, _full_peaks in zip(peaks, full_peaks):
+            assert [p[1] for p in _peaks] == [p[1] for p in _full_peaks]
+            assert np.allclose([p[0] for p in _peaks],
+                               [p[0] for p in _full_peaks])
+        assert np.all(np.array(used_chans) == np.array(used_full))
+
+    @pytest.mark.parametrize("use_context", [False, True])
+    def test_peaks_non_stationary(self, use_context):
+        """ Peaks below the floor set by early, loud tiles are not lost """
+        from eqcorrscan.utils.findpeaks import multi_find_peaks
+
+        state = np.random.RandomState(12)
+        n_samples, loud_len, period = 40000, 8000, 20
+        sine = np.sin(2 * np.pi * np.arange(n_samples) / period)
+        stream, templates = Stream(), [Stream() for _ in range(3)]
+        for station in stas[:2]:
+            for channel in chans:
+                # Loud sine at the start, then noise
+                data = state.randn(n_samples)
+                data[:loud_len] += 10 * sine[:loud_len]
+                stream += Trace(data=data)
+                stream[-1].stats.station = station
+                stream[-1].stats.channel = channel
+                for template in templates:
+                    template += Trace(
+                        data=sine[:template_len] +
+                        0.5 * state.randn(template_len))
+                    template[-1].stats.station = station
+                    template[-1].stats.channel = channel
+        stream_dict, template_dict, pad_dict, seed_ids = corr._get_array_dicts(
+            templates, stream, stack=True)
+        _templates = {seed_id: t.copy() for seed_id, t in template_dict.items()}
+        cc_full, _ = corr.fftw_multi_normxcorr(
+            template_dict, {seed_id: data.copy() for seed_id, data
+                            in stream_dict.items()},
+            pad_dict, seed_ids, cores_inner=1, stack=True, fft_len=2 ** 12)
+        # One chunk per tile, so the first tiles only see the loud sine and
+        # the peaks of the loud start are below the first floor but above
+        # the final threshold
+        with corr.FFTWContext() as context:
+            peaks, thresholds, _ = corr.fftw_multi_normxcorr_peaks(
+                _templates, stream_dict, pad_dict, seed_ids, threshold=4.0,
+                threshold_type="MAD", trig_int=20, fft_len=2 ** 12,
+                fftw_stack_memory=0,
+                fftw_context=context if use_context else None)
+        assert np.allclose(
+            thresholds, 4.0 * np.median(np.abs(cc_full), axis=-1), rtol=2e-3)
+        full_peaks = multi_find_peaks(
+            arr=cc_full, thresh=thresholds, trig_int=20, cores=1)
+        assert len(peaks) == len(full_peaks)
+        for _peaks, _full_peaks in zip(peaks, full_peaks):
+            assert [p[1] for p in _peaks] == [p[1] for p in _full_peaks]
+            assert np.allclose([p[0] for p in _peaks],
+                               [p[0] for p in _full_peaks])
+
+
+class _ThreadComm(object):
+    """ The MPI calls used for sharding, with ranks as threads """
+    def __init__(self, rank, size, shared):
+        self.rank, self.size, self.shared = rank, size, shared
+
+    def Get_rank(self):
+        return self.rank
+
+    def Get_size(self):
+        return self.size
+
+    def allgather(self, obj):
+        self.shared["slots"][self.rank] = obj
+        self.shared["barrier"].wait()
+        out = list(self.shared["slots"])
+        self.shared["barrier"].wait()
+        return out
+
+    def bcast(self, obj, root=0):
+        return self.allgather(obj)[root]
+
+    def Bcast(self, buf, root=0):
+        value = self.allgather(buf)[root]
+        if self.rank != root:
+            buf[...] = value
+
+    def gather(self, obj, root=0):
+        out = self.allgather(obj)
+        return out if self.rank == root else None
+
+    def send(self, obj, dest):
+        self.shared["queues"][dest].put(obj)
+
+    def recv(self, source):
+        return self.shared["queues"][self.rank].get()
+
+
+class TestMPISharding:
+    """ Check that peaks of sharded templates match those of all templates """
+    @pytest.mark.parametrize("size,threshold_type",
+                             [(1, "MAD"), (3, "MAD"), (3, "av_chan_corr"),
+                              (25, "MAD")])
+    def test_shards_match_all(self, multichannel_templates,
+                              multichannel_stream, size, threshold_type):
+        import queue
+        import threading
+        from concurrent.futures import ThreadPoolExecutor
+
+        stream_dict, template_dict, pad_dict, seed_ids = corr._get_array_dicts(
+            multichannel_templates, multichannel_stream.copy(), stack=True)
+        threshold = 4.0 if threshold_type == "MAD" else 0.05
+        peaks, thresholds, used_chans = corr.fftw_multi_normxcorr_peaks(
+            {seed_id: t.copy() for seed_id, t in template_dict.items()},
+            stream_dict, pad_dict, seed_ids, threshold=threshold,
+            threshold_type=threshold_type, trig_int=20)
+        shared = dict(barrier=threading.Barrier(size), slots=[None] * size,
+                      queues=[queue.Queue() for _ in range(size)])
+
+        def _rank(rank):
+            # Only the root rank has the templates and data
+            is_root = rank == 0
+            return corr.mpi_multi_normxcorr_peaks(
+                template_dict if is_root else None,
+                stream_dict if is_root else None,
+                pad_dict if is_root else None, seed_ids,
+                threshold=threshold, threshold_type=threshold_type,
+                trig_int=20, comm=_ThreadComm(rank, size, shared))
+
+        with ThreadPoolExecutor(size) as executor:
+            results = list(executor.map(_rank, range(size)))
+        assert all(result == (None, None, None) for result in results[1:])
+        sharded_peaks, sharded_thresholds, sharded_used = results[0]
+        assert len(sharded_peaks) == len(peaks) == n_templates
+        for _peaks, _sharded_peaks in zip(peaks, sharded_peaks):
+            assert [p[1] for p in _peaks] == [p[1] for p in _sharded_peaks]
+            assert np.allclose([p[0] for p in _peaks],
+                               [p[0] for p in _sharded_peaks])
+        assert np.allclose(thresholds, sharded_thresholds)
+        assert np.all(np.array(used_chans) == np.array(sharded_used))
+
+
+@pytest.mark.skipif(not corr.CUPY_INSTALLED,
+                    reason="CuPy or a GPU is not available")
+class TestCupyBackend:
+    """ Check that GPU correlations and peaks match the fftw backend """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.mark.parametrize("stack", [True, False])
+    def test_batches_match_fftw(self, multichannel_templates,
+                                multichannel_stream, stack):
+        stream = multichannel_stream.copy()
+        if not stack:
+            for tr in stream:
+                tr.data = tr.data[0:unstacked_stream_len]
+        stream_dict, template_dict, pad_dict, seed_ids = corr._get_array_dicts(
+            multichannel_templates, stream, stack=stack)
+        if stack:
+            pad_dict = {seed_id: [(i + j) % 7 for j in range(n_templates)]
+                        for i, seed_id in enumerate(seed_ids)}
+        templates = {seed_id: t.copy() for seed_id, t in template_dict.items()}
+        cc_fftw, used_fftw = corr.fftw_multi_normxcorr(
+            template_dict, stream_dict, pad_dict, seed_ids, cores_inner=1,
+            stack=stack, fft_len=2 ** 10)
+        # Small enough for several batches of templates and of chunks
+        cc_gpu, used_gpu = corr.cupy_multi_normxcorr(
+            templates, stream_dict, pad_dict, seed_ids, stack=stack,
+            fft_len=2 ** 10, gpu_memory_limit=8 * 2 ** 20)
+        assert cc_gpu.shape == cc_fftw.shape
+        assert np.allclose(cc_gpu, cc_fftw, atol=self.atol)
+        assert np.all(np.array(used_gpu) == np.array(used_fftw))
+
+    @pytest.mark.parametrize("threshold_type", ["MAD", "absolute"])
+    def test_peaks_match_full(self, multichannel_templates,
+                              multichannel_stream, threshold_type):
+        from eqcorrscan.utils.findpeaks import multi_find_peaks
+
+        stream_dict, template_dict, pad_dict, seed_ids = corr._get_array_dicts(
+            multichannel_templates, multichannel_stream.copy(), stack=True)
+        cc_full, _ = corr.cupy_multi_normxcorr(
+            template_dict, stream_dict, pad_dict, seed_ids, stack=True)
+        if threshold_type == "MAD":
+            threshold = 4.0
+        else:
+            threshold = float(0.5 * np.abs(cc_full).max())
+        peaks, thresholds, _ = corr.cupy_multi_normxcorr_peaks(
+            template_dict, stream_dict, pad_dict, seed_ids,
+            threshold=threshold, threshold_type=threshold_type, trig_int=20,
+            gpu_memory_limit=8 * 2 ** 20)
+        if threshold_type == "MAD":
+            assert np.allclose(
+                thresholds, threshold * np.median(np.abs(cc_full), axis=-1))
+        full_peaks = multi_find_peaks(
+            arr=cc_full, thresh=thresholds, trig_int=20, cores=1)
+        assert len(peaks) == len(full_peaks)
+        for _peaks, _full_peaks in zip(peaks, full_peaks):
+            assert [p[1] for p in _peaks] == [p[1] for p in _full_peaks]
+
+
+@pytest.mark.serial
+class TestFFTWImageChannels:
+    """ Check that data read in place or converted match float32 data """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @staticmethod
+    def _correlate(templates, data, **kwargs):
+        seed_ids = sorted(templates)
+        pads = {seed_id: np.zeros(len(templates[seed_id]), dtype=int)
+                for seed_id in seed_ids}
+        return corr.fftw_multi_normxcorr(
+            template_array={k: v.copy() for k, v in templates.items()},
+            stream_array=data, pad_array=pads, seed_ids=seed_ids,
+            cores_inner=1, cores_outer=2, fft_len=2 ** 10, **kwargs)
+
+    @pytest.fixture(scope='class')
+    def raw_counts(self):
+        rng = np.random.default_rng(42)
+        templates = {f"NZ.S{i}..Z": rng.standard_normal((3, 50))
+                     for i in range(3)}
+        data = {seed_id: rng.integers(-2 ** 20, 2 ** 20, 5000)
+                for seed_id in templates}
+        return templates, data
+
+    @pytest.mark.parametrize("stack", [True, False])
+    @pytest.mark.parametrize("dtype", [np.int32, np.float64, "strided"])
+    def test_matches_float32(self, raw_counts, dtype, stack):
+        templates, data = raw_counts
+        cc_float, chans_float = self._correlate(
+            templates, {k: v.astype(np.float32) for k, v in data.items()},
+            stack=stack)
+        if dtype == "strided":
+            # Every other sample of interleaved float32 data
+            interleaved = {k: np.repeat(v.astype(np.float32), 2)[::2]
+                           for k, v in data.items()}
+            assert not interleaved[sorted(data)[0]].flags['C_CONTIGUOUS']
+            raw = interleaved
+        else:
+            raw = {k: v.astype(dtype) for k, v in data.items()}
+        cc_raw, chans_raw = self._correlate(templates, raw, stack=stack)
+        assert np.array_equal(chans_float, chans_raw)
+        assert np.allclose(cc_float, cc_raw, atol=self.atol)
+
+    def test_short_channel_zero_padded(self, raw_counts):
+        templates, data = raw_counts
+        short_id = sorted(data)[1]
+        padded = {k: v.astype(np.float32) for k, v in data.items()}
+        padded[short_id][3000:] = 0
+        short = {k: v.astype(np.float32) for k, v in data.items()}
+        short[short_id] = short[short_id][0:3000]
+        cc_padded, _ = self._correlate(templates, padded)
+        cc_short, _ = self._correlate(templates, short)
+        assert np.allclose(cc_padded, cc_short, atol=self.atol)
+
+    def test_stream_not_changed(self, raw_counts):
+        templates, data = raw_counts
+        quiet = {k: (v * 1e-12).astype(np.float64) for k, v in data.items()}
+        held = {k: v.copy() for k, v in quiet.items()}
+        self._correlate(templates, quiet)
+        for seed_id in quiet:
+            assert np.array_equal(quiet[seed_id], held[seed_id])
+
+
+class TestFFTWDays:
+    """ Check that prefetched days give the same ccs as one at a time """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture(scope='class')
+    def days(self):
+        rng = np.random.default_rng(7)
+        templates = {f"NZ.S{i}..Z": rng.standard_normal((4, 40))
+                     for i in range(3)}
+        days = [{seed_id: rng.standard_normal(3000 + 100 * day)
+                 for seed_id in templates} for day in range(4)]
+        pads = {seed_id: np.arange(4) for seed_id in templates}
+        return templates, days, pads
+
+    @pytest.mark.parametrize("prefetch", [1, 3])
+    def test_days_match_single(self, days, prefetch):
+        templates, data, pads = days
+        seed_ids = sorted(templates)
+        expected = [corr.fftw_multi_normxcorr(
+            template_array={k: v.copy() for k, v in templates.items()},
+            stream_array={k: v.copy() for k, v in day.items()},
+            pad_array=pads, seed_ids=seed_ids, cores_inner=1,
+            fft_len=2 ** 12)[0] for day in data]
+        prepared = []
+
+        def prepare(index):
+            prepared.append(index)
+            return {k: v.copy() for k, v in data[index].items()}
+
+        with corr.FFTWContext() as context:
+            results = corr.fftw_multi_normxcorr_days(
+                templates, (i for i in range(len(data))), pads, seed_ids,
+                callback=lambda i, cccs, used_chans: (i, cccs),
+                prepare=prepare, prefetch=prefetch, fftw_context=context,
+                fft_len=2 ** 12)
+            # Spectra are only computed once
+            assert len(context) == 1
+        assert prepared == list(range(len(data)))
+        assert [i for i, _ in results] == list(range(len(data)))
+        for (_, cccs), cc_expected in zip(results, expected):
+            assert np.allclose(cccs, cc_expected, atol=self.atol)
+
+    def test_prepare_errors_raised(self, days):
+        templates, data, pads = days
+
+        def prepare(index):
+            if index == 2:
+                raise IOError("Could not read day")
+            return data[index]
+
+        called = []
+        with pytest.raises(IOError):
+            corr.fftw_multi_normxcorr_days(
+                templates, range(len(data)), pads, sorted(templates),
+                callback=lambda i, cccs, used_chans: called.append(i),
+                prepare=prepare)
+        assert called == [0, 1]
+
+
+class TestSIMDKernels:
+    """ Check that the vectorised kernels match the scalar kernels """
+    atol = TestArrayCorrelateFunctions.atol
+
+    def test_vector_kernels_match_scalar(self, multichannel_templates,
+                                         multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        try:
+            assert corr.set_simd_level("scalar") == "scalar"
+            cc_scalar, _, _ = func(
+                multichannel_templates, multichannel_stream.copy(), cores=1,
+                cores_outer=2)
+        finally:
+            level = corr.set_simd_level()
+        assert level == corr.get_simd_level()
+        cc_vector, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            cores_outer=2)
+        assert np.allclose(cc_scalar, cc_vector, atol=self.atol)
+
+    def test_bad_level_raises(self):
+        with pytest.raises(ValueError):
+            corr.set_simd_level("mmx")
+
+
+class TestTimeDomainBlocked:
+    """ Check that blocked time-domain ccs match the FFTW ccs """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.mark.parametrize("stack,cores", [(True, 1), (True, 3),
+                                             (False, 3)])
+    def test_matches_fftw(self, multichannel_templates, multichannel_stream,
+                          stack, cores):
+        stream = multichannel_stream.copy()
+        if not stack:
+            for tr in stream:
+                tr.data = tr.data[0:unstacked_stream_len]
+        cc_fftw, _, chans_fftw = corr.get_stream_xcorr("fftw", "concurrent")(
+            multichannel_templates, stream.copy(), cores=1, stack=stack)
+        cc_time, _, chans_time = corr.get_stream_xcorr(
+            "time_domain", "concurrent")(
+            multichannel_templates, stream.copy(), cores=cores, stack=stack)
+        assert chans_fftw == chans_time
+        assert np.allclose(cc_fftw, cc_time, atol=self.atol)
+
+    def test_vector_kernels_match_scalar(self, multichannel_templates,
+                                         multichannel_stream):
+        func = corr.get_stream_xcorr("time_domain", "concurrent")
+        try:
+            corr.set_simd_level("scalar")
+            cc_scalar, _, _ = func(
+                multichannel_templates, multichannel_stream.copy(), cores=2)
+        finally:
+            corr.set_simd_level()
+        cc_vector, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=2)
+        assert np.allclose(cc_scalar, cc_vector, atol=self.atol)
+
+
+class TestBatchNormxcorr:
+    """ Check that batched short correlations match the FFTW ccs """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture(scope="class")
+    def batch(self):
+        """ Templates and windows of mixed lengths, with shared windows """
+        state = np.random.RandomState(42)
+        templates = [state.randn(length).astype(np.float32)
+                     for length in (8, 30, 30, 200, 513)]
+        windows = [state.randn(length).astype(np.float32)
+                   for length in (40, 600, 2000)]
+        pairs = [(t, w) for t in range(len(templates))
+                 for w in range(len(windows))
+                 if len(windows[w]) >= len(templates[t])]
+        return templates, windows, pairs
+
+    @pytest.mark.parametrize("method", ["auto", "time", "fft"])
+    def test_matches_fftw(self, batch, method):
+        templates, windows, pairs = batch
+        cc_max, lags, correlations = corr.batch_normxcorr(
+            templates, windows, pairs=pairs, cores=2, method=method,
+            return_correlations=True)
+        assert len(correlations) == len(pairs)
+        for (t, w), peak, lag, ccc in zip(pairs, cc_max, lags, correlations):
+            expected, _ = corr.fftw_normxcorr(
+                templates[t][np.newaxis], windows[w], [0])
+            assert np.allclose(ccc, expected[0], atol=self.atol)
+            assert peak == ccc.max()
+            assert lag == ccc.argmax()
+
+    def test_interpolated_peaks(self):
+        """ Sub-sample shifts of a sine are recovered by interpolation """
+        template = np.sin(np.arange(64) / 5.)
+        window = np.sin((np.arange(200) - 40.4) / 5.)
+        cc_max, lags = corr.batch_normxcorr(
+            [template], [window], interpolate=True)
+        assert abs(lags[0] - 40.4) < 0.1
+        assert cc_max[0] <= 1.0
+
+    def test_flat_template(self):
+        cc_max, lags, correlations = corr.batch_normxcorr(
+            [np.ones(20)], [np.random.randn(100)], return_correlations=True)
+        assert cc_max[0] == 0
+        assert np.all(correlations[0] == 0)
+
+    def test_short_window_raises(self):
+        with pytest.raises(ValueError):
+            corr.batch_normxcorr([np.random.randn(50)],
+                                 [np.random.randn(20)])
+
+    def test_bad_method_raises(self):
+        with pytest.raises(ValueError):
+            corr.batch_normxcorr([np.ones(5)], [np.ones(10)], method="gpu")
+
+
+class TestXcorrTuner:
+    """ Check backend tuning and that the auto backend matches fftw """
+    atol = TestArrayCorrelateFunctions.atol
+
+    def test_results_persist(self, tmpdir, monkeypatch):
+        filename = join(str(tmpdir), "tuning", "xcorr.json")
+        tuner = corr.XcorrTuner(
+            filename=filename, n_repeats=1, fft_lens=[2 ** 10, 2 ** 11])
+        result = tuner.best(200, 4, 2, 1)
+        assert result["backend"] in corr.XcorrTuner.backends
+        assert set(result["timings"].keys()) == {
+            "fftw:1024", "fftw:2048", "time_domain"}
+        assert os.path.isfile(filename)
+
+        def _no_benchmark(*args, **kwargs):
+            raise AssertionError("Tuned shapes should not be re-measured")
+
+        reloaded = corr.XcorrTuner(filename=filename)
+        monkeypatch.setattr(reloaded, "_benchmark", _no_benchmark)
+        assert len(reloaded) == 1
+        assert reloaded.best(200, 4, 2, 1) == result
+
+    def test_memory_bounded(self, monkeypatch):
+        """ Long fft-lengths for many templates are not tried """
+        tuner = corr.XcorrTuner(n_repeats=1, memory_limit=2 ** 30)
+        fft_lens = tuner._candidate_fft_lens(200, 2000, 10, 10)
+        assert fft_lens[0] == 2 ** 9
+        assert max(fft_lens) < 2 ** 16
+        assert all(corr._fftw_workspace_bytes(2000, 10, fft_len, 10)
+                   <= 2 ** 30 for fft_len in fft_lens)
+        # The shortest is kept even if it does not fit
+        assert tuner._candidate_fft_lens(
+            200, 2000, 10, 10, memory_limit=1) == [2 ** 9]
+        # Benchmarks only correlate a subset of the templates
+        run = []
+
+        def _fftw_multi_normxcorr(template_array, *args, **kwargs):
+            run.append(len(next(iter(template_array.values()))))
+
+        monkeypatch.setattr(
+            corr, "fftw_multi_normxcorr", _fftw_multi_normxcorr)
+        tuner._benchmark("fftw", 200, 2000, 2, 1, fft_len=2 ** 10)
+        assert run == [tuner.fftw_templates]
+
+    @pytest.mark.parametrize("backend", ["fftw", "time_domain"])
+    def test_auto_matches_fftw(self, multichannel_templates,
+                               multichannel_stream, backend):
+        tuner = corr.XcorrTuner(n_repeats=1, fft_lens=[2 ** 11])
+        tuner.backends = (backend, )
+        cc_fftw, no_chans_fftw, _ = corr.get_stream_xcorr(
+            "fftw", "concurrent")(
+            multichannel_templates, multichannel_stream.copy(), cores=2)
+        cc_auto, no_chans_auto, _ = corr.get_stream_xcorr(
+            "auto", "concurrent")(
+            multichannel_templates, multichannel_stream.copy(), cores=2,
+            xcorr_tuner=tuner)
+        assert len(tuner) == 1
+        assert np.all(no_chans_fftw == no_chans_auto)
+        assert np.allclose(cc_fftw, cc_auto, atol=self.atol)
+
+
+class TestFFTWPlanner:
+    """ Check planner rigour and wisdom handling for the fftw backend """
+    atol = TestArrayCorrelateFunctions.atol
+
+    def test_measured_plans_match(self, multichannel_templates,
+                                  multichannel_stream):
+        func = corr.get_stream_xcorr("fftw", "concurrent")
+        cc_estimate, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1)
+        cc_measure, _, _ = func(
+            multichannel_templates, multichannel_stream.copy(), cores=1,
+            fftw_planner="measure")
+        assert np.allclose(cc_estimate, cc_measure, atol=self.atol)
+
+    def test_array_measured_plans_match(self, array_template, array_stream,
+                                        pads):
+        cc_estimate, _ = corr.fftw_normxcorr(
+            array_template, array_stream, pads)
+        cc_measure, _ = corr.fftw_normxcorr(
+            array_template, array_stream, pads, fftw_planner="measure")
+        assert np.allclose(cc_estimate, cc_measure, atol=self.atol)
+
+    def test_wisdom_round_trip(self, tmpdir, array_template, array_stream,
+                               pads):
+        wisdom_file = str(tmpdir.join("test.wisdom"))
+        corr.fftw_normxcorr(
+            array_template, array_stream, pads, fftw_planner="measure")
+        corr.export_fftw_wisdom(wisdom_file)
+        corr.forget_fftw_wisdom()
+        corr.import_fftw_wisdom(wisdom_file)
+        cc, _ = corr.fftw_normxcorr(
+            array_template, array_stream, pads, fftw_planner="measure")
+        assert np.isclose(cc[0, starting_index], 1., atol=self.atol)
+        corr.forget_fftw_wisdom()
+
+    def test_missing_wisdom_raises(self, tmpdir):
+        with pytest.raises(IOError):
+            corr.import_fftw_wisdom(str(tmpdir.join("not_a_file")))
+
+    def test_bad_planner_raises(self, array_template, array_stream, pads):
+        with pytest.raises(ValueError):
+            corr.fftw_normxcorr(
+                array_template, array_stream, pads, fftw_planner="wibble")
+
+
 class TestXcorrContextManager:
     # fake_cache = copy.deepcopy(corr.XCOR_FUNCS)
 
@@ -44,6 +44,22 @@ class TestDeclustering:
         peaks_out = decluster(peaks, index, trig_int, threshold=0)
         assert len(peaks) > len(peaks_out)
 
+    @pytest.mark.parametrize("trig_int", [0, 3, 40, 10000])
+    def test_many_peaks_match_greedy(self, trig_int):
+        """ Check declustering many peaks against a simple greedy loop. """
+        rng = np.random.default_rng(42)
+        peaks = rng.standard_normal(3000).astype(np.float32)
+        index = rng.integers(-50000, 50000, 3000)
+        threshold = 0.5
+        expected = []
+        for i in np.abs(peaks).argsort()[::-1]:
+            if abs(peaks[i]) < threshold:
+                break
+            if all(abs(index[i] - kept) > trig_int for _, kept in expected):
+                expected.append((peaks[i], index[i]))
+        peaks_out = decluster(peaks, index, trig_int, threshold=threshold)
+        assert peaks_out == expected
+
     def test_clustered_dist_time(self):
         peaks = np.array([100, 65, 20, 120, 300])
         index = np.array([2000, 5000, 10, 70, 500])
@@ -63,6 +79,36 @@ class TestDeclustering:
         assert peaks_out == [(300.0, 500), (120.0, 70), (100.0, 2000),
                              (65.0, 5000)]
 
+    def test_many_peaks_dist_time_match_greedy(self):
+        """ Check space-time declustering against a simple greedy loop. """
+        from eqcorrscan.utils.clustering import dist_mat_km
+
+        rng = np.random.default_rng(42)
+        templates = [
+            Event(origins=[Origin(latitude=lat, longitude=lon, depth=depth)])
+            for lat, lon, depth in zip(
+                rng.uniform(-42, -41, 20), rng.uniform(172, 173, 20),
+                rng.uniform(0, 20000, 20))]
+        template_distances = dist_mat_km(Catalog(templates))
+        peaks = rng.standard_normal(2000).astype(np.float32)
+        index = rng.integers(0, 200000, 2000)
+        template_ids = rng.integers(0, len(templates), 2000)
+        catalog = Catalog([templates[i] for i in template_ids])
+        trig_int, hypocentral_separation, threshold = 500, 30.0, 0.5
+        expected, kept = [], []
+        for i in np.abs(peaks).argsort()[::-1]:
+            if abs(peaks[i]) < threshold:
+                break
+            if all(abs(index[i] - index[j]) > trig_int or
+                   template_distances[template_ids[i], template_ids[j]] >=
+                   hypocentral_separation for j in kept):
+                kept.append(i)
+                expected.append((peaks[i], index[i]))
+        peaks_out = decluster_distance_time(
+            peaks, index, trig_int, catalog, hypocentral_separation,
+            threshold=threshold)
+        assert peaks_out == expected
+
     def test_separated_dist(self):
         peaks = np.array([100, 65, 20, 120, 300])
         index = np.array([2000, 5000, 10, 70, 500])
@@ -170,6 +216,48 @@ class TestStandardPeakFinding:
         assert len(full_peak_array_py) == 69
 
 
+class TestPackedPeakFinding:
+    """ Peaks found in segments across threads and written packed. """
+    @staticmethod
+    def _expected(arr, thresh):
+        zero = np.zeros(1, dtype=arr.dtype)
+        prev_value = np.concatenate([zero, arr[:-1]])
+        next_value = np.concatenate([arr[1:], zero])
+        return np.nonzero(
+            (np.abs(arr) > thresh) &
+            ((next_value - arr) * (prev_value - arr) > 0))[0]
+
+    @pytest.mark.parametrize("length", [1, 2, 17, 65535, 65537, 500001])
+    def test_long_array_threaded(self, length):
+        arr = np.random.RandomState(length).randn(length).astype(np.float32)
+        # Flat sections and runs of alternating peaks
+        arr[length // 3:length // 3 + 50] = 1.0
+        arr[length // 2:length // 2 + 200:2] = 2.5
+        expected = self._expected(arr, 1.5)
+        for threads in [1, 4]:
+            peak_vals, peak_indices = _find_peaks_c(
+                array=arr, threshold=1.5, threads=threads)
+            np.testing.assert_array_equal(peak_indices, expected)
+            np.testing.assert_array_equal(peak_vals, arr[expected])
+
+    def test_dense_peaks(self):
+        """ More peaks than first allocated for. """
+        arr = np.tile(np.array([1, -1], dtype=np.float32), 50000)
+        peak_vals, peak_indices = _find_peaks_c(array=arr, threshold=0.5)
+        np.testing.assert_array_equal(peak_indices, np.arange(len(arr)))
+
+    def test_few_arrays_many_threads(self):
+        arrays = np.random.RandomState(1).randn(2, 300000).astype(np.float32)
+        thresholds = [2.0, 3.0]
+        peak_vals, peak_indices = _multi_find_peaks_c(
+            arrays=arrays, thresholds=thresholds, threads=8)
+        for arr, thresh, vals, indices in zip(
+                arrays, thresholds, peak_vals, peak_indices):
+            np.testing.assert_array_equal(
+                indices, self._expected(arr, thresh))
+            np.testing.assert_array_equal(vals, arr[indices])
+
+
 class TestEdgeCases:
     """ A selection of weird datasets to find peaks in. """
     datasets = []
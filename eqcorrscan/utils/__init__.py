@@ -16,6 +16,12 @@ try:
 except ImportError:
     FMF_INSTALLED = False
 
+try:
+    import cupy  # noqa: F401
+    CUPY_INSTALLED = cupy.cuda.is_available()
+except ImportError:
+    CUPY_INSTALLED = False
+
 
 __all__ = ['archive_read', 'catalog_to_dd', 'catalog_utils', 'clustering',
            'correlate', 'despike', 'findpeaks', 'mag_calc', 'picker',
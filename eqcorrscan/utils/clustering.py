@@ -20,7 +20,8 @@ from scipy.spatial.distance import squareform
 
 from eqcorrscan.utils import stacking
 from eqcorrscan.utils.archive_read import read_data
-from eqcorrscan.utils.correlate import get_array_xcorr, get_stream_xcorr
+from eqcorrscan.utils.correlate import (
+    batch_normxcorr, get_array_xcorr, get_stream_xcorr)
 from eqcorrscan.utils.pre_processing import _prep_data_for_correlation
 
 Logger = logging.getLogger(__name__)
@@ -173,10 +174,58 @@ def distance_matrix(stream_list, shift_len=0.0,
 
     .. note::
         Requires all traces to have the same sampling rate and same length.
+
+    .. note::
+        When every stream has one trace per seed id and all traces have the
+        same sampling rate and length and no masked data, all the channel
+        pairs are correlated in one call of
+        :func:`eqcorrscan.utils.correlate.batch_normxcorr` (each pair only
+        once when shift_len is 0). The third axis of the shift matrix is
+        then ordered by sorted trace id, and shifts for channels that a pair
+        of streams do not share are nan.
     """
     n_streams = len(stream_list)
     # May have to allow duplicate channels for P- and S-picks at each station
     stream_list = [st.sort() for st in stream_list]
+    trace_ids = _batch_trace_ids(stream_list)
+    if trace_ids is not None:
+        dist_mat, shift_mat, shift_dict = _batch_distance_matrix(
+            stream_list=stream_list, trace_ids=trace_ids, shift_len=shift_len,
+            allow_individual_trace_shifts=allow_individual_trace_shifts,
+            cores=cores)
+    else:
+        dist_mat, shift_mat, shift_dict = _stream_distance_matrix(
+            stream_list=stream_list, shift_len=shift_len,
+            allow_individual_trace_shifts=allow_individual_trace_shifts,
+            cores=cores)
+    n_uniq_traces = shift_mat.shape[2]
+    if shift_len == 0:
+        assert np.allclose(dist_mat, dist_mat.T, atol=0.00001)
+        # Force perfect symmetry
+        dist_mat = (dist_mat + dist_mat.T) / 2
+    else:
+        # get the shortest distance for each correlation pair
+        dist_mat_shortest = np.minimum(dist_mat, dist_mat.T)
+        # Indicator says which matrix has shortest dist: value 0: mat2; 1: mat1
+        mat_indicator = dist_mat_shortest == dist_mat
+        mat_indicator = np.repeat(mat_indicator[:, :, np.newaxis],
+                                  n_uniq_traces, axis=2)[:, :]
+        # Get shift for the shortest distances
+        shift_mat = (
+            shift_mat * mat_indicator +
+            np.transpose(shift_mat, [1, 0, 2]) * (1 - mat_indicator))
+        dist_mat = dist_mat_shortest
+    # Squeeze matrix to 2 axis (ignore nans) if 3rd dimension not needed
+    if shift_len == 0 or allow_individual_trace_shifts is False:
+        shift_mat = np.nanmean(shift_mat, axis=2)
+    np.fill_diagonal(dist_mat, 0)
+    return dist_mat, shift_mat.squeeze(), shift_dict
+
+
+def _stream_distance_matrix(stream_list, shift_len,
+                            allow_individual_trace_shifts, cores):
+    """ Correlate each stream with all streams, see distance_matrix. """
+    n_streams = len(stream_list)
     uniq_traces = set([tr.id for st in stream_list for tr in st])
     n_uniq_traces = len(uniq_traces)
     # Initialize square matrix
@@ -202,27 +251,92 @@ def distance_matrix(stream_list, shift_len=0.0,
         shift_mat_list = [shift_mat[:, :, mti] for mti in master_trace_indcs]
         trace_shift_dict = dict(zip(master_ids, shift_mat_list))
         shift_dict[i] = trace_shift_dict
-    if shift_len == 0:
-        assert np.allclose(dist_mat, dist_mat.T, atol=0.00001)
-        # Force perfect symmetry
-        dist_mat = (dist_mat + dist_mat.T) / 2
+    return dist_mat, shift_mat, shift_dict
+
+
+def _batch_trace_ids(stream_list):
+    """
+    Get the sorted trace ids of streams that can be correlated in one batch.
+
+    :returns:
+        Sorted list of unique trace ids, or None if any stream is empty or
+        has repeated trace ids, or if the traces differ in sampling rate or
+        length or have masked data.
+    """
+    traces = [tr for st in stream_list for tr in st]
+    if len(traces) == 0 or min(len(st) for st in stream_list) == 0:
+        return None
+    for st in stream_list:
+        if len({tr.id for tr in st}) != len(st):
+            return None
+    if len({tr.stats.sampling_rate for tr in traces}) != 1:
+        return None
+    if len({tr.stats.npts for tr in traces}) != 1:
+        return None
+    if any(np.ma.is_masked(tr.data) for tr in traces):
+        return None
+    return sorted({tr.id for tr in traces})
+
+
+def _batch_distance_matrix(stream_list, trace_ids, shift_len,
+                           allow_individual_trace_shifts, cores):
+    """
+    Correlate all pairs of streams in one batch, see distance_matrix.
+
+    As in cross_chan_correlation, stream i is the data and stream j, trimmed
+    by half of shift_len at both ends, is the template of row i, column j.
+    """
+    n_streams, n_uniq_traces = len(stream_list), len(trace_ids)
+    df = stream_list[0][0].stats.sampling_rate
+    end_trim = int((shift_len * df) / 2)
+    individual = allow_individual_trace_shifts and shift_len > 0
+    # Without trimming the correlations are symmetric: only correlate j >= i
+    symmetric = end_trim == 0
+    columns = {tr_id: c for c, tr_id in enumerate(trace_ids)}
+    index, templates, windows = dict(), [], []
+    for i, st in enumerate(stream_list):
+        for tr in st:
+            index[(i, columns[tr.id])] = len(windows)
+            windows.append(tr.data)
+            templates.append(tr.data[end_trim:tr.stats.npts - end_trim])
+    pairs, jobs = [], []
+    for i in range(n_streams):
+        for j in range(i if symmetric else 0, n_streams):
+            for c in range(n_uniq_traces):
+                if (i, c) in index and (j, c) in index:
+                    pairs.append((index[(j, c)], index[(i, c)]))
+                    jobs.append((i, j, c))
+    jobs = np.array(jobs, dtype=int).reshape(-1, 3)
+    rows, cols, chans = jobs.T
+    stack = not individual and not symmetric
+    out = batch_normxcorr(templates, windows, pairs=pairs, cores=cores,
+                          return_correlations=stack)
+    n_chans = np.zeros([n_streams, n_streams])
+    np.add.at(n_chans, (rows, cols), 1)
+    shift_mat = np.empty([n_streams, n_streams, n_uniq_traces])
+    shift_mat[:] = np.nan
+    if stack:
+        # Shift all channels together by the peak of the summed correlations
+        cccsums = np.zeros([n_streams, n_streams, 2 * end_trim + 1])
+        np.add.at(cccsums, (rows, cols),
+                  np.reshape(out[2], (-1, 2 * end_trim + 1)))
+        coherances = cccsums.max(axis=-1)
+        positions = (cccsums.argmax(axis=-1) - end_trim) / df
+        shift_mat[rows, cols, chans] = positions[rows, cols]
     else:
-        # get the shortest distance for each correlation pair
-        dist_mat_shortest = np.minimum(dist_mat, dist_mat.T)
-        # Indicator says which matrix has shortest dist: value 0: mat2; 1: mat1
-        mat_indicator = dist_mat_shortest == dist_mat
-        mat_indicator = np.repeat(mat_indicator[:, :, np.newaxis],
-                                  n_uniq_traces, axis=2)[:, :]
-        # Get shift for the shortest distances
-        shift_mat = (
-            shift_mat * mat_indicator +
-            np.transpose(shift_mat, [1, 0, 2]) * (1 - mat_indicator))
-        dist_mat = dist_mat_shortest
-    # Squeeze matrix to 2 axis (ignore nans) if 3rd dimension not needed
-    if shift_len == 0 or allow_individual_trace_shifts is False:
-        shift_mat = np.nanmean(shift_mat, axis=2)
-    np.fill_diagonal(dist_mat, 0)
-    return dist_mat, shift_mat.squeeze(), shift_dict
+        coherances = np.zeros([n_streams, n_streams])
+        np.add.at(coherances, (rows, cols), out[0])
+        shift_mat[rows, cols, chans] = (out[1] - end_trim) / df
+    if symmetric:
+        coherances = np.triu(coherances) + np.triu(coherances, 1).T
+        n_chans = np.triu(n_chans) + np.triu(n_chans, 1).T
+        shift_mat[cols, rows, chans] = shift_mat[rows, cols, chans]
+    with np.errstate(divide="ignore", invalid="ignore"):
+        dist_mat = 1 - coherances / n_chans
+    shift_dict = {
+        i: {tr.id: shift_mat[:, :, columns[tr.id]] for tr in st}
+        for i, st in enumerate(stream_list)}
+    return dist_mat, shift_mat, shift_dict
 
 
 def cluster(template_list, show=True, corr_thresh=0.3, shift_len=0,
@@ -827,6 +941,9 @@ def remove_unclustered(catalog, distance_cutoff, num_threads=None):
     """
     Remove events in catalog which do not have any other nearby events.
 
+    Neighbours are found through a uniform grid of the catalog, so isolated
+    events are not compared against every other event.
+
     :type catalog: obspy.core.event.Catalog
     :param catalog: Catalog for which to compute the distance matrix
     :type distance_cutoff: float
@@ -837,7 +954,6 @@ def remove_unclustered(catalog, distance_cutoff, num_threads=None):
     """
     import ctypes
     from eqcorrscan.utils.libnames import _load_cdll
-    from math import radians
 
     utilslib = _load_cdll('libutils')
 
@@ -856,24 +972,8 @@ def remove_unclustered(catalog, distance_cutoff, num_threads=None):
 
     # Initialize square matrix
     mask = np.ascontiguousarray(np.zeros(len(catalog), dtype=np.uint8))
-    latitudes, longitudes, depths = (
-        np.empty(len(catalog), dtype=np.float32),
-        np.empty(len(catalog), dtype=np.float32),
-        np.empty(len(catalog), dtype=np.float32))
-    for i, event in enumerate(catalog):
-        origin = event.preferred_origin() or event.origins[0]
-        latitudes[i] = radians(origin.latitude)
-        longitudes[i] = radians(origin.longitude)
-        depths[i] = origin.depth / 1000
-    depths = np.ascontiguousarray(depths, dtype=np.float32)
-    latitudes = np.ascontiguousarray(latitudes, dtype=np.float32)
-    longitudes = np.ascontiguousarray(longitudes, dtype=np.float32)
-
-    if num_threads is None:
-        # Testing showed that 400 events per thread was best on the i7.
-        num_threads = int(min(cpu_count(), len(catalog) // 400))
-    if num_threads == 0:
-        num_threads = 1
+    latitudes, longitudes, depths = _catalog_locations(catalog)
+    num_threads = _distance_threads(len(catalog), num_threads)
 
     ret = utilslib.remove_unclustered(
         latitudes, longitudes, depths, len(catalog), mask, distance_cutoff,
@@ -890,24 +990,75 @@ def remove_unclustered(catalog, distance_cutoff, num_threads=None):
     return catalog
 
 
-def dist_mat_km(catalog, num_threads=None):
+def _catalog_locations(catalog):
     """
-    Compute the distance matrix for a catalog using hypocentral separation.
+    Locations of the preferred origins of a catalog for the distance routines.
+
+    :returns:
+        Latitudes and longitudes in radians and depths in km, as contiguous
+        float32 arrays.
+    """
+    latitudes, longitudes, depths = (
+        np.empty(len(catalog)), np.empty(len(catalog)), np.empty(len(catalog)))
+    for i, event in enumerate(catalog):
+        origin = event.preferred_origin() or event.origins[0]
+        latitudes[i] = origin.latitude
+        longitudes[i] = origin.longitude
+        depths[i] = origin.depth / 1000
+    depths = np.ascontiguousarray(depths, dtype=np.float32)
+    latitudes = np.ascontiguousarray(np.radians(latitudes), dtype=np.float32)
+    longitudes = np.ascontiguousarray(np.radians(longitudes), dtype=np.float32)
+    return latitudes, longitudes, depths
+
 
-    Will give physical distance in kilometers.
+def _distance_threads(n_events, num_threads=None):
+    """ Threads to compute distances between n_events over. """
+    if num_threads is None:
+        # Testing showed that 400 events per thread was best on the i7.
+        num_threads = int(min(cpu_count(), n_events // 400))
+    if num_threads == 0:
+        num_threads = 1
+    return num_threads
+
+
+def dist_array_km(catalog, num_threads=None, dtype=np.float32):
+    """
+    Compute the condensed distance matrix for a catalog using hypocentral
+    separation.
+
+    Will give physical distance in kilometers, as
+    :func:`scipy.spatial.distance.pdist` would, so the result can be given
+    directly to :func:`scipy.cluster.hierarchy.linkage`. Only the upper
+    triangle is stored, halving the memory of :func:`dist_mat_km`.
 
     :type catalog: obspy.core.event.Catalog
     :param catalog: Catalog for which to compute the distance matrix
+    :type num_threads: int
+    :param num_threads:
+        Number of threads to use, defaults to one per 400 events up to the
+        number of cores.
+    :type dtype: numpy.dtype
+    :param dtype:
+        Either np.float32 or np.float16. float16 quarters the memory of a
+        square float32 matrix but only keeps about three significant figures.
 
-    :returns: distance matrix
+    :returns:
+        Condensed distance matrix of length n * (n - 1) / 2 for n events
     :rtype: :class:`numpy.ndarray`
     """
     import ctypes
     from eqcorrscan.utils.libnames import _load_cdll
 
+    formats = {np.dtype(np.float32): 0, np.dtype(np.float16): 1}
+    dtype = np.dtype(dtype)
+    if dtype not in formats:
+        raise NotImplementedError(
+            "dtype must be one of {0}, not {1}".format(
+                [str(key) for key in formats.keys()], dtype))
+
     utilslib = _load_cdll('libutils')
 
-    utilslib.distance_matrix.argtypes = [
+    utilslib.distance_matrix_condensed.argtypes = [
         np.ctypeslib.ndpointer(dtype=np.float32,
                                flags='C_CONTIGUOUS'),
         np.ctypeslib.ndpointer(dtype=np.float32,
@@ -915,38 +1066,156 @@ def dist_mat_km(catalog, num_threads=None):
         np.ctypeslib.ndpointer(dtype=np.float32,
                                flags='C_CONTIGUOUS'),
         ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=dtype,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_int, ctypes.c_int]
+    utilslib.distance_matrix_condensed.restype = ctypes.c_int
+
+    n_events = len(catalog)
+    latitudes, longitudes, depths = _catalog_locations(catalog)
+    dist_vec = np.empty(n_events * (n_events - 1) // 2, dtype=dtype)
+    num_threads = _distance_threads(n_events, num_threads)
+
+    ret = utilslib.distance_matrix_condensed(
+        latitudes, longitudes, depths, n_events, dist_vec, formats[dtype],
+        num_threads)
+
+    if ret != 0:  # pragma: no cover
+        raise MemoryError("Could not allocate distance workspace")
+    return dist_vec
+
+
+def dist_pairs_km(catalog, cutoff, num_threads=None):
+    """
+    Find pairs of events in a catalog within a hypocentral separation.
+
+    A sparse alternative to :func:`dist_array_km` for large catalogs when
+    only nearby events matter: distances are only kept for pairs no more than
+    cutoff km apart, and pairs are found through a uniform grid of the
+    catalog rather than by computing the distance of every pair.
+
+    :type catalog: obspy.core.event.Catalog
+    :param catalog: Catalog to find pairs in
+    :type cutoff: float
+    :param cutoff: Largest separation to keep in km
+    :type num_threads: int
+    :param num_threads:
+        Number of threads to use, defaults to one per 400 events up to the
+        number of cores.
+
+    :returns:
+        Indexes of the first events, indexes of the second events (always
+        greater than the first) and distances in km of each pair, ordered by
+        first then second index.
+    :rtype: tuple
+    """
+    import ctypes
+    from eqcorrscan.utils.libnames import _load_cdll
+
+    utilslib = _load_cdll('libutils')
+
+    utilslib.distance_pairs.argtypes = [
         np.ctypeslib.ndpointer(dtype=np.float32,
                                flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_long, ctypes.c_float,
+        np.ctypeslib.ndpointer(dtype=np.int64,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p,
         ctypes.c_int]
-    utilslib.distance_matrix.restype = ctypes.c_int
+    utilslib.distance_pairs.restype = ctypes.c_longlong
+
+    n_events = len(catalog)
+    latitudes, longitudes, depths = _catalog_locations(catalog)
+    row_counts = np.zeros(n_events, dtype=np.int64)
+    num_threads = _distance_threads(n_events, num_threads)
+
+    # Count first so that the pairs can be written in place
+    n_pairs = utilslib.distance_pairs(
+        latitudes, longitudes, depths, n_events, cutoff, row_counts,
+        None, None, None, num_threads)
+    if n_pairs < 0:  # pragma: no cover
+        raise MemoryError("Could not allocate distance workspace")
+    rows = np.empty(n_pairs, dtype=np.int64)
+    cols = np.empty(n_pairs, dtype=np.int64)
+    dists = np.empty(n_pairs, dtype=np.float32)
+    if n_pairs:
+        ret = utilslib.distance_pairs(
+            latitudes, longitudes, depths, n_events, cutoff, row_counts,
+            rows.ctypes.data, cols.ctypes.data, dists.ctypes.data,
+            num_threads)
+        if ret < 0:  # pragma: no cover
+            raise MemoryError("Could not allocate distance workspace")
+    return rows, cols, dists
+
+
+def neighbour_counts_km(catalog, cutoff, num_threads=None):
+    """
+    Count the events within a hypocentral separation of each event.
 
-    # Initialize square matrix
-    dist_mat = np.zeros((len(catalog), len(catalog)), dtype=np.float32)
-    latitudes, longitudes, depths = (
-        np.empty(len(catalog)), np.empty(len(catalog)), np.empty(len(catalog)))
-    for i, event in enumerate(catalog):
-        origin = event.preferred_origin() or event.origins[0]
-        latitudes[i] = origin.latitude
-        longitudes[i] = origin.longitude
-        depths[i] = origin.depth / 1000
-    depths = np.ascontiguousarray(depths, dtype=np.float32)
-    latitudes = np.ascontiguousarray(np.radians(latitudes), dtype=np.float32)
-    longitudes = np.ascontiguousarray(np.radians(longitudes), dtype=np.float32)
+    Events are found through a uniform grid of the catalog rather than by
+    computing the distance of every pair.
 
-    if num_threads is None:
-        # Testing showed that 400 events per thread was best on the i7.
-        num_threads = int(min(cpu_count(), len(catalog) // 400))
-    if num_threads == 0:
-        num_threads = 1
+    :type catalog: obspy.core.event.Catalog
+    :param catalog: Catalog to count neighbours in
+    :type cutoff: float
+    :param cutoff: Largest separation of neighbours in km
+    :type num_threads: int
+    :param num_threads:
+        Number of threads to use, defaults to one per 400 events up to the
+        number of cores.
+
+    :returns: Number of other events within cutoff of each event
+    :rtype: :class:`numpy.ndarray`
+    """
+    import ctypes
+    from eqcorrscan.utils.libnames import _load_cdll
 
-    ret = utilslib.distance_matrix(
-        latitudes, longitudes, depths, len(catalog), dist_mat, num_threads)
+    utilslib = _load_cdll('libutils')
 
-    if ret != 0:  # pragma: no cover
-        raise Exception("Internal error while computing distance matrix")
-    # Fill distance matrix
-    out = dist_mat.T + dist_mat
-    return out
+    utilslib.neighbour_counts.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_long, ctypes.c_float,
+        np.ctypeslib.ndpointer(dtype=np.int64,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_int]
+    utilslib.neighbour_counts.restype = ctypes.c_longlong
+
+    latitudes, longitudes, depths = _catalog_locations(catalog)
+    counts = np.zeros(len(catalog), dtype=np.int64)
+    num_threads = _distance_threads(len(catalog), num_threads)
+
+    ret = utilslib.neighbour_counts(
+        latitudes, longitudes, depths, len(catalog), cutoff, counts,
+        num_threads)
+
+    if ret < 0:  # pragma: no cover
+        raise MemoryError("Could not allocate location index")
+    return counts
+
+
+def dist_mat_km(catalog, num_threads=None):
+    """
+    Compute the distance matrix for a catalog using hypocentral separation.
+
+    Will give physical distance in kilometers. For large catalogs use
+    :func:`dist_array_km`, which does not need the full square matrix.
+
+    :type catalog: obspy.core.event.Catalog
+    :param catalog: Catalog for which to compute the distance matrix
+
+    :returns: distance matrix
+    :rtype: :class:`numpy.ndarray`
+    """
+    return squareform(dist_array_km(catalog, num_threads=num_threads))
 
 
 def dist_mat_time(catalog):
@@ -1050,12 +1319,11 @@ def catalog_cluster(catalog, thresh, metric="distance", show=True):
     """
     # Compute the distance matrix and linkage
     if metric == "distance":
-        dist_mat = dist_mat_km(catalog)
+        dist_vec = dist_array_km(catalog)
     elif metric == "time":
-        dist_mat = dist_mat_time(catalog)
+        dist_vec = squareform(dist_mat_time(catalog))
     else:
         raise NotImplementedError("Only supports distance and time metrics")
-    dist_vec = squareform(dist_mat)
     Z = linkage(dist_vec, method='average')
 
     # Cluster the linkage using the given threshold as the cutoff
@@ -18,11 +18,18 @@ than the Numpy routine.
     GNU Lesser General Public License, Version 3
     (https://www.gnu.org/copyleft/lesser.html)
 """
+import concurrent.futures
 import contextlib
 import copy
 import ctypes
+import hashlib
+import json
 import os
 import logging
+import platform
+import threading
+import time
+from collections import OrderedDict
 from multiprocessing import Pool as ProcessPool, cpu_count
 from multiprocessing.pool import ThreadPool
 
@@ -31,7 +38,7 @@ import math
 from packaging import version
 
 from eqcorrscan.utils.libnames import _load_cdll
-from eqcorrscan.utils import FMF_INSTALLED
+from eqcorrscan.utils import FMF_INSTALLED, CUPY_INSTALLED
 
 
 Logger = logging.getLogger(__name__)
@@ -62,6 +69,47 @@ MULTIPLIER = 1e8
 # Minimum version for compatible correlations from Fast Matched Filter
 MIN_FMF_VERSION = version.parse("1.4.0")
 
+# Default memory for thread-private stacks in the fftw backend
+FFTW_STACK_MEMORY = 2 ** 30
+# Default bytes of FFT workspace for all templates at fft-lengths tried by
+# XcorrTuner when fftw_memory_limit is not given
+XCORR_TUNER_MEMORY = 2 ** 32
+# Default bytes of sliding moments kept by an FFTWContext
+FFTW_MOMENTS_MEMORY = 2 ** 30
+# FFTW planner rigour - values must match the PLANNER_* defines in libutils.h
+FFTW_PLANNERS = {"estimate": 0, "measure": 1, "patient": 2, "exhaustive": 3}
+# Instruction sets for C kernels - values must match SIMD_* in libutils.h
+SIMD_LEVELS = {"scalar": 0, "avx2": 1, "avx512": 2, "neon": 3}
+# Output types for multi_normxcorr_fftw, int16 correlations are scaled by
+# INT16_SCALE
+FFTW_OUTPUT_DTYPES = {np.dtype(np.float32): 0, np.dtype(np.float16): 1,
+                      np.dtype(np.int16): 2}
+INT16_SCALE = 32767
+# Sample types of continuous data read without conversion by the fftw
+# backend - values must match IMAGE_* in libutils.h
+IMAGE_DTYPES = {np.dtype(np.float32): 0, np.dtype(np.int32): 1,
+                np.dtype(np.float64): 2}
+# MAD peak candidates are kept above this fraction of the running threshold,
+# as PEAK_FLOOR_FRACTION in libutils.h
+PEAK_FLOOR_FRACTION = 0.5
+# Windows of continuous data with less variance than this are not
+# normalised, and below WARN_DIFF are counted as low variance - as
+# ACCEPTED_DIFF and WARN_DIFF in libutils.h
+ACCEPTED_DIFF = 1e-10
+WARN_DIFF = 1e-8
+# Fraction of free device memory used by the cupy backend when no limit is
+# given, and the most overlap-save chunks it transforms at once
+CUPY_MEMORY_FRACTION = 0.5
+CUPY_CHUNK_BATCH = 64
+# Warning flags of correlation_stats - values must match CORR_WARN_* in
+# libutils.h
+CORR_WARN_OUTER_DISABLED = 1
+CORR_WARN_OVERSUBSCRIBED = 2
+CORR_WARN_UNKNOWN_PLANNER = 4
+CORR_WARN_MEMORY_LIMIT = 8
+# Methods of batch_normxcorr - values must match BATCH_* in libutils.h
+BATCH_METHODS = {"auto": 0, "time": 1, "fft": 2}
+
 
 class CorrelationError(Exception):
     """ Error handling for correlation functions. """
@@ -480,53 +528,124 @@ def time_multi_normxcorr(templates, stream, pads, threaded=False, *args,
 
     :return: np.ndarray of cross-correlations
     :return: np.ndarray channels used
+
+    .. Note::
+        Correlations are normalised in the same way as :func:`fftw_normxcorr`
+        and computed in tiles of templates and lags, see
+        :func:`time_multi_channel_normxcorr`.
     """
-    used_chans = ~np.isnan(templates).any(axis=1)
+    cores = kwargs.get('cores', cpu_count()) if threaded else 1
+    ccc, used_chans = time_multi_channel_normxcorr(
+        template_array={"": templates}, stream_array={"": stream},
+        pad_array={"": pads}, seed_ids=[""], cores=cores, stack=False)
+    return ccc[:, 0], used_chans[0]
+
+
+def time_multi_channel_normxcorr(template_array, stream_array, pad_array,
+                                 seed_ids, cores=1, stack=True, *args,
+                                 **kwargs):
+    """
+    Time-domain correlations of multiple channels in one C call.
+
+    A drop-in for :func:`fftw_multi_normxcorr` that is faster for short
+    templates: the sliding moments of the stream are the same as those used
+    by the FFTW routines, and each tile of lags is correlated with blocks of
+    templates held in vector registers.
+
+    :type template_array: dict
+    :param template_array: Templates keyed by seed id
+    :type stream_array: dict
+    :param stream_array: Continuous data keyed by seed id
+    :type pad_array: dict
+    :param pad_array: Pads of each template keyed by seed id
+    :type seed_ids: list
+    :param seed_ids: Seed ids to correlate, in order
+    :type cores: int
+    :param cores: Number of threads to share tiles between
+    :type stack: bool
+    :param stack: Whether to sum correlations over channels
 
+    rtype: np.ndarray, list
+    :return: Array of cross-correlations and list of used channels.
+    """
     utilslib = _load_cdll('libutils')
 
-    argtypes = [
-        np.ctypeslib.ndpointer(dtype=np.float32, ndim=1,
+    utilslib.multi_normxcorr_time_blocked.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float32,
                                flags='C_CONTIGUOUS'),
-        ctypes.c_int, ctypes.c_int,
-        np.ctypeslib.ndpointer(dtype=np.float32, ndim=1,
+        ctypes.c_long, ctypes.c_long, ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
                                flags='C_CONTIGUOUS'),
         ctypes.c_int,
-        np.ctypeslib.ndpointer(dtype=np.float32, ndim=1,
-                               flags='C_CONTIGUOUS')]
-    restype = ctypes.c_int
-    if threaded:
-        func = utilslib.multi_normxcorr_time_threaded
-        argtypes.append(ctypes.c_int)
-    else:
-        func = utilslib.multi_normxcorr_time
-    func.argtypes = argtypes
-    func.restype = restype
-    # Need to de-mean everything
-    templates_means = templates.mean(axis=1).astype(np.float32)[:, np.newaxis]
-    stream_mean = stream.mean().astype(np.float32)
-    templates = templates.astype(np.float32) - templates_means
-    stream = stream.astype(np.float32) - stream_mean
-    template_len = templates.shape[1]
-    n_templates = templates.shape[0]
-    image_len = stream.shape[0]
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_int]
+    utilslib.multi_normxcorr_time_blocked.restype = ctypes.c_int
+
+    template_len = template_array[seed_ids[0]].shape[1]
+    n_channels = len(seed_ids)
+    n_templates = template_array[seed_ids[0]].shape[0]
+    image_len = stream_array[seed_ids[0]].shape[0]
     ccc_length = image_len - template_len + 1
     assert ccc_length > 0, "Template must be shorter than stream"
-    ccc = np.ascontiguousarray(
-        np.empty(ccc_length * n_templates), np.float32)
-    t_array = np.ascontiguousarray(templates.flatten(), np.float32)
-    time_args = [t_array, template_len, n_templates,
-                 np.ascontiguousarray(stream, np.float32), image_len, ccc]
-    if threaded:
-        time_args.append(kwargs.get('cores', cpu_count()))
-    func(*time_args)
-    ccc[np.isnan(ccc)] = 0.0
-    ccc = ccc.reshape((n_templates, image_len - template_len + 1))
-    for i in range(len(pads)):
-        ccc[i] = np.append(ccc[i], np.zeros(pads[i]))[pads[i]:]
-    templates += templates_means
-    stream += stream_mean
-    return ccc, used_chans
+    used_chans = [~np.isnan(template_array[seed_id]).any(axis=1)
+                  for seed_id in seed_ids]
+    norm = [np.nan_to_num(
+        (template_array[seed_id] -
+         template_array[seed_id].mean(axis=-1, keepdims=True)) / (
+            template_array[seed_id].std(axis=-1, keepdims=True) *
+            template_len)) for seed_id in seed_ids]
+    norm = np.ascontiguousarray(norm, dtype=np.float32)
+    image = np.ascontiguousarray(
+        [stream_array[seed_id] for seed_id in seed_ids], dtype=np.float32)
+    for i, seed_id in enumerate(seed_ids):
+        # Check that stream is non-zero and above variance threshold
+        if not np.all(image[i] == 0) and np.var(image[i]) < 1e-8:
+            image[i] *= MULTIPLIER
+            Logger.warning(f"Low variance found for {seed_id}, applying "
+                           "gain to stabilise correlations")
+    if stack:
+        cccs = np.zeros((n_templates, ccc_length), np.float32)
+    else:
+        cccs = np.zeros((n_templates, n_channels, ccc_length), np.float32)
+    used_chans_np = np.ascontiguousarray(used_chans, dtype=np.intc)
+    pad_array_np = np.ascontiguousarray(
+        [pad_array[seed_id] for seed_id in seed_ids], dtype=np.intc)
+    variance_warnings = np.zeros(n_channels, dtype=np.intc)
+    missed_correlations = np.zeros(n_channels, dtype=np.intc)
+
+    ret = utilslib.multi_normxcorr_time_blocked(
+        norm, n_templates, template_len, n_channels, image, image_len, cccs,
+        used_chans_np, pad_array_np, max(int(cores or 1), 1),
+        variance_warnings, missed_correlations, int(stack))
+    if ret < 0:
+        raise MemoryError("Memory allocation failed in correlation C-code")
+    elif ret > 0:
+        Logger.critical(
+            'Out-of-range correlation in C-code, these are set to zero. '
+            'You are STRONGLY RECOMMENDED to check your data for spikes, '
+            'clipping or non-physical artifacts')
+    for i, missed_corr in enumerate(missed_correlations):
+        if missed_corr:
+            Logger.debug(
+                f"{missed_corr} correlations not computed on {seed_ids[i]}, "
+                f"are there gaps in the data? If not, consider "
+                "increasing gain")
+    for i, variance_warning in enumerate(variance_warnings):
+        if variance_warning and variance_warning > template_len:
+            Logger.warning(
+                f"Low variance found in {variance_warning} places for "
+                f"{seed_ids[i]}, check result.")
+    return cccs, used_chans
 
 
 @register_array_xcorr('fftw', is_default=True)
@@ -557,6 +676,12 @@ def fftw_normxcorr(templates, stream, pads, threaded=False, *args, **kwargs):
 
     :return: np.ndarray of cross-correlations
     :return: np.ndarray channels used
+
+    .. Note::
+        Set the `fftw_planner` keyword argument to one of "estimate"
+        (default), "measure", "patient" or "exhaustive" to select how hard
+        FFTW works to find fast transforms, see :func:`export_fftw_wisdom`
+        to keep the results.
     """
     utilslib = _load_cdll('libutils')
 
@@ -577,7 +702,8 @@ def fftw_normxcorr(templates, stream, pads, threaded=False, *args, **kwargs):
         np.ctypeslib.ndpointer(dtype=np.intc,
                                flags='C_CONTIGUOUS'),
         np.ctypeslib.ndpointer(dtype=np.intc,
-                               flags='C_CONTIGUOUS')]
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_int]
     restype = ctypes.c_int
 
     if threaded:
@@ -632,7 +758,8 @@ def fftw_normxcorr(templates, stream, pads, threaded=False, *args, **kwargs):
         template_length, n_templates,
         np.ascontiguousarray(stream, np.float32), stream_length,
         np.ascontiguousarray(ccc, np.float32), fftshape,
-        used_chans_np, pads_np, variance_warning, missed_corr)
+        used_chans_np, pads_np, variance_warning, missed_corr,
+        _get_fftw_planner(kwargs.get("fftw_planner")))
     if ret < 0:
         raise MemoryError()
     elif ret > 0:
@@ -684,27 +811,16 @@ def _time_threaded_normxcorr(templates, stream, stack=True, *args, **kwargs):
         list of list of tuples of station, channel for all cross-correlations.
     :rtype: list
     """
-    no_chans = np.zeros(len(templates))
-    chans = [[] for _ in range(len(templates))]
+    chans = [[] for _i in range(len(templates))]
     array_dict_tuple = _get_array_dicts(templates, stream, stack=stack)
     stream_dict, template_dict, pad_dict, seed_ids = array_dict_tuple
-    ccc_length = max(
-        len(stream[0]) - len(templates[0][0]) + 1,
-        len(templates[0][0]) - len(stream[0]) + 1)
-    if stack:
-        cccsums = np.zeros([len(templates), ccc_length])
-    else:
-        cccsums = np.zeros([len(templates), len(seed_ids), ccc_length])
-    for chan_no, seed_id in enumerate(seed_ids):
-        tr_cc, tr_chans = time_multi_normxcorr(
-            template_dict[seed_id], stream_dict[seed_id], pad_dict[seed_id],
-            True)
-        if stack:
-            cccsums = np.sum([cccsums, tr_cc], axis=0)
-        else:
-            cccsums[:, chan_no] = tr_cc
-        no_chans += tr_chans.astype(np.int)
-        for chan, state in zip(chans, tr_chans):
+    cccsums, tr_chans = time_multi_channel_normxcorr(
+        template_array=template_dict, stream_array=stream_dict,
+        pad_array=pad_dict, seed_ids=seed_ids,
+        cores=kwargs.get('cores') or cpu_count(), stack=stack)
+    no_chans = np.sum(np.array(tr_chans).astype(np.int), axis=0)
+    for seed_id, tr_chan in zip(seed_ids, tr_chans):
+        for chan, state in zip(chans, tr_chan):
             if state:
                 chan.append(seed_id)
     if stack:
@@ -740,24 +856,31 @@ def _fftw_stream_xcorr(templates, stream, stack=True, *args, **kwargs):
     :returns:
         list of list of tuples of station, channel for all cross-correlations.
     :rtype: list
-    """
-    # number of threads:
-    #   default to using inner threads
-    #   if `cores` or `cores_outer` passed in then use that
-    #   else if OMP_NUM_THREADS set use that
-    #   otherwise use all available
-    num_cores_inner = kwargs.pop('cores', None)
-    if num_cores_inner is None:
-        num_cores_inner = int(os.getenv("OMP_NUM_THREADS", cpu_count()))
 
+    .. Note::
+        Threading is split between channels (`cores_outer`) and within each
+        channel (`cores`), where the overlap-save chunks of a channel are
+        correlated in parallel.  If only `cores` is given the threads are
+        used across channels first, which usually scales best.  Every
+        thread (`cores` x `cores_outer`) needs its own workspace of roughly
+        3 x n_templates x fft_len floats.
+    """
     chans = [[] for _i in range(len(templates))]
     array_dict_tuple = _get_array_dicts(templates, stream, stack=stack)
     stream_dict, template_dict, pad_dict, seed_ids = array_dict_tuple
     assert set(seed_ids)
+    num_cores_inner, num_cores_outer = _set_inner_outer_threading(
+        kwargs.pop('cores', None), kwargs.pop('cores_outer', None),
+        len(seed_ids))
+    if kwargs.get("fftw_context") is not None:
+        # The data are copied for each call, identify them by their traces
+        kwargs.update(fftw_moments_sources={
+            seed_id: stream.select(id=seed_id.split('_')[0])[0]
+            for seed_id in seed_ids})
     cccsums, tr_chans = fftw_multi_normxcorr(
         template_array=template_dict, stream_array=stream_dict,
         pad_array=pad_dict, seed_ids=seed_ids, cores_inner=num_cores_inner,
-        stack=stack, *args, **kwargs)
+        cores_outer=num_cores_outer, stack=stack, *args, **kwargs)
     no_chans = np.sum(np.array(tr_chans).astype(np.int), axis=0)
     for seed_id, tr_chan in zip(seed_ids, tr_chans):
         for chan, state in zip(chans, tr_chan):
@@ -770,8 +893,880 @@ def _fftw_stream_xcorr(templates, stream, stack=True, *args, **kwargs):
     return cccsums, no_chans, chans
 
 
+def _get_fftw_planner(planner):
+    """
+    Get the integer planner rigour for the C code from a name.
+
+    >>> _get_fftw_planner("measure")
+    1
+    >>> _get_fftw_planner(None)
+    0
+    """
+    if planner is None:
+        return FFTW_PLANNERS["estimate"]
+    if isinstance(planner, str) and planner.lower() in FFTW_PLANNERS:
+        return FFTW_PLANNERS[planner.lower()]
+    raise ValueError(
+        f"fftw_planner {planner} not in {list(FFTW_PLANNERS.keys())}")
+
+
+def import_fftw_wisdom(filename):
+    """
+    Load FFTW wisdom from a file.
+
+    Plans made after this will use the wisdom, so a machine that has measured
+    plans once (see :func:`export_fftw_wisdom`) can start every later job with
+    optimal plans and negligible planning cost.  Wisdom is only used if the
+    planner rigour requested is no higher than the one the wisdom was made
+    with.
+
+    :type filename: str
+    :param filename: File written by :func:`export_fftw_wisdom`
+
+    :raises: IOError if the wisdom could not be read.
+    """
+    utilslib = _load_cdll('libutils')
+    utilslib.import_fftw_wisdom.argtypes = [ctypes.c_char_p]
+    utilslib.import_fftw_wisdom.restype = ctypes.c_int
+    ret = utilslib.import_fftw_wisdom(os.fsencode(filename))
+    if ret != 0:
+        raise IOError(f"Could not import FFTW wisdom from {filename}")
+    Logger.info(f"Imported FFTW wisdom from {filename}")
+
+
+def export_fftw_wisdom(filename):
+    """
+    Save all the FFTW wisdom accumulated by this process to a file.
+
+    .. rubric:: Example
+
+    A worker can plan once for the fft-length and number of templates it will
+    use, then save the plans for later sessions:
+
+    >>> from eqcorrscan.utils.correlate import (
+    ...     fftw_normxcorr, export_fftw_wisdom)
+    >>> templates = np.random.randn(4, 100).astype(np.float32)
+    >>> stream = np.random.randn(10000).astype(np.float32)
+    >>> ccc, _ = fftw_normxcorr(
+    ...     templates, stream, pads=[0, 0, 0, 0], fftw_planner="measure",
+    ...     fft_len=2 ** 11)
+    >>> export_fftw_wisdom("eqcorrscan.wisdom")
+    >>> import os
+    >>> os.remove("eqcorrscan.wisdom")
+
+    :type filename: str
+    :param filename: File to write to
+
+    :raises: IOError if the wisdom could not be written.
+    """
+    utilslib = _load_cdll('libutils')
+    utilslib.export_fftw_wisdom.argtypes = [ctypes.c_char_p]
+    utilslib.export_fftw_wisdom.restype = ctypes.c_int
+    ret = utilslib.export_fftw_wisdom(os.fsencode(filename))
+    if ret != 0:
+        raise IOError(f"Could not export FFTW wisdom to {filename}")
+
+
+def forget_fftw_wisdom():
+    """ Forget all FFTW wisdom held by this process. """
+    utilslib = _load_cdll('libutils')
+    utilslib.forget_fftw_wisdom.argtypes = []
+    utilslib.forget_fftw_wisdom.restype = None
+    utilslib.forget_fftw_wisdom()
+
+
+def get_simd_level():
+    """
+    Get the instruction set used by the vectorised C correlation kernels.
+
+    :return: One of the keys of SIMD_LEVELS
+    :rtype: str
+    """
+    utilslib = _load_cdll('libutils')
+    utilslib.get_simd_level.argtypes = []
+    utilslib.get_simd_level.restype = ctypes.c_int
+    level = utilslib.get_simd_level()
+    return {value: key for key, value in SIMD_LEVELS.items()}[level]
+
+
+def set_simd_level(level=None):
+    """
+    Force the instruction set used by the vectorised C correlation kernels.
+
+    The best instruction set for the CPU is selected by default, this is
+    mostly useful for testing and benchmarking.
+
+    :type level: str
+    :param level:
+        One of the keys of SIMD_LEVELS, or None to select the best available.
+        Unsupported instruction sets fall back to "scalar".
+
+    :return: The instruction set in use
+    :rtype: str
+    """
+    if level is None:
+        level_int = -1
+    else:
+        try:
+            level_int = SIMD_LEVELS[level.lower()]
+        except (KeyError, AttributeError):
+            raise ValueError(
+                f"SIMD level {level} unknown, must be one of "
+                f"{list(SIMD_LEVELS.keys())}")
+    utilslib = _load_cdll('libutils')
+    utilslib.set_simd_level.argtypes = [ctypes.c_int]
+    utilslib.set_simd_level.restype = ctypes.c_int
+    used = utilslib.set_simd_level(level_int)
+    if level_int >= 0 and used != level_int:
+        Logger.warning(f"SIMD level {level} is not supported by this CPU, "
+                       "using scalar kernels")
+    return {value: key for key, value in SIMD_LEVELS.items()}[used]
+
+
+def set_numa_layout(domains=1, pin=False):
+    """
+    Set how fftw correlation threads and their memory are placed on machines
+    with several NUMA domains (sockets).
+
+    Workspaces are always initialised by the thread that uses them, so on
+    Linux they are placed in the memory of that thread's domain. The outer
+    (channel) threads are split into `domains` contiguous blocks: contexts
+    with cached template spectra (see :class:`FFTWContext`) keep a copy of
+    the spectra for each block, written by a thread of that block. With
+    `pin` each thread is pinned to a CPU while correlating, the inner threads
+    of an outer thread to neighbouring CPUs, so that threads stay next to
+    their memory.  Applies to correlations (and contexts) started afterwards.
+
+    :type domains: int
+    :param domains:
+        Number of NUMA domains to spread outer threads over, usually the
+        number of sockets.  Each copy of the spectra costs as much memory as
+        the first.
+    :type pin: bool
+    :param pin:
+        Pin threads to CPUs while correlating (Linux only), in the order of
+        the CPUs that the process is allowed to use.
+
+    :return: Whether threads will be pinned
+    :rtype: bool
+
+    .. Note::
+        Pinning assumes that the OpenMP runtime re-uses the same threads for
+        the same places in teams of the same size, as the common runtimes do.
+        Domains work best with `cores_outer` a multiple of `domains`.
+    """
+    if domains < 1:
+        raise ValueError(f"domains must be at least 1, not {domains}")
+    utilslib = _load_cdll('libutils')
+    utilslib.set_numa_layout.argtypes = [ctypes.c_int, ctypes.c_int]
+    utilslib.set_numa_layout.restype = ctypes.c_int
+    return bool(utilslib.set_numa_layout(int(domains), int(bool(pin))))
+
+
+class FFTWContext(object):
+    """
+    Persistent state for the fftw correlation backend.
+
+    Holds template spectra and FFTW plans in C between calls to
+    :func:`fftw_multi_normxcorr` so that correlating the same templates
+    against successive chunks of data (e.g. the chunks of a
+    :meth:`eqcorrscan.core.match_filter.tribe.Tribe.detect` run) only
+    transforms the templates once.  Pass an instance as the `fftw_context`
+    keyword argument to any of the fftw stream functions (this can be given
+    straight to `Tribe.detect`).
+
+    Contexts are keyed on the templates, the channel layout, fft-length and
+    threading, so one instance can be shared between template groups: each
+    group gets its own context.  Call :meth:`clear` (or use the instance as a
+    context manager) to release the memory.
+
+    The sliding means and standard deviations of the data used to normalise
+    correlations only depend on the data and the template length, so these
+    are also kept for each channel and shared between template groups
+    correlated against the same data.  Data are identified by their seed id,
+    start-time, length and buffer (a reference to which is held while their
+    moments are kept), not by their values, so data must not be changed in
+    place while a context is used with them.
+
+    :type cache_moments: bool
+    :param cache_moments:
+        Whether to keep the sliding moments of the data, set to False to
+        save memory.
+    :type moments_memory: int
+    :param moments_memory:
+        Bytes of moments to keep, the least recently used are freed to make
+        room for new data.  Channels whose moments do not fit are normalised
+        from moments computed for each chunk.
+    :type spectra_dir: str
+    :param spectra_dir:
+        Directory to keep the template spectra of each set of templates in
+        between processes.  Spectra are read from this rather than
+        computed when a file for the same templates and fft-length exists,
+        and are written to it when they are computed, so a restarted
+        detector does not need to transform its templates again.
+
+    .. Note::
+        Spectra files are written in the byte order and float format of the
+        machine that wrote them, and are only read on machines that match.
+
+    .. Note::
+        The spectra of every template on every channel are kept in memory,
+        which needs n_channels x n_templates x (fft_len / 2 + 1) complex
+        floats for each set of templates held.  Moments need 17 bytes per
+        sample of each channel for each template length, up to
+        `moments_memory`.
+
+    .. rubric:: Example
+
+    >>> with FFTWContext() as context:
+    ...     len(context)
+    0
+    """
+    def __init__(self, cache_moments=True, spectra_dir=None,
+                 moments_memory=FFTW_MOMENTS_MEMORY):
+        self.cache_moments = cache_moments
+        self.moments_memory = moments_memory
+        self.spectra_dir = spectra_dir
+        self._contexts = dict()
+        self._moments = OrderedDict()
+        self._moments_bytes = 0
+
+    def __len__(self):
+        return len(self._contexts)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.clear()
+
+    def __del__(self):
+        try:
+            self.clear()
+        except Exception:  # pragma: no cover
+            # Library may already be unloaded at interpreter shutdown
+            pass
+
+    def __getstate__(self):
+        # C pointers cannot be shared across processes.
+        return {"cache_moments": self.cache_moments,
+                "moments_memory": self.moments_memory,
+                "spectra_dir": self.spectra_dir, "_contexts": dict(),
+                "_moments": OrderedDict(), "_moments_bytes": 0}
+
+    @staticmethod
+    def _key(template_array, seed_ids, fft_len, cores, planner):
+        """ Get a hashable identifier for a set of templates. """
+        template_hash = hashlib.sha1()
+        for seed_id in seed_ids:
+            template_hash.update(seed_id.encode())
+            template_hash.update(
+                np.ascontiguousarray(template_array[seed_id]).view(np.uint8))
+        return (template_hash.hexdigest(), fft_len, cores, planner)
+
+    def _get(self, key):
+        return self._contexts.get(key)
+
+    def _spectra_file(self, key):
+        """ File for the spectra of the templates and fft-length of key. """
+        return os.path.join(self.spectra_dir, f"{key[0]}_{key[1]}.spectra")
+
+    def _load(self, key, utilslib, cores_inner, cores_outer, planner):
+        """
+        Make a context from spectra saved in spectra_dir, or None if there
+        are none for key.
+        """
+        if self.spectra_dir is None:
+            return None
+        filename = self._spectra_file(key)
+        if not os.path.isfile(filename):
+            return None
+        utilslib.multi_normxcorr_fftw_load.argtypes = [
+            ctypes.c_char_p, ctypes.c_char_p, ctypes.c_long, ctypes.c_int,
+            ctypes.c_int, ctypes.c_int]
+        utilslib.multi_normxcorr_fftw_load.restype = ctypes.c_void_p
+        handle = utilslib.multi_normxcorr_fftw_load(
+            filename.encode(), key[0].encode(), key[1], cores_inner,
+            cores_outer, planner)
+        if not handle:
+            Logger.warning(f"Could not load template spectra from {filename}"
+                           ", computing them")
+            return None
+        Logger.debug(f"Loaded template spectra from {filename}")
+        self._contexts[key] = (handle, utilslib)
+        return handle
+
+    def _save(self, key, handle, utilslib):
+        """ Write the spectra of a context to spectra_dir. """
+        filename = self._spectra_file(key)
+        if not os.path.isdir(self.spectra_dir):
+            os.makedirs(self.spectra_dir)
+        utilslib.multi_normxcorr_fftw_save.argtypes = [
+            ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p]
+        utilslib.multi_normxcorr_fftw_save.restype = ctypes.c_int
+        # Write then move so that concurrent readers never see part of a file
+        tmp_filename = f"{filename}.{os.getpid()}.tmp"
+        if utilslib.multi_normxcorr_fftw_save(
+                handle, tmp_filename.encode(), key[0].encode()) != 0:
+            Logger.warning(f"Could not save template spectra to {filename}")
+            if os.path.isfile(tmp_filename):
+                os.remove(tmp_filename)
+            return
+        os.replace(tmp_filename, filename)
+
+    def _create(self, key, utilslib, templates, n_templates, template_len,
+                n_channels, fft_len, used_chans, pad_array, cores_inner,
+                cores_outer, planner):
+        utilslib.multi_normxcorr_fftw_create.argtypes = [
+            np.ctypeslib.ndpointer(dtype=np.float32,
+                                   flags='C_CONTIGUOUS'),
+            ctypes.c_long, ctypes.c_long, ctypes.c_long, ctypes.c_long,
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags='C_CONTIGUOUS'),
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags='C_CONTIGUOUS'),
+            ctypes.c_int, ctypes.c_int, ctypes.c_int]
+        utilslib.multi_normxcorr_fftw_create.restype = ctypes.c_void_p
+        handle = utilslib.multi_normxcorr_fftw_create(
+            templates, n_templates, template_len, n_channels, fft_len,
+            used_chans, pad_array, cores_inner, cores_outer, planner)
+        if not handle:
+            raise MemoryError(
+                "Memory allocation failed creating correlation context")
+        self._contexts[key] = (handle, utilslib)
+        if self.spectra_dir is not None:
+            self._save(key, handle, utilslib)
+        return handle
+
+    @staticmethod
+    def _moments_key(seed_id, source, image_len, template_len):
+        """
+        Identify the data of a channel without reading it.
+
+        :type source: obspy.core.trace.Trace or np.ndarray
+        :param source: Trace the channel was taken from, or the channel
+
+        :return: Hashable key and the array whose buffer it refers to.
+        """
+        starttime = None
+        if hasattr(source, "stats"):
+            starttime = str(source.stats.starttime)
+            source = source.data
+        data = np.asarray(source)
+        key = (seed_id, starttime, data.shape, data.strides, data.dtype.str,
+               data.__array_interface__["data"][0], image_len, template_len)
+        return key, data
+
+    def _get_moments(self, utilslib, channels, image, seed_ids,
+                     template_len, cores, sources=None):
+        """
+        Get the moments of each channel for template_len, computing those
+        not already held that fit in moments_memory.
+
+        :type channels: list
+        :param channels: Continuous data of each channel
+        :type image: _ImageChannels
+        :param image: The same channels as passed to the C-code
+        :type sources: list
+        :param sources:
+            Trace or array each channel was made from, used to identify the
+            data, or None to identify the channels themselves.
+
+        :return:
+            ctypes array of pointers to the moments of each channel, NULL for
+            channels whose moments are computed for each chunk.
+        """
+        if not self.cache_moments:
+            return None
+        utilslib.sliding_moments_create_image.argtypes = [
+            ctypes.POINTER(_ImageChannels), ctypes.c_long, ctypes.c_long,
+            ctypes.c_long, ctypes.c_int]
+        utilslib.sliding_moments_create_image.restype = ctypes.c_void_p
+        image_len = max(channel.shape[0] for channel in channels)
+        n_bytes = 17 * (image_len - template_len + 1)
+        sources = sources or channels
+        keys = [self._moments_key(seed_id, source, image_len, template_len)
+                for seed_id, source in zip(seed_ids, sources)]
+        in_use = {key for key, _ in keys}
+        handles = []
+        for i, (key, data) in enumerate(keys):
+            if key in self._moments:
+                self._moments.move_to_end(key)
+                handles.append(self._moments[key][0])
+                continue
+            # Free the least recently used moments not needed by this call
+            for old_key in [k for k in self._moments if k not in in_use]:
+                if self._moments_bytes + n_bytes <= self.moments_memory:
+                    break
+                self._free_moments([self._moments.pop(old_key)])
+            if self._moments_bytes + n_bytes > self.moments_memory:
+                handles.append(None)
+                continue
+            handle = utilslib.sliding_moments_create_image(
+                ctypes.byref(image), i, image_len, template_len, cores)
+            if not handle:
+                raise MemoryError(
+                    "Memory allocation failed computing moments")
+            self._moments[key] = (handle, utilslib, n_bytes, data)
+            self._moments_bytes += n_bytes
+            handles.append(handle)
+        return (ctypes.c_void_p * len(handles))(*handles)
+
+    def _free_moments(self, moments):
+        for handle, utilslib, n_bytes, _ in moments:
+            utilslib.sliding_moments_destroy.argtypes = [ctypes.c_void_p]
+            utilslib.sliding_moments_destroy.restype = None
+            utilslib.sliding_moments_destroy(handle)
+            self._moments_bytes -= n_bytes
+
+    def clear(self):
+        """ Free all the C memory held by this instance. """
+        for handle, utilslib in self._contexts.values():
+            utilslib.multi_normxcorr_fftw_destroy.argtypes = [ctypes.c_void_p]
+            utilslib.multi_normxcorr_fftw_destroy.restype = None
+            utilslib.multi_normxcorr_fftw_destroy(handle)
+        self._contexts = dict()
+        self._free_moments(self._moments.values())
+        self._moments = OrderedDict()
+
+
+class FFTWStreamCorrelator(object):
+    """
+    Streaming correlations with the fftw backend for real-time detection.
+
+    Template spectra and the last `template_len - 1 + max(pad)` samples of
+    each channel are held in C, so each call to :meth:`push` correlates a new
+    block of data and returns only the correlations that could not be
+    computed before.  The work done by each push scales with the block
+    length (plus the template length and pads), not the length of data seen.
+
+    :type template_array: dict
+    :param template_array:
+        Templates for each seed id, (n_templates, template_len) arrays as for
+        :func:`fftw_multi_normxcorr`.
+    :type pad_array: dict
+    :param pad_array: Pads for each seed id, fixed for the life of the stream.
+    :type seed_ids: list
+    :param seed_ids: Seed ids of the channels, in the order to use.
+    :type stack: bool
+    :param stack: Whether to stack correlations over channels.
+    :type cores_inner: int
+    :param cores_inner: Number of threads to use within each channel
+    :type cores_outer: int
+    :param cores_outer: Number of channels to correlate concurrently.
+    :type block_len: int
+    :param block_len:
+        Expected number of samples per push, used to choose the fft-length.
+    :type fft_len: int
+    :param fft_len: Size for fft, overrides block_len.
+    :type fftw_planner: str
+    :param fftw_planner: FFTW planner rigour, see :func:`fftw_multi_normxcorr`
+    :type fftw_stack_memory: int
+    :param fftw_stack_memory:
+        Bytes to use for thread-private stacks, see
+        :func:`fftw_multi_normxcorr`
+
+    .. Note::
+        Correlation `i` (counted from the first sample pushed) is returned
+        once `i + template_len + max(pad)` samples have been pushed, when
+        every channel has data for it.  Unlike :func:`fftw_multi_normxcorr`
+        no gain is applied to low-variance data as this cannot be done
+        consistently between blocks.
+
+    .. rubric:: Example
+
+    >>> templates = {"a": np.random.randn(2, 20).astype(np.float32)}
+    >>> pads = {"a": [0, 0]}
+    >>> with FFTWStreamCorrelator(templates, pads, ["a"]) as streamer:
+    ...     for _ in range(3):
+    ...         cccs, used_chans = streamer.push(
+    ...             {"a": np.random.randn(50).astype(np.float32)})
+    ...         print(cccs.shape)
+    (2, 31)
+    (2, 50)
+    (2, 50)
+    """
+    def __init__(self, template_array, pad_array, seed_ids, stack=True,
+                 cores_inner=1, cores_outer=1, block_len=None, fft_len=None,
+                 fftw_planner=None, fftw_stack_memory=FFTW_STACK_MEMORY):
+        self._utilslib = _load_cdll('libutils')
+        self._handle = None
+        self.seed_ids = list(seed_ids)
+        self.stack = stack
+        self.stack_memory = int(fftw_stack_memory)
+        self.n_templates, self.template_len = template_array[
+            self.seed_ids[0]].shape
+        self.n_channels = len(self.seed_ids)
+        self.used_chans = [~np.isnan(template_array[seed_id]).any(axis=1)
+                           for seed_id in self.seed_ids]
+        templates = []
+        for seed_id in self.seed_ids:
+            norm = ((template_array[seed_id] -
+                     template_array[seed_id].mean(axis=-1, keepdims=True)) / (
+                template_array[seed_id].std(axis=-1, keepdims=True) *
+                self.template_len))
+            templates.append(np.nan_to_num(norm))
+        templates = np.ascontiguousarray(templates, dtype=np.float32)
+        pads = np.ascontiguousarray(
+            [pad_array[seed_id] for seed_id in self.seed_ids], dtype=np.intc)
+        self.max_pad = int(pads.max()) if pads.size else 0
+        if fft_len is None:
+            fft_len = min(2 ** 13, next_fast_len(
+                self.template_len - 1 + self.max_pad +
+                (block_len or self.template_len)))
+        if fft_len < self.template_len:
+            fft_len = next_fast_len(self.template_len - 1 + self.max_pad +
+                                    (block_len or self.template_len))
+            Logger.warning(
+                f"FFT length is shorter than the template, setting to "
+                f"{fft_len}")
+        self.fft_len = fft_len
+        cores_inner, cores_outer = _set_inner_outer_threading(
+            cores_inner, cores_outer, self.n_channels)
+
+        self._utilslib.multi_normxcorr_fftw_stream_create.argtypes = [
+            np.ctypeslib.ndpointer(dtype=np.float32,
+                                   flags='C_CONTIGUOUS'),
+            ctypes.c_long, ctypes.c_long, ctypes.c_long, ctypes.c_long,
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags='C_CONTIGUOUS'),
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags='C_CONTIGUOUS'),
+            ctypes.c_int, ctypes.c_int, ctypes.c_int]
+        self._utilslib.multi_normxcorr_fftw_stream_create.restype = \
+            ctypes.c_void_p
+        self._utilslib.multi_normxcorr_fftw_stream_push.argtypes = [
+            ctypes.c_void_p,
+            np.ctypeslib.ndpointer(dtype=np.float32,
+                                   flags='C_CONTIGUOUS'),
+            ctypes.c_long,
+            np.ctypeslib.ndpointer(dtype=np.float32,
+                                   flags='C_CONTIGUOUS'),
+            ctypes.POINTER(ctypes.c_long),
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags='C_CONTIGUOUS'),
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags='C_CONTIGUOUS'),
+            ctypes.c_int, ctypes.c_long, ctypes.POINTER(_CorrelationStats)]
+        self._utilslib.multi_normxcorr_fftw_stream_push.restype = ctypes.c_int
+        self._utilslib.multi_normxcorr_fftw_stream_destroy.argtypes = [
+            ctypes.c_void_p]
+        self._utilslib.multi_normxcorr_fftw_stream_destroy.restype = None
+
+        self._handle = self._utilslib.multi_normxcorr_fftw_stream_create(
+            templates, self.n_templates, self.template_len, self.n_channels,
+            self.fft_len, np.ascontiguousarray(self.used_chans, dtype=np.intc),
+            pads, cores_inner, cores_outer,
+            _get_fftw_planner(fftw_planner))
+        if not self._handle:
+            raise MemoryError(
+                "Memory allocation failed creating correlation stream")
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.close()
+
+    def __del__(self):
+        try:
+            self.close()
+        except Exception:  # pragma: no cover
+            # Library may already be unloaded at interpreter shutdown
+            pass
+
+    def __getstate__(self):
+        raise TypeError("FFTWStreamCorrelator holds C state and cannot be "
+                        "pickled")
+
+    def push(self, block_array, fftw_stats=None):
+        """
+        Correlate the next block of data.
+
+        :type block_array: dict
+        :param block_array:
+            New samples for each seed id, all the same length.
+        :type fftw_stats: dict
+        :param fftw_stats:
+            Updated in place with the timings and counts of this push, as
+            for :func:`fftw_multi_normxcorr`.
+
+        :return:
+            Correlations not returned before: (n_templates, n_out) if
+            stacked, otherwise (n_templates, n_channels, n_out) - and the
+            used channels as for :func:`fftw_multi_normxcorr`.
+        """
+        if self._handle is None:
+            raise ValueError("Stream has been closed")
+        block = np.ascontiguousarray(
+            [block_array[seed_id] for seed_id in self.seed_ids],
+            dtype=np.float32)
+        block_len = block.shape[1]
+        if self.stack:
+            cccs = np.zeros((self.n_templates, block_len), np.float32)
+        else:
+            cccs = np.zeros(
+                (self.n_templates, self.n_channels, block_len), np.float32)
+        n_out = ctypes.c_long(0)
+        variance_warnings = np.zeros(self.n_channels, dtype=np.intc)
+        missed_correlations = np.zeros(self.n_channels, dtype=np.intc)
+        stats, out_of_range = _correlation_stats(self.n_channels)
+        ret = self._utilslib.multi_normxcorr_fftw_stream_push(
+            self._handle, block, block_len, cccs, ctypes.byref(n_out),
+            variance_warnings, missed_correlations, int(self.stack),
+            self.stack_memory, ctypes.byref(stats))
+        if ret < 0:
+            raise MemoryError(
+                "Memory allocation failed in correlation C-code")
+        report = _report_correlation_stats(
+            stats, out_of_range, self.seed_ids, fftw_stats)
+        if ret > 0:
+            _log_out_of_range(report)
+        for i, missed_corr in enumerate(missed_correlations):
+            if missed_corr:
+                Logger.debug(
+                    f"{missed_corr} correlations not computed on "
+                    f"{self.seed_ids[i]}, are there gaps in the data?")
+        # Rows are packed n_out long
+        n_out = n_out.value
+        cccs = cccs.ravel()[0:cccs.size // block_len * n_out].reshape(
+            cccs.shape[:-1] + (n_out, ))
+        return cccs, self.used_chans
+
+    def close(self):
+        """ Free the C memory held by this stream. """
+        if self._handle is not None:
+            self._utilslib.multi_normxcorr_fftw_stream_destroy(self._handle)
+            self._handle = None
+
+
+def _set_inner_outer_threading(num_cores_inner, num_cores_outer, n_chans):
+    """
+    Work out how to split threads between and within channels.
+
+    :type num_cores_inner: int
+    :param num_cores_inner:
+        Threads requested (as `cores`), if None then OMP_NUM_THREADS or all
+        available cores are used.
+    :type num_cores_outer: int
+    :param num_cores_outer:
+        Threads requested to run over channels, if None these are set from
+        num_cores_inner.
+    :type n_chans: int
+    :param n_chans: Number of channels to correlate
+
+    :return: inner threads, outer threads
+
+    .. rubric:: Example
+
+    >>> _set_inner_outer_threading(8, None, 4)
+    (2, 4)
+    >>> _set_inner_outer_threading(8, None, 20)
+    (1, 8)
+    >>> _set_inner_outer_threading(2, 4, 20)
+    (2, 4)
+    """
+    if num_cores_inner is None:
+        num_cores_inner = int(os.getenv("OMP_NUM_THREADS", cpu_count()))
+    if num_cores_outer is None:
+        # Many channels with a single-threaded FFT each scales better than
+        # threading each FFT, use any left-over threads within channels.
+        num_cores_outer = max(1, min(num_cores_inner, n_chans))
+        num_cores_inner = max(1, num_cores_inner // num_cores_outer)
+    elif num_cores_outer > n_chans:
+        num_cores_outer = n_chans
+    return num_cores_inner, num_cores_outer
+
+
+class _ImageChannels(ctypes.Structure):
+    """ Continuous data as pointers to each channel, as image_channels. """
+    _fields_ = [("data", ctypes.POINTER(ctypes.c_void_p)),
+                ("lengths", ctypes.POINTER(ctypes.c_long)),
+                ("strides", ctypes.POINTER(ctypes.c_long)),
+                ("dtype", ctypes.c_int),
+                ("origin", ctypes.c_long)]
+
+
+class _CorrelationStats(ctypes.Structure):
+    """ Timings and counts of a correlation call, as correlation_stats. """
+    _fields_ = [("template_fft", ctypes.c_double),
+                ("moments", ctypes.c_double),
+                ("image_fft", ctypes.c_double),
+                ("multiply", ctypes.c_double),
+                ("inverse_fft", ctypes.c_double),
+                ("normalise", ctypes.c_double),
+                ("stack", ctypes.c_double),
+                ("peaks", ctypes.c_double),
+                ("total", ctypes.c_double),
+                ("n_chunks", ctypes.c_longlong),
+                ("n_skipped_chunks", ctypes.c_longlong),
+                ("n_out_of_range", ctypes.c_longlong),
+                ("bytes_allocated", ctypes.c_longlong),
+                ("warnings", ctypes.c_int),
+                ("out_of_range", ctypes.POINTER(ctypes.c_int))]
+
+
+def _correlation_stats(n_channels):
+    """
+    Zeroed _CorrelationStats counting out-of-range correlations per channel.
+
+    :return:
+        _CorrelationStats and the per-channel counts it points to, which
+        must be kept alive while it is used.
+    """
+    out_of_range = np.zeros(n_channels, dtype=np.intc)
+    stats = _CorrelationStats()
+    stats.out_of_range = ctypes.cast(
+        out_of_range.ctypes.data, ctypes.POINTER(ctypes.c_int))
+    return stats, out_of_range
+
+
+def _report_correlation_stats(stats, out_of_range, seed_ids,
+                              fftw_stats=None):
+    """
+    Log the timings and warnings of a correlation call.
+
+    :type stats: _CorrelationStats
+    :param stats: Stats filled by the C-code
+    :type out_of_range: np.ndarray
+    :param out_of_range: Out-of-range correlations of each channel
+    :type seed_ids: list
+    :param seed_ids: Seed ids of the channels
+    :type fftw_stats: dict
+    :param fftw_stats: Updated in place with the stats if given
+
+    :return: dict of the stats
+    """
+    report = {name: getattr(stats, name) for name, _ in stats._fields_
+              if name not in ("warnings", "out_of_range")}
+    report["out_of_range"] = {
+        seed_id: int(n) for seed_id, n in zip(seed_ids, out_of_range) if n}
+    report["warnings"] = []
+    if stats.warnings & CORR_WARN_OUTER_DISABLED:
+        report["warnings"].append("outer_disabled")
+        Logger.warning(
+            "Outer threading is not safe with this FFTW build - using "
+            "inner threading only")
+    if stats.warnings & CORR_WARN_OVERSUBSCRIBED:
+        report["warnings"].append("oversubscribed")
+        Logger.warning(
+            "More threads were requested than there are cores - this may "
+            "slow correlations down")
+    if stats.warnings & CORR_WARN_UNKNOWN_PLANNER:
+        report["warnings"].append("unknown_planner")
+        Logger.warning("Unknown FFTW planner - using estimate")
+    if stats.warnings & CORR_WARN_MEMORY_LIMIT:
+        report["warnings"].append("memory_limit")
+        Logger.warning(
+            "fftw_memory_limit is too small for one template - correlating "
+            "one template at a time")
+    Logger.debug(
+        "Correlation took {total:.3f}s over {n_chunks} chunks "
+        "({n_skipped_chunks} skipped), thread-seconds: template FFT "
+        "{template_fft:.3f}, moments {moments:.3f}, image FFT "
+        "{image_fft:.3f}, multiply {multiply:.3f}, inverse FFT "
+        "{inverse_fft:.3f}, normalise {normalise:.3f}, stack {stack:.3f}, "
+        "peaks {peaks:.3f}, {bytes_allocated} bytes allocated".format(
+            **report))
+    if fftw_stats is not None:
+        fftw_stats.update(report)
+    return report
+
+
+def _log_out_of_range(report):
+    """ Log out-of-range correlations of a report from the C-code. """
+    channels = ", ".join(
+        f"{seed_id}: {n}" for seed_id, n in report["out_of_range"].items())
+    Logger.critical(
+        f"{report['n_out_of_range']} out-of-range correlations in C-code, "
+        f"these are set to zero ({channels}). You are STRONGLY RECOMMENDED "
+        "to check your data for spikes, clipping or non-physical artifacts")
+
+
+def _image_channels(channels):
+    """
+    Describe channels of continuous data for the C-code without copying.
+
+    Channels are passed as they are when they share one of IMAGE_DTYPES and
+    their strides are whole samples, otherwise they are copied to float32.
+
+    :type channels: list
+    :param channels: 1D np.ndarray of each channel
+
+    :return:
+        _ImageChannels and the arrays it points to, which must be kept
+        alive while it is used.
+    """
+    channels = [np.asarray(channel) for channel in channels]
+    dtypes = {channel.dtype for channel in channels}
+    dtype = dtypes.pop() if len(dtypes) == 1 else np.dtype(np.float32)
+    if dtype not in IMAGE_DTYPES:
+        dtype = np.dtype(np.float32)
+    keep = []
+    for channel in channels:
+        if (channel.ndim != 1 or channel.dtype != dtype or
+                channel.strides[0] <= 0 or
+                channel.strides[0] % dtype.itemsize):
+            channel = np.ascontiguousarray(channel.ravel(), dtype=dtype)
+        keep.append(channel)
+    data = (ctypes.c_void_p * len(keep))(
+        *[channel.ctypes.data for channel in keep])
+    lengths = (ctypes.c_long * len(keep))(
+        *[channel.shape[0] for channel in keep])
+    strides = (ctypes.c_long * len(keep))(
+        *[max(channel.strides[0] // dtype.itemsize, 1) for channel in keep])
+    image = _ImageChannels(data, lengths, strides, IMAGE_DTYPES[dtype])
+    return image, (keep, data, lengths, strides)
+
+
+def _ncc_output(shape, dtype, filename=None):
+    """
+    Zeroed output for correlations, in memory or memory-mapped to filename.
+    """
+    if filename is None:
+        return np.zeros(shape, dtype=dtype)
+    dirname = os.path.dirname(os.path.abspath(filename))
+    if not os.path.isdir(dirname):
+        os.makedirs(dirname)
+    # A new mapping is zero-filled (and sparse where the file-system allows)
+    return np.memmap(filename, dtype=dtype, mode="w+", shape=shape)
+
+
+class _OutputFlusher(object):
+    """
+    Context manager to flush a memory-mapped output every interval seconds
+    from a background thread, and once on exit.
+
+    The C-code runs without the GIL, so writing back correlations that have
+    been computed overlaps with computing the rest.
+    """
+    def __init__(self, output, interval=None):
+        self.output = output
+        self.interval = interval
+        self._done = threading.Event()
+        self._thread = None
+
+    def _run(self):
+        while not self._done.wait(self.interval):
+            self.output.flush()
+
+    def __enter__(self):
+        if isinstance(self.output, np.memmap) and self.interval:
+            self._thread = threading.Thread(target=self._run, daemon=True)
+            self._thread.start()
+        return self
+
+    def __exit__(self, *args):
+        self._done.set()
+        if self._thread is not None:
+            self._thread.join()
+        if isinstance(self.output, np.memmap):
+            self.output.flush()
+
+
 def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
-                         cores_inner, stack=True, *args, **kwargs):
+                         cores_inner, stack=True, cores_outer=1, *args,
+                         **kwargs):
     """
     Use a C loop rather than a Python loop - in some cases this will be fast.
 
@@ -779,69 +1774,163 @@ def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
     :param template_array:
     :type stream_array: dict
     :param stream_array:
+        1D np.ndarray of continuous data keyed by seed id. These are read in
+        place when they are all float32, int32 or float64, and may be
+        strided views. Shorter channels are zero-padded.
     :type pad_array: dict
     :param pad_array:
     :type seed_ids: list
     :param seed_ids:
+    :type cores_inner: int
+    :param cores_inner: Number of threads to use within each channel
+    :type cores_outer: int
+    :param cores_outer:
+        Number of channels to correlate concurrently, each with its own
+        workspace.
 
     rtype: np.ndarray, list
     :return: 3D Array of cross-correlations and list of used channels.
+
+    .. Note::
+        Pass an :class:`FFTWContext` as `fftw_context` to keep the template
+        spectra between calls with the same templates. The moments of the
+        data it keeps are identified by the arrays in `stream_array`, or by
+        the traces they were made from given as `fftw_moments_sources`
+        (keyed by seed id).
+
+    .. Note::
+        Pass `fftw_planner` as one of "estimate" (default), "measure",
+        "patient" or "exhaustive" to select the FFTW planner rigour.
+        Planning is only done once per call (or once per
+        :class:`FFTWContext`) and measured plans are kept as FFTW wisdom
+        for the rest of the process - use :func:`export_fftw_wisdom` and
+        :func:`import_fftw_wisdom` to keep them between processes.
+
+    .. Note::
+        When stacking with more than one outer thread each thread stacks
+        into its own correlogram and these are summed at the end.  Pass
+        `fftw_stack_memory` to set how many bytes these stacks can use
+        (default 1 GiB) - above this correlograms are stacked in tiles of
+        time, and if tiles would be too short threads stack directly into
+        the output.  Set to 0 to always stack directly into the output.
+
+    .. Note::
+        Pass `fftw_memory_limit` (bytes) to bound the FFT workspaces - when
+        all templates would not fit in this they are correlated in batches
+        that do.  This does not include the returned correlations.  Ignored
+        when using an :class:`FFTWContext`.
+
+    .. Note::
+        Pass `fftw_output_dtype` as `np.float16`, or `np.int16` for
+        unstacked correlations, to return correlations in half the memory
+        of the default `np.float32`.  int16 correlations are scaled by
+        `INT16_SCALE` (32767).  Correlations are computed and stacked as
+        float32 and converted in tiles of time that use at most
+        `fftw_stack_memory` bytes per outer thread.
+
+    .. Note::
+        Pass `fftw_output_file` to return the correlations as a
+        :class:`numpy.memmap` of that file (created or overwritten) rather
+        than in memory, e.g. for unstacked correlations larger than RAM.
+        Each overlap-save chunk writes a contiguous run of each correlogram.
+        Pass `fftw_output_flush` (seconds) to flush written correlations to
+        disk from a background thread while correlations are computed,
+        otherwise this is left to the operating system until the end of the
+        call.
+
+    .. Note::
+        Pass a dict as `fftw_stats` to have it updated with the timings and
+        counts of the call, e.g. to export them for monitoring: seconds
+        spent in each stage ("template_fft", "moments", "image_fft",
+        "multiply", "inverse_fft", "normalise", "stack", "peaks"), summed
+        over threads, and the wall-clock "total"; "n_chunks" and
+        "n_skipped_chunks" of overlap-save; "bytes_allocated" for
+        workspaces; "n_out_of_range" correlations (set to zero) with
+        "out_of_range" counts keyed by seed id; and "warnings" about
+        threading, the planner and `fftw_memory_limit` (these are also
+        logged as warnings).  The rest are logged at debug level either way.
     """
     utilslib = _load_cdll('libutils')
 
-    utilslib.multi_normxcorr_fftw.argtypes = [
+    utilslib.multi_normxcorr_fftw_image.argtypes = [
         np.ctypeslib.ndpointer(dtype=np.float32,
                                flags='C_CONTIGUOUS'),
         ctypes.c_long, ctypes.c_long, ctypes.c_long,
-        np.ctypeslib.ndpointer(dtype=np.float32,
-                               flags='C_CONTIGUOUS'),
-        ctypes.c_long,
-        np.ctypeslib.ndpointer(dtype=np.float32,
-                               flags='C_CONTIGUOUS'),
+        ctypes.POINTER(_ImageChannels), ctypes.c_long,
+        np.ctypeslib.ndpointer(flags='C_CONTIGUOUS'),
         ctypes.c_long,
         np.ctypeslib.ndpointer(dtype=np.intc,
                                flags='C_CONTIGUOUS'),
         np.ctypeslib.ndpointer(dtype=np.intc,
                                flags='C_CONTIGUOUS'),
-        ctypes.c_int,
+        ctypes.c_int, ctypes.c_int,
         np.ctypeslib.ndpointer(dtype=np.intc,
                                flags='C_CONTIGUOUS'),
         np.ctypeslib.ndpointer(dtype=np.intc,
                                flags='C_CONTIGUOUS'),
-        ctypes.c_int]
-    utilslib.multi_normxcorr_fftw.restype = ctypes.c_int
+        ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_long,
+        ctypes.c_long, ctypes.POINTER(ctypes.c_void_p),
+        ctypes.POINTER(_CorrelationStats)]
+    utilslib.multi_normxcorr_fftw_image.restype = ctypes.c_int
     '''
     Arguments are:
         templates (stacked [ch_1-t_1, ch_1-t_2, ..., ch_2-t_1, ch_2-t_2, ...])
         number of templates
         template length
         number of channels
-        image (stacked [ch_1, ch_2, ..., ch_n])
+        image (pointers to ch_1, ch_2, ..., ch_n, see _image_channels)
         image length
         cross-correlations (stacked as per image)
         fft-length
         used channels (stacked as per templates)
         pad array (stacked as per templates)
         num thread inner
+        num thread outer
         variance warnings
         missed correlation warnings (usually due to gaps)
         stack option
+        output type of cross-correlations (see FFTW_OUTPUT_DTYPES)
+        fftw planner rigour
+        memory for thread-private stacks in bytes
+        memory for workspaces in bytes (0 for no limit)
+        moments of each channel (or None to compute them)
+        timings and counts of the call (see _CorrelationStats)
     '''
+    utilslib.multi_normxcorr_fftw_execute_image.argtypes = [
+        ctypes.c_void_p, ctypes.POINTER(_ImageChannels), ctypes.c_long,
+        np.ctypeslib.ndpointer(flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_int, ctypes.c_int, ctypes.c_long,
+        ctypes.POINTER(ctypes.c_void_p), ctypes.POINTER(_CorrelationStats)]
+    utilslib.multi_normxcorr_fftw_execute_image.restype = ctypes.c_int
+    peak_options = kwargs.get("fftw_peaks")
+    if peak_options is not None:
+        _set_fftw_peaks_argtypes(utilslib)
+        if not stack:
+            raise NotImplementedError(
+                "Peaks can only be found for stacked correlations")
 
     # pre processing
-    used_chans = []
+    fftw_context = kwargs.get("fftw_context")
+    planner = _get_fftw_planner(kwargs.get("fftw_planner"))
+    stack_memory = int(kwargs.get("fftw_stack_memory", FFTW_STACK_MEMORY))
+    memory_limit = int(kwargs.get("fftw_memory_limit") or 0)
+    output_dtype = np.dtype(kwargs.get("fftw_output_dtype") or np.float32)
+    if output_dtype not in FFTW_OUTPUT_DTYPES:
+        raise NotImplementedError(
+            f"fftw_output_dtype must be one of {list(FFTW_OUTPUT_DTYPES)}")
+    if stack and output_dtype == np.int16:
+        raise NotImplementedError(
+            "int16 output is only supported for unstacked correlations")
     template_len = template_array[seed_ids[0]].shape[1]
-    for seed_id in seed_ids:
-        used_chans.append(~np.isnan(template_array[seed_id]).any(axis=1))
-        template_array[seed_id] = (
-            (template_array[seed_id] -
-             template_array[seed_id].mean(axis=-1, keepdims=True)) / (
-                template_array[seed_id].std(axis=-1, keepdims=True) *
-                template_len))
-        template_array[seed_id] = np.nan_to_num(template_array[seed_id])
     n_channels = len(seed_ids)
     n_templates = template_array[seed_ids[0]].shape[0]
-    image_len = stream_array[seed_ids[0]].shape[0]
+    image_len = max(stream_array[seed_id].shape[0] for seed_id in seed_ids)
     # In testing, 2**13 consistently comes out fastest - setting to
     # default. https://github.com/eqcorrscan/EQcorrscan/pull/285
     fft_len = kwargs.get(
@@ -851,28 +1940,50 @@ def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
             f"FFT length of {fft_len} is shorter than the template, setting to"
             f" {next_fast_len(template_len + image_len - 1)}")
         fft_len = next_fast_len(template_len + image_len - 1)
-    template_array = np.ascontiguousarray(
-        [template_array[x] for x in seed_ids], dtype=np.float32)
-    multipliers = {}
+    used_chans = [~np.isnan(template_array[seed_id]).any(axis=1)
+                  for seed_id in seed_ids]
+    context = None
+    if fftw_context is not None:
+        context_key = fftw_context._key(
+            template_array, seed_ids, fft_len, (cores_inner, cores_outer),
+            planner)
+        context = fftw_context._get(context_key)
+        if context is not None:
+            Logger.debug("Using cached template spectra")
+        else:
+            context = fftw_context._load(
+                context_key, utilslib, cores_inner, cores_outer, planner)
+    if context is None:
+        for seed_id in seed_ids:
+            template_array[seed_id] = (
+                (template_array[seed_id] -
+                 template_array[seed_id].mean(axis=-1, keepdims=True)) / (
+                    template_array[seed_id].std(axis=-1, keepdims=True) *
+                    template_len))
+            template_array[seed_id] = np.nan_to_num(template_array[seed_id])
+        template_array = np.ascontiguousarray(
+            [template_array[x] for x in seed_ids], dtype=np.float32)
+    channels = []
     for x in seed_ids:
+        channel = stream_array[x]
         # Check that stream is non-zero and above variance threshold
-        if not np.all(stream_array[x] == 0) and np.var(stream_array[x]) < 1e-8:
-            # Apply gain
-            stream_array[x] *= MULTIPLIER
+        if not np.all(channel == 0) and np.var(channel) < 1e-8:
+            # Apply gain to a copy, the data are otherwise read in place
+            channel = (channel * MULTIPLIER).astype(np.float32)
             Logger.warning(f"Low variance found for {x}, applying gain "
                            "to stabilise correlations")
-            multipliers.update({x: MULTIPLIER})
-        else:
-            multipliers.update({x: 1})
-    stream_array = np.ascontiguousarray([stream_array[x] for x in seed_ids],
-                                        dtype=np.float32)
+        channels.append(channel)
+    image, _keep = _image_channels(channels)
     ccc_length = image_len - template_len + 1
     assert ccc_length > 0, "Template must be shorter than stream"
-    if stack:
-        cccs = np.zeros((n_templates, ccc_length), np.float32)
+    if peak_options is not None:
+        cccs = None
+    elif stack:
+        cccs = _ncc_output((n_templates, ccc_length), output_dtype,
+                           kwargs.get("fftw_output_file"))
     else:
-        cccs = np.zeros(
-            (n_templates, n_channels, ccc_length), dtype=np.float32)
+        cccs = _ncc_output((n_templates, n_channels, ccc_length),
+                           output_dtype, kwargs.get("fftw_output_file"))
     used_chans_np = np.ascontiguousarray(used_chans, dtype=np.intc)
     pad_array_np = np.ascontiguousarray(
         [pad_array[seed_id] for seed_id in seed_ids], dtype=np.intc)
@@ -881,18 +1992,50 @@ def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
     missed_correlations = np.ascontiguousarray(
         np.zeros(n_channels), dtype=np.intc)
 
+    stats, out_of_range = _correlation_stats(n_channels)
+
     # call C function
-    ret = utilslib.multi_normxcorr_fftw(
-        template_array, n_templates, template_len, n_channels, stream_array,
-        image_len, cccs, fft_len, used_chans_np, pad_array_np,
-        cores_inner, variance_warnings, missed_correlations, int(stack))
+    moments = None
+    if fftw_context is not None:
+        sources = kwargs.get("fftw_moments_sources") or stream_array
+        moments = fftw_context._get_moments(
+            utilslib, channels, image, seed_ids, template_len,
+            cores_inner * cores_outer,
+            sources=[sources[seed_id] for seed_id in seed_ids])
+    if fftw_context is not None and context is None:
+        context = fftw_context._create(
+            context_key, utilslib, template_array, n_templates, template_len,
+            n_channels, fft_len, used_chans_np, pad_array_np, cores_inner,
+            cores_outer, planner)
+    if peak_options is not None:
+        ret, cccs = _fftw_multi_normxcorr_peaks(
+            utilslib, context, template_array, n_templates, template_len,
+            n_channels, image, image_len, fft_len, used_chans_np,
+            pad_array_np, cores_inner, cores_outer, variance_warnings,
+            missed_correlations, planner, stack_memory, memory_limit,
+            moments, stats, **peak_options)
+    elif context is not None:
+        with _OutputFlusher(cccs, kwargs.get("fftw_output_flush")):
+            ret = utilslib.multi_normxcorr_fftw_execute_image(
+                context, ctypes.byref(image), image_len, cccs, pad_array_np,
+                variance_warnings, missed_correlations, int(stack),
+                FFTW_OUTPUT_DTYPES[output_dtype], stack_memory, moments,
+                ctypes.byref(stats))
+    else:
+        with _OutputFlusher(cccs, kwargs.get("fftw_output_flush")):
+            ret = utilslib.multi_normxcorr_fftw_image(
+                template_array, n_templates, template_len, n_channels,
+                ctypes.byref(image), image_len, cccs, fft_len, used_chans_np,
+                pad_array_np, cores_inner, cores_outer, variance_warnings,
+                missed_correlations, int(stack),
+                FFTW_OUTPUT_DTYPES[output_dtype], planner, stack_memory,
+                memory_limit, moments, ctypes.byref(stats))
     if ret < 0:
         raise MemoryError("Memory allocation failed in correlation C-code")
-    elif ret > 0:
-        Logger.critical(
-            'Out-of-range correlation in C-code, see WARNING from C-code.'
-            'You are STRONGLY RECOMMENDED to check your data for spikes, '
-            'clipping or non-physical artifacts')
+    report = _report_correlation_stats(
+        stats, out_of_range, seed_ids, kwargs.get("fftw_stats"))
+    if ret > 0:
+        _log_out_of_range(report)
         # raise CorrelationError("Internal correlation error")
     for i, missed_corr in enumerate(missed_correlations):
         if missed_corr:
@@ -905,18 +2048,724 @@ def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
             Logger.warning(
                 f"Low variance found in {variance_warning} places for "
                 f"{seed_ids[i]}, check result.")
-    # Remove gain
-    for i, x in enumerate(seed_ids):
-        stream_array[i] *= multipliers[x]
     return cccs, used_chans
 
 
-# ------------------------------- FastMatchedFilter Wrapper
-
-def _run_fmf_xcorr(template_arr, data_arr, weights, pads, arch, step=1):
-    if not FMF_INSTALLED:
-        raise ImportError("FastMatchedFilter is not available")
-    import fast_matched_filter
+def _set_fftw_peaks_argtypes(utilslib):
+    """ Set the argument types of the fused correlation and peak functions. """
+    utilslib.ncc_peaks_create.argtypes = [
+        ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_int]
+    utilslib.ncc_peaks_create.restype = ctypes.c_void_p
+    utilslib.ncc_peaks_finish.argtypes = [
+        ctypes.c_void_p, ctypes.c_long, ctypes.c_int]
+    utilslib.ncc_peaks_finish.restype = ctypes.c_int
+    utilslib.ncc_peaks_counts.argtypes = [
+        ctypes.c_void_p,
+        np.ctypeslib.ndpointer(dtype=ctypes.c_long,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS')]
+    utilslib.ncc_peaks_counts.restype = ctypes.c_int
+    utilslib.ncc_peaks_copy.argtypes = [
+        ctypes.c_void_p,
+        np.ctypeslib.ndpointer(dtype=ctypes.c_long,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS')]
+    utilslib.ncc_peaks_copy.restype = ctypes.c_int
+    utilslib.ncc_peaks_destroy.argtypes = [ctypes.c_void_p]
+    utilslib.ncc_peaks_destroy.restype = None
+    utilslib.multi_normxcorr_fftw_peaks_image.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_long, ctypes.c_long, ctypes.c_long,
+        ctypes.POINTER(_ImageChannels), ctypes.c_long, ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_int, ctypes.c_int,
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_int, ctypes.c_long, ctypes.c_long,
+        ctypes.POINTER(ctypes.c_void_p), ctypes.c_void_p,
+        ctypes.POINTER(_CorrelationStats)]
+    utilslib.multi_normxcorr_fftw_peaks_image.restype = ctypes.c_int
+    utilslib.multi_normxcorr_fftw_execute_peaks_image.argtypes = [
+        ctypes.c_void_p, ctypes.POINTER(_ImageChannels), ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_long, ctypes.POINTER(ctypes.c_void_p), ctypes.c_void_p,
+        ctypes.POINTER(_CorrelationStats)]
+    utilslib.multi_normxcorr_fftw_execute_peaks_image.restype = ctypes.c_int
+
+
+def _fftw_peaks_pass(
+        utilslib, context, template_array, n_templates, template_len,
+        n_channels, image, image_len, fft_len, used_chans, pad_array,
+        cores_inner, cores_outer, variance_warnings, missed_correlations,
+        planner, stack_memory, memory_limit, moments, stats, thresholds,
+        threshold_type, trig_int):
+    """
+    Correlate once and keep only the peaks of the stacked correlograms.
+
+    :return:
+        Return code of the correlation and, if it succeeded, a tuple of the
+        peaks (list of lists of (value, index) tuples, one list per
+        template), the threshold used for each template and whether peaks
+        of each template may be missing.
+    """
+    thresholds = np.ascontiguousarray(thresholds, dtype=np.float32)
+    peaks = utilslib.ncc_peaks_create(
+        n_templates, thresholds, threshold_type)
+    if not peaks:
+        raise MemoryError("Could not allocate peaks in C-code")
+    try:
+        if context is not None:
+            ret = utilslib.multi_normxcorr_fftw_execute_peaks_image(
+                context, ctypes.byref(image), image_len, pad_array,
+                variance_warnings, missed_correlations, stack_memory,
+                moments, peaks, ctypes.byref(stats))
+        else:
+            ret = utilslib.multi_normxcorr_fftw_peaks_image(
+                template_array, n_templates, template_len, n_channels,
+                ctypes.byref(image), image_len, fft_len, used_chans, pad_array,
+                cores_inner, cores_outer, variance_warnings,
+                missed_correlations, planner, stack_memory, memory_limit,
+                moments, peaks, ctypes.byref(stats))
+        if ret < 0:
+            return ret, None
+        # Peaks within trig_int + 1 samples are declustered, as for
+        # multi_find_peaks
+        if utilslib.ncc_peaks_finish(
+                peaks, -1 if trig_int is None else int(trig_int) + 1,
+                cores_inner * cores_outer) != 0:
+            return -1, None
+        n_peaks = np.zeros(n_templates, dtype=ctypes.c_long)
+        used_thresholds = np.zeros(n_templates, dtype=np.float32)
+        incomplete = np.zeros(n_templates, dtype=np.intc)
+        utilslib.ncc_peaks_counts(peaks, n_peaks, used_thresholds, incomplete)
+        indexes = np.zeros(max(n_peaks.sum(), 1), dtype=ctypes.c_long)
+        values = np.zeros(max(n_peaks.sum(), 1), dtype=np.float32)
+        utilslib.ncc_peaks_copy(peaks, indexes, values)
+    finally:
+        utilslib.ncc_peaks_destroy(peaks)
+    all_peaks, start = [], 0
+    for n in n_peaks:
+        all_peaks.append(list(zip(values[start: start + n],
+                                  indexes[start: start + n])))
+        start += n
+    return ret, (all_peaks, used_thresholds, incomplete.astype(bool))
+
+
+def _fftw_multi_normxcorr_peaks(
+        utilslib, context, template_array, n_templates, template_len,
+        n_channels, image, image_len, fft_len, used_chans, pad_array,
+        cores_inner, cores_outer, variance_warnings, missed_correlations,
+        planner, stack_memory, memory_limit, moments, stats, thresholds,
+        threshold_type, trig_int):
+    """
+    Correlate and keep only the peaks of the stacked correlograms.
+
+    MAD thresholds are only known once every correlation has been seen, so
+    peaks are kept above a fraction of the running threshold. Templates
+    whose final threshold fell below that floor are correlated again with
+    their final threshold as an absolute threshold, so no peaks are lost.
+
+    :return:
+        Return code of the correlation and a tuple of the peaks (list of
+        lists of (value, index) tuples, one list per template) and the
+        threshold used for each template.
+    """
+    ret, result = _fftw_peaks_pass(
+        utilslib, context, template_array, n_templates, template_len,
+        n_channels, image, image_len, fft_len, used_chans, pad_array,
+        cores_inner, cores_outer, variance_warnings, missed_correlations,
+        planner, stack_memory, memory_limit, moments, stats, thresholds,
+        threshold_type, trig_int)
+    if ret < 0:
+        return ret, None
+    all_peaks, used_thresholds, incomplete = result
+    if not incomplete.any():
+        return ret, (all_peaks, used_thresholds)
+    Logger.info(
+        f"The MAD thresholds of {incomplete.sum()} templates fell below "
+        f"{PEAK_FLOOR_FRACTION} of their running value, correlating these "
+        "again to find all peaks")
+    redo = np.flatnonzero(incomplete)
+    if context is None:
+        # Only the incomplete templates need to be correlated again
+        redo_thresholds = used_thresholds[redo]
+        template_array = np.ascontiguousarray(template_array[:, redo])
+        used_chans = np.ascontiguousarray(used_chans[:, redo])
+        pad_array = np.ascontiguousarray(pad_array[:, redo])
+    else:
+        # The templates of a context are fixed, the others find no peaks
+        redo_thresholds = np.where(incomplete, used_thresholds, np.inf)
+    # The warnings and out-of-range counts were found by the first pass
+    out_of_range = np.ctypeslib.as_array(stats.out_of_range, (n_channels, ))
+    first_out_of_range = (stats.n_out_of_range, out_of_range.copy())
+    redo_ret, redo_result = _fftw_peaks_pass(
+        utilslib, context, template_array, len(redo_thresholds),
+        template_len, n_channels, image, image_len, fft_len, used_chans,
+        pad_array, cores_inner, cores_outer, np.zeros_like(variance_warnings),
+        np.zeros_like(missed_correlations), planner, stack_memory,
+        memory_limit, moments, stats, redo_thresholds, 0, trig_int)
+    stats.n_out_of_range, out_of_range[:] = first_out_of_range
+    if redo_ret < 0:
+        return redo_ret, None
+    redo_peaks = redo_result[0]
+    if context is not None:
+        redo_peaks = [redo_peaks[t] for t in redo]
+    for t, peaks in zip(redo, redo_peaks):
+        all_peaks[t] = peaks
+    return ret, (all_peaks, used_thresholds)
+
+
+def _peak_thresholds(template_array, seed_ids, threshold, threshold_type):
+    """
+    Thresholds of each template for fused peak-finding.
+
+    :return:
+        1 if thresholds multiply the median absolute correlation (MAD) or 0
+        if they are absolute, and the threshold of each template.
+    """
+    no_chans = np.sum(
+        [~np.isnan(template_array[seed_id]).any(axis=1)
+         for seed_id in seed_ids], axis=0)
+    if str(threshold_type) == str("MAD"):
+        return 1, [threshold] * len(no_chans)
+    elif str(threshold_type) == str("absolute"):
+        return 0, [threshold] * len(no_chans)
+    elif str(threshold_type) == str("av_chan_corr"):
+        return 0, threshold * no_chans
+    raise ValueError(
+        "threshold_type must be one of: MAD, absolute, av_chan_corr")
+
+
+def fftw_multi_normxcorr_peaks(template_array, stream_array, pad_array,
+                               seed_ids, threshold, threshold_type="MAD",
+                               trig_int=None, cores_inner=1, cores_outer=1,
+                               **kwargs):
+    """
+    Correlate and find peaks in the stacked correlations without ever
+    holding the full stacked correlations in memory.
+
+    Stacked correlations are computed in tiles of time (each outer thread
+    holds `fftw_stack_memory` bytes at most) and the peaks of each tile are
+    found as they are computed, as by
+    :func:`eqcorrscan.utils.findpeaks.multi_find_peaks`.
+
+    :type template_array: dict
+    :param template_array: As for :func:`fftw_multi_normxcorr`
+    :type stream_array: dict
+    :param stream_array: As for :func:`fftw_multi_normxcorr`
+    :type pad_array: dict
+    :param pad_array: As for :func:`fftw_multi_normxcorr`
+    :type seed_ids: list
+    :param seed_ids: As for :func:`fftw_multi_normxcorr`
+    :type threshold: float
+    :param threshold:
+        Threshold, or multiplier of the median absolute value of each
+        stacked correlation for MAD thresholds.
+    :type threshold_type: str
+    :param threshold_type: One of "MAD", "absolute" or "av_chan_corr"
+    :type trig_int: int
+    :param trig_int:
+        The minimum difference in samples between peaks, as for
+        :func:`eqcorrscan.utils.findpeaks.multi_find_peaks`, or None to
+        keep every peak.
+    :type cores_inner: int
+    :param cores_inner: Number of threads to use within each channel
+    :type cores_outer: int
+    :param cores_outer: Number of channels to correlate concurrently.
+
+    :rtype: list, np.ndarray, list
+    :return:
+        List of lists of tuples of (peak, index) for each template, the
+        threshold used for each template and list of used channels.
+
+    .. Note::
+        MAD thresholds are found from a histogram of the absolute
+        correlations of each template, so are accurate to within a small
+        fraction of a percent rather than exact. Peaks are kept above a
+        fraction of the running threshold of each template, templates whose
+        final threshold is lower than that are correlated a second time.
+
+    .. rubric:: Example
+
+    >>> rng = np.random.default_rng(42)
+    >>> templates = {"NZ.A..Z": rng.standard_normal((2, 20)),
+    ...              "NZ.B..Z": rng.standard_normal((2, 20))}
+    >>> data = {seed_id: rng.standard_normal(2000) for seed_id in templates}
+    >>> for seed_id in templates:
+    ...     data[seed_id][500: 520] += 5 * templates[seed_id][0]
+    >>> pads = {seed_id: np.zeros(2, dtype=int) for seed_id in templates}
+    >>> peaks, thresholds, used_chans = fftw_multi_normxcorr_peaks(
+    ...     templates, data, pads, list(templates), threshold=8.0,
+    ...     trig_int=20)
+    >>> [int(index) for value, index in peaks[0]]
+    [500]
+    """
+    threshold_int, thresholds = _peak_thresholds(
+        template_array, seed_ids, threshold, threshold_type)
+    kwargs.update(fftw_peaks=dict(
+        thresholds=thresholds, threshold_type=threshold_int,
+        trig_int=trig_int))
+    (peaks, thresholds), used_chans = fftw_multi_normxcorr(
+        template_array=template_array, stream_array=stream_array,
+        pad_array=pad_array, seed_ids=seed_ids, cores_inner=cores_inner,
+        cores_outer=cores_outer, stack=True, **kwargs)
+    return peaks, thresholds, used_chans
+
+
+def fftw_multi_normxcorr_days(template_array, days, pad_array, seed_ids,
+                              callback, prepare=None, prefetch=1,
+                              cores_inner=1, cores_outer=1, stack=True,
+                              fftw_context=None, **kwargs):
+    """
+    Correlate the same templates with a sequence of days (or any chunks) of
+    data, reading and preparing the next days while one is correlated.
+
+    Template spectra and FFTW plans are computed once and kept in an
+    :class:`FFTWContext` for all the days.  Days are taken from `days` and
+    passed through `prepare` on a background thread, `prefetch` days ahead
+    of the day being correlated, so reading and processing data overlaps
+    with correlating it (the C-code runs without the GIL).
+
+    :type template_array: dict
+    :param template_array: As for :func:`fftw_multi_normxcorr`
+    :type days: iterable
+    :param days:
+        Sequence or generator of days, each either a stream_array (as for
+        :func:`fftw_multi_normxcorr`) or anything `prepare` makes one from.
+        Generators are only advanced by the background thread.
+    :type pad_array: dict
+    :param pad_array: As for :func:`fftw_multi_normxcorr`
+    :type seed_ids: list
+    :param seed_ids:
+        As for :func:`fftw_multi_normxcorr`, every day must have data for
+        every seed id.
+    :type callback: callable
+    :param callback:
+        Called as `callback(index, cccs, used_chans)` with the correlations
+        of each day in turn (in the calling thread), while the next days are
+        prepared.
+    :type prepare: callable
+    :param prepare:
+        Function to make a stream_array from each item of `days` (e.g. read
+        and process a day of data), or None if the items are stream_arrays.
+    :type prefetch: int
+    :param prefetch: Number of days to prepare ahead of the day correlated.
+    :type cores_inner: int
+    :param cores_inner: As for :func:`fftw_multi_normxcorr`
+    :type cores_outer: int
+    :param cores_outer: As for :func:`fftw_multi_normxcorr`
+    :type stack: bool
+    :param stack: As for :func:`fftw_multi_normxcorr`
+    :type fftw_context: :class:`FFTWContext`
+    :param fftw_context:
+        Context to keep the template spectra in, one is made (and cleared at
+        the end) if not given.
+
+    :rtype: list
+    :return: What `callback` returned for each day.
+
+    .. Note::
+        Other keyword arguments are passed to :func:`fftw_multi_normxcorr`.
+        Pass `fft_len` to use the same plans for days of different lengths.
+
+    .. rubric:: Example
+
+    >>> rng = np.random.default_rng(42)
+    >>> templates = {"NZ.A..Z": rng.standard_normal((2, 20)),
+    ...              "NZ.B..Z": rng.standard_normal((2, 20))}
+    >>> pads = {seed_id: np.zeros(2, dtype=int) for seed_id in templates}
+    >>> def read_day(day):
+    ...     return {seed_id: rng.standard_normal(2000)
+    ...             for seed_id in templates}
+    >>> shapes = fftw_multi_normxcorr_days(
+    ...     templates, range(3), pads, list(templates),
+    ...     callback=lambda i, cccs, used_chans: cccs.shape, prepare=read_day)
+    >>> shapes
+    [(2, 1981), (2, 1981), (2, 1981)]
+    """
+    prefetch = max(int(prefetch), 1)
+    own_context = fftw_context is None
+    if own_context:
+        fftw_context = FFTWContext()
+    days = iter(days)
+    finished = object()
+
+    def _next_day():
+        try:
+            day = next(days)
+        except StopIteration:
+            return finished
+        return day if prepare is None else prepare(day)
+
+    results = []
+    with concurrent.futures.ThreadPoolExecutor(max_workers=1) as loader:
+        # One loader thread: generators are never advanced concurrently
+        pending = [loader.submit(_next_day) for _ in range(prefetch)]
+        try:
+            index = 0
+            while True:
+                stream_array = pending.pop(0).result()
+                if stream_array is finished:
+                    break
+                pending.append(loader.submit(_next_day))
+                # The templates are normalised in place when the context is
+                # made, keep the caller's templates for the context key.
+                cccs, used_chans = fftw_multi_normxcorr(
+                    template_array=dict(template_array),
+                    stream_array=stream_array, pad_array=pad_array,
+                    seed_ids=seed_ids, cores_inner=cores_inner,
+                    cores_outer=cores_outer, stack=stack,
+                    fftw_context=fftw_context, **kwargs)
+                del stream_array
+                results.append(callback(index, cccs, used_chans))
+                index += 1
+        finally:
+            for future in pending:
+                future.cancel()
+            if own_context:
+                fftw_context.clear()
+    return results
+
+
+# ------------------------------- Batched short correlations
+
+def _pack_arrays(arrays):
+    """
+    Pack 1D arrays into one float32 buffer.
+
+    :return: buffer, offset of each array, length of each array
+
+    .. rubric:: Example
+
+    >>> buffer, offsets, lengths = _pack_arrays(
+    ...     [np.arange(3), np.arange(2)])
+    >>> print(buffer, offsets, lengths)
+    [0. 1. 2. 0. 1.] [0 3] [3 2]
+    """
+    lengths = np.array([len(arr) for arr in arrays], dtype=np.int64)
+    offsets = np.zeros(len(arrays), dtype=np.int64)
+    np.cumsum(lengths[:-1], out=offsets[1:])
+    if len(arrays) == 0:
+        return np.zeros(0, dtype=np.float32), offsets, lengths
+    buffer = np.ascontiguousarray(
+        np.concatenate([np.asarray(arr, dtype=np.float32).ravel()
+                        for arr in arrays]))
+    return buffer, offsets, lengths
+
+
+def batch_normxcorr(templates, windows, pairs=None, interpolate=False,
+                    cores=1, method="auto", return_correlations=False):
+    """
+    Correlate many short templates with short windows of data in one call.
+
+    Each job correlates one template with one window for every lag of the
+    template within the window (`len(window) - len(template) + 1` lags), for
+    example a template channel with the data around a detection when
+    refining picks, or one event's waveform with another's when clustering.
+    Jobs are run in parallel in C: short jobs in the time-domain, longer
+    jobs in batches of FFTs of the same length, without the per-call
+    planning and allocation of :func:`fftw_multi_normxcorr`.
+
+    :type templates: list
+    :param templates:
+        1D arrays of template data, these do not need to be normalised.
+    :type windows: list
+    :param windows:
+        1D arrays of data, each at least as long as the templates they are
+        correlated with.
+    :type pairs: numpy.ndarray
+    :param pairs:
+        (n_jobs, 2) indexes into templates and windows of each job, so that
+        templates and windows can be shared between jobs. If None templates
+        and windows must be the same length and are correlated in turn.
+    :type interpolate: bool
+    :param interpolate:
+        Refine the peak of each job by fitting a parabola to the maximum and
+        the correlations either side.
+    :type cores: int
+    :param cores: Number of threads to parallel jobs over.
+    :type method: str
+    :param method:
+        "auto" to pick the time-domain or FFTs for each job by its length, or
+        "time" or "fft" to use one for every job.
+    :type return_correlations: bool
+    :param return_correlations:
+        Also return the correlations of each job.
+
+    :return:
+        Maximum correlation of each job, lag of the maximum of each job in
+        samples from the start of its window (fractional if interpolated),
+        and if return_correlations, a list of the correlations of each job.
+    :rtype: numpy.ndarray, numpy.ndarray, list
+
+    .. Note::
+        Correlations are normalised as in the "fftw" backend, correlations
+        that cannot be normalised (flat templates or data) are zero.
+
+    .. rubric:: Example
+
+    >>> template = np.sin(np.arange(20) / 3)
+    >>> window = np.zeros(50)
+    >>> window[12:32] = template
+    >>> cc_max, lags = batch_normxcorr([template], [window])
+    >>> print(round(float(cc_max[0]), 4), lags[0])
+    1.0 12.0
+    """
+    if method not in BATCH_METHODS:
+        raise ValueError(f"method must be one of {list(BATCH_METHODS)}")
+    if pairs is None:
+        if len(templates) != len(windows):
+            raise ValueError(
+                "templates and windows must be the same length without pairs")
+        pairs = np.repeat(np.arange(len(templates))[:, np.newaxis], 2, axis=1)
+    pairs = np.asarray(pairs, dtype=np.int64).reshape(-1, 2)
+    template_buffer, template_offsets, template_lens = _pack_arrays(templates)
+    window_buffer, window_offsets, window_lens = _pack_arrays(windows)
+    jobs = np.ascontiguousarray(np.stack(
+        [template_offsets[pairs[:, 0]], template_lens[pairs[:, 0]],
+         window_offsets[pairs[:, 1]], window_lens[pairs[:, 1]]],
+        axis=1), dtype=np.int64)
+    n_lags = jobs[:, 3] - jobs[:, 1] + 1
+    if np.any(n_lags < 1):
+        raise ValueError("Windows must be at least as long as their templates")
+    cc_max = np.zeros(len(jobs), dtype=np.float32)
+    lags = np.zeros(len(jobs), dtype=np.float64)
+    ccc = None
+    if return_correlations:
+        ccc = np.zeros(int(n_lags.sum()), dtype=np.float32)
+    utilslib = _load_cdll('libutils')
+    utilslib.normxcorr_batch.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.int64,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_longlong,
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags='C_CONTIGUOUS'),
+        ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int]
+    utilslib.normxcorr_batch.restype = ctypes.c_int
+    ret = utilslib.normxcorr_batch(
+        template_buffer, window_buffer, jobs, len(jobs), cc_max, lags,
+        None if ccc is None else ccc.ctypes.data, int(interpolate),
+        max(1, int(cores)), BATCH_METHODS[method])
+    if ret < 0:
+        raise MemoryError("Memory allocation failed in correlation C-code")
+    elif ret > 0:
+        Logger.critical(
+            f"{ret} out-of-range correlations in C-code, these are set to "
+            "zero. You are STRONGLY RECOMMENDED to check your data for "
+            "spikes, clipping or non-physical artifacts")
+    if return_correlations:
+        correlations = (
+            np.split(ccc, np.cumsum(n_lags)[:-1]) if len(jobs) else [])
+        return cc_max, lags, correlations
+    return cc_max, lags
+
+
+# ------------------------------- Distributed correlations
+
+def _template_shard(n_templates, rank, size):
+    """
+    First and last (exclusive) template of the shard of a rank.
+
+    Shards are contiguous and differ in size by at most one template.
+
+    .. rubric:: Example
+
+    >>> [_template_shard(10, rank, 3) for rank in range(3)]
+    [(0, 4), (4, 7), (7, 10)]
+    >>> [_template_shard(2, rank, 3) for rank in range(3)]
+    [(0, 1), (1, 2), (2, 2)]
+    """
+    per_rank, extra = divmod(n_templates, size)
+    start = rank * per_rank + min(rank, extra)
+    return start, start + per_rank + (rank < extra)
+
+
+def _bcast_arrays(comm, arrays, root):
+    """
+    Broadcast a dict of arrays from root without pickling the data.
+
+    :type comm: mpi4py.MPI.Comm
+    :param comm: Communicator
+    :type arrays: dict
+    :param arrays: Arrays keyed by seed id on root, ignored on other ranks
+    :type root: int
+    :param root: Rank holding the arrays
+
+    :return: dict of the arrays on every rank
+    """
+    if comm.Get_rank() == root:
+        arrays = {key: np.ascontiguousarray(value)
+                  for key, value in arrays.items()}
+        layout = [(key, value.shape, value.dtype.str)
+                  for key, value in arrays.items()]
+    else:
+        layout = None
+    layout = comm.bcast(layout, root=root)
+    if comm.Get_rank() != root:
+        arrays = {key: np.empty(shape, dtype=np.dtype(dtype))
+                  for key, shape, dtype in layout}
+    for key, _, _ in layout:
+        comm.Bcast(arrays[key], root=root)
+    return arrays
+
+
+def mpi_multi_normxcorr_peaks(template_array, stream_array, pad_array,
+                              seed_ids, threshold, threshold_type="MAD",
+                              trig_int=None, comm=None, root=0,
+                              backend="fftw", **kwargs):
+    """
+    Correlate and find peaks with templates sharded across MPI ranks.
+
+    Every rank correlates a contiguous shard of the templates with all of
+    the continuous data using :func:`fftw_multi_normxcorr_peaks` (or
+    :func:`cupy_multi_normxcorr_peaks`), so each rank only holds the
+    spectra and stacked correlations of its own templates.  Only the peaks
+    of each shard are gathered to `root`.  Thresholds and declustering are
+    per template, so the peaks are those of correlating every template on
+    one node.
+
+    Call collectively on every rank of `comm`, e.g. from a script run with
+    `mpiexec`.
+
+    :type template_array: dict
+    :param template_array:
+        As for :func:`fftw_multi_normxcorr`, all of the templates.  Pass
+        None on ranks other than `root` to have their shards sent from
+        `root`.
+    :type stream_array: dict
+    :param stream_array:
+        As for :func:`fftw_multi_normxcorr`.  Ranks that read the data
+        themselves pass it, ranks passing None get the data of `root`
+        broadcast to them once.
+    :type pad_array: dict
+    :param pad_array:
+        As for :func:`fftw_multi_normxcorr`, None where `template_array` is.
+    :type seed_ids: list
+    :param seed_ids: As for :func:`fftw_multi_normxcorr`
+    :type threshold: float
+    :param threshold: As for :func:`fftw_multi_normxcorr_peaks`
+    :type threshold_type: str
+    :param threshold_type: As for :func:`fftw_multi_normxcorr_peaks`
+    :type trig_int: int
+    :param trig_int: As for :func:`fftw_multi_normxcorr_peaks`
+    :type comm: mpi4py.MPI.Comm
+    :param comm: Communicator to shard over, defaults to COMM_WORLD
+    :type root: int
+    :param root: Rank to gather the peaks to
+    :type backend: str
+    :param backend: "fftw" or "cupy" to correlate each shard with
+
+    :rtype: list, np.ndarray, list
+    :return:
+        On `root`, as for :func:`fftw_multi_normxcorr_peaks` for all of the
+        templates in order. None, None, None on other ranks.
+
+    .. Note::
+        Other keyword arguments (e.g. `cores_inner`, `cores_outer` or
+        `fft_len`) are passed to the correlation of each shard, use the
+        cores of one rank for these.
+    """
+    if comm is None:
+        from mpi4py import MPI
+        comm = MPI.COMM_WORLD
+    funcs = {"fftw": fftw_multi_normxcorr_peaks,
+             "cupy": cupy_multi_normxcorr_peaks}
+    if backend not in funcs:
+        raise NotImplementedError(
+            f"backend must be one of {list(funcs)}")
+    rank, size = comm.Get_rank(), comm.Get_size()
+
+    # Templates and pads of this shard, sent from root where not given
+    have_templates = comm.allgather(template_array is not None)
+    if not have_templates[root]:
+        raise ValueError("Templates must be given on the root rank")
+    n_templates = comm.bcast(
+        template_array[seed_ids[0]].shape[0] if rank == root else None,
+        root=root)
+    start, end = _template_shard(n_templates, rank, size)
+    if rank == root:
+        for other in range(size):
+            if other != root and not have_templates[other]:
+                other_start, other_end = _template_shard(
+                    n_templates, other, size)
+                comm.send(
+                    ({seed_id: template_array[seed_id][other_start:other_end]
+                      for seed_id in seed_ids},
+                     {seed_id: pad_array[seed_id][other_start:other_end]
+                      for seed_id in seed_ids}), dest=other)
+    if have_templates[rank]:
+        shard_templates = {seed_id: template_array[seed_id][start:end]
+                           for seed_id in seed_ids}
+        shard_pads = {seed_id: pad_array[seed_id][start:end]
+                      for seed_id in seed_ids}
+    else:
+        shard_templates, shard_pads = comm.recv(source=root)
+
+    # Continuous data read locally, or broadcast once from root
+    have_data = comm.allgather(stream_array is not None)
+    if not have_data[root]:
+        raise ValueError("Continuous data must be given on the root rank")
+    needs = [not have or other == root
+             for other, have in enumerate(have_data)]
+    if all(needs):
+        stream_array = _bcast_arrays(comm, stream_array, root)
+    elif sum(needs) > 1:
+        # Only broadcast to the ranks without data of their own
+        sub_comm = comm.Split(0 if needs[rank] else 1, rank)
+        if needs[rank]:
+            stream_array = _bcast_arrays(
+                sub_comm, stream_array, sum(needs[:root]))
+        sub_comm.Free()
+
+    if end > start:
+        peaks, thresholds, used_chans = funcs[backend](
+            shard_templates, stream_array, shard_pads, seed_ids,
+            threshold=threshold, threshold_type=threshold_type,
+            trig_int=trig_int, **kwargs)
+        Logger.debug(f"Rank {rank} found peaks for templates {start} to {end}")
+    else:
+        peaks, thresholds, used_chans = [], np.zeros(0, np.float32), [
+            np.zeros(0, dtype=bool) for _ in seed_ids]
+    gathered = comm.gather((peaks, thresholds, used_chans), root=root)
+    if rank != root:
+        return None, None, None
+    all_peaks = [_peaks for shard in gathered for _peaks in shard[0]]
+    thresholds = np.concatenate([shard[1] for shard in gathered])
+    used_chans = [np.concatenate([shard[2][i] for shard in gathered])
+                  for i in range(len(seed_ids))]
+    return all_peaks, thresholds, used_chans
+
+
+# ------------------------------- FastMatchedFilter Wrapper
+
+def _run_fmf_xcorr(template_arr, data_arr, weights, pads, arch, step=1):
+    if not FMF_INSTALLED:
+        raise ImportError("FastMatchedFilter is not available")
+    import fast_matched_filter
 
     if version.parse(fast_matched_filter.__version__) >= MIN_FMF_VERSION:
         from fast_matched_filter import matched_filter as fmf
@@ -1072,6 +2921,793 @@ def _fmf_multi_xcorr(templates, stream, *args, **kwargs):
     return cccsums, no_chans, chans
 
 
+# ------------------------------- GPU backend
+
+# Normalisation, clipping and stacking of the inverse transforms of one
+# channel, as normxcorr_fftw_internal and set_ncc_block do in multi_corr.c.
+# Each thread writes one correlation, so channels correlated one after
+# another stack without atomics.
+_CUPY_NORMALISE_STACK = r"""
+extern "C" __global__ void normalise_stack(
+    const float *ccc, const double *mean, const double *inv_std,
+    const unsigned char *valid, const double *norm_sums, const int *pads,
+    const int *used, float *acc, int *out_of_range, long long first,
+    long long ccc_len, int n_templates, int n_chunks, int step, int fft_len,
+    int template_len)
+{
+    long long idx = (long long) blockDim.x * blockIdx.x + threadIdx.x;
+    long long per_template = (long long) n_chunks * step;
+    long long r, pos, out;
+    int t, chunk, i;
+    float value;
+
+    if (idx >= per_template * n_templates) {
+        return;
+    }
+    t = (int) (idx / per_template);
+    r = idx % per_template;
+    pos = first + r;
+    out = pos - pads[t];
+    if (!used[t] || pos >= ccc_len || out < 0 || !(valid[r] & 1)) {
+        return;
+    }
+    chunk = (int) (r / step);
+    i = (int) (r % step);
+    value = (float) (((double) ccc[
+        ((long long) t * n_chunks + chunk) * fft_len + template_len - 1 + i] -
+        norm_sums[t] * mean[r]) * inv_std[r]);
+    if (isnan(value)) {
+        value = 0.0f;
+    } else if (fabsf(value) > 1.01f) {
+        value = 0.0f;
+        atomicAdd(out_of_range, 1);
+    } else if (value > 1.0f) {
+        value = 1.0f;
+    } else if (value < -1.0f) {
+        value = -1.0f;
+    }
+    acc[(long long) t * ccc_len + out] += value;
+}
+"""
+
+# Peaks of each row above its threshold, as find_peaks in find_peaks.c
+_CUPY_PEAK_MASK = """
+long long j = i % length;
+float value = acc[i];
+float prev = (j > 0) ? acc[i - 1] : 0.0f;
+float next = (j < length - 1) ? acc[i + 1] : 0.0f;
+mask = (fabsf(value) > thresholds[i / length]) &&
+    ((next - value) * (prev - value) > 0);
+"""
+
+_CUPY_KERNELS = {}  # compiled kernels, keyed by device
+
+
+def _cupy_kernels(cp):
+    """ Compile (once per device) the kernels of the cupy backend. """
+    device = cp.cuda.Device().id
+    if device not in _CUPY_KERNELS:
+        _CUPY_KERNELS[device] = (
+            cp.RawKernel(_CUPY_NORMALISE_STACK, "normalise_stack"),
+            cp.ElementwiseKernel(
+                "raw float32 acc, raw float32 thresholds, int64 length",
+                "bool mask", _CUPY_PEAK_MASK, "eqcorrscan_peak_mask"))
+    return _CUPY_KERNELS[device]
+
+
+def _cupy_batches(memory_limit, n_templates, n_channels, n_chunks, fft_len,
+                  ccc_len, peaks=False):
+    """
+    Templates and overlap-save chunks to correlate at once on the device.
+
+    Each template of a batch keeps its spectra for every channel on the
+    device with its correlations (three times over to find peaks, for the
+    median and peak mask), and needs a product and inverse transform for
+    each chunk of a batch.  Chunks are halved until at least one template
+    fits.
+
+    :type memory_limit: int
+    :param memory_limit: Bytes of device memory to use
+    :type n_templates: int
+    :param n_templates: Number of templates
+    :type n_channels: int
+    :param n_channels: Number of channels
+    :type n_chunks: int
+    :param n_chunks: Number of overlap-save chunks of each channel
+    :type fft_len: int
+    :param fft_len: Length of transforms
+    :type ccc_len: int
+    :param ccc_len: Length of correlations
+    :type peaks: bool
+    :param peaks: Whether peaks are found on the device
+
+    :return: templates per batch, chunks per batch
+
+    .. rubric:: Example
+
+    >>> _cupy_batches(2 ** 30, 100, 10, 1055, 2 ** 13, 8640000)
+    (26, 64)
+    >>> _cupy_batches(2 ** 30, 100, 10, 1055, 2 ** 13, 8640000, peaks=True)
+    (9, 64)
+    """
+    n2 = fft_len // 2 + 1
+    per_template = n_channels * n2 * 8 + ccc_len * 4 * (3 if peaks else 1)
+    per_chunk_template = n2 * 8 + fft_len * 4
+    # Data, its transform and moments with their temporaries in double
+    per_chunk = fft_len * (4 + 4 * 8) + n2 * 8
+    n_chunk_batch = max(1, min(n_chunks, CUPY_CHUNK_BATCH))
+    while True:
+        free = memory_limit - n_chunk_batch * per_chunk
+        n_template_batch = free // (
+            per_template + n_chunk_batch * per_chunk_template)
+        if n_template_batch >= 1 or n_chunk_batch == 1:
+            break
+        n_chunk_batch = max(1, n_chunk_batch // 2)
+    return int(max(1, min(n_template_batch, n_templates))), n_chunk_batch
+
+
+def _cupy_moments(cp, chunks, template_len, step, first, ccc_len):
+    """
+    Moments of the windows of overlap-save chunks, as sliding_moments.
+
+    Sums are taken in double about the mean of each chunk, so quiet windows
+    after loud ones keep their precision.
+
+    :return:
+        mean, 1 / standard deviation (zero where not valid), flags of
+        MOMENT_VALID (1) windows, and the number of low variance and of
+        invalid windows before ccc_len.
+    """
+    n_chunks, chunk_len = chunks.shape
+    data = chunks.astype(cp.float64)
+    chunk_mean = data.mean(axis=1, keepdims=True)
+    data -= chunk_mean
+    sums = cp.zeros((n_chunks, chunk_len + 1), dtype=cp.float64)
+    cp.cumsum(data, axis=1, out=sums[:, 1:])
+    window_sum = sums[:, template_len:template_len + step] - sums[:, :step]
+    cp.cumsum(data * data, axis=1, out=sums[:, 1:])
+    window_mean = window_sum / template_len
+    var = cp.maximum(
+        (sums[:, template_len:template_len + step] - sums[:, :step]) /
+        template_len - window_mean * window_mean, 0.0)
+    del data, sums
+    # Windows that are a single repeated value are not valid either
+    changes = cp.zeros((n_chunks, chunk_len), dtype=cp.int32)
+    cp.cumsum(chunks[:, 1:] != chunks[:, :-1], axis=1, dtype=cp.int32,
+              out=changes[:, 1:])
+    n_changes = (changes[:, template_len - 1:template_len - 1 + step] -
+                 changes[:, :step])
+    del changes
+    mean = (window_mean + chunk_mean).ravel()
+    std = cp.sqrt(var).ravel()
+    var = var.ravel()
+    pos = first + cp.arange(n_chunks * step)
+    valid = ((var >= ACCEPTED_DIFF) & (n_changes.ravel() > 0) &
+             ~((pos > 0) & (cp.abs(mean * std) < ACCEPTED_DIFF)))
+    inv_std = cp.where(valid, 1.0 / cp.where(valid, std, 1.0), 0.0)
+    in_range = pos < ccc_len
+    n_low = cp.count_nonzero(valid & (var <= WARN_DIFF) & in_range)
+    n_invalid = cp.count_nonzero(~valid & in_range)
+    return mean, inv_std, valid.astype(cp.uint8), n_low, n_invalid
+
+
+def cupy_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
+                         stack=True, *args, **kwargs):
+    """
+    Overlap-save correlations of many templates and channels on a GPU.
+
+    Uses cuFFT (or hipFFT with a ROCm build of CuPy) through CuPy, with the
+    same used channel, pad and stacking semantics as
+    :func:`fftw_multi_normxcorr`.  Templates are correlated in batches: the
+    spectra of a batch stay on the device for every channel, chunks of each
+    channel are transformed together, multiplied with every template
+    spectrum and inverse transformed in one batched transform, and a
+    single kernel normalises, clips, shifts by the pads and stacks these
+    into correlations held on the device.  Only the stacked correlations
+    (or peaks) of each batch are copied back.
+
+    :type template_array: dict
+    :param template_array:
+        2D np.ndarray of templates (n_templates x template_len) keyed by
+        seed id, templates not using a channel are NaN.
+    :type stream_array: dict
+    :param stream_array:
+        1D np.ndarray of continuous data keyed by seed id.  Shorter channels
+        are zero-padded.
+    :type pad_array: dict
+    :param pad_array: Pads of each template keyed by seed id
+    :type seed_ids: list
+    :param seed_ids: Seed ids of the channels to correlate
+    :type stack: bool
+    :param stack: Whether to stack the correlations of each channel
+
+    rtype: np.ndarray, list
+    :return: Array of cross-correlations and list of used channels.
+
+    .. Note::
+        Pass `gpu_memory_limit` (bytes) to bound the device memory used,
+        which sets how many templates are correlated at once.  This
+        defaults to `CUPY_MEMORY_FRACTION` of the free memory of the
+        current device - select the device with :class:`cupy.cuda.Device`.
+        `fft_len` is as for :func:`fftw_multi_normxcorr`.
+    """
+    import cupy as cp
+
+    normalise_stack, peak_mask = _cupy_kernels(cp)
+    peak_options = kwargs.get("gpu_peaks")
+    if peak_options is not None and not stack:
+        raise NotImplementedError(
+            "Peaks can only be found for stacked correlations")
+    template_len = template_array[seed_ids[0]].shape[1]
+    n_channels = len(seed_ids)
+    n_templates = template_array[seed_ids[0]].shape[0]
+    image_len = max(stream_array[seed_id].shape[0] for seed_id in seed_ids)
+    ccc_len = image_len - template_len + 1
+    assert ccc_len > 0, "Template must be shorter than stream"
+    fft_len = kwargs.get(
+        "fft_len", min(2 ** 13, next_fast_len(template_len + image_len - 1)))
+    if fft_len < template_len:
+        Logger.warning(
+            f"FFT length of {fft_len} is shorter than the template, setting to"
+            f" {next_fast_len(template_len + image_len - 1)}")
+        fft_len = next_fast_len(template_len + image_len - 1)
+    step = fft_len - template_len + 1
+    n_chunks = -(-ccc_len // step)
+    memory_limit = kwargs.get("gpu_memory_limit") or int(
+        cp.cuda.Device().mem_info[0] * CUPY_MEMORY_FRACTION)
+    n_template_batch, n_chunk_batch = _cupy_batches(
+        memory_limit, n_templates, n_channels, n_chunks, fft_len, ccc_len,
+        peaks=peak_options is not None)
+    Logger.debug(
+        f"Correlating {n_template_batch} templates and {n_chunk_batch} chunks "
+        f"at once on the GPU")
+
+    used_chans = [~np.isnan(template_array[seed_id]).any(axis=1)
+                  for seed_id in seed_ids]
+    norm = {}
+    for seed_id in seed_ids:
+        templates = template_array[seed_id]
+        norm[seed_id] = np.nan_to_num(
+            (templates - templates.mean(axis=-1, keepdims=True)) / (
+                templates.std(axis=-1, keepdims=True) * template_len))
+    used_np = np.ascontiguousarray(used_chans, dtype=np.intc)
+    pads_np = np.ascontiguousarray(
+        [pad_array[seed_id] for seed_id in seed_ids], dtype=np.intc)
+    channels = []
+    for seed_id in seed_ids:
+        channel = np.asarray(stream_array[seed_id], dtype=np.float32)
+        if not np.all(channel == 0) and np.var(channel) < 1e-8:
+            channel = channel * np.float32(MULTIPLIER)
+            Logger.warning(f"Low variance found for {seed_id}, applying gain "
+                           "to stabilise correlations")
+        channels.append(channel)
+
+    if peak_options is not None:
+        cccs = None
+        all_peaks, used_thresholds = [], np.zeros(n_templates, np.float32)
+    elif stack:
+        cccs = np.zeros((n_templates, ccc_len), np.float32)
+    else:
+        cccs = np.zeros((n_templates, n_channels, ccc_len), np.float32)
+    out_of_range = cp.zeros(n_channels, dtype=cp.int32)
+    variance_warnings = np.zeros(n_channels, dtype=int)
+    missed_correlations = np.zeros(n_channels, dtype=int)
+    padded_len = n_chunks * step + template_len - 1
+    threads = 256
+    for t0 in range(0, n_templates, n_template_batch):
+        t1 = min(t0 + n_template_batch, n_templates)
+        nt = t1 - t0
+        templates = np.ascontiguousarray(
+            [norm[seed_id][t0:t1] for seed_id in seed_ids], dtype=np.float32)
+        norm_sums = cp.asarray(templates.sum(axis=-1, dtype=np.float64))
+        spectra = cp.fft.rfft(
+            cp.asarray(templates)[..., ::-1], n=fft_len, axis=-1)
+        del templates
+        used = cp.asarray(np.ascontiguousarray(used_np[:, t0:t1]))
+        pads = cp.asarray(np.ascontiguousarray(pads_np[:, t0:t1]))
+        acc = cp.zeros((nt, ccc_len), dtype=cp.float32)
+        for i, channel in enumerate(channels):
+            image = cp.zeros(padded_len, dtype=cp.float32)
+            image[0:channel.shape[0]] = cp.asarray(channel)
+            for c0 in range(0, n_chunks, n_chunk_batch):
+                nb = min(n_chunk_batch, n_chunks - c0)
+                chunks = cp.ascontiguousarray(cp.lib.stride_tricks.as_strided(
+                    image[c0 * step:], shape=(nb, fft_len),
+                    strides=(step * image.itemsize, image.itemsize)))
+                mean, inv_std, valid, n_low, n_invalid = _cupy_moments(
+                    cp, chunks, template_len, step, c0 * step, ccc_len)
+                if t0 == 0:
+                    variance_warnings[i] += int(n_low)
+                    missed_correlations[i] += int(n_invalid)
+                ccc = cp.fft.irfft(
+                    spectra[i][:, None, :] * cp.fft.rfft(chunks, axis=1),
+                    n=fft_len, axis=-1)
+                n_threads = nt * nb * step
+                normalise_stack(
+                    ((n_threads + threads - 1) // threads, ), (threads, ),
+                    (ccc, mean, inv_std, valid, norm_sums[i], pads[i],
+                     used[i], acc, out_of_range[i:i + 1],
+                     np.int64(c0 * step), np.int64(ccc_len), np.int32(nt),
+                     np.int32(nb), np.int32(step), np.int32(fft_len),
+                     np.int32(template_len)))
+                del chunks, mean, inv_std, valid, ccc
+            if not stack:
+                cccs[t0:t1, i] = acc.get()
+                acc.fill(0)
+        if peak_options is not None:
+            peaks, thresholds = _cupy_peaks(
+                cp, peak_mask, acc, t0, **peak_options)
+            all_peaks.extend(peaks)
+            used_thresholds[t0:t1] = thresholds
+        elif stack:
+            acc.get(out=cccs[t0:t1])
+        del spectra, acc
+    out_of_range = out_of_range.get()
+    if out_of_range.any():
+        _log_out_of_range(dict(
+            n_out_of_range=int(out_of_range.sum()),
+            out_of_range={seed_id: int(n) for seed_id, n
+                          in zip(seed_ids, out_of_range) if n}))
+    for i, missed_corr in enumerate(missed_correlations):
+        if missed_corr:
+            Logger.debug(
+                f"{missed_corr} correlations not computed on {seed_ids[i]}, "
+                f"are there gaps in the data? If not, consider "
+                "increasing gain")
+    for i, variance_warning in enumerate(variance_warnings):
+        if variance_warning and variance_warning > template_len:
+            Logger.warning(
+                f"Low variance found in {variance_warning} places for "
+                f"{seed_ids[i]}, check result.")
+    if peak_options is not None:
+        return (all_peaks, used_thresholds), used_chans
+    return cccs, used_chans
+
+
+def _cupy_peaks(cp, peak_mask, acc, t0, thresholds, threshold_type,
+                trig_int):
+    """
+    Peaks of stacked correlations held on the device.
+
+    Only the peaks above threshold are copied back, these are declustered
+    as by :func:`eqcorrscan.utils.findpeaks.multi_find_peaks`.
+
+    :return:
+        List of lists of (value, index) tuples, one list per row of acc, and
+        the threshold used for each row.
+    """
+    from eqcorrscan.utils.findpeaks import _multi_decluster
+
+    nt, length = acc.shape
+    thresholds = np.asarray(thresholds, dtype=np.float32)[t0:t0 + nt]
+    if threshold_type == 1:
+        thresholds = (cp.asarray(thresholds) * cp.median(
+            cp.abs(acc), axis=-1)).astype(cp.float32)
+    else:
+        thresholds = cp.asarray(thresholds)
+    mask = peak_mask(acc, thresholds, np.int64(length), size=acc.size)
+    indexes = cp.flatnonzero(mask)
+    del mask
+    values = acc.ravel()[indexes].get()
+    indexes = indexes.get()
+    thresholds = thresholds.get()
+    rows = indexes // length
+    indexes = indexes % length
+    split = np.searchsorted(rows, np.arange(1, nt))
+    values, indexes = np.split(values, split), np.split(indexes, split)
+    peaks = [[] for _ in range(nt)]
+    found = [i for i in range(nt) if len(values[i])]
+    if trig_int is None:
+        for i in found:
+            peaks[i] = list(zip(values[i], indexes[i]))
+    elif len(found):
+        declustered = _multi_decluster(
+            peaks=[values[i] for i in found],
+            indices=[indexes[i] for i in found], trig_int=trig_int,
+            thresholds=[thresholds[i] for i in found], cores=cpu_count())
+        for i, _peaks in zip(found, declustered):
+            peaks[i] = sorted(_peaks, key=lambda peak: peak[1])
+    return peaks, thresholds
+
+
+def cupy_multi_normxcorr_peaks(template_array, stream_array, pad_array,
+                               seed_ids, threshold, threshold_type="MAD",
+                               trig_int=None, **kwargs):
+    """
+    Correlate on a GPU and only copy back the peaks of the stacked
+    correlations.
+
+    Arguments and returns are as for :func:`fftw_multi_normxcorr_peaks`,
+    other keyword arguments are as for :func:`cupy_multi_normxcorr`.  MAD
+    thresholds are exact medians of each stacked correlation.
+    """
+    threshold_int, thresholds = _peak_thresholds(
+        template_array, seed_ids, threshold, threshold_type)
+    kwargs.update(gpu_peaks=dict(
+        thresholds=thresholds, threshold_type=threshold_int,
+        trig_int=trig_int))
+    (peaks, thresholds), used_chans = cupy_multi_normxcorr(
+        template_array=template_array, stream_array=stream_array,
+        pad_array=pad_array, seed_ids=seed_ids, stack=True, **kwargs)
+    return peaks, thresholds, used_chans
+
+
+@register_array_xcorr("cupy")
+def cupy_normxcorr(templates, stream, pads, *args, **kwargs):
+    """
+    Normalised cross-correlation of one channel on a GPU using CuPy.
+
+    :param templates: 2D Array of templates
+    :type templates: np.ndarray
+    :param stream: 1D array of continuous data
+    :type stream: np.ndarray
+    :param pads: List of ints of pad lengths in the same order as templates
+    :type pads: list
+
+    :return: np.ndarray of cross-correlations
+    :return: np.ndarray channels used
+
+    .. Note::
+        Keyword arguments are as for :func:`cupy_multi_normxcorr`.
+    """
+    ccc, used_chans = cupy_multi_normxcorr(
+        {"0": templates}, {"0": stream}, {"0": pads}, ["0"], stack=True,
+        **kwargs)
+    return ccc, used_chans[0]
+
+
+@cupy_normxcorr.register("stream_xcorr")
+@cupy_normxcorr.register("multithread")
+@cupy_normxcorr.register("concurrent")
+def _cupy_stream_xcorr(templates, stream, stack=True, *args, **kwargs):
+    """
+    Correlate all channels with the cupy backend.
+
+    :type templates: list
+    :param templates:
+        A list of templates, where each one should be an obspy.Stream object
+        containing multiple traces of seismic data and the relevant header
+        information.
+    :type stream: obspy.core.stream.Stream
+    :param stream:
+        A single Stream object to be correlated with the templates.
+
+    :returns:
+        New list of :class:`numpy.ndarray` objects.  These will contain
+        the correlation sums for each template for this day of data.
+    :rtype: list
+    :returns:
+        list of ints as number of channels used for each cross-correlation.
+    :rtype: list
+    :returns:
+        list of list of tuples of station, channel for all cross-correlations.
+    :rtype: list
+
+    .. Note::
+        Work is parallel on the device, `cores` and `cores_outer` are
+        ignored.
+    """
+    chans = [[] for _i in range(len(templates))]
+    array_dict_tuple = _get_array_dicts(templates, stream, stack=stack)
+    stream_dict, template_dict, pad_dict, seed_ids = array_dict_tuple
+    kwargs.pop("cores", None)
+    kwargs.pop("cores_outer", None)
+    cccsums, tr_chans = cupy_multi_normxcorr(
+        template_array=template_dict, stream_array=stream_dict,
+        pad_array=pad_dict, seed_ids=seed_ids, stack=stack, *args, **kwargs)
+    no_chans = np.sum(np.array(tr_chans).astype(np.int), axis=0)
+    for seed_id, tr_chan in zip(seed_ids, tr_chans):
+        for chan, state in zip(chans, tr_chan):
+            if state:
+                chan.append(seed_id)
+    if stack:
+        cccsums = _zero_invalid_correlation_sums(cccsums, pad_dict, chans)
+    chans = [[(seed_id.split('.')[1], seed_id.split('.')[-1].split('_')[0])
+              for seed_id in _chans] for _chans in chans]
+    return cccsums, no_chans, chans
+
+
+# ------------------------------- Backend autotuning
+
+class XcorrTuner(object):
+    """
+    Measured choice of correlation backend and fft-length for this machine.
+
+    The fastest fft-length for the fftw backend depends on the template
+    length (short fft-lengths need more overlap-save chunks, long ones make
+    larger template spectra), the number of templates and channels and the
+    threads available, and for short templates the time-domain backend can
+    be faster than either.  The tuner benchmarks a range of fft-lengths and
+    the time-domain backend on random data of the shape given and keeps the
+    fastest.
+
+    Results are kept for each machine (host, architecture, cores and
+    instruction set), and written to `filename` if one is given, so that
+    each shape is only measured once.  The default tuner, used by the
+    "auto" backend (e.g. `get_stream_xcorr("auto", "concurrent")`), keeps
+    its results in the file named by the `EQCORRSCAN_XCORR_TUNING`
+    environment variable, or only in memory if this is not set.  Pass a
+    tuner as `xcorr_tuner` to the "auto" backend to use another.
+
+    :type filename: str
+    :param filename: JSON file to read and write results to.
+    :type n_repeats: int
+    :param n_repeats:
+        Number of times to run each benchmark, the fastest is kept.
+    :type fft_lens: list
+    :param fft_lens:
+        fft-lengths to benchmark, by default powers of two from twice the
+        template length up to 2 ** 16.
+    :type memory_limit: int
+    :param memory_limit:
+        Bytes of FFT workspace that correlating all templates may use,
+        fft-lengths that need more are not tried (the shortest is always
+        tried).  The `fftw_memory_limit` of the "auto" backend is used
+        instead when given.
+
+    .. Note::
+        Each fftw benchmark correlates about four fft-lengths of data with
+        every channel and a subset of the templates.  The time-domain
+        backend is measured on a subset of the templates and lags.  The
+        cost of both is proportional to the templates and lags.
+
+    .. rubric:: Example
+
+    >>> tuner = XcorrTuner()
+    >>> len(tuner)
+    0
+    """
+    backends = ("fftw", "time_domain")
+    # Templates and lags correlated when benchmarking the time-domain backend
+    time_domain_templates = 16
+    time_domain_lags = 4096
+    # Templates correlated when benchmarking the fftw backend
+    fftw_templates = 64
+
+    def __init__(self, filename=None, n_repeats=2, fft_lens=None,
+                 memory_limit=XCORR_TUNER_MEMORY):
+        self.filename = filename
+        self.n_repeats = n_repeats
+        self.fft_lens = fft_lens
+        self.memory_limit = memory_limit
+        self._results = None
+        self._lock = threading.Lock()
+
+    def __len__(self):
+        return len(self.results)
+
+    @property
+    def results(self):
+        """ Tuned shapes for this machine, keyed by _key. """
+        if self._results is None:
+            self._results = self._load().get(self._machine(), dict())
+        return self._results
+
+    @staticmethod
+    def _machine():
+        return "-".join((platform.node(), platform.machine(),
+                         str(cpu_count()), get_simd_level()))
+
+    @staticmethod
+    def _key(template_len, n_templates, n_channels, cores):
+        return f"{template_len}-{n_templates}-{n_channels}-{cores}"
+
+    def _load(self):
+        if self.filename is None or not os.path.isfile(self.filename):
+            return dict()
+        try:
+            with open(self.filename, "r") as f:
+                return json.load(f)
+        except (OSError, ValueError) as e:
+            Logger.warning(f"Could not read xcorr tuning from "
+                           f"{self.filename}: {e}")
+            return dict()
+
+    def save(self):
+        """ Write the results for this machine to filename. """
+        if self.filename is None:
+            return
+        everything = self._load()
+        everything[self._machine()] = self.results
+        dirname = os.path.dirname(os.path.abspath(self.filename))
+        os.makedirs(dirname, exist_ok=True)
+        # Write then move, so that other processes never read a partial file
+        tmp_name = f"{self.filename}.{os.getpid()}.tmp"
+        with open(tmp_name, "w") as f:
+            json.dump(everything, f, indent=1)
+        os.replace(tmp_name, self.filename)
+
+    def clear(self):
+        """ Forget the results for this machine - does not change filename """
+        self._results = dict()
+
+    def _candidate_fft_lens(self, template_len, n_templates=1, n_channels=1,
+                            cores=1, memory_limit=None):
+        if self.fft_lens is not None:
+            fft_lens = sorted(fft_len for fft_len in self.fft_lens
+                              if fft_len >= template_len)
+        else:
+            k_min = max(9, int(math.ceil(math.log2(2 * template_len))))
+            fft_lens = [2 ** k for k in range(k_min, max(k_min, 16) + 1)]
+        memory_limit = memory_limit or self.memory_limit
+        if not memory_limit:
+            return fft_lens
+        fitting = [fft_len for fft_len in fft_lens
+                   if _fftw_workspace_bytes(n_templates, n_channels, fft_len,
+                                            cores) <= memory_limit]
+        return fitting or fft_lens[:1]
+
+    def _benchmark(self, backend, template_len, n_templates, n_channels,
+                   cores, fft_len=None):
+        """ Fastest seconds per correlation lag of backend for the shape """
+        if backend == "time_domain":
+            n_run = min(n_templates, self.time_domain_templates)
+            n_corr = self.time_domain_lags
+        else:
+            n_run = min(n_templates, self.fftw_templates)
+            n_corr = 3 * fft_len + 1
+        image_len = n_corr + template_len - 1
+        rng = np.random.RandomState(42)
+        seed_ids = [f"NZ.STA{i}..HHZ_0" for i in range(n_channels)]
+        templates = rng.randn(n_channels, n_run, template_len).astype(
+            np.float32)
+        image = rng.randn(n_channels, image_len).astype(np.float32)
+        pads = {seed_id: [0] * n_run for seed_id in seed_ids}
+        best = None
+        for _ in range(self.n_repeats):
+            template_array = {seed_id: templates[i].copy()
+                              for i, seed_id in enumerate(seed_ids)}
+            stream_array = {seed_id: image[i].copy()
+                            for i, seed_id in enumerate(seed_ids)}
+            tic = time.perf_counter()
+            if backend == "time_domain":
+                time_multi_channel_normxcorr(
+                    template_array, stream_array, pads, seed_ids,
+                    cores=cores)
+            else:
+                inner, outer = _set_inner_outer_threading(
+                    cores, None, n_channels)
+                fftw_multi_normxcorr(
+                    template_array, stream_array, pads, seed_ids,
+                    cores_inner=inner, cores_outer=outer, fft_len=fft_len)
+            elapsed = time.perf_counter() - tic
+            best = elapsed if best is None else min(best, elapsed)
+        return best * (n_templates / n_run) / n_corr
+
+    def tune(self, template_len, n_templates, n_channels, cores=None,
+             memory_limit=None):
+        """
+        Benchmark the backends for a shape and keep the fastest.
+
+        :type template_len: int
+        :param template_len: Length of templates in samples
+        :type n_templates: int
+        :param n_templates: Number of templates
+        :type n_channels: int
+        :param n_channels: Number of channels
+        :type cores: int
+        :param cores:
+            Threads to use, defaults to OMP_NUM_THREADS or all cores.
+        :type memory_limit: int
+        :param memory_limit:
+            Bytes of FFT workspace for all templates, defaults to the
+            memory_limit of the tuner.
+
+        :return:
+            Dict of the fastest "backend", its "fft_len" (None for the
+            time-domain) and the "timings" in seconds per correlation lag of
+            everything tried.
+        :rtype: dict
+        """
+        if cores is None:
+            cores = int(os.getenv("OMP_NUM_THREADS", cpu_count()))
+        timings = dict()
+        for backend in self.backends:
+            if backend == "time_domain":
+                timings[backend] = self._benchmark(
+                    backend, template_len, n_templates, n_channels, cores)
+                continue
+            for fft_len in self._candidate_fft_lens(
+                    template_len, n_templates, n_channels, cores,
+                    memory_limit):
+                timings[f"{backend}:{fft_len}"] = self._benchmark(
+                    backend, template_len, n_templates, n_channels, cores,
+                    fft_len=fft_len)
+        fastest = min(timings, key=timings.get)
+        backend, _, fft_len = fastest.partition(":")
+        result = dict(backend=backend, fft_len=int(fft_len or 0) or None,
+                      timings=timings)
+        Logger.info(f"Fastest correlation for {n_templates} templates of "
+                    f"{template_len} samples on {n_channels} channels with "
+                    f"{cores} threads is {fastest}")
+        self.results[self._key(
+            template_len, n_templates, n_channels, cores)] = result
+        self.save()
+        return result
+
+    def best(self, template_len, n_templates, n_channels, cores=None,
+             memory_limit=None):
+        """
+        Get the fastest backend for a shape, tuning it if it is new.
+
+        See :meth:`tune` for arguments and returns.
+        """
+        if cores is None:
+            cores = int(os.getenv("OMP_NUM_THREADS", cpu_count()))
+        key = self._key(template_len, n_templates, n_channels, cores)
+        with self._lock:
+            result = self.results.get(key)
+            if result is None:
+                result = self.tune(
+                    template_len, n_templates, n_channels, cores,
+                    memory_limit)
+        return result
+
+
+def _fftw_workspace_bytes(n_templates, n_channels, fft_len, cores):
+    """
+    Approximate bytes of FFT workspace for correlating all templates at once
+    with fftw_multi_normxcorr, as in template_batch_size of multi_corr.c.
+    """
+    inner, outer = _set_inner_outer_threading(cores, None, n_channels)
+    per_template = (outer + outer * inner) * (
+        4 * fft_len + 8 * (fft_len // 2 + 1)) + n_channels * (
+        8 * (fft_len // 2 + 1) + 4)
+    return n_templates * per_template
+
+
+XCORR_TUNER = XcorrTuner(filename=os.getenv("EQCORRSCAN_XCORR_TUNING"))
+
+
+@register_array_xcorr("auto")
+def auto_normxcorr(templates, stream, pads, threaded=False, *args, **kwargs):
+    """
+    Normalised cross-correlation using the fastest backend for the shape.
+
+    The backend (fftw or time-domain) and fft-length are chosen by an
+    :class:`XcorrTuner`, which benchmarks them the first time each shape is
+    seen.  Arguments are as for :func:`fftw_normxcorr`, pass `xcorr_tuner`
+    to use a tuner other than the default.
+
+    :return: np.ndarray of cross-correlations
+    :return: np.ndarray channels used
+    """
+    tuner = kwargs.pop("xcorr_tuner", None) or XCORR_TUNER
+    cores = kwargs.get("cores") if threaded else 1
+    best = tuner.best(templates.shape[1], templates.shape[0], 1, cores,
+                      kwargs.get("fftw_memory_limit"))
+    if best["backend"] == "time_domain":
+        return time_multi_normxcorr(
+            templates, stream, pads, threaded, *args, **kwargs)
+    kwargs.setdefault("fft_len", min(
+        best["fft_len"], next_fast_len(templates.shape[1] + len(stream) - 1)))
+    return fftw_normxcorr(templates, stream, pads, threaded, *args, **kwargs)
+
+
+@auto_normxcorr.register("concurrent")
+def _auto_stream_xcorr(templates, stream, stack=True, *args, **kwargs):
+    """
+    Correlate with the fastest concurrent backend for the shape.
+
+    See :func:`_fftw_stream_xcorr` for arguments - fftw specific arguments
+    (e.g. `fftw_context`) select the fftw backend, and only the fft-length
+    is tuned.  Pass `xcorr_tuner` to use a tuner other than the default.
+    """
+    tuner = kwargs.pop("xcorr_tuner", None) or XCORR_TUNER
+    template_len = templates[0][0].stats.npts
+    best = tuner.best(template_len, len(templates), len(templates[0]),
+                      kwargs.get("cores"), kwargs.get("fftw_memory_limit"))
+    fftw_only = any(key.startswith("fftw_") for key in kwargs)
+    if best["backend"] == "time_domain" and not fftw_only:
+        return _time_threaded_normxcorr(
+            templates, stream, stack, *args, **kwargs)
+    if best["fft_len"] is not None:
+        kwargs.setdefault("fft_len", min(
+            best["fft_len"],
+            next_fast_len(template_len + stream[0].stats.npts - 1)))
+    return _fftw_stream_xcorr(templates, stream, stack, *args, **kwargs)
+
+
 # ------------------------------- stream_xcorr functions
 
 
@@ -1155,6 +3791,8 @@ def _get_array_dicts(templates, stream, stack, copy_streams=True):
 # Remove fmf if it isn't installed
 if not FMF_INSTALLED:
     XCOR_FUNCS.pop("fmf")
+if not CUPY_INSTALLED:
+    XCOR_FUNCS.pop("cupy")
 # a dict of built in xcorr functions, used to distinguish from user-defined
 XCORR_FUNCS_ORIGINAL = copy.copy(XCOR_FUNCS)
 
@@ -17,7 +17,6 @@ from scipy import ndimage
 
 from eqcorrscan.utils.correlate import pool_boy
 from eqcorrscan.utils.libnames import _load_cdll
-from eqcorrscan.utils.clustering import dist_mat_km
 
 
 Logger = logging.getLogger(__name__)
@@ -223,9 +222,9 @@ def multi_find_peaks(arr, thresh, trig_int, parallel=True, full_peaks=False,
                 arr=sub_arr, thresh=arr_thresh, trig_int=trig_int,
                 full_peaks=full_peaks))
     else:
-        if cores is None:
-            cores = min(arr.shape[0], cpu_count())
         if internal_func.__name__ != 'find_peaks_compiled':
+            if cores is None:
+                cores = min(arr.shape[0], cpu_count())
             with pool_boy(Pool=Pool, traces=arr.shape[0], cores=cores) as pool:
                 params = ((sub_arr, arr_thresh, trig_int, full_peaks)
                           for sub_arr, arr_thresh in zip(arr, thresh))
@@ -233,8 +232,11 @@ def multi_find_peaks(arr, thresh, trig_int, parallel=True, full_peaks=False,
                     pool.apply_async(internal_func, param) for param in params]
                 peaks = [res.get() for res in results]
         else:
+            # Arrays are split across threads, so use every core even for
+            # only a few arrays
             peaks = _multi_find_peaks_compiled(
-                arr, thresh, trig_int, full_peaks=full_peaks, cores=cores)
+                arr, thresh, trig_int, full_peaks=full_peaks,
+                cores=cores or cpu_count())
     return peaks
 
 
@@ -421,30 +423,35 @@ def decluster_distance_time(peaks, index, trig_int, catalog,
     :param threshold: Minimum absolute peak value to retain it
 
     :return: list of tuples of (value, sample)
+
+    .. Note::
+        Distances are only computed between peaks within trig_int of
+        one-another, and events are only located once however many peaks
+        share them (e.g. detections of the same template), so memory is
+        linear in the number of peaks.
     """
+    from math import radians
+
     utilslib = _load_cdll('libutils')
 
     length = peaks.shape[0]
     trig_int = int(trig_int)
+    max_index = max(abs(int(index.max())), abs(int(index.min())), trig_int)
+    if max_index != ctypes.c_longlong(max_index).value:
+        raise OverflowError("Maximum index larger than internal long long")
 
-    for var in [index.max(), trig_int]:
-        if var == ctypes.c_long(var).value:
-            long_type = ctypes.c_long
-            func = utilslib.decluster_dist_time
-        elif var == ctypes.c_longlong(var).value:
-            long_type = ctypes.c_longlong
-            func = utilslib.decluster_dist_time_ll
-        else:
-            raise OverflowError("Maximum index larger than internal long long")
-
+    func = utilslib.decluster_dist_time_ids
     func.argtypes = [
         np.ctypeslib.ndpointer(dtype=np.float32, shape=(length,),
                                flags='C_CONTIGUOUS'),
-        np.ctypeslib.ndpointer(dtype=long_type, shape=(length,),
+        np.ctypeslib.ndpointer(dtype=np.longlong, shape=(length,),
                                flags='C_CONTIGUOUS'),
-        np.ctypeslib.ndpointer(dtype=np.float32, shape=(length * length,),
+        np.ctypeslib.ndpointer(dtype=np.longlong, shape=(length,),
                                flags='C_CONTIGUOUS'),
-        long_type, ctypes.c_float, long_type, ctypes.c_float,
+        np.ctypeslib.ndpointer(dtype=np.float32, flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.float32, flags='C_CONTIGUOUS'),
+        np.ctypeslib.ndpointer(dtype=np.float32, flags='C_CONTIGUOUS'),
+        ctypes.c_longlong, ctypes.c_float, ctypes.c_longlong, ctypes.c_float,
         np.ctypeslib.ndpointer(dtype=np.uint32, shape=(length,),
                                flags='C_CONTIGUOUS')]
     func.restype = ctypes.c_int
@@ -453,18 +460,29 @@ def decluster_distance_time(peaks, index, trig_int, catalog,
     # Sort everything in the same way.
     arr = peaks[sorted_inds[::-1]]
     inds = index[sorted_inds[::-1]]
-    sorted_events = [catalog[i] for i in sorted_inds[::-1]]
-    distance_matrix = dist_mat_km(catalog=sorted_events)
+    # Locations are only held once for events shared between peaks
+    event_ids, latitudes, longitudes, depths = dict(), [], [], []
+    template_ids = np.empty(length, dtype=np.longlong)
+    for i, j in enumerate(sorted_inds[::-1]):
+        event = catalog[j]
+        if id(event) not in event_ids:
+            origin = event.preferred_origin() or event.origins[0]
+            event_ids[id(event)] = len(latitudes)
+            latitudes.append(radians(origin.latitude))
+            longitudes.append(radians(origin.longitude))
+            depths.append(origin.depth / 1000)
+        template_ids[i] = event_ids[id(event)]
 
     arr = np.ascontiguousarray(arr, dtype=np.float32)
-    inds = np.ascontiguousarray(inds, dtype=long_type)
-    distance_matrix = np.ascontiguousarray(
-        distance_matrix.flatten(order="C"), dtype=np.float32)
+    inds = np.ascontiguousarray(inds, dtype=np.longlong)
+    latitudes = np.ascontiguousarray(latitudes, dtype=np.float32)
+    longitudes = np.ascontiguousarray(longitudes, dtype=np.float32)
+    depths = np.ascontiguousarray(depths, dtype=np.float32)
     out = np.zeros(len(arr), dtype=np.uint32)
 
     ret = func(
-        arr, inds, distance_matrix, long_type(length), np.float32(threshold),
-        long_type(trig_int), hypocentral_separation, out)
+        arr, inds, template_ids, latitudes, longitudes, depths, length,
+        np.float32(threshold), trig_int, hypocentral_separation, out)
     if ret != 0:
         raise MemoryError("Issue with c-routine, returned %i" % ret)
 
@@ -529,67 +547,69 @@ def decluster(peaks, index, trig_int, threshold=0):
     return peaks_out
 
 
-def _find_peaks_c(array, threshold):
+def _find_peaks_c(array, threshold, threads=None):
     """
     Use a C func to find peaks in the array.
-    """
-    utilslib = _load_cdll('libutils')
-
-    length = array.shape[0]
-    utilslib.find_peaks.argtypes = [
-        np.ctypeslib.ndpointer(dtype=np.float32, shape=(length, ),
-                               flags='C_CONTIGUOUS'),
-        ctypes.c_long, ctypes.c_float,
-        np.ctypeslib.ndpointer(dtype=np.uint32, shape=(length, ),
-                               flags='C_CONTIGUOUS')]
-    utilslib.find_peaks.restype = ctypes.c_int
-    arr = np.ascontiguousarray(array, np.float32)
-    out = np.ascontiguousarray(np.zeros((length, ), dtype=np.uint32))
-    ret = utilslib.find_peaks(arr, ctypes.c_long(length), threshold, out)
-
-    if ret != 0:
-        raise MemoryError("Internal error")
 
-    peaks_locations = np.nonzero(out)
-    return array[peaks_locations], peaks_locations[0]
+    Long arrays are split across threads.
+    """
+    peak_indices, = _multi_find_peaks_packed(
+        array.reshape(1, -1), [threshold], threads=threads or 1)
+    return array[peak_indices], peak_indices
 
 
 def _multi_find_peaks_c(arrays, thresholds, threads):
     """
     Wrapper for multi-find peaks C-func
     """
+    peak_locations = _multi_find_peaks_packed(
+        arrays, thresholds, threads=threads)
+    peaks = [arrays[i][peak_locs]
+             for i, peak_locs in enumerate(peak_locations)]
+    return peaks, peak_locations
+
+
+def _multi_find_peaks_packed(arrays, thresholds, threads):
+    """
+    Positions of peaks in each row of a 2D array from the packed C-func.
+
+    :returns: List of arrays of the positions of the peaks of each row.
+    """
     utilslib = _load_cdll('libutils')
 
-    length = arrays.shape[1]
-    n = np.int32(arrays.shape[0])
+    n, length = arrays.shape
+    if n == 0:
+        return []
     thresholds = np.ascontiguousarray(thresholds, np.float32)
-    arr = np.ascontiguousarray(arrays.flatten(), np.float32)
-    utilslib.multi_find_peaks.argtypes = [
-        np.ctypeslib.ndpointer(dtype=np.float32, shape=(n * length,),
+    arr = np.ascontiguousarray(arrays, np.float32)
+    utilslib.multi_find_peaks_packed.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float32, shape=(n, length),
                                flags='C_CONTIGUOUS'),
-        ctypes.c_long, ctypes.c_int,
+        ctypes.c_longlong, ctypes.c_int,
         np.ctypeslib.ndpointer(dtype=np.float32, shape=(n, ),
                                flags='C_CONTIGUOUS'),
         ctypes.c_int,
-        np.ctypeslib.ndpointer(dtype=np.uint32, shape=(n * length, ),
+        np.ctypeslib.ndpointer(dtype=np.int64, flags='C_CONTIGUOUS'),
+        ctypes.c_void_p, ctypes.c_longlong,
+        np.ctypeslib.ndpointer(dtype=np.int64, shape=(n, ),
                                flags='C_CONTIGUOUS')]
-    utilslib.multi_find_peaks.restype = ctypes.c_int
-
-    out = np.ascontiguousarray(np.zeros((n * length, ), dtype=np.uint32))
-    ret = utilslib.multi_find_peaks(
-        arr, ctypes.c_long(length), n, thresholds, threads, out)
-    # Copy data to avoid farking the users data
-    if ret != 0:
-        raise MemoryError("Internal error")
-    peaks = []
-    peak_locations = []
-    out = out.reshape(n, length)
-    for i in range(n):
-        peak_locs = np.nonzero(out[i])
-        peaks.append(arrays[i][peak_locs])
-        peak_locations.append(peak_locs[0])
-
-    return peaks, peak_locations
+    utilslib.multi_find_peaks_packed.restype = ctypes.c_longlong
+
+    n_peaks = np.zeros(n, dtype=np.int64)
+    # Peaks are usually sparse, if there are more than this the C-func says
+    # how many and we go again.
+    capacity = max(1024, (n * length) // 64)
+    for _ in range(2):
+        indexes = np.empty(capacity, dtype=np.int64)
+        ret = utilslib.multi_find_peaks_packed(
+            arr, length, n, thresholds, threads, indexes, None, capacity,
+            n_peaks)
+        if ret < 0:
+            raise MemoryError("Internal error")
+        if ret <= capacity:
+            break
+        capacity = ret
+    return np.split(indexes[:ret], np.cumsum(n_peaks)[:-1])
 
 
 def coin_trig(peaks, stachans, samp_rate, moveout, min_trig, trig_int):
@@ -0,0 +1,823 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  benchmark.c
+ *
+ *        Purpose:  Standalone benchmark of the libutils kernels - sweeps
+ *                  correlation, peak-finding and distance problem sizes and
+ *                  thread counts on synthetic and seismic-shaped data and
+ *                  reports timings of each stage as JSON.
+ *
+ *                  Build with `python setup.py build_bench`, run with --help
+ *                  for options.
+ *
+ *        Created:  14/10/26
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Calum Chamberlain
+ *   Organization:  EQcorrscan
+ *      Copyright:  EQcorrscan developers.
+ *        License:  GNU Lesser General Public License, Version 3
+ *                  (https://www.gnu.org/copyleft/lesser.html)
+ *
+ * =====================================================================================
+ */
+
+#include <libutils.h>
+#if defined(_WIN32)
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+#endif
+
+#define BENCH_MAX_VALUES 16
+
+#define BENCH_FFTW 1
+#define BENCH_TIME 2
+#define BENCH_PEAKS 4
+#define BENCH_DISTANCE 8
+
+#define BENCH_NOISE 1
+#define BENCH_SEISMIC 2
+
+// Cut-off of the distance benchmarks in km
+#define BENCH_CUTOFF 10.0f
+
+typedef struct {
+    int n;
+    long values[BENCH_MAX_VALUES];
+} bench_list;
+
+typedef struct {
+    bench_list template_len;
+    bench_list n_templates;
+    bench_list n_channels;
+    bench_list fft_len;             // 0 for the default used by correlate.py
+    bench_list inner;
+    bench_list outer;
+    bench_list stack;
+    bench_list n_events;
+    long image_len;
+    int repeat;
+    int planner;
+    int data;                       // BENCH_NOISE and/or BENCH_SEISMIC
+    int kernels;                    // BENCH_FFTW, BENCH_TIME, BENCH_PEAKS, BENCH_DISTANCE
+    double max_memory;              // bytes of outputs, larger cases are skipped
+} bench_options;
+
+typedef struct {
+    FILE *out;
+    int n_results;
+} bench_report;
+
+
+// Data ------------------------------------------------------------------------
+
+static double bench_uniform(unsigned long long *state){
+    // xorshift64*, uniform on (0, 1)
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((double) ((*state * 2685821657736338717ULL) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double bench_gaussian(unsigned long long *state){
+    // Box-Muller, one of the pair
+    double u = bench_uniform(state), v = bench_uniform(state);
+    return sqrt(-2.0 * log(u)) * cos(6.283185307179586 * v);
+}
+
+static long bench_event_time(long event, long n_events, long image_len, long template_len){
+    // Start of an event in the seismic-shaped image, clear of the gap in channel 0
+    long span = image_len / 2 - template_len - 2000;
+
+    if (span < 1) {
+        return 0;
+    }
+    return 1000 + (event * span) / n_events;
+}
+
+static void bench_image(float *image, long n_channels, long image_len, long template_len,
+                        int data, unsigned long long *state){
+    /* Noise is white, seismic-shaped images are red noise in counts with a
+     * burst at each event (moved out across channels) and a gap of zeros in
+     * the first channel. */
+    long c, i, e, n_events = 20;
+
+    for (c = 0; c < n_channels; ++c){
+        float *chan = &image[c * image_len];
+        double last = 0.0;
+
+        for (i = 0; i < image_len; ++i){
+            if (data == BENCH_NOISE) {
+                chan[i] = (float) bench_gaussian(state);
+            } else {
+                last = 0.9 * last + bench_gaussian(state);
+                chan[i] = (float) (1000.0 * last);
+            }
+        }
+        if (data != BENCH_SEISMIC) {
+            continue;
+        }
+        for (e = 0; e < n_events; ++e){
+            long start = bench_event_time(e, n_events, image_len, template_len) + c * 10;
+            for (i = 0; i < 1000 && start + i < image_len; ++i){
+                chan[start + i] += (float) (40000.0 * exp(-i / 200.0) * sin(6.283185307179586 * i / 25.0));
+            }
+        }
+        if (c == 0) {
+            for (i = image_len / 2; i < image_len / 2 + image_len / 10 && i < image_len; ++i){
+                chan[i] = 0.0f;
+            }
+        }
+    }
+}
+
+static void bench_templates(float *templates, long n_templates, long template_len,
+                            long n_channels, const float *image, long image_len,
+                            int data, int *pad_array, unsigned long long *state){
+    /* Normalised templates, (template - mean) / (std * template_len), stacked
+     * [ch_1-t_1, ch_1-t_2, ..., ch_2-t_1, ...]. Seismic-shaped templates are
+     * cut from the events of the image, with pads of the moveout between
+     * channels. */
+    long c, t, k;
+
+    for (c = 0; c < n_channels; ++c){
+        for (t = 0; t < n_templates; ++t){
+            float *tp = &templates[(c * n_templates + t) * template_len];
+            double mean = 0.0, var = 0.0;
+
+            if (data == BENCH_SEISMIC) {
+                long start = bench_event_time(t % 20, 20, image_len, template_len) + c * 10 + (t / 20) * 5;
+                for (k = 0; k < template_len; ++k){
+                    tp[k] = image[c * image_len + start + k] + (float) (100.0 * bench_gaussian(state));
+                }
+                pad_array[c * n_templates + t] = (int) (c * 10);
+            } else {
+                for (k = 0; k < template_len; ++k){
+                    tp[k] = (float) bench_gaussian(state);
+                }
+                pad_array[c * n_templates + t] = 0;
+            }
+            for (k = 0; k < template_len; ++k){
+                mean += tp[k];
+            }
+            mean /= template_len;
+            for (k = 0; k < template_len; ++k){
+                var += (tp[k] - mean) * (tp[k] - mean);
+            }
+            var = sqrt(var / template_len) * template_len;
+            for (k = 0; k < template_len; ++k){
+                tp[k] = (float) ((tp[k] - mean) / var);
+            }
+        }
+    }
+}
+
+static void bench_locations(float *latitudes, float *longitudes, float *depths, long n_events,
+                            int data, unsigned long long *state){
+    /* Uniform over a 10 x 10 degree region, or seismic-shaped: clusters of
+     * events a few km across */
+    long i;
+    const double deg = 0.017453292519943295;
+
+    for (i = 0; i < n_events; ++i){
+        if (data == BENCH_NOISE) {
+            latitudes[i] = (float) ((-45.0 + 10.0 * bench_uniform(state)) * deg);
+            longitudes[i] = (float) ((170.0 + 10.0 * bench_uniform(state)) * deg);
+            depths[i] = (float) (30.0 * bench_uniform(state));
+        } else {
+            unsigned long long cluster = (unsigned long long) (i % 50) * 2654435761ULL;
+            double lat = -45.0 + (double) (cluster % 1000) / 100.0;
+            double lon = 170.0 + (double) ((cluster / 1000) % 1000) / 100.0;
+            latitudes[i] = (float) ((lat + 0.02 * bench_gaussian(state)) * deg);
+            longitudes[i] = (float) ((lon + 0.02 * bench_gaussian(state)) * deg);
+            depths[i] = (float) (10.0 + 2.0 * bench_gaussian(state));
+        }
+    }
+}
+
+
+// Measurement -----------------------------------------------------------------
+
+static int bench_max_threads(void){
+#ifdef N_THREADS
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static long long bench_peak_rss(void){
+    // High-water mark of the resident set of this process in bytes
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return (long long) counters.PeakWorkingSetSize;
+    }
+    return -1;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    #if defined(__APPLE__)
+    return (long long) usage.ru_maxrss;
+    #else
+    return (long long) usage.ru_maxrss * 1024;
+    #endif
+#endif
+}
+
+static long bench_fft_len(long fft_len, long template_len, long image_len){
+    // As the default of correlate.py, a power of two rather than next_fast_len
+    long len = 1;
+
+    if (fft_len > 0) {
+        return fft_len;
+    }
+    while (len < template_len + image_len - 1 && len < (1L << 13)){
+        len <<= 1;
+    }
+    return len;
+}
+
+static const char *bench_data_name(int data){
+    return (data == BENCH_SEISMIC) ? "seismic" : "noise";
+}
+
+static void bench_begin(bench_report *report, const char *kernel, int data){
+    fprintf(report->out, "%s\n    {\"kernel\": \"%s\", \"data\": \"%s\"",
+            (report->n_results > 0) ? "," : "", kernel, bench_data_name(data));
+    report->n_results += 1;
+}
+
+static void bench_end(bench_report *report, int status){
+    fprintf(report->out, ", \"status\": %d, \"peak_rss_bytes\": %lld}", status, bench_peak_rss());
+    fflush(report->out);
+}
+
+static int compare_magnitude(const void *a, const void *b){
+    // Sort peaks by descending absolute value, as findpeaks.decluster does
+    float fa = fabsf(((const float *) a)[0]), fb = fabsf(((const float *) b)[0]);
+    return (fa < fb) - (fa > fb);
+}
+
+typedef struct {
+    float value;
+    float pad;                      // keeps index aligned
+    long index;
+} bench_peak;
+
+static int bench_peaks(bench_report *report, float *arrays, long n_arrays, long len,
+                       float *thresholds, long trig_int, int threads){
+    /* Find and then decluster the peaks of each array, writing the stage
+     * timings, returns non-zero on failure */
+    long long total, k, *indexes, *n_peaks;
+    long a, *lengths, *peak_index;
+    float *values, *sorted;
+    unsigned int *out;
+    bench_peak *peaks;
+    double t0, t_find, t_decluster;
+    long long n_detections = 0;
+    int status = 0;
+
+    n_peaks = (long long *) malloc((size_t) n_arrays * sizeof(long long));
+    lengths = (long *) malloc((size_t) n_arrays * sizeof(long));
+    if (n_peaks == NULL || lengths == NULL) {
+        free(n_peaks);
+        free(lengths);
+        return -1;
+    }
+    total = multi_find_peaks_packed(arrays, len, (int) n_arrays, thresholds, threads,
+                                    NULL, NULL, 0, n_peaks);
+    if (total < 0) {
+        free(n_peaks);
+        free(lengths);
+        return -1;
+    }
+    indexes = (long long *) malloc((size_t) (total + 1) * sizeof(long long));
+    values = (float *) malloc((size_t) (total + 1) * sizeof(float));
+    sorted = (float *) malloc((size_t) (total + 1) * sizeof(float));
+    peak_index = (long *) malloc((size_t) (total + 1) * sizeof(long));
+    peaks = (bench_peak *) malloc((size_t) (total + 1) * sizeof(bench_peak));
+    out = (unsigned int *) calloc((size_t) (total + 1), sizeof(unsigned int));
+    if (indexes == NULL || values == NULL || sorted == NULL || peak_index == NULL ||
+        peaks == NULL || out == NULL) {
+        status = -1;
+        goto cleanup;
+    }
+    t0 = wall_time();
+    multi_find_peaks_packed(arrays, len, (int) n_arrays, thresholds, threads,
+                            indexes, values, total, n_peaks);
+    t_find = wall_time() - t0;
+
+    // Sorting is part of declustering in findpeaks
+    t0 = wall_time();
+    for (a = 0, k = 0; a < n_arrays; k += n_peaks[a], ++a){
+        long long j;
+        lengths[a] = (long) n_peaks[a];
+        for (j = 0; j < n_peaks[a]; ++j){
+            peaks[k + j].value = values[k + j];
+            peaks[k + j].index = (long) indexes[k + j];
+        }
+        qsort(&peaks[k], (size_t) n_peaks[a], sizeof(bench_peak), compare_magnitude);
+        for (j = 0; j < n_peaks[a]; ++j){
+            sorted[k + j] = peaks[k + j].value;
+            peak_index[k + j] = peaks[k + j].index;
+        }
+    }
+    status = multi_decluster(sorted, peak_index, lengths, (int) n_arrays, thresholds,
+                             trig_int, out, threads);
+    t_decluster = wall_time() - t0;
+    for (k = 0; k < total; ++k){
+        n_detections += out[k];
+    }
+    fprintf(report->out, ", \"peaks\": %.6f, \"decluster\": %.6f, \"n_peaks\": %lld, "
+            "\"n_detections\": %lld", t_find, t_decluster, total, n_detections);
+
+cleanup:
+    free(n_peaks);
+    free(lengths);
+    free(indexes);
+    free(values);
+    free(sorted);
+    free(peak_index);
+    free(peaks);
+    free(out);
+    return status;
+}
+
+
+// Benchmarks ------------------------------------------------------------------
+
+static void bench_correlations(bench_report *report, const bench_options *opts, int kernel,
+                               int data, long template_len, long n_templates, long n_channels,
+                               long fft_len, int inner, int outer, int stack){
+    /* One case of multi_normxcorr_fftw (kernel BENCH_FFTW) or
+     * multi_normxcorr_time_blocked (BENCH_TIME): correlate, then find and
+     * decluster the peaks of the output */
+    long image_len = opts->image_len, n_corr = image_len - template_len + 1;
+    long n_rows = n_templates * (stack ? 1 : n_channels), r;
+    double ncc_bytes = (double) n_rows * n_corr * sizeof(float), t0, t, best = -1, sum = 0;
+    float *templates = NULL, *image = NULL, *ncc = NULL, *thresholds = NULL;
+    int *used = NULL, *pads = NULL, *vw = NULL, *mc = NULL, status = 0;
+    unsigned long long state = 42 + (unsigned long long) (template_len * n_templates * n_channels);
+    multi_normxcorr_fftw_context *ctx = NULL;
+    correlation_stats stats;
+
+    bench_begin(report, (kernel == BENCH_FFTW) ? "multi_normxcorr_fftw" : "multi_normxcorr_time", data);
+    if (kernel == BENCH_FFTW) {
+        fft_len = bench_fft_len(fft_len, template_len, image_len);
+    }
+    fprintf(report->out, ", \"template_len\": %ld, \"n_templates\": %ld, \"n_channels\": %ld, "
+            "\"image_len\": %ld, \"fft_len\": %ld, \"inner\": %d, \"outer\": %d, \"stack\": %d, "
+            "\"repeat\": %d", template_len, n_templates, n_channels, image_len,
+            (kernel == BENCH_FFTW) ? fft_len : 0, inner, outer, stack, opts->repeat);
+    if (n_corr < 1 || (kernel == BENCH_FFTW && fft_len < template_len)) {
+        fprintf(report->out, ", \"skipped\": \"template longer than image or fft\"");
+        bench_end(report, 0);
+        return;
+    }
+    if (ncc_bytes > opts->max_memory) {
+        fprintf(report->out, ", \"skipped\": \"output of %.0f bytes is over --max-memory\"", ncc_bytes);
+        bench_end(report, 0);
+        return;
+    }
+    templates = (float *) malloc((size_t) (n_templates * n_channels * template_len) * sizeof(float));
+    image = (float *) malloc((size_t) (n_channels * image_len) * sizeof(float));
+    ncc = (float *) malloc((size_t) n_rows * (size_t) n_corr * sizeof(float));
+    thresholds = (float *) malloc((size_t) n_rows * sizeof(float));
+    used = (int *) malloc((size_t) (n_templates * n_channels) * sizeof(int));
+    pads = (int *) malloc((size_t) (n_templates * n_channels) * sizeof(int));
+    vw = (int *) calloc((size_t) n_channels, sizeof(int));
+    mc = (int *) calloc((size_t) n_channels, sizeof(int));
+    if (templates == NULL || image == NULL || ncc == NULL || thresholds == NULL ||
+        used == NULL || pads == NULL || vw == NULL || mc == NULL) {
+        status = -1;
+        goto cleanup;
+    }
+    bench_image(image, n_channels, image_len, template_len, data, &state);
+    bench_templates(templates, n_templates, template_len, n_channels, image, image_len,
+                    data, pads, &state);
+    for (r = 0; r < n_templates * n_channels; ++r){
+        used[r] = 1;
+    }
+
+    if (kernel == BENCH_FFTW) {
+        t0 = wall_time();
+        ctx = multi_normxcorr_fftw_create(templates, n_templates, template_len, n_channels,
+                                          fft_len, used, pads, inner, outer, opts->planner);
+        t = wall_time() - t0;
+        if (ctx == NULL) {
+            status = -1;
+            goto cleanup;
+        }
+        fprintf(report->out, ", \"stages\": {\"create\": %.6f", t);
+    } else {
+        fprintf(report->out, ", \"stages\": {\"create\": 0.0");
+    }
+    memset(&stats, 0, sizeof(stats));
+    for (r = 0; r < opts->repeat && status == 0; ++r){
+        memset(ncc, 0, (size_t) n_rows * (size_t) n_corr * sizeof(float));
+        t0 = wall_time();
+        if (kernel == BENCH_FFTW) {
+            status = multi_normxcorr_fftw_execute(ctx, image, image_len, ncc, NULL, vw, mc,
+                                                  stack, NCC_FLOAT32, 1L << 30, NULL, &stats);
+        } else {
+            status = multi_normxcorr_time_blocked(templates, n_templates, template_len,
+                                                  n_channels, image, image_len, ncc, used,
+                                                  pads, inner * outer, vw, mc, stack);
+        }
+        t = wall_time() - t0;
+        best = (best < 0 || t < best) ? t : best;
+        sum += t;
+    }
+    fprintf(report->out, ", \"execute\": %.6f, \"execute_mean\": %.6f", best,
+            sum / opts->repeat);
+    if (kernel == BENCH_FFTW) {
+        // Mean of the stages within execute, summed over threads
+        fprintf(report->out, ", \"execute_stages\": {\"moments\": %.6f, \"image_fft\": %.6f, "
+                "\"multiply\": %.6f, \"inverse_fft\": %.6f, \"normalise\": %.6f, "
+                "\"stack\": %.6f, \"n_chunks\": %lld, \"n_skipped_chunks\": %lld}",
+                stats.moments / opts->repeat, stats.image_fft / opts->repeat,
+                stats.multiply / opts->repeat, stats.inverse_fft / opts->repeat,
+                stats.normalise / opts->repeat, stats.stack / opts->repeat,
+                stats.n_chunks / opts->repeat, stats.n_skipped_chunks / opts->repeat);
+    }
+    if (status == 0) {
+        // Correlations of noise have a standard deviation of about 1 / sqrt(template_len)
+        for (r = 0; r < n_rows; ++r){
+            thresholds[r] = (float) (5.0 * sqrt((double) (stack ? n_channels : 1) / template_len));
+        }
+        status = bench_peaks(report, ncc, n_rows, n_corr, thresholds, template_len,
+                             inner * outer);
+    }
+    fprintf(report->out, "}, \"samples_templates_per_s\": %.6g",
+            (best > 0) ? (double) n_corr * n_templates * n_channels / best : 0.0);
+
+cleanup:
+    multi_normxcorr_fftw_destroy(ctx);
+    free(templates);
+    free(image);
+    free(ncc);
+    free(thresholds);
+    free(used);
+    free(pads);
+    free(vw);
+    free(mc);
+    bench_end(report, status);
+}
+
+static void bench_find_peaks(bench_report *report, const bench_options *opts, int data,
+                             long n_arrays, long trig_int, int threads){
+    /* Peaks alone: packed peak finding against the per-sample mask of
+     * multi_find_peaks, then declustering */
+    long len = opts->image_len, i;
+    double bytes = (double) n_arrays * len * (sizeof(float) + sizeof(unsigned int)), t0, t_mask;
+    float *arrays, *thresholds;
+    unsigned int *mask;
+    int status = 0;
+    unsigned long long state = 7 + (unsigned long long) n_arrays;
+
+    bench_begin(report, "find_peaks", data);
+    fprintf(report->out, ", \"n_arrays\": %ld, \"len\": %ld, \"trig_int\": %ld, \"threads\": %d",
+            n_arrays, len, trig_int, threads);
+    if (bytes > opts->max_memory) {
+        fprintf(report->out, ", \"skipped\": \"arrays of %.0f bytes are over --max-memory\"", bytes);
+        bench_end(report, 0);
+        return;
+    }
+    arrays = (float *) malloc((size_t) n_arrays * (size_t) len * sizeof(float));
+    thresholds = (float *) malloc((size_t) n_arrays * sizeof(float));
+    mask = (unsigned int *) calloc((size_t) n_arrays * (size_t) len, sizeof(unsigned int));
+    if (arrays == NULL || thresholds == NULL || mask == NULL) {
+        status = -1;
+    } else {
+        for (i = 0; i < n_arrays * len; ++i){
+            arrays[i] = (float) bench_gaussian(&state);
+        }
+        if (data == BENCH_SEISMIC) {
+            // Stacked correlograms are smooth, with few peaks
+            for (i = 1; i < n_arrays * len; ++i){
+                arrays[i] = 0.95f * arrays[i - 1] + 0.3f * arrays[i];
+            }
+        }
+        for (i = 0; i < n_arrays; ++i){
+            thresholds[i] = 3.0f;
+        }
+        t0 = wall_time();
+        status = multi_find_peaks(arrays, len, (int) n_arrays, thresholds, threads, mask);
+        t_mask = wall_time() - t0;
+        fprintf(report->out, ", \"stages\": {\"mask\": %.6f", t_mask);
+        if (status == 0) {
+            status = bench_peaks(report, arrays, n_arrays, len, thresholds, trig_int, threads);
+        }
+        fprintf(report->out, "}");
+    }
+    free(arrays);
+    free(thresholds);
+    free(mask);
+    bench_end(report, status);
+}
+
+static void bench_distance(bench_report *report, const bench_options *opts, int data,
+                           long n_events, int threads){
+    /* Condensed distance matrix, pairs within BENCH_CUTOFF and
+     * remove_unclustered at BENCH_CUTOFF */
+    double condensed_bytes = (double) n_events * (n_events - 1) / 2 * sizeof(float), t0;
+    float *latitudes, *longitudes, *depths, *dist_vec = NULL, *dists = NULL;
+    long long *row_counts, *rows = NULL, *cols = NULL, n_pairs = 0;
+    unsigned char *mask;
+    int status = 0;
+    long i, n_clustered = 0;
+    unsigned long long state = 11 + (unsigned long long) n_events;
+
+    bench_begin(report, "distance", data);
+    fprintf(report->out, ", \"n_events\": %ld, \"threads\": %d, \"cutoff_km\": %.1f, \"stages\": {",
+            n_events, threads, BENCH_CUTOFF);
+    latitudes = (float *) malloc((size_t) n_events * sizeof(float));
+    longitudes = (float *) malloc((size_t) n_events * sizeof(float));
+    depths = (float *) malloc((size_t) n_events * sizeof(float));
+    row_counts = (long long *) malloc((size_t) n_events * sizeof(long long));
+    mask = (unsigned char *) calloc((size_t) n_events, sizeof(unsigned char));
+    if (latitudes == NULL || longitudes == NULL || depths == NULL || row_counts == NULL ||
+        mask == NULL) {
+        status = -1;
+        goto cleanup;
+    }
+    bench_locations(latitudes, longitudes, depths, n_events, data, &state);
+
+    if (condensed_bytes <= opts->max_memory) {
+        dist_vec = (float *) malloc((size_t) condensed_bytes + sizeof(float));
+        if (dist_vec == NULL) {
+            status = -1;
+            goto cleanup;
+        }
+        t0 = wall_time();
+        status = distance_matrix_condensed(latitudes, longitudes, depths, n_events, dist_vec,
+                                           DIST_FLOAT32, threads);
+        fprintf(report->out, "\"condensed\": %.6f, ", wall_time() - t0);
+    }
+    t0 = wall_time();
+    n_pairs = distance_pairs(latitudes, longitudes, depths, n_events, BENCH_CUTOFF,
+                             row_counts, NULL, NULL, NULL, threads);
+    if (n_pairs >= 0) {
+        rows = (long long *) malloc((size_t) (n_pairs + 1) * sizeof(long long));
+        cols = (long long *) malloc((size_t) (n_pairs + 1) * sizeof(long long));
+        dists = (float *) malloc((size_t) (n_pairs + 1) * sizeof(float));
+        if (rows == NULL || cols == NULL || dists == NULL ||
+            distance_pairs(latitudes, longitudes, depths, n_events, BENCH_CUTOFF,
+                           row_counts, rows, cols, dists, threads) < 0) {
+            status = -1;
+        }
+    } else {
+        status = -1;
+    }
+    fprintf(report->out, "\"pairs\": %.6f, ", wall_time() - t0);
+    t0 = wall_time();
+    if (remove_unclustered(latitudes, longitudes, depths, n_events, mask, BENCH_CUTOFF,
+                           threads) != 0) {
+        status = -1;
+    }
+    fprintf(report->out, "\"remove_unclustered\": %.6f}", wall_time() - t0);
+    for (i = 0; i < n_events; ++i){
+        n_clustered += mask[i];
+    }
+    fprintf(report->out, ", \"n_pairs\": %lld, \"n_clustered\": %ld", n_pairs, n_clustered);
+
+cleanup:
+    free(latitudes);
+    free(longitudes);
+    free(depths);
+    free(row_counts);
+    free(mask);
+    free(dist_vec);
+    free(rows);
+    free(cols);
+    free(dists);
+    bench_end(report, status);
+}
+
+
+// Options ---------------------------------------------------------------------
+
+static void bench_usage(void){
+    printf(
+        "Usage: eqcorrscan_bench [options]\n"
+        "Sweeps every combination of the listed values (comma separated) and writes\n"
+        "timings in seconds of each stage as JSON.\n\n"
+        "  --kernels LIST       fftw,time,peaks,distance (default fftw,peaks,distance)\n"
+        "  --data LIST          noise,seismic (default both)\n"
+        "  --template-len LIST  (default 256,1024)\n"
+        "  --n-templates LIST   (default 16,128)\n"
+        "  --n-channels LIST    (default 4,16)\n"
+        "  --fft-len LIST       0 for the default of correlate.py (default 0)\n"
+        "  --inner LIST         threads within channels (default 1)\n"
+        "  --outer LIST         threads over channels, and threads of the peak and\n"
+        "                       distance kernels (default 1,max)\n"
+        "  --stack LIST         1 to stack channels, 0 not to (default 1)\n"
+        "  --n-events LIST      events for distance kernels (default 1000,10000)\n"
+        "  --image-len N        samples per channel (default 86400)\n"
+        "  --repeat N           correlations are repeated, best and mean reported (default 3)\n"
+        "  --planner N          FFTW planner rigour, 0 (estimate) to 3 (default 0)\n"
+        "  --simd N             force an instruction set (see set_simd_level)\n"
+        "  --max-memory BYTES   skip cases with larger outputs (default 2e9)\n"
+        "  --output FILE        write JSON here rather than stdout\n\n"
+        "peak_rss_bytes is the high-water mark of the process so far: run one case\n"
+        "per invocation to attribute it to that case.\n");
+}
+
+static int bench_parse_list(const char *text, bench_list *list){
+    // Comma separated integers, "max" for the number of threads OpenMP would use
+    char *end;
+
+    list->n = 0;
+    while (*text && list->n < BENCH_MAX_VALUES){
+        if (strncmp(text, "max", 3) == 0) {
+            list->values[list->n++] = bench_max_threads();
+            end = (char *) text + 3;
+        } else {
+            list->values[list->n++] = strtol(text, &end, 10);
+            if (end == text) {
+                return -1;
+            }
+        }
+        text = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+    }
+    return (list->n > 0) ? 0 : -1;
+}
+
+static void bench_set_list(bench_list *list, int n, const long *values){
+    int i;
+
+    list->n = n;
+    for (i = 0; i < n; ++i){
+        list->values[i] = values[i];
+    }
+}
+
+static int bench_parse_names(const char *text, const char **names, const int *flags, int n){
+    // Comma separated names to a combination of flags, -1 if a name is not known
+    int result = 0, i;
+    size_t len;
+
+    while (*text){
+        len = strcspn(text, ",");
+        for (i = 0; i < n; ++i){
+            if (strlen(names[i]) == len && strncmp(text, names[i], len) == 0) {
+                result |= flags[i];
+                break;
+            }
+        }
+        if (i == n) {
+            return -1;
+        }
+        text += len;
+        if (*text == ',') {
+            text += 1;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char **argv){
+    static const char *kernel_names[] = {"fftw", "time", "peaks", "distance"};
+    static const int kernel_flags[] = {BENCH_FFTW, BENCH_TIME, BENCH_PEAKS, BENCH_DISTANCE};
+    static const char *data_names[] = {"noise", "seismic"};
+    static const int data_flags[] = {BENCH_NOISE, BENCH_SEISMIC};
+    const long template_lens[] = {256, 1024}, n_templates[] = {16, 128};
+    const long n_channels[] = {4, 16}, zero[] = {0}, one[] = {1};
+    const long outers[] = {1, bench_max_threads()}, n_events[] = {1000, 10000};
+    bench_options opts;
+    bench_report report;
+    const char *output = NULL;
+    int a, i, j, k, l, m, n, p, d;
+
+    bench_set_list(&opts.template_len, 2, template_lens);
+    bench_set_list(&opts.n_templates, 2, n_templates);
+    bench_set_list(&opts.n_channels, 2, n_channels);
+    bench_set_list(&opts.fft_len, 1, zero);
+    bench_set_list(&opts.inner, 1, one);
+    bench_set_list(&opts.outer, (outers[1] > 1) ? 2 : 1, outers);
+    bench_set_list(&opts.stack, 1, one);
+    bench_set_list(&opts.n_events, 2, n_events);
+    opts.image_len = 86400;
+    opts.repeat = 3;
+    opts.planner = PLANNER_ESTIMATE;
+    opts.data = BENCH_NOISE | BENCH_SEISMIC;
+    opts.kernels = BENCH_FFTW | BENCH_PEAKS | BENCH_DISTANCE;
+    opts.max_memory = 2e9;
+
+    for (a = 1; a < argc; ++a){
+        const char *arg = argv[a], *value = (a + 1 < argc) ? argv[a + 1] : NULL;
+        int bad = 0;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            bench_usage();
+            return 0;
+        }
+        if (value == NULL) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return 2;
+        }
+        a += 1;
+        if (strcmp(arg, "--kernels") == 0) {
+            bad = (opts.kernels = bench_parse_names(value, kernel_names, kernel_flags, 4)) <= 0;
+        } else if (strcmp(arg, "--data") == 0) {
+            bad = (opts.data = bench_parse_names(value, data_names, data_flags, 2)) <= 0;
+        } else if (strcmp(arg, "--template-len") == 0) {
+            bad = bench_parse_list(value, &opts.template_len);
+        } else if (strcmp(arg, "--n-templates") == 0) {
+            bad = bench_parse_list(value, &opts.n_templates);
+        } else if (strcmp(arg, "--n-channels") == 0) {
+            bad = bench_parse_list(value, &opts.n_channels);
+        } else if (strcmp(arg, "--fft-len") == 0) {
+            bad = bench_parse_list(value, &opts.fft_len);
+        } else if (strcmp(arg, "--inner") == 0) {
+            bad = bench_parse_list(value, &opts.inner);
+        } else if (strcmp(arg, "--outer") == 0) {
+            bad = bench_parse_list(value, &opts.outer);
+        } else if (strcmp(arg, "--stack") == 0) {
+            bad = bench_parse_list(value, &opts.stack);
+        } else if (strcmp(arg, "--n-events") == 0) {
+            bad = bench_parse_list(value, &opts.n_events);
+        } else if (strcmp(arg, "--image-len") == 0) {
+            bad = (opts.image_len = strtol(value, NULL, 10)) < 1;
+        } else if (strcmp(arg, "--repeat") == 0) {
+            bad = (opts.repeat = (int) strtol(value, NULL, 10)) < 1;
+        } else if (strcmp(arg, "--planner") == 0) {
+            opts.planner = (int) strtol(value, NULL, 10);
+        } else if (strcmp(arg, "--simd") == 0) {
+            set_simd_level((int) strtol(value, NULL, 10));
+        } else if (strcmp(arg, "--max-memory") == 0) {
+            opts.max_memory = strtod(value, NULL);
+        } else if (strcmp(arg, "--output") == 0) {
+            output = value;
+        } else {
+            fprintf(stderr, "Unknown option %s, see --help\n", arg);
+            return 2;
+        }
+        if (bad) {
+            fprintf(stderr, "Bad value %s for %s, see --help\n", value, arg);
+            return 2;
+        }
+    }
+    report.out = (output != NULL) ? fopen(output, "w") : stdout;
+    report.n_results = 0;
+    if (report.out == NULL) {
+        fprintf(stderr, "Could not open %s\n", output);
+        return 1;
+    }
+
+    fprintf(report.out, "{\"system\": {\"simd_level\": %d, \"max_threads\": %d, "
+            "\"sizeof_long\": %d},\n \"results\": [", get_simd_level(),
+            bench_max_threads(), (int) sizeof(long));
+    for (d = BENCH_NOISE; d <= BENCH_SEISMIC; d <<= 1){
+        if (!(opts.data & d)) {
+            continue;
+        }
+        for (k = BENCH_FFTW; k <= BENCH_TIME; k <<= 1){
+            if (!(opts.kernels & k)) {
+                continue;
+            }
+            for (i = 0; i < opts.template_len.n; ++i)
+            for (j = 0; j < opts.n_templates.n; ++j)
+            for (l = 0; l < opts.n_channels.n; ++l)
+            for (m = 0; m < ((k == BENCH_FFTW) ? opts.fft_len.n : 1); ++m)
+            for (n = 0; n < opts.inner.n; ++n)
+            for (p = 0; p < opts.outer.n; ++p)
+            for (a = 0; a < opts.stack.n; ++a){
+                bench_correlations(
+                    &report, &opts, k, d, opts.template_len.values[i],
+                    opts.n_templates.values[j], opts.n_channels.values[l],
+                    opts.fft_len.values[m], (int) opts.inner.values[n],
+                    (int) opts.outer.values[p], (int) opts.stack.values[a]);
+            }
+        }
+        if (opts.kernels & BENCH_PEAKS) {
+            for (j = 0; j < opts.n_templates.n; ++j)
+            for (p = 0; p < opts.outer.n; ++p){
+                bench_find_peaks(&report, &opts, d, opts.n_templates.values[j],
+                                 opts.template_len.values[0], (int) opts.outer.values[p]);
+            }
+        }
+        if (opts.kernels & BENCH_DISTANCE) {
+            for (j = 0; j < opts.n_events.n; ++j)
+            for (p = 0; p < opts.outer.n; ++p){
+                bench_distance(&report, &opts, d, opts.n_events.values[j],
+                               (int) opts.outer.values[p]);
+            }
+        }
+    }
+    fprintf(report.out, "\n]}\n");
+    if (output != NULL) {
+        fclose(report.out);
+    }
+    return 0;
+}
@@ -18,23 +18,30 @@
  * =====================================================================================
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <math.h>
-#if defined(__linux__) || defined(__linux) || defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
-    #include <omp.h>
-    #ifndef N_THREADS
-        #define N_THREADS omp_get_max_threads()
-    #endif
-#endif
+#include <libutils.h>
 
 #define EARTH_RADIUS 6371.009
 
-float dist_calc(float, float, float, float, float, float);
+static inline void unit_vector(float lat, float lon, double *x, double *y, double *z){
+    /* Unit vector of a location on the sphere */
+    double cos_lat = cos((double) lat);
 
-int distance_matrix(float*, float*, float*, long, float*, int);
+    *x = cos_lat * cos((double) lon);
+    *y = cos_lat * sin((double) lon);
+    *z = sin((double) lat);
+}
 
-int remove_unclustered(float*, float*, float*, long, unsigned char*, float, int);
+static inline float chord_distance(double chord, float depth1, float depth2){
+    /* Distance in km from the squared chord between the unit vectors of two
+     * locations, the half chord is the sine of half the central angle */
+    double half_chord = 0.5 * sqrt(chord), surface, ddepth = depth1 - depth2;
+
+    if (half_chord > 1.0) {
+        half_chord = 1.0;
+    }
+    surface = EARTH_RADIUS * 2 * asin(half_chord);
+    return (float) sqrt(surface * surface + ddepth * ddepth);
+}
 
 float dist_calc(float lat1, float lon1, float depth1, float lat2, float lon2, float depth2){
 //    Function to calculate the distance in km between two points.
@@ -42,7 +49,9 @@ float dist_calc(float lat1, float lon1, float depth1, float lat2, float lon2, fl
 //    Uses the
 //    `haversine formula <https://en.wikipedia.org/wiki/Haversine_formula>`_
 //    to calculate great circle distance at the Earth's surface, then uses
-//    trig to include depth.
+//    trig to include depth. The haversine is evaluated from the chord between
+//    the unit vectors of the points, which keeps precision for points that
+//    are close and for points that are nearly antipodal.
 //
 //    :type lat1: float - Latitude of point 1 in radians
 //    :type lon1: float - Longitude of point 1 in radians
@@ -51,20 +60,13 @@ float dist_calc(float lat1, float lon1, float depth1, float lat2, float lon2, fl
 //    :type lon2: float - Longitude of point 2 in radians
 //    :type depth2: float - Depth of point 2 in km (positive down)
 //    :type distance: float - Distance between two points (output, km)
+    double x1, y1, z1, x2, y2, z2;
 
-
-    double central_angle;
-    float dlat, dlong, ddepth, distance;
-
-    dlat = lat1 - lat2;
-    dlong = lon1 - lon2;
-    ddepth = depth1 - depth2;
-
-    central_angle = 2 * asin(sqrt(pow(sin(dlat / 2), 2) + cos(lat1) * cos(lat2) * pow(sin(dlong / 2), 2)));
-
-    distance = EARTH_RADIUS * central_angle;
-    distance = sqrt(pow(distance, 2) + pow(ddepth, 2));
-    return distance;
+    unit_vector(lat1, lon1, &x1, &y1, &z1);
+    unit_vector(lat2, lon2, &x2, &y2, &z2);
+    return chord_distance(
+        (x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) + (z1 - z2) * (z1 - z2),
+        depth1, depth2);
 }
 
 int distance_matrix(float *latitudes, float *longitudes, float *depths, long n_locs,
@@ -93,6 +95,656 @@ int distance_matrix(float *latitudes, float *longitudes, float *depths, long n_l
     return out;
 }
 
+typedef struct {
+    double *x;
+    double *y;
+    double *z;
+    const float *depths;
+} unit_locations;
+
+static void unit_locations_free(unit_locations *locs){
+    free(locs->x);
+    free(locs->y);
+    free(locs->z);
+}
+
+static int unit_locations_init(
+    unit_locations *locs, const float *latitudes, const float *longitudes,
+    const float *depths, long n_locs){
+    /* Unit vectors of each location on the sphere, so that the great circle
+     * between a pair follows from the chord between them without any trig per
+     * pair. Returns -1 if allocation failed. */
+    long i;
+    size_t n = (n_locs > 0) ? (size_t) n_locs : 1;
+
+    locs->x = (double *) malloc(n * sizeof(double));
+    locs->y = (double *) malloc(n * sizeof(double));
+    locs->z = (double *) malloc(n * sizeof(double));
+    locs->depths = depths;
+    if (locs->x == NULL || locs->y == NULL || locs->z == NULL) {
+        printf("Error allocating location workspace\n");
+        unit_locations_free(locs);
+        return -1;
+    }
+    for (i = 0; i < n_locs; ++i){
+        unit_vector(latitudes[i], longitudes[i], &locs->x[i], &locs->y[i], &locs->z[i]);
+    }
+    return 0;
+}
+
+static void location_chords(
+    const unit_locations *locs, long i, long start, long n, double *chords){
+    /* Squared chords from location i to the n locations from start, kept free
+     * of branches and calls so that it vectorises */
+    long k;
+    const double xi = locs->x[i], yi = locs->y[i], zi = locs->z[i];
+    const double *x = &locs->x[start], *y = &locs->y[start], *z = &locs->z[start];
+
+    for (k = 0; k < n; ++k){
+        double dx = x[k] - xi, dy = y[k] - yi, dz = z[k] - zi;
+        chords[k] = dx * dx + dy * dy + dz * dz;
+    }
+}
+
+static inline size_t condensed_row(long n_locs, long i){
+    /* Index of the pair (i, i + 1) in the condensed upper triangle */
+    return (size_t) i * (size_t) n_locs - (size_t) i * (size_t) (i + 1) / 2;
+}
+
+int distance_matrix_condensed(float *latitudes, float *longitudes, float *depths,
+                              long n_locs, void *dist_vec, int out_format,
+                              int n_threads){
+  /*
+    Purpose: calculate the distance, as dist_calc, between every pair of a set
+             of locations into a condensed upper triangle, ordered as
+             scipy.spatial.distance.pdist so it can be given to
+             scipy.cluster.hierarchy.linkage
+    Args:
+      latitudes:   Latitudes in radians
+      longitudes:  Longitudes in radians
+      depths:      Depths in km (positive down)
+      n_locs:      Number of locations
+      dist_vec:    Output of n_locs * (n_locs - 1) / 2 distances in km, the
+                   distance between i and j > i is at
+                   n_locs * i - i * (i + 1) / 2 + j - i - 1
+      out_format:  DIST_FLOAT32 for float, DIST_FLOAT16 for IEEE half
+                   (unsigned short)
+      n_threads:   Number of threads to parallel over
+    Returns:
+      0 on success, -1 if workspace could not be allocated
+  */
+    unit_locations locs;
+    long i;
+
+    if (unit_locations_init(&locs, latitudes, longitudes, depths, n_locs) != 0) {
+        return -1;
+    }
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic, 16)
+    for (i = 0; i < n_locs - 1; ++i){
+        double chords[DIST_BLOCK];
+        size_t row = condensed_row(n_locs, i);
+        long start, k;
+
+        for (start = i + 1; start < n_locs; start += DIST_BLOCK){
+            long n = (start + DIST_BLOCK > n_locs) ? n_locs - start : DIST_BLOCK;
+            size_t index = row + (size_t) (start - i - 1);
+
+            location_chords(&locs, i, start, n, chords);
+            if (out_format == DIST_FLOAT16) {
+                unsigned short *out = &((unsigned short *) dist_vec)[index];
+                for (k = 0; k < n; ++k){
+                    out[k] = float_to_half(chord_distance(
+                        chords[k], depths[i], depths[start + k]));
+                }
+            } else {
+                float *out = &((float *) dist_vec)[index];
+                for (k = 0; k < n; ++k){
+                    out[k] = chord_distance(chords[k], depths[i], depths[start + k]);
+                }
+            }
+        }
+    }
+    unit_locations_free(&locs);
+    return 0;
+}
+
+static inline int location_coord(double position, double cell){
+    // Grid coordinate of a position along one axis
+    return (int) floor(position / cell);
+}
+
+static unsigned long long location_cell_slot(
+    const location_index *index, int cx, int cy, int cz){
+    // Slot of a cell, or of the empty slot it would go in (Fibonacci hashing)
+    unsigned long long key = ((unsigned long long) (unsigned int) cx * 73856093ULL) ^
+                             ((unsigned long long) (unsigned int) cy * 19349663ULL) ^
+                             ((unsigned long long) (unsigned int) cz * 83492791ULL);
+    unsigned long long slot = ((key * 11400714819323198485ULL) >> index->shift) & index->mask;
+    long cell;
+
+    while ((cell = index->slots[slot]) >= 0){
+        const int *coords = &index->cell_coords[3 * cell];
+        if (coords[0] == cx && coords[1] == cy && coords[2] == cz) {
+            break;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return slot;
+}
+
+location_index *location_index_create(float *latitudes, float *longitudes, float *depths,
+                                      long n_locs, float cell, int n_threads){
+  /*
+    Purpose: build a uniform grid of a set of locations so that neighbours
+             can be found without computing the distance of every pair
+    Args:
+      latitudes:   Latitudes in radians
+      longitudes:  Longitudes in radians
+      depths:      Depths in km (positive down)
+      n_locs:      Number of locations
+      cell:        Width of grid cells in km, queries are quickest for radii
+                   of about cell. At least DIST_MIN_CELL is used.
+      n_threads:   Number of threads to parallel over
+    Returns:
+      Pointer to the index, or NULL if allocation failed. Free with
+      location_index_destroy.
+    Notes:
+      Locations are gridded by their earth-centred position at their depth
+      below a sphere of EARTH_RADIUS. Positions of two locations are never
+      further apart than scale times their distance from dist_calc, so the
+      cells within scale times a radius hold every location within it.
+  */
+    location_index *index;
+    size_t n = (n_locs > 0) ? (size_t) n_locs : 1;
+    unsigned long long n_slots = 1, slot;
+    int bits = 0, *coords;
+    long i, c, *cell_of;
+    float min_depth = 0.0f;
+
+    index = (location_index *) calloc(1, sizeof(location_index));
+    if (index == NULL) {
+        printf("Error allocating location index\n");
+        return NULL;
+    }
+    while (n_slots < 2 * (unsigned long long) n && bits < 62){
+        n_slots <<= 1;
+        bits += 1;
+    }
+    index->n_locs = n_locs;
+    index->cell = (cell >= DIST_MIN_CELL) ? cell : DIST_MIN_CELL;
+    index->mask = n_slots - 1;
+    index->shift = 64 - bits;
+    index->x = (double *) malloc(n * sizeof(double));
+    index->y = (double *) malloc(n * sizeof(double));
+    index->z = (double *) malloc(n * sizeof(double));
+    index->ex = (double *) malloc(n * sizeof(double));
+    index->ey = (double *) malloc(n * sizeof(double));
+    index->ez = (double *) malloc(n * sizeof(double));
+    index->depths = (float *) malloc(n * sizeof(float));
+    index->order = (long *) malloc(n * sizeof(long));
+    index->cell_start = (long *) malloc((n + 1) * sizeof(long));
+    index->cell_coords = (int *) malloc(3 * n * sizeof(int));
+    index->slots = (long *) malloc((size_t) n_slots * sizeof(long));
+    coords = (int *) malloc(3 * n * sizeof(int));
+    cell_of = (long *) malloc(n * sizeof(long));
+    if (index->x == NULL || index->y == NULL || index->z == NULL ||
+        index->ex == NULL || index->ey == NULL || index->ez == NULL ||
+        index->depths == NULL || index->order == NULL || index->cell_start == NULL ||
+        index->cell_coords == NULL || index->slots == NULL || coords == NULL ||
+        cell_of == NULL) {
+        printf("Error allocating location index\n");
+        free(coords);
+        free(cell_of);
+        location_index_destroy(index);
+        return NULL;
+    }
+    for (i = 0; i < n_locs; ++i){
+        if (depths[i] < min_depth) {
+            min_depth = depths[i];
+        }
+    }
+    // Above the sphere positions are further apart than at its surface
+    index->scale = (EARTH_RADIUS - min_depth) / EARTH_RADIUS;
+
+    #pragma omp parallel for num_threads(n_threads)
+    for (i = 0; i < n_locs; ++i){
+        double radius = EARTH_RADIUS - depths[i];
+
+        unit_vector(latitudes[i], longitudes[i], &index->x[i], &index->y[i], &index->z[i]);
+        index->ex[i] = radius * index->x[i];
+        index->ey[i] = radius * index->y[i];
+        index->ez[i] = radius * index->z[i];
+        index->depths[i] = depths[i];
+        coords[3 * i] = location_coord(index->ex[i], index->cell);
+        coords[3 * i + 1] = location_coord(index->ey[i], index->cell);
+        coords[3 * i + 2] = location_coord(index->ez[i], index->cell);
+    }
+
+    // Count locations in each cell, then order locations by cell
+    for (slot = 0; slot < n_slots; ++slot){
+        index->slots[slot] = -1;
+    }
+    for (i = 0; i < n_locs; ++i){
+        slot = location_cell_slot(index, coords[3 * i], coords[3 * i + 1], coords[3 * i + 2]);
+        if (index->slots[slot] < 0) {
+            c = index->n_cells++;
+            index->slots[slot] = c;
+            memcpy(&index->cell_coords[3 * c], &coords[3 * i], 3 * sizeof(int));
+            index->cell_start[c] = 0;
+        }
+        cell_of[i] = index->slots[slot];
+        index->cell_start[cell_of[i]] += 1;
+    }
+    for (c = 0, i = 0; c < index->n_cells; ++c){
+        long count = index->cell_start[c];
+        index->cell_start[c] = i;
+        i += count;
+    }
+    for (i = 0; i < n_locs; ++i){
+        index->order[index->cell_start[cell_of[i]]++] = i;
+    }
+    for (c = index->n_cells; c > 0; --c){
+        index->cell_start[c] = index->cell_start[c - 1];
+    }
+    index->cell_start[0] = 0;
+    free(coords);
+    free(cell_of);
+    return index;
+}
+
+void location_index_destroy(location_index *index){
+    if (index == NULL) {
+        return;
+    }
+    free(index->x);
+    free(index->y);
+    free(index->z);
+    free(index->ex);
+    free(index->ey);
+    free(index->ez);
+    free(index->depths);
+    free(index->order);
+    free(index->cell_start);
+    free(index->cell_coords);
+    free(index->slots);
+    free(index);
+}
+
+// Called with each location within the radius of a query, stops the query if non-zero
+typedef int (*location_visitor)(void *state, long j, float dist);
+
+typedef struct {
+    double ux, uy, uz;          // unit vector of the query point
+    double px, py, pz;          // earth-centred position of the query point
+    double reach2;              // squared earth-centred separation of candidates
+    float depth;
+    float radius;
+    location_visitor visit;
+    void *state;
+} location_query;
+
+static int location_visit_cell(
+    const location_index *index, long c, const location_query *query){
+    // Visit the locations of a cell within the query radius, 1 if stopped
+    long k;
+
+    for (k = index->cell_start[c]; k < index->cell_start[c + 1]; ++k){
+        long j = index->order[k];
+        double dx = index->ex[j] - query->px, dy = index->ey[j] - query->py,
+               dz = index->ez[j] - query->pz;
+        float dist;
+
+        if (dx * dx + dy * dy + dz * dz > query->reach2) {
+            continue;
+        }
+        dx = index->x[j] - query->ux;
+        dy = index->y[j] - query->uy;
+        dz = index->z[j] - query->uz;
+        dist = chord_distance(dx * dx + dy * dy + dz * dz, query->depth, index->depths[j]);
+        if (dist <= query->radius && query->visit(query->state, j, dist)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void location_index_visit(
+    const location_index *index, double ux, double uy, double uz, float depth,
+    float radius, location_visitor visit, void *state){
+    /* Call visit for every location within radius of a point given by its unit
+     * vector and depth, in no particular order, until visit returns non-zero */
+    location_query query;
+    double reach = radius * index->scale, span, er = EARTH_RADIUS - depth;
+    int lo[3], hi[3], cx, cy, cz;
+    long c;
+
+    if (!(radius >= 0)) {
+        return;
+    }
+    // No two positions are further apart than the diameter of the deepest sphere
+    if (reach > 2 * EARTH_RADIUS * index->scale + index->cell) {
+        reach = 2 * EARTH_RADIUS * index->scale + index->cell;
+    }
+    query.ux = ux;
+    query.uy = uy;
+    query.uz = uz;
+    query.px = er * ux;
+    query.py = er * uy;
+    query.pz = er * uz;
+    // Allow for rounding of positions, candidates are checked exactly
+    query.reach2 = reach * reach * (1.0 + 1e-9) + 1e-9;
+    query.depth = depth;
+    query.radius = radius;
+    query.visit = visit;
+    query.state = state;
+    lo[0] = location_coord(query.px - reach, index->cell);
+    lo[1] = location_coord(query.py - reach, index->cell);
+    lo[2] = location_coord(query.pz - reach, index->cell);
+    hi[0] = location_coord(query.px + reach, index->cell);
+    hi[1] = location_coord(query.py + reach, index->cell);
+    hi[2] = location_coord(query.pz + reach, index->cell);
+    span = (double) (hi[0] - lo[0] + 1) * (double) (hi[1] - lo[1] + 1) * (double) (hi[2] - lo[2] + 1);
+    if (span > (double) index->n_cells) {
+        // Fewer occupied cells than cells in reach
+        for (c = 0; c < index->n_cells; ++c){
+            if (location_visit_cell(index, c, &query)) {
+                return;
+            }
+        }
+        return;
+    }
+    for (cx = lo[0]; cx <= hi[0]; ++cx){
+        for (cy = lo[1]; cy <= hi[1]; ++cy){
+            for (cz = lo[2]; cz <= hi[2]; ++cz){
+                c = index->slots[location_cell_slot(index, cx, cy, cz)];
+                if (c >= 0 && location_visit_cell(index, c, &query)) {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    long *neighbours;
+    long max_neighbours;
+    long n;
+} location_list;
+
+static int location_list_visit(void *state, long j, float dist){
+    location_list *list = (location_list *) state;
+
+    (void) dist;
+    if (list->n < list->max_neighbours) {
+        list->neighbours[list->n] = j;
+    }
+    list->n += 1;
+    return 0;
+}
+
+long location_index_query(location_index *index, float latitude, float longitude,
+                          float depth, float radius, long *neighbours,
+                          long max_neighbours){
+  /*
+    Purpose: find the locations of an index within radius of a point
+    Args:
+      index:            Index from location_index_create
+      latitude:         Latitude of the point in radians
+      longitude:        Longitude of the point in radians
+      depth:            Depth of the point in km (positive down)
+      radius:           Largest distance, as dist_calc, in km
+      neighbours:       Output of the locations found, in no particular order
+      max_neighbours:   Length of neighbours, later locations are counted but
+                        not written
+    Returns:
+      Number of locations within radius
+  */
+    location_list list;
+    double ux, uy, uz;
+
+    list.neighbours = neighbours;
+    list.max_neighbours = max_neighbours;
+    list.n = 0;
+    unit_vector(latitude, longitude, &ux, &uy, &uz);
+    location_index_visit(index, ux, uy, uz, depth, radius, location_list_visit, &list);
+    return list.n;
+}
+
+typedef struct {
+    long self;
+    long long n;
+    int only_after;             // only count locations after self
+} location_count;
+
+static int location_count_visit(void *state, long j, float dist){
+    location_count *count = (location_count *) state;
+
+    (void) dist;
+    if (j != count->self && (!count->only_after || j > count->self)) {
+        count->n += 1;
+    }
+    return 0;
+}
+
+long long location_index_counts(location_index *index, float radius, long long *counts,
+                                int n_threads){
+  /*
+    Purpose: count the neighbours of each location of an index
+    Args:
+      index:       Index from location_index_create
+      radius:      Largest distance of neighbours, as dist_calc, in km
+      counts:      Output of the number of other locations within radius of
+                   each location, n_locs long
+      n_threads:   Number of threads to parallel over
+    Returns:
+      Sum of counts
+  */
+    long long total = 0;
+    long i;
+
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic, 64) reduction(+:total)
+    for (i = 0; i < index->n_locs; ++i){
+        location_count count;
+
+        count.self = i;
+        count.n = 0;
+        count.only_after = 0;
+        location_index_visit(
+            index, index->x[i], index->y[i], index->z[i], index->depths[i], radius,
+            location_count_visit, &count);
+        counts[i] = count.n;
+        total += count.n;
+    }
+    return total;
+}
+
+typedef struct {
+    long long col;
+    float dist;
+} location_pair;
+
+typedef struct {
+    long self;
+    long long n;
+    long long capacity;
+    location_pair *pairs;
+} location_pair_list;
+
+static int location_pair_visit(void *state, long j, float dist){
+    location_pair_list *list = (location_pair_list *) state;
+
+    if (j > list->self && list->n < list->capacity) {
+        list->pairs[list->n].col = j;
+        list->pairs[list->n].dist = dist;
+        list->n += 1;
+    }
+    return 0;
+}
+
+static int location_pair_compare(const void *a, const void *b){
+    long long col_a = ((const location_pair *) a)->col, col_b = ((const location_pair *) b)->col;
+
+    return (col_a > col_b) - (col_a < col_b);
+}
+
+long long location_index_pairs(location_index *index, float radius, long long *row_counts,
+                               long long *rows, long long *cols, float *dists,
+                               int n_threads){
+  /*
+    Purpose: find every pair of locations of an index within radius
+    Args:
+      index:       Index from location_index_create
+      radius:      Largest distance, as dist_calc, in km
+      row_counts:  Number of pairs (i, j > i) for each location i, n_locs
+                   long. Output when rows is NULL, otherwise must be as given
+                   by a call with rows NULL.
+      rows:        NULL to only count pairs, otherwise output of i for each
+                   pair, ordered by i then j
+      cols:        Output of j for each pair
+      dists:       Output of distance in km of each pair
+      n_threads:   Number of threads to parallel over
+    Returns:
+      Number of pairs, or -1 if workspace could not be allocated
+  */
+    long long total = 0, *offsets;
+    long i;
+    int status = 0;
+
+    if (rows == NULL) {
+        #pragma omp parallel for num_threads(n_threads) schedule(dynamic, 64) reduction(+:total)
+        for (i = 0; i < index->n_locs; ++i){
+            location_count count;
+
+            count.self = i;
+            count.n = 0;
+            count.only_after = 1;
+            location_index_visit(
+                index, index->x[i], index->y[i], index->z[i], index->depths[i],
+                radius, location_count_visit, &count);
+            row_counts[i] = count.n;
+            total += count.n;
+        }
+        return total;
+    }
+    offsets = (long long *) malloc(((index->n_locs > 0) ? (size_t) index->n_locs : 1) * sizeof(long long));
+    if (offsets == NULL) {
+        printf("Error allocating pair offsets\n");
+        return -1;
+    }
+    for (i = 0; i < index->n_locs; ++i){
+        offsets[i] = total;
+        total += row_counts[i];
+    }
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic, 64) reduction(+:status)
+    for (i = 0; i < index->n_locs; ++i){
+        location_pair_list list;
+        long long k;
+
+        if (row_counts[i] == 0) {
+            continue;
+        }
+        list.self = i;
+        list.n = 0;
+        list.capacity = row_counts[i];
+        list.pairs = (location_pair *) malloc((size_t) row_counts[i] * sizeof(location_pair));
+        if (list.pairs == NULL) {
+            status -= 1;
+            continue;
+        }
+        location_index_visit(
+            index, index->x[i], index->y[i], index->z[i], index->depths[i], radius,
+            location_pair_visit, &list);
+        qsort(list.pairs, (size_t) list.n, sizeof(location_pair), location_pair_compare);
+        for (k = 0; k < list.n; ++k){
+            rows[offsets[i] + k] = i;
+            cols[offsets[i] + k] = list.pairs[k].col;
+            dists[offsets[i] + k] = list.pairs[k].dist;
+        }
+        free(list.pairs);
+    }
+    free(offsets);
+    if (status < 0) {
+        printf("Error allocating pair workspace\n");
+        return -1;
+    }
+    return total;
+}
+
+long long distance_pairs(float *latitudes, float *longitudes, float *depths,
+                         long n_locs, float cutoff, long long *row_counts,
+                         long long *rows, long long *cols, float *dists,
+                         int n_threads){
+  /*
+    Purpose: find every pair of a set of locations no more than cutoff apart,
+             a sparse alternative to distance_matrix_condensed when only
+             nearby pairs are needed
+    Args:
+      latitudes:   Latitudes in radians
+      longitudes:  Longitudes in radians
+      depths:      Depths in km (positive down)
+      n_locs:      Number of locations
+      cutoff:      Largest distance to keep in km
+      Others as for location_index_pairs
+    Returns:
+      Number of pairs, or -1 if workspace could not be allocated
+  */
+    location_index *index;
+    long long total;
+
+    index = location_index_create(latitudes, longitudes, depths, n_locs, cutoff, n_threads);
+    if (index == NULL) {
+        return -1;
+    }
+    total = location_index_pairs(index, cutoff, row_counts, rows, cols, dists, n_threads);
+    location_index_destroy(index);
+    return total;
+}
+
+long long neighbour_counts(float *latitudes, float *longitudes, float *depths,
+                           long n_locs, float cutoff, long long *counts,
+                           int n_threads){
+  /*
+    Purpose: count the other locations within cutoff of each of a set of
+             locations
+    Args:
+      latitudes:   Latitudes in radians
+      longitudes:  Longitudes in radians
+      depths:      Depths in km (positive down)
+      n_locs:      Number of locations
+      cutoff:      Largest distance of neighbours in km
+      counts:      Output of the number of neighbours of each location
+      n_threads:   Number of threads to parallel over
+    Returns:
+      Sum of counts, or -1 if workspace could not be allocated
+  */
+    location_index *index;
+    long long total;
+
+    index = location_index_create(latitudes, longitudes, depths, n_locs, cutoff, n_threads);
+    if (index == NULL) {
+        return -1;
+    }
+    total = location_index_counts(index, cutoff, counts, n_threads);
+    location_index_destroy(index);
+    return total;
+}
+
+typedef struct {
+    long self;
+    long found;
+    float cutoff;
+} location_neighbour;
+
+static int location_neighbour_visit(void *state, long j, float dist){
+    location_neighbour *neighbour = (location_neighbour *) state;
+
+    if (j != neighbour->self && dist < neighbour->cutoff) {
+        neighbour->found = j;
+        return 1;
+    }
+    return 0;
+}
+
 int remove_unclustered(float *latitudes, float *longitudes, float *depths, long n_locs,
                        unsigned char *mask, float distance_cutoff, int n_threads){
     /* Check whether locations have any other locations within distance_cutoff and return 0 if not and 1 if true.
@@ -104,26 +756,33 @@ int remove_unclustered(float *latitudes, float *longitudes, float *depths, long
     *  :type mask: Array of uint8 which will be filled as bools - should be initialised as zeros
     *  :type distance_cutoff: float, cutoff distance in km
     *  :type n_threads: int Number of threads to parallel over
+    *
+    *  Returns 0 on success, -1 if the location index could not be allocated.
     */
-    int out = 0;
+    location_index *index;
     long i;
 
-    #pragma omp parallel for num_threads(n_threads)
+    index = location_index_create(
+        latitudes, longitudes, depths, n_locs, distance_cutoff, n_threads);
+    if (index == NULL) {
+        return -1;
+    }
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic, 64)
     for (i = 0; i < n_locs; ++i){
-        long j;
-        float dist;
+        location_neighbour neighbour;
+
         if (mask[i] != 0){continue;}
-        for (j = 0; j < n_locs; ++j){
-            dist = dist_calc(
-                latitudes[j], longitudes[j], depths[j],
-                latitudes[i], longitudes[i], depths[i]);
-            if (j != i && dist < distance_cutoff){
-                mask[i] = 1;
-                mask[j] = 1;
-                // No more calculation needs to be done.
-                break;
-            }
+        neighbour.self = i;
+        neighbour.found = -1;
+        neighbour.cutoff = distance_cutoff;
+        location_index_visit(
+            index, index->x[i], index->y[i], index->z[i], index->depths[i],
+            distance_cutoff, location_neighbour_visit, &neighbour);
+        if (neighbour.found >= 0){
+            mask[i] = 1;
+            mask[neighbour.found] = 1;
         }
     }
-    return out;
+    location_index_destroy(index);
+    return 0;
 }
@@ -26,7 +26,8 @@ int decluster_dist_time(float *arr, long *indexes, float *distances,
     // Takes a sorted array, with indexes as the time between events, and the
     // distances as a distance matrix sorted in the same way.
     long i, j, step;
-    int keep, distance_index;
+    int keep;
+    size_t distance_index;
 
     if (fabs(arr[0]) < thresh){return 0;}
 
@@ -39,7 +40,7 @@ int decluster_dist_time(float *arr, long *indexes, float *distances,
             break;
         }
         for (j = 0; j < i; ++j){
-            distance_index = (i * len) + j;
+            distance_index = ((size_t) i * len) + j;
             step = labs(indexes[i] - indexes[j]);
 
             if (trig_int >= step && out[j] == 1 && distances[distance_index] < dist_thresh){
@@ -58,7 +59,8 @@ int decluster_dist_time_ll(float *arr, long long *indexes, float *distances,
     // Takes a sorted array, with indexes as the time between events, and the
     // distances as a distance matrix sorted in the same way.
     long long i, j, step;
-    int keep, distance_index;
+    int keep;
+    size_t distance_index;
 
     if (fabs(arr[0]) < thresh){return 0;}
 
@@ -71,7 +73,7 @@ int decluster_dist_time_ll(float *arr, long long *indexes, float *distances,
             break;
         }
         for (j = 0; j < i; ++j){
-            distance_index = (i * len) + j;
+            distance_index = ((size_t) i * len) + j;
             step = llabs(indexes[i] - indexes[j]);
             if (trig_int >= step && out[j] == 1 && distances[distance_index] < dist_thresh){
                 keep = 0;
@@ -84,35 +86,139 @@ int decluster_dist_time_ll(float *arr, long long *indexes, float *distances,
 }
 
 
+// Kept peaks are held in bins of trig_int + 1 samples, so only the bin of a
+// candidate and its neighbours need checking. Bins are kept in an open-addressed
+// hash table, each with a list of its peaks, so memory scales with the number of
+// peaks rather than their span.
+typedef struct peak_bins {
+    long long *bin;             // bin of each slot
+    long long *head;            // first kept peak in the bin of each slot, -1 if empty
+    unsigned long long mask;    // n_slots - 1
+    int shift;                  // 64 - log2(n_slots)
+    long long width;            // trig_int + 1
+    long long *index;           // index of each kept peak
+    long long *peak;            // position in the sorted peaks of each kept peak
+    long long *next;            // next kept peak in the same bin, -1 at the end
+    long long n_kept;
+} peak_bins;
+
+static int peak_bins_init(peak_bins *bins, long long len, long long trig_int){
+    // Enough slots for len peaks at most half full, -1 if allocation failed
+    unsigned long long n_slots = 2, slot;
+    int bits = 1;
+
+    while (n_slots < 2 * (unsigned long long) len && bits < 62){
+        n_slots <<= 1;
+        bits += 1;
+    }
+    bins->mask = n_slots - 1;
+    bins->shift = 64 - bits;
+    bins->width = (trig_int < LLONG_MAX) ? trig_int + 1 : LLONG_MAX;
+    bins->n_kept = 0;
+    bins->bin = (long long *) malloc((size_t) n_slots * sizeof(long long));
+    bins->head = (long long *) malloc((size_t) n_slots * sizeof(long long));
+    bins->index = (long long *) malloc((size_t) len * sizeof(long long));
+    bins->peak = (long long *) malloc((size_t) len * sizeof(long long));
+    bins->next = (long long *) malloc((size_t) len * sizeof(long long));
+    if (bins->bin == NULL || bins->head == NULL || bins->index == NULL ||
+        bins->peak == NULL || bins->next == NULL){
+        free(bins->bin);
+        free(bins->head);
+        free(bins->index);
+        free(bins->peak);
+        free(bins->next);
+        return -1;
+    }
+    for (slot = 0; slot < n_slots; ++slot){
+        bins->head[slot] = -1;
+    }
+    return 0;
+}
+
+static void peak_bins_free(peak_bins *bins){
+    free(bins->bin);
+    free(bins->head);
+    free(bins->index);
+    free(bins->peak);
+    free(bins->next);
+}
+
+static inline long long peak_bin(const peak_bins *bins, long long index){
+    // Floor division, so that negative indexes bin consistently
+    return (index >= 0) ? index / bins->width : -((-(index + 1)) / bins->width) - 1;
+}
+
+static inline unsigned long long peak_bin_slot(const peak_bins *bins, long long bin){
+    // Slot of a bin, or of the empty slot it would go in (Fibonacci hashing)
+    unsigned long long slot = (((unsigned long long) bin * 11400714819323198485ULL) >> bins->shift) & bins->mask;
+
+    while (bins->head[slot] >= 0 && bins->bin[slot] != bin){
+        slot = (slot + 1) & bins->mask;
+    }
+    return slot;
+}
+
+static inline long long peak_bins_first(const peak_bins *bins, long long bin){
+    // First kept peak in a bin, -1 if none
+    return bins->head[peak_bin_slot(bins, bin)];
+}
+
+static void peak_bins_add(peak_bins *bins, long long index, long long peak){
+    long long bin = peak_bin(bins, index), k = bins->n_kept++;
+    unsigned long long slot = peak_bin_slot(bins, bin);
+
+    bins->bin[slot] = bin;
+    bins->index[k] = index;
+    bins->peak[k] = peak;
+    bins->next[k] = bins->head[slot];
+    bins->head[slot] = k;
+}
+
+static int peak_bins_near(const peak_bins *bins, long long index, long long trig_int){
+    // 1 if a kept peak is within trig_int of index
+    long long bin = peak_bin(bins, index), b, k;
+
+    for (b = bin - 1; b <= bin + 1; ++b){
+        for (k = peak_bins_first(bins, b); k >= 0; k = bins->next[k]){
+            if (llabs(index - bins->index[k]) <= trig_int){return 1;}
+        }
+    }
+    return 0;
+}
+
 // Functions for long longs
 int decluster_ll(float *arr, long long *indexes, long long len,
                  float thresh, long long trig_int, unsigned int *out){
-    // Takes a sorted array and the indexes
-    long long i, j, step;
-    int keep;
+    // Takes a sorted array and the indexes. Peaks are kept, highest first, if
+    // no peak already kept is within trig_int. Returns -1 if memory for the
+    // kept peaks could not be allocated.
+    long long i;
+    peak_bins bins;
 
-    if (fabs(arr[0]) < thresh){return 0;}
+    if (len < 1 || fabs(arr[0]) < thresh){return 0;}
+    if (trig_int < 0){
+        // Nothing is close enough to remove
+        for (i = 0; i < len && fabs(arr[i]) >= thresh; ++i){out[i] = 1;}
+        return 0;
+    }
+    if (peak_bins_init(&bins, len, trig_int) != 0){return -1;}
 
     // Take first (highest) peak
     out[0] = 1;
+    peak_bins_add(&bins, indexes[0], 0);
     for (i = 1; i < len; ++i){
-        keep = 1;
         // Threshold is for absolute values
         if (fabs(arr[i]) < thresh){
             break;
         }
-        for (j = 0; j < i; ++j){
-            step = llabs(indexes[i] - indexes[j]);
-            if (trig_int >= step && out[j] == 1){
-                keep = 0;
-                break;
-            }
-        }
-        if (keep == 1){
+        if (peak_bins_near(&bins, indexes[i], trig_int)){
+            out[i] = 0;
+        } else {
             out[i] = 1;
-         }
-        else {out[i] = 0;}
+            peak_bins_add(&bins, indexes[i], i);
+        }
     }
+    peak_bins_free(&bins);
     return 0;
 }
 
@@ -128,7 +234,7 @@ int multi_decluster_ll(float *arr, long long *indices,
         start_ind += lengths[i];
     }
 
-    #pragma omp parallel for num_threads(threads)
+    #pragma omp parallel for num_threads(threads) reduction(+:ret_val) schedule(dynamic)
     for (i = 0; i < n; ++i){
         ret_val += decluster_ll(
             &arr[start_inds[i]], &indices[start_inds[i]], lengths[i], thresholds[i],
@@ -142,32 +248,33 @@ int multi_decluster_ll(float *arr, long long *indices,
 // Functions for longs - should be the same logic as above
 int decluster(float *arr, long *indexes, long len,
               float thresh, long trig_int, unsigned int *out){
-    // Takes a sorted array and the indexes
-    long i, j, step;
-    int keep;
+    // Takes a sorted array and the indexes, as decluster_ll
+    long i;
+    peak_bins bins;
 
-    if (fabs(arr[0]) < thresh){return 0;}
+    if (len < 1 || fabs(arr[0]) < thresh){return 0;}
+    if (trig_int < 0){
+        for (i = 0; i < len && fabs(arr[i]) >= thresh; ++i){out[i] = 1;}
+        return 0;
+    }
+    if (peak_bins_init(&bins, len, trig_int) != 0){return -1;}
 
     // Take first (highest) peak
     out[0] = 1;
+    peak_bins_add(&bins, indexes[0], 0);
     for (i = 1; i < len; ++i){
-        keep = 1;
         // Threshold is for absolute values
         if (fabs(arr[i]) < thresh){
             break;
         }
-        for (j = 0; j < i; ++j){
-            step = labs(indexes[i] - indexes[j]);
-            if (trig_int >= step && out[j] == 1){
-                keep = 0;
-                break;
-            }
-        }
-        if (keep == 1){
+        if (peak_bins_near(&bins, indexes[i], trig_int)){
+            out[i] = 0;
+        } else {
             out[i] = 1;
-         }
-        else {out[i] = 0;}
+            peak_bins_add(&bins, indexes[i], i);
+        }
     }
+    peak_bins_free(&bins);
     return 0;
 }
 
@@ -183,7 +290,7 @@ int multi_decluster(float *arr, long *indices,
         start_ind += lengths[i];
     }
 
-    #pragma omp parallel for num_threads(threads)
+    #pragma omp parallel for num_threads(threads) reduction(+:ret_val) schedule(dynamic)
     for (i = 0; i < n; ++i){
         ret_val += decluster(
             &arr[start_inds[i]], &indices[start_inds[i]], lengths[i], thresholds[i],
@@ -194,6 +301,77 @@ int multi_decluster(float *arr, long *indices,
 }
 
 
+int decluster_dist_time_ids(float *arr, long long *indexes, long long *template_ids,
+                            float *latitudes, float *longitudes, float *depths,
+                            long long len, float thresh, long long trig_int,
+                            float dist_thresh, unsigned int *out){
+  /*
+    Purpose: decluster peaks in time and distance, as decluster_dist_time,
+             without a distance matrix between every pair of peaks
+    Args:
+      arr:          Peaks, sorted by decreasing absolute value
+      indexes:      Index (time) of each peak
+      template_ids: Template (location) of each peak, indexes latitudes,
+                    longitudes and depths
+      latitudes:    Latitude of each template in radians
+      longitudes:   Longitude of each template in radians
+      depths:       Depth of each template in km (positive down)
+      len:          Number of peaks
+      thresh:       Minimum absolute value of peaks to keep
+      trig_int:     Peaks within this of a kept peak in time, and within
+                    dist_thresh of it in space, are removed
+      dist_thresh:  Distance in km
+      out:          Output, 1 for peaks kept
+    Returns:
+      0 on success, -1 if memory for the kept peaks could not be allocated
+    Notes:
+      Only kept peaks within trig_int in time are compared in distance, so
+      memory is linear in the number of peaks.
+  */
+    long long i, b, k;
+    peak_bins bins;
+
+    if (len < 1 || fabs(arr[0]) < thresh){return 0;}
+    if (trig_int < 0){
+        for (i = 0; i < len && fabs(arr[i]) >= thresh; ++i){out[i] = 1;}
+        return 0;
+    }
+    if (peak_bins_init(&bins, len, trig_int) != 0){return -1;}
+
+    // Take first (highest) peak
+    out[0] = 1;
+    peak_bins_add(&bins, indexes[0], 0);
+    for (i = 1; i < len; ++i){
+        long long bin = peak_bin(&bins, indexes[i]), t = template_ids[i];
+        int keep = 1;
+
+        // Threshold is for absolute values
+        if (fabs(arr[i]) < thresh){
+            break;
+        }
+        for (b = bin - 1; b <= bin + 1 && keep; ++b){
+            for (k = peak_bins_first(&bins, b); k >= 0; k = bins.next[k]){
+                long long kt = template_ids[bins.peak[k]];
+
+                if (llabs(indexes[i] - bins.index[k]) <= trig_int &&
+                    ((kt == t) ? 0.0f : dist_calc(
+                        latitudes[t], longitudes[t], depths[t],
+                        latitudes[kt], longitudes[kt], depths[kt])) < dist_thresh){
+                    keep = 0;
+                    break;
+                }
+            }
+        }
+        out[i] = keep;
+        if (keep){
+            peak_bins_add(&bins, indexes[i], i);
+        }
+    }
+    peak_bins_free(&bins);
+    return 0;
+}
+
+
 int find_peaks(float *arr, long len, float thresh, unsigned int *peak_positions){
     // Find peaks in noisy data above some threshold and at-least
     // trig-int samples apart. Sets all other values in array to 0
@@ -241,4 +419,484 @@ int multi_find_peaks(float *arr, long len, int n, float *thresholds, int threads
 
     free(start_inds);
     return ret_val;
-}
\ No newline at end of file
+}
+
+long long multi_find_peaks_packed(
+    float *arr, long long len, int n, float *thresholds, int threads,
+    long long *indexes, float *values, long long capacity, long long *n_peaks){
+  /*
+    Purpose: find peaks, as find_peaks, in each of n arrays, writing only the
+             positions and values of peaks. Arrays are split into segments
+             of FIND_PEAKS_SEGMENT so that threads are used when there are
+             fewer arrays than threads.
+    Args:
+      arr:          n arrays of len, one after the other
+      len:          Length of each array
+      n:            Number of arrays
+      thresholds:   Threshold of each array
+      threads:      Number of threads to use
+      indexes:      Output of the position in its array of each peak, peaks
+                    of the first array then the second and so on
+      values:       Output of the value of each peak, or NULL
+      capacity:     Length of indexes and values, nothing is written to
+                    either if there are more peaks than this
+      n_peaks:      Output of the number of peaks in each array, n long
+    Returns:
+      Number of peaks, which may be more than capacity, or -1 if workspace
+      could not be allocated.
+  */
+    long long n_segments = (len + FIND_PEAKS_SEGMENT - 1) / FIND_PEAKS_SEGMENT, total = 0;
+    long long *offsets;
+    long t, n_tasks = (long) (n * n_segments);
+    int i;
+
+    for (i = 0; i < n; ++i){
+        n_peaks[i] = 0;
+    }
+    if (len < 1 || n < 1) {
+        return 0;
+    }
+    offsets = (long long *) malloc((size_t) n_tasks * sizeof(long long));
+    if (offsets == NULL) {
+        printf("Error allocating peak offsets\n");
+        return -1;
+    }
+    // Count, then write each segment from its offset
+    #pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (t = 0; t < n_tasks; ++t){
+        long long a = t / n_segments, start = (t % n_segments) * FIND_PEAKS_SEGMENT;
+        long long end = (start + FIND_PEAKS_SEGMENT < len) ? start + FIND_PEAKS_SEGMENT : len;
+
+        offsets[t] = find_peaks_span(&arr[a * len], len, start, end, thresholds[a], NULL);
+    }
+    for (t = 0; t < n_tasks; ++t){
+        long long count = offsets[t];
+        n_peaks[t / n_segments] += count;
+        offsets[t] = total;
+        total += count;
+    }
+    if (total <= capacity) {
+        #pragma omp parallel for num_threads(threads) schedule(dynamic)
+        for (t = 0; t < n_tasks; ++t){
+            long long a = t / n_segments, start = (t % n_segments) * FIND_PEAKS_SEGMENT;
+            long long end = (start + FIND_PEAKS_SEGMENT < len) ? start + FIND_PEAKS_SEGMENT : len;
+            long long k, count;
+
+            count = find_peaks_span(
+                &arr[a * len], len, start, end, thresholds[a], &indexes[offsets[t]]);
+            if (values != NULL) {
+                for (k = offsets[t]; k < offsets[t] + count; ++k){
+                    values[k] = arr[a * len + indexes[k]];
+                }
+            }
+        }
+    }
+    free(offsets);
+    return total;
+}
+
+long long find_peaks_packed(
+    float *arr, long long len, float thresh, int threads, long long *indexes,
+    float *values, long long capacity){
+  /*
+    Purpose: find peaks, as find_peaks, in one array, writing only the
+             positions and values of peaks. The array is split into segments
+             across threads.
+    Args:
+      As multi_find_peaks_packed for a single array
+    Returns:
+      Number of peaks, which may be more than capacity, or -1 if workspace
+      could not be allocated.
+  */
+    long long n_peaks;
+
+    return multi_find_peaks_packed(
+        arr, len, 1, &thresh, threads, indexes, values, capacity, &n_peaks);
+}
+
+// Peaks of correlograms that are only ever seen a section at a time
+static inline int peak_hist_bin(float value){
+    // Bin of |value| - the exponent and top seven bits of the mantissa
+    unsigned int bits;
+    long bin;
+
+    value = fabsf(value);
+    memcpy(&bits, &value, sizeof(bits));
+    bin = (long) (bits >> 16) - PEAK_HIST_OFFSET;
+    if (bin < 0){return 0;}
+    if (bin >= PEAK_HIST_BINS){return PEAK_HIST_BINS - 1;}
+    return (int) bin;
+}
+
+static inline float peak_hist_edge(long bin){
+    // Lower edge of a bin, the first bin also holds everything below 2^-16
+    unsigned int bits = (unsigned int) (bin + PEAK_HIST_OFFSET) << 16;
+    float edge;
+
+    if (bin <= 0){return 0.0f;}
+    memcpy(&edge, &bits, sizeof(edge));
+    return edge;
+}
+
+static float peak_hist_median(const unsigned int *histogram, long n){
+    // Median of the values in a histogram, interpolated within its bin
+    double rank = 0.5 * (double) (n - 1), below = 0.0, frac;
+    long bin;
+
+    if (n < 1){return 0.0f;}
+    for (bin = 0; bin < PEAK_HIST_BINS; ++bin){
+        if (below + histogram[bin] > rank){
+            frac = (rank - below + 0.5) / histogram[bin];
+            return (float) (peak_hist_edge(bin) +
+                            frac * (peak_hist_edge(bin + 1) - peak_hist_edge(bin)));
+        }
+        below += histogram[bin];
+    }
+    return peak_hist_edge(PEAK_HIST_BINS);
+}
+
+static int ncc_peaks_add(ncc_peaks *peaks, long t, long index, float value){
+    long n = peaks->n_peaks[t];
+
+    if (n == peaks->capacity[t]){
+        long capacity = (n < 16) ? 16 : 2 * n;
+        long *new_index = (long *) realloc(peaks->index[t], (size_t) capacity * sizeof(long));
+        float *new_value;
+
+        if (new_index == NULL){return -1;}
+        peaks->index[t] = new_index;
+        new_value = (float *) realloc(peaks->value[t], (size_t) capacity * sizeof(float));
+        if (new_value == NULL){return -1;}
+        peaks->value[t] = new_value;
+        peaks->capacity[t] = capacity;
+    }
+    peaks->index[t][n] = index;
+    peaks->value[t][n] = value;
+    peaks->n_peaks[t] = n + 1;
+    return 0;
+}
+
+static inline int ncc_peaks_test(ncc_peaks *peaks, long t, float next_value){
+    // The find_peaks test for the last sample seen
+    float value = peaks->last[t], prev_value = peaks->prev[t];
+
+    if (fabs(value) > peaks->floor[t] &&
+        (next_value - value) * (prev_value - value) > 0){
+        return ncc_peaks_add(peaks, t, peaks->n_seen[t] - 1, value);
+    }
+    return 0;
+}
+
+ncc_peaks *ncc_peaks_create(long n_templates, float *thresholds, int threshold_type){
+  /*
+    Purpose: set up peak finding for correlograms that are only seen a section
+             of time at a time (see multi_normxcorr_fftw_peaks)
+    Args:
+      n_templates:    Number of correlograms
+      thresholds:     For PEAK_THRESHOLD_ABSOLUTE the threshold for each
+                      correlogram, for PEAK_THRESHOLD_MAD the multiplier of the
+                      median absolute value of each correlogram - copied
+      threshold_type: PEAK_THRESHOLD_ABSOLUTE or PEAK_THRESHOLD_MAD
+    Returns:
+      Pointer to the peaks, or NULL if allocation failed. Free with
+      ncc_peaks_destroy.
+    Notes:
+      The MAD is estimated from a histogram of PEAK_HIST_BINS per correlogram,
+      so is accurate to a small fraction of a percent. Because it is not known
+      until every sample has been seen, candidate peaks are kept above
+      PEAK_FLOOR_FRACTION of the lowest running threshold. The floor is only
+      lowered, so earlier sections were filtered with higher floors: peaks
+      are incomplete if the final threshold is below the highest of these.
+  */
+    long t;
+    ncc_peaks *peaks;
+
+    if (threshold_type != PEAK_THRESHOLD_ABSOLUTE && threshold_type != PEAK_THRESHOLD_MAD){
+        printf("ERROR: threshold_type %i is not supported\n", threshold_type);
+        return NULL;
+    }
+    peaks = (ncc_peaks *) calloc(1, sizeof(ncc_peaks));
+    if (peaks == NULL){
+        printf("Error allocating peaks\n");
+        return NULL;
+    }
+    peaks->n_templates = n_templates;
+    peaks->threshold_type = threshold_type;
+    peaks->thresholds = (float *) malloc((size_t) n_templates * sizeof(float));
+    peaks->floor = (float *) malloc((size_t) n_templates * sizeof(float));
+    peaks->max_floor = (float *) malloc((size_t) n_templates * sizeof(float));
+    peaks->prev = (float *) calloc(n_templates, sizeof(float));
+    peaks->last = (float *) calloc(n_templates, sizeof(float));
+    peaks->n_seen = (long *) calloc(n_templates, sizeof(long));
+    peaks->n_peaks = (long *) calloc(n_templates, sizeof(long));
+    peaks->capacity = (long *) calloc(n_templates, sizeof(long));
+    peaks->index = (long **) calloc(n_templates, sizeof(long*));
+    peaks->value = (float **) calloc(n_templates, sizeof(float*));
+    peaks->incomplete = (int *) calloc(n_templates, sizeof(int));
+    if (threshold_type == PEAK_THRESHOLD_MAD){
+        peaks->histogram = (unsigned int *) calloc(
+            (size_t) n_templates * PEAK_HIST_BINS, sizeof(unsigned int));
+    }
+    if (peaks->thresholds == NULL || peaks->floor == NULL || peaks->max_floor == NULL ||
+        peaks->prev == NULL ||
+        peaks->last == NULL || peaks->n_seen == NULL || peaks->n_peaks == NULL ||
+        peaks->capacity == NULL || peaks->index == NULL || peaks->value == NULL ||
+        peaks->incomplete == NULL ||
+        (threshold_type == PEAK_THRESHOLD_MAD && peaks->histogram == NULL)){
+        printf("Error allocating peaks\n");
+        ncc_peaks_destroy(peaks);
+        return NULL;
+    }
+    for (t = 0; t < n_templates; ++t){
+        peaks->thresholds[t] = thresholds[t];
+        peaks->floor[t] = (threshold_type == PEAK_THRESHOLD_MAD) ? INFINITY : thresholds[t];
+        peaks->max_floor[t] = (threshold_type == PEAK_THRESHOLD_MAD) ? 0.0f : thresholds[t];
+    }
+    return peaks;
+}
+
+int ncc_peaks_update(ncc_peaks *peaks, long first_template, long n_templates,
+                     const float *ncc, long len, int threads){
+  /*
+    Purpose: find candidate peaks in the next section of correlograms
+    Args:
+      peaks:          From ncc_peaks_create
+      first_template: First correlogram in ncc
+      n_templates:    Number of correlograms in ncc
+      ncc:            Next len samples of each correlogram (n_templates x len)
+      len:            Number of samples
+      threads:        Number of threads to parallel correlograms over
+    Returns:
+      0 on success, -1 if memory for candidates could not be allocated
+  */
+    long t;
+    int ret_val = 0;
+
+    if (peaks->finished){
+        printf("ERROR: peaks have already been finished\n");
+        return -1;
+    }
+    #pragma omp parallel for num_threads(threads) reduction(+:ret_val)
+    for (t = first_template; t < first_template + n_templates; ++t){
+        const float *arr = &ncc[(size_t) (t - first_template) * len];
+        long i;
+
+        if (peaks->histogram != NULL){
+            unsigned int *histogram = &peaks->histogram[(size_t) t * PEAK_HIST_BINS];
+            float running;
+
+            for (i = 0; i < len; ++i){
+                histogram[peak_hist_bin(arr[i])] += 1;
+            }
+            running = peaks->thresholds[t] * peak_hist_median(histogram, peaks->n_seen[t] + len);
+            if (PEAK_FLOOR_FRACTION * running < peaks->floor[t]){
+                peaks->floor[t] = PEAK_FLOOR_FRACTION * running;
+            }
+            if (peaks->floor[t] > peaks->max_floor[t]){
+                peaks->max_floor[t] = peaks->floor[t];
+            }
+        }
+        for (i = 0; i < len; ++i){
+            if (peaks->n_seen[t] > 0 && ret_val == 0){
+                ret_val += ncc_peaks_test(peaks, t, arr[i]);
+            }
+            peaks->prev[t] = peaks->last[t];
+            peaks->last[t] = arr[i];
+            peaks->n_seen[t] += 1;
+        }
+    }
+    if (ret_val != 0){
+        printf("Error allocating candidate peaks\n");
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct peak_candidate {
+    long index;
+    float value;
+} peak_candidate;
+
+static int compare_peak_values(const void *a, const void *b){
+    // Descending absolute value, later peaks first for equal values
+    const peak_candidate *pa = (const peak_candidate *) a, *pb = (const peak_candidate *) b;
+    float va = fabsf(pa->value), vb = fabsf(pb->value);
+
+    if (va != vb){return (va < vb) ? 1 : -1;}
+    return (pa->index < pb->index) ? 1 : (pa->index > pb->index) ? -1 : 0;
+}
+
+static int compare_peak_indexes(const void *a, const void *b){
+    const peak_candidate *pa = (const peak_candidate *) a, *pb = (const peak_candidate *) b;
+
+    return (pa->index > pb->index) - (pa->index < pb->index);
+}
+
+static int ncc_peaks_decluster(ncc_peaks *peaks, long t, long trig_int){
+    // Decluster the peaks of one correlogram, keeping them in time order
+    long i, n = peaks->n_peaks[t], n_kept = 0;
+    peak_candidate *sorted = (peak_candidate *) malloc((size_t) n * sizeof(peak_candidate));
+    float *arr = (float *) malloc((size_t) n * sizeof(float));
+    long *indexes = (long *) malloc((size_t) n * sizeof(long));
+    unsigned int *out = (unsigned int *) calloc(n, sizeof(unsigned int));
+
+    if (sorted == NULL || arr == NULL || indexes == NULL || out == NULL){
+        free(sorted);
+        free(arr);
+        free(indexes);
+        free(out);
+        return -1;
+    }
+    for (i = 0; i < n; ++i){
+        sorted[i].index = peaks->index[t][i];
+        sorted[i].value = peaks->value[t][i];
+    }
+    qsort(sorted, n, sizeof(peak_candidate), compare_peak_values);
+    for (i = 0; i < n; ++i){
+        arr[i] = sorted[i].value;
+        indexes[i] = sorted[i].index;
+    }
+    if (decluster(arr, indexes, n, peaks->thresholds[t], trig_int, out) != 0){
+        free(sorted);
+        free(arr);
+        free(indexes);
+        free(out);
+        return -1;
+    }
+    for (i = 0; i < n; ++i){
+        if (out[i] == 1){
+            sorted[n_kept++] = sorted[i];
+        }
+    }
+    qsort(sorted, n_kept, sizeof(peak_candidate), compare_peak_indexes);
+    for (i = 0; i < n_kept; ++i){
+        peaks->index[t][i] = sorted[i].index;
+        peaks->value[t][i] = sorted[i].value;
+    }
+    peaks->n_peaks[t] = n_kept;
+    free(sorted);
+    free(arr);
+    free(indexes);
+    free(out);
+    return 0;
+}
+
+int ncc_peaks_finish(ncc_peaks *peaks, long trig_int, int threads){
+  /*
+    Purpose: find the peaks above the final thresholds once every section of
+             the correlograms has been seen
+    Args:
+      peaks:      From ncc_peaks_create
+      trig_int:   Peaks within this many samples of a higher peak are removed
+                  (as for decluster), negative to keep every peak
+      threads:    Number of threads to parallel correlograms over
+    Returns:
+      0 on success, -1 if memory could not be allocated
+  */
+    long t;
+    int ret_val = 0;
+
+    if (peaks->finished){
+        return 0;
+    }
+    #pragma omp parallel for num_threads(threads) reduction(+:ret_val)
+    for (t = 0; t < peaks->n_templates; ++t){
+        long i, n_kept = 0;
+        float thresh;
+
+        // Do separately for the last value
+        if (peaks->n_seen[t] > 0){
+            ret_val += ncc_peaks_test(peaks, t, 0);
+        }
+        if (peaks->histogram != NULL){
+            peaks->thresholds[t] *= peak_hist_median(
+                &peaks->histogram[(size_t) t * PEAK_HIST_BINS], peaks->n_seen[t]);
+            peaks->incomplete[t] = (peaks->thresholds[t] < peaks->max_floor[t]);
+        }
+        thresh = peaks->thresholds[t];
+        for (i = 0; i < peaks->n_peaks[t]; ++i){
+            if (fabs(peaks->value[t][i]) > thresh){
+                peaks->index[t][n_kept] = peaks->index[t][i];
+                peaks->value[t][n_kept] = peaks->value[t][i];
+                n_kept += 1;
+            }
+        }
+        peaks->n_peaks[t] = n_kept;
+        if (trig_int >= 0 && n_kept > 1){
+            ret_val += ncc_peaks_decluster(peaks, t, trig_int);
+        }
+    }
+    peaks->finished = 1;
+    if (ret_val != 0){
+        printf("Error allocating peaks\n");
+        return -1;
+    }
+    return 0;
+}
+
+int ncc_peaks_counts(ncc_peaks *peaks, long *n_peaks, float *thresholds, int *incomplete){
+  /*
+    Purpose: get the number of peaks of each correlogram once finished
+    Args:
+      peaks:      From ncc_peaks_finish
+      n_peaks:    Output, number of peaks of each correlogram
+      thresholds: Output, threshold used for each correlogram
+      incomplete: Output, 1 where the final MAD threshold is below the highest
+                  level candidates were kept above so peaks may be missing
+  */
+    if (!peaks->finished){
+        printf("ERROR: peaks have not been finished\n");
+        return -1;
+    }
+    memcpy(n_peaks, peaks->n_peaks, (size_t) peaks->n_templates * sizeof(long));
+    memcpy(thresholds, peaks->thresholds, (size_t) peaks->n_templates * sizeof(float));
+    memcpy(incomplete, peaks->incomplete, (size_t) peaks->n_templates * sizeof(int));
+    return 0;
+}
+
+int ncc_peaks_copy(ncc_peaks *peaks, long *index, float *value){
+  /*
+    Purpose: copy the peaks of every correlogram, in time order, one
+             correlogram after another (see ncc_peaks_counts for the lengths)
+  */
+    long t;
+    size_t start = 0;
+
+    if (!peaks->finished){
+        printf("ERROR: peaks have not been finished\n");
+        return -1;
+    }
+    for (t = 0; t < peaks->n_templates; ++t){
+        if (peaks->n_peaks[t] > 0){
+            memcpy(&index[start], peaks->index[t], (size_t) peaks->n_peaks[t] * sizeof(long));
+            memcpy(&value[start], peaks->value[t], (size_t) peaks->n_peaks[t] * sizeof(float));
+        }
+        start += peaks->n_peaks[t];
+    }
+    return 0;
+}
+
+void ncc_peaks_destroy(ncc_peaks *peaks){
+    long t;
+
+    if (peaks == NULL){
+        return;
+    }
+    for (t = 0; t < peaks->n_templates; ++t){
+        if (peaks->index != NULL){free(peaks->index[t]);}
+        if (peaks->value != NULL){free(peaks->value[t]);}
+    }
+    free(peaks->thresholds);
+    free(peaks->floor);
+    free(peaks->max_floor);
+    free(peaks->prev);
+    free(peaks->last);
+    free(peaks->n_seen);
+    free(peaks->histogram);
+    free(peaks->n_peaks);
+    free(peaks->capacity);
+    free(peaks->index);
+    free(peaks->value);
+    free(peaks->incomplete);
+    free(peaks);
+}
@@ -21,6 +21,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <time.h>
 #if (defined(_MSC_VER))
     #include <float.h>
     #define isnanf(x) _isnan(x)
@@ -49,6 +51,179 @@
 #define ACCEPTED_DIFF 1e-10 //1e-15
 // Define difference to warn user on
 #define WARN_DIFF 1e-8 //1e-10
+// FFTW planner rigour, see fftw_planner_flags
+#define PLANNER_ESTIMATE 0
+#define PLANNER_MEASURE 1
+#define PLANNER_PATIENT 2
+#define PLANNER_EXHAUSTIVE 3
+// Block sizes (samples x templates) for normalising correlations
+#ifndef NORM_BLOCK_SAMPLES
+    #define NORM_BLOCK_SAMPLES 512
+#endif
+#ifndef NORM_BLOCK_TEMPLATES
+    #define NORM_BLOCK_TEMPLATES 16
+#endif
+// Flags for the moments of correlation windows, see sliding_moments_range
+#define MOMENT_VALID 1          // correlations can be normalised
+#define MOMENT_LOW_VARIANCE 2   // variance is below WARN_DIFF
+// Windows per block when computing moments in parallel
+#ifndef MOMENT_BLOCK
+    #define MOMENT_BLOCK 4096
+#endif
+// Internal stack_option: stack into an ncc that only the calling thread writes to
+#define STACK_PRIVATE 2
+// Tiles (lags x templates) for time-domain correlations, and the number of templates
+// held in registers by the time-domain kernels
+#ifndef TIME_BLOCK_LAGS
+    #define TIME_BLOCK_LAGS 1024
+#endif
+#ifndef TIME_BLOCK_TEMPLATES
+    #define TIME_BLOCK_TEMPLATES 16
+#endif
+#define TIME_BLOCK_REGISTERS 4
+// Jobs of normxcorr_batch, each a row of BATCH_JOB_FIELDS offsets and lengths
+#define BATCH_JOB_FIELDS 4
+#define BATCH_TEMPLATE 0        // first sample of the template in templates
+#define BATCH_TEMPLATE_LEN 1
+#define BATCH_WINDOW 2          // first sample of the window in windows
+#define BATCH_WINDOW_LEN 3      // window_len - template_len + 1 lags are correlated
+// Methods of normxcorr_batch
+#define BATCH_AUTO 0
+#define BATCH_TIME 1
+#define BATCH_FFT 2
+// Jobs transformed together by normxcorr_batch, and the ratio of time-domain cost
+// (template_len x lags) to FFT cost (fft_len x log2(fft_len)) below which jobs
+// are correlated in the time-domain
+#ifndef BATCH_FFT_JOBS
+    #define BATCH_FFT_JOBS 16
+#endif
+#ifndef BATCH_TIME_RATIO
+    #define BATCH_TIME_RATIO 4
+#endif
+// Instruction sets for the simd kernels, see get_simd_level
+#define SIMD_SCALAR 0
+#define SIMD_AVX2 1
+#define SIMD_AVX512 2
+#define SIMD_NEON 3
+// Output formats for correlations, see multi_normxcorr_fftw
+#define NCC_FLOAT32 0
+#define NCC_FLOAT16 1
+#define NCC_INT16 2
+#define NCC_INT16_SCALE 32767.0f
+// Sample types of images given as pointers to each channel (image_channels)
+#define IMAGE_FLOAT32 0
+#define IMAGE_INT32 1
+#define IMAGE_FLOAT64 2
+// Threshold types for ncc_peaks
+#define PEAK_THRESHOLD_ABSOLUTE 0
+#define PEAK_THRESHOLD_MAD 1
+// Histogram of |cccsum| for the streaming MAD, 128 bins per octave from 2^-16 to 2^16
+#define PEAK_HIST_BINS 4096
+#define PEAK_HIST_OFFSET ((127 - 16) << 7)
+// MAD candidates are kept above this fraction of the running threshold
+#ifndef PEAK_FLOOR_FRACTION
+    #define PEAK_FLOOR_FRACTION 0.5f
+#endif
+// Warnings of correlation calls, see correlation_stats
+#define CORR_WARN_OUTER_DISABLED 1  // outer threading is unsafe here, threads moved inside
+#define CORR_WARN_OVERSUBSCRIBED 2  // more threads than cores were requested
+#define CORR_WARN_UNKNOWN_PLANNER 4 // planner is not a PLANNER_*, FFTW_ESTIMATE was used
+#define CORR_WARN_MEMORY_LIMIT 8    // memory_limit is too small for one template
+// Samples of an array searched by each thread in multi_find_peaks_packed
+#ifndef FIND_PEAKS_SEGMENT
+    #define FIND_PEAKS_SEGMENT 65536
+#endif
+// Output formats for condensed distance matrices, see distance_matrix_condensed
+#define DIST_FLOAT32 0
+#define DIST_FLOAT16 1
+// Locations paired with each location per pass of the distance engine
+#ifndef DIST_BLOCK
+    #define DIST_BLOCK 1024
+#endif
+// Smallest grid cell of a location_index in km, keeps cell coordinates in an int
+#define DIST_MIN_CELL 1e-3
+
+static inline unsigned short float_to_half(float value){
+    /* IEEE half of a float, rounding to nearest even */
+    unsigned int bits, sign, exponent, mantissa, shift, rem, halfway;
+    unsigned short half;
+
+    memcpy(&bits, &value, sizeof(bits));
+    sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+    if (bits >= 0x7f800000) {
+        // inf and NaN
+        return (unsigned short) (sign | 0x7c00 | ((bits > 0x7f800000) ? 0x200 : 0));
+    }
+    if (bits >= 0x477ff000) {
+        // rounds to more than 65504
+        return (unsigned short) (sign | 0x7c00);
+    }
+    if (bits < 0x33000000) {
+        // rounds to zero
+        return (unsigned short) sign;
+    }
+    exponent = bits >> 23;
+    if (exponent < 113) {
+        // subnormal half
+        mantissa = (bits & 0x7fffff) | 0x800000;
+        shift = 126 - exponent;
+        half = (unsigned short) (mantissa >> shift);
+        rem = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        half = (unsigned short) (((exponent - 112) << 10) | ((bits & 0x7fffff) >> 13));
+        rem = bits & 0x1fff;
+        halfway = 0x1000;
+    }
+    if (rem > halfway || (rem == halfway && (half & 1))) {
+        half += 1;
+    }
+    return (unsigned short) (sign | half);
+}
+
+// distance_cluster functions
+float dist_calc(float, float, float, float, float, float);
+
+int distance_matrix(float*, float*, float*, long, float*, int);
+
+int distance_matrix_condensed(float*, float*, float*, long, void*, int, int);
+
+long long distance_pairs(float*, float*, float*, long, float, long long*,
+                         long long*, long long*, float*, int);
+
+int remove_unclustered(float*, float*, float*, long, unsigned char*, float, int);
+
+long long neighbour_counts(float*, float*, float*, long, float, long long*, int);
+
+// Uniform grid of locations for neighbour searches - treat as opaque and only use
+// through the location_index_* functions.
+typedef struct location_index {
+    long n_locs;
+    long n_cells;
+    double cell;                // width of grid cells in km
+    double scale;               // earth-centred separations are at most scale x distance
+    double *x, *y, *z;          // n_locs, unit vectors of locations
+    double *ex, *ey, *ez;       // n_locs, earth-centred positions in km, including depth
+    float *depths;              // n_locs
+    long *order;                // n_locs, locations ordered by cell
+    long *cell_start;           // n_cells + 1, start of each cell in order
+    int *cell_coords;           // n_cells x 3
+    long *slots;                // cell of each hash slot, -1 if empty
+    unsigned long long mask;    // number of slots - 1
+    int shift;
+} location_index;
+
+location_index *location_index_create(float*, float*, float*, long, float, int);
+
+long location_index_query(location_index*, float, float, float, float, long*, long);
+
+long long location_index_counts(location_index*, float, long long*, int);
+
+long long location_index_pairs(location_index*, float, long long*, long long*,
+                               long long*, float*, int);
+
+void location_index_destroy(location_index*);
 
 // find_peaks functions
 int decluster_dist_time_ll(float*, long long*, float*, long long, float,
@@ -56,6 +231,9 @@ int decluster_dist_time_ll(float*, long long*, float*, long long, float,
 
 int decluster_dist_time(float*, long*, float*, long, float, long, float, unsigned int*);
 
+int decluster_dist_time_ids(float*, long long*, long long*, float*, float*, float*,
+                            long long, float, long long, float, unsigned int*);
+
 int decluster_ll(float*, long long*, long long, float, long long, unsigned int*);
 
 int multi_decluster_ll(float*, long long*, long long*, int, float*, long long, unsigned int*, int);
@@ -68,19 +246,194 @@ int findpeaks(float*, long, float, unsigned int*);
 
 int multi_find_peaks(float*, long, int, float*, int, unsigned int*);
 
+long long find_peaks_packed(float*, long long, float, int, long long*, float*, long long);
+
+long long multi_find_peaks_packed(float*, long long, int, float*, int, long long*, float*,
+                                  long long, long long*);
+
+// Peaks of correlograms seen a section of time at a time - treat as opaque and only
+// use through the ncc_peaks_* functions.
+typedef struct ncc_peaks {
+    long n_templates;
+    int threshold_type;         // PEAK_THRESHOLD_ABSOLUTE or PEAK_THRESHOLD_MAD
+    int finished;
+    float *thresholds;          // n_templates, absolute thresholds (MAD multipliers until finished)
+    float *floor;               // n_templates, candidates are kept above this
+    float *max_floor;           // n_templates, highest floor candidates were kept above
+    float *prev;                // n_templates, sample before last
+    float *last;                // n_templates, last sample seen
+    long *n_seen;               // n_templates, samples seen
+    unsigned int *histogram;    // n_templates x PEAK_HIST_BINS, NULL for absolute
+    long *n_peaks;              // n_templates, candidates (peaks once finished)
+    long *capacity;             // n_templates
+    long **index;               // per template, positions of candidates
+    float **value;              // per template, values of candidates
+    int *incomplete;            // n_templates, final threshold is below max_floor
+} ncc_peaks;
+
+ncc_peaks *ncc_peaks_create(long, float*, int);
+
+int ncc_peaks_update(ncc_peaks*, long, long, const float*, long, int);
+
+int ncc_peaks_finish(ncc_peaks*, long, int);
+
+int ncc_peaks_counts(ncc_peaks*, long*, float*, int*);
+
+int ncc_peaks_copy(ncc_peaks*, long*, float*);
+
+void ncc_peaks_destroy(ncc_peaks*);
+
+// moments functions
+// Moments of every window of a single-channel image, for one template length
+typedef struct sliding_moments {
+    long image_len;
+    long template_len;
+    double *mean;               // image_len - template_len + 1
+    double *inv_std;            // as mean, zero where correlations cannot be normalised
+    unsigned char *valid;       // as mean, MOMENT_VALID and MOMENT_LOW_VARIANCE flags
+} sliding_moments;
+
+// An image given as a pointer to each channel, see image_channel_span
+typedef struct image_channels {
+    void **data;                // first sample of each channel
+    long *lengths;              // samples in each channel, later samples read as zero
+    long *strides;              // elements between successive samples of each channel
+    int dtype;                  // IMAGE_FLOAT32, IMAGE_INT32 or IMAGE_FLOAT64
+    long origin;                // sample of the stream at the first sample, 0 unless streaming
+} image_channels;
+
+void sliding_moments_range(
+    const float*, long, long, long, double*, double*, unsigned char*, int);
+
+const float *image_channel_span(const image_channels*, long, long, long, float*);
+
+int sliding_moments_image(
+    const image_channels*, long, long, long, long, double*, double*, unsigned char*,
+    int);
+
+sliding_moments *sliding_moments_create(float*, long, long, int);
+
+sliding_moments *sliding_moments_create_image(const image_channels*, long, long, long, int);
+
+void sliding_moments_destroy(sliding_moments*);
+
 // multi_corr functions
+// Timings and counts of correlation calls, see multi_normxcorr_fftw. Times are in
+// seconds summed over the threads doing the work. Calls add to every field, so zero
+// the struct first.
+typedef struct correlation_stats {
+    double template_fft;        // transforms of templates, zero for cached spectra
+    double moments;             // sliding moments of the image
+    double image_fft;           // forward transforms of image chunks
+    double multiply;            // products of template and image spectra
+    double inverse_fft;
+    double normalise;
+    double stack;               // writing or stacking into ncc and summing stacks
+    double peaks;               // peaks of stacked correlations, if only peaks are kept
+    double total;               // wall-clock time of the call
+    long long n_chunks;         // overlap-save chunks transformed
+    long long n_skipped_chunks; // chunks with nothing to normalise (e.g. zero gaps)
+    long long n_out_of_range;   // correlations out of range, these are zeroed
+    long long bytes_allocated;  // workspace allocated by the call
+    int warnings;               // CORR_WARN_* flags
+    int *out_of_range;          // out-of-range correlations per channel, or NULL
+} correlation_stats;
+
+static inline double wall_time(void){
+    // Seconds from an arbitrary start, for timing stages
+#ifdef N_THREADS
+    return omp_get_wtime();
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Persistent state for repeated multi-channel correlations - treat as opaque and only
+// use through the multi_normxcorr_fftw_{create,execute,destroy} functions.
+typedef struct multi_normxcorr_fftw_context {
+    long n_templates;
+    long template_len;
+    long n_channels;
+    long fft_len;
+    int num_threads_inner;
+    int num_threads_outer;
+    int *used_chans;                    // n_channels x n_templates
+    int *pad_array;                     // n_channels x n_templates
+    float *norm_sums;                   // n_channels x n_templates, NULL if not cached
+    fftwf_complex **template_spectra;   // per channel, NULL if not cached
+    // Copies of the spectra for the outer threads of other NUMA domains,
+    // (n_replicas - 1) x n_channels, NULL if there is only one
+    fftwf_complex **spectra_replicas;
+    int n_replicas;
+    // Per-worker workspaces, num_threads_outer x num_threads_inner
+    float **template_ext;
+    float **image_ext;
+    float **ccc;
+    fftwf_complex **outa;
+    fftwf_complex **outb;
+    fftwf_complex **out;
+    double **mean;
+    double **inv_std;
+    unsigned char **valid;
+    fftwf_plan pa, pb, px;
+    long long bytes;                    // allocated for workspaces and spectra
+    int warnings;                       // CORR_WARN_* flags from creation
+} multi_normxcorr_fftw_context;
+
+// Files of the template spectra of a context, see multi_normxcorr_fftw_save. The
+// header is followed by used_chans and pad_array (int) and norm_sums (float), each
+// n_channels x n_templates, then the spectra of each channel in turn.
+#define SPECTRA_FILE_MAGIC "EQCSPEC"
+#define SPECTRA_FILE_VERSION 1
+#define SPECTRA_KEY_LEN 64
+typedef struct spectra_file_header {
+    char magic[8];                  // SPECTRA_FILE_MAGIC
+    int version;                    // SPECTRA_FILE_VERSION
+    int byte_order;                 // 1 as written, to reject other-endian files
+    long long n_templates;
+    long long template_len;
+    long long n_channels;
+    long long fft_len;
+    char key[SPECTRA_KEY_LEN];      // caller's identifier of the templates
+} spectra_file_header;
+
 int normxcorr_fftw_main(float*, long, long, float*, long, int, int, float*, long,
                         float*, float*, float*, fftwf_complex*, fftwf_complex*,
                         fftwf_complex*, fftwf_plan, fftwf_plan, fftwf_plan,
                         int*, int*, int, int*, int*, int);
 
+void normxcorr_fftw_template_spectra(
+    float*, long, long, long, float*, fftwf_complex*, float*, fftwf_plan);
+
+int normxcorr_fftw_chunks(
+    long, long, const image_channels*, long, long, int, int, float*, long, long, long,
+    float**, float*, float**,
+    fftwf_complex*, fftwf_complex**, fftwf_complex**, double**, double**, unsigned char**,
+    sliding_moments*, int, fftwf_plan, fftwf_plan, int*, int*, int, int*, int*, int,
+    correlation_stats*);
+
 int normxcorr_fftw_internal(
-    long, long, float*, long, int, int, float*, long, long, float*, float*, float*,
-    float*, fftwf_complex*, fftwf_complex*, fftwf_complex*, fftwf_plan,
-    fftwf_plan, int*, int*, int, int*, int*, int, long);
+    long, long, long, int, int, float*, long, long, long, float*, float*, float*,
+    float*, fftwf_complex*, fftwf_complex*, fftwf_complex*, const double*,
+    const double*, const unsigned char*, fftwf_plan, fftwf_plan, int*, int*, int,
+    int, long, correlation_stats*);
 
 int normxcorr_fftw_threaded(
-    float*, long, long, float*, long, float*, long, int*, int*, int*, int*);
+    float*, long, long, float*, long, float*, long, int*, int*, int*, int*, int);
+
+int set_ncc_block(
+    long, long, long, int, int, long, long, const float*, const unsigned char*, int*,
+    float*, int);
+
+unsigned int fftw_planner_flags(int);
+
+int import_fftw_wisdom(char*);
+
+int export_fftw_wisdom(char*);
+
+void forget_fftw_wisdom(void);
+
+int set_numa_layout(int, int);
 
 void free_fftwf_arrays(
     int, float**, float**, float**, fftwf_complex**, fftwf_complex**,
@@ -91,10 +444,88 @@ void free_fftw_arrays(
      fftw_complex**);
 
 int multi_normxcorr_fftw(
-    float*, long, long, long, float*, long, float*, long, int*, int*, int,
-    int*, int*, int);
+    float*, long, long, long, float*, long, void*, long, int*, int*, int,
+    int, int*, int*, int, int, int, long, long, sliding_moments**, correlation_stats*);
+
+int multi_normxcorr_fftw_image(
+    float*, long, long, long, const image_channels*, long, void*, long, int*, int*,
+    int, int, int*, int*, int, int, int, long, long, sliding_moments**,
+    correlation_stats*);
+
+int normxcorr_fftw(float*, long, long, float*, long, float*, long, int*, int*, int*, int*, int);
+
+multi_normxcorr_fftw_context *multi_normxcorr_fftw_create(
+    float*, long, long, long, long, int*, int*, int, int, int);
+
+int multi_normxcorr_fftw_execute(
+    multi_normxcorr_fftw_context*, float*, long, void*, int*, int*, int*, int, int,
+    long, sliding_moments**, correlation_stats*);
 
-int normxcorr_fftw(float*, long, long, float*, long, float*, long, int*, int*, int*, int*);
+int multi_normxcorr_fftw_execute_image(
+    multi_normxcorr_fftw_context*, const image_channels*, long, void*, int*, int*,
+    int*, int, int, long, sliding_moments**, correlation_stats*);
+
+int multi_normxcorr_fftw_peaks(
+    float*, long, long, long, float*, long, long, int*, int*, int, int, int*,
+    int*, int, long, long, sliding_moments**, ncc_peaks*, correlation_stats*);
+
+int multi_normxcorr_fftw_peaks_image(
+    float*, long, long, long, const image_channels*, long, long, int*, int*, int,
+    int, int*, int*, int, long, long, sliding_moments**, ncc_peaks*,
+    correlation_stats*);
+
+int multi_normxcorr_fftw_execute_peaks(
+    multi_normxcorr_fftw_context*, float*, long, int*, int*, int*, long,
+    sliding_moments**, ncc_peaks*, correlation_stats*);
+
+int multi_normxcorr_fftw_execute_peaks_image(
+    multi_normxcorr_fftw_context*, const image_channels*, long, int*, int*, int*,
+    long, sliding_moments**, ncc_peaks*, correlation_stats*);
+
+int multi_normxcorr_fftw_save(multi_normxcorr_fftw_context*, const char*, const char*);
+
+multi_normxcorr_fftw_context *multi_normxcorr_fftw_load(
+    const char*, const char*, long, int, int, int);
+
+void multi_normxcorr_fftw_destroy(multi_normxcorr_fftw_context*);
+
+// Streaming correlations of successive blocks of data - treat as opaque and only use
+// through the multi_normxcorr_fftw_stream_{create,push,destroy} functions.
+typedef struct multi_normxcorr_fftw_stream {
+    multi_normxcorr_fftw_context *ctx; // template spectra, plans and workspaces
+    long max_pad;
+    long history_len;                   // template_len - 1 + max_pad
+    long n_held;                        // samples held per channel, at most history_len
+    long n_pushed;                      // samples pushed per channel
+    float *history;                     // n_channels x history_len
+    float *image;                       // n_channels x (history_len + capacity)
+    long capacity;                      // longest block image has room for
+} multi_normxcorr_fftw_stream;
+
+multi_normxcorr_fftw_stream *multi_normxcorr_fftw_stream_create(
+    float*, long, long, long, long, int*, int*, int, int, int);
+
+int multi_normxcorr_fftw_stream_push(
+    multi_normxcorr_fftw_stream*, float*, long, float*, long*, int*, int*, int, long,
+    correlation_stats*);
+
+void multi_normxcorr_fftw_stream_destroy(multi_normxcorr_fftw_stream*);
+
+int normxcorr_batch(float*, float*, long long*, long long, float*, double*, float*,
+                    int, int, int);
+
+// simd functions
+int get_simd_level(void);
+
+int set_simd_level(int);
+
+void multiply_spectra(const fftwf_complex*, const fftwf_complex*, fftwf_complex*, long);
+
+void normalise_correlations(float*, const double*, const double*, double, double, long);
+
+void correlate_templates(const float*, long, int, const float*, long, float*, long);
+
+long long find_peaks_span(const float*, long long, long long, long long, float, long long*);
 
 // time_corr functions
 int normxcorr_time_threaded(float*, int, float*, int, float*, int);
@@ -104,3 +535,6 @@ int normxcorr_time(float*, int, float*, int, float*);
 int multi_normxcorr_time(float*, int, int, float*, int, float*);
 
 int multi_normxcorr_time_threaded(float*, int, int, float*, int, float*, int);
+
+int multi_normxcorr_time_blocked(
+    float*, long, long, long, float*, long, float*, int*, int*, int, int*, int*, int);
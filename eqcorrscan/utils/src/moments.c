@@ -0,0 +1,319 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  moments.c
+ *
+ *        Purpose:  Sliding-window moments of an image for normalising
+ *                  cross-correlations, these only depend on the image and the
+ *                  template length so can be shared between templates
+ *
+ *        Created:  14/10/26
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Calum Chamberlain
+ *   Organization:  EQcorrscan
+ *      Copyright:  EQcorrscan developers.
+ *        License:  GNU Lesser General Public License, Version 3
+ *                  (https://www.gnu.org/copyleft/lesser.html)
+ *
+ * =====================================================================================
+ */
+
+#include <libutils.h>
+
+
+static inline void compensated_add(double *sum, double *compensation, double value){
+    /* Neumaier summation - the rounding error of each addition is kept so that
+     * long running sums do not drift */
+    double t = *sum + value;
+
+    if (fabs(*sum) >= fabs(value)) {
+        *compensation += (*sum - t) + value;
+    } else {
+        *compensation += (value - t) + *sum;
+    }
+    *sum = t;
+}
+
+static void sliding_moments_block(
+    const float *image, long template_len, long n, long origin, double *mean,
+    double *inv_std, unsigned char *valid)
+{
+    /* Moments of the n windows starting at image[0], which is sample origin of
+     * the channel. The first window is summed directly so blocks are
+     * independent. */
+    long i, k, flat_run = 0;
+    double sum = 0.0, sum_c = 0.0, m2 = 0.0, m2_c = 0.0;
+    double window_mean, old_mean, new_samp, old_samp, var, stdev;
+
+    for (k = 0; k < template_len; ++k){
+        compensated_add(&sum, &sum_c, (double) image[k]);
+    }
+    window_mean = (sum + sum_c) / template_len;
+    for (k = 0; k < template_len; ++k){
+        double diff = (double) image[k] - window_mean;
+        compensated_add(&m2, &m2_c, diff * diff);
+    }
+    // Repeated samples running into the end of the first window
+    for (k = template_len - 1; k > 0 && flat_run < template_len - 1; --k){
+        if (image[k] != image[k - 1]) {
+            break;
+        }
+        flat_run += 1;
+    }
+
+    for (i = 0; i < n; ++i){
+        long pos = origin + i;
+        unsigned char flags = 0;
+
+        if (i > 0) {
+            // Need to work in double otherwise we end up with annoying floating
+            // point errors when the variance is massive - collecting fp errors.
+            new_samp = (double) image[i + template_len - 1];
+            old_samp = (double) image[i - 1];
+            old_mean = window_mean;
+            compensated_add(&sum, &sum_c, new_samp);
+            compensated_add(&sum, &sum_c, -old_samp);
+            window_mean = (sum + sum_c) / template_len;
+            compensated_add(&m2, &m2_c, (new_samp - old_samp) * (new_samp - window_mean + old_samp - old_mean));
+            if (new_samp == (double) image[i + template_len - 2]) {
+                flat_run += (flat_run < template_len - 1);
+            } else {
+                flat_run = 0;
+            }
+        }
+        var = (m2 + m2_c) / template_len;
+        stdev = 0.0;
+        // Windows need some variance and not to be a single repeated value
+        if (var >= ACCEPTED_DIFF && flat_run < template_len - 1) {
+            flags = MOMENT_VALID;
+            stdev = sqrt(var);
+            if (var <= WARN_DIFF){
+                flags |= MOMENT_LOW_VARIANCE;
+            }
+            if (pos > 0 && fabs(window_mean * stdev) < ACCEPTED_DIFF){
+                flags &= ~MOMENT_VALID;
+            }
+        }
+        mean[i] = window_mean;
+        inv_std[i] = (flags & MOMENT_VALID) ? 1.0 / stdev : 0.0;
+        valid[i] = flags;
+    }
+}
+
+void sliding_moments_range(
+    const float *image, long template_len, long start, long n, double *mean,
+    double *inv_std, unsigned char *valid, int num_threads)
+{
+  /*
+    Purpose: compute the moments of windows of template_len of an image
+    Args:
+      image:        Whole image, windows starting before start are used to
+                    find repeated samples
+      template_len: Length of windows
+      start:        First window
+      n:            Number of windows, start + n + template_len - 1 must be
+                    no more than the length of image
+      mean:         Output for the mean of each window, n long
+      inv_std:      Output for 1 / standard deviation of each window, zero if
+                    correlations cannot be normalised, n long
+      valid:        Output MOMENT_VALID if correlations can be normalised,
+                    and MOMENT_LOW_VARIANCE if the variance is below WARN_DIFF,
+                    n long
+      num_threads:  Number of threads to parallel blocks of MOMENT_BLOCK over
+  */
+    long b, n_blocks = (n + MOMENT_BLOCK - 1) / MOMENT_BLOCK;
+
+    #pragma omp parallel for num_threads(num_threads) if(n_blocks > 1)
+    for (b = 0; b < n_blocks; ++b){
+        long offset = b * MOMENT_BLOCK;
+        long block_len = (offset + MOMENT_BLOCK > n) ? n - offset : MOMENT_BLOCK;
+        sliding_moments_block(
+            &image[start + offset], template_len, block_len, start + offset,
+            &mean[offset], &inv_std[offset], &valid[offset]);
+    }
+}
+
+const float *image_channel_span(
+    const image_channels *image, long chan, long start, long n, float *buffer)
+{
+  /*
+    Purpose: samples start to start + n of one channel of an image as floats
+    Args:
+      image:    Image given as pointers to each channel
+      chan:     Channel to read
+      start:    First sample
+      n:        Number of samples
+      buffer:   Workspace of n floats, samples are converted into this unless
+                the channel is contiguous float32 covering the whole span
+    Returns:
+      Pointer to the samples, either into the channel or to buffer. Samples
+      past the length of the channel are zero.
+  */
+    long i, n_in, len = image->lengths[chan], stride = image->strides[chan];
+
+    if (image->dtype == IMAGE_FLOAT32 && stride == 1 && start + n <= len) {
+        return (const float *) image->data[chan] + start;
+    }
+    n_in = (start >= len) ? 0 : ((start + n > len) ? len - start : n);
+    if (image->dtype == IMAGE_INT32) {
+        const int *data = (const int *) image->data[chan];
+        for (i = 0; i < n_in; ++i){
+            buffer[i] = (float) data[(start + i) * stride];
+        }
+    } else if (image->dtype == IMAGE_FLOAT64) {
+        const double *data = (const double *) image->data[chan];
+        for (i = 0; i < n_in; ++i){
+            buffer[i] = (float) data[(start + i) * stride];
+        }
+    } else {
+        const float *data = (const float *) image->data[chan];
+        for (i = 0; i < n_in; ++i){
+            buffer[i] = data[(start + i) * stride];
+        }
+    }
+    for (i = n_in; i < n; ++i){
+        buffer[i] = 0.0f;
+    }
+    return buffer;
+}
+
+int sliding_moments_image(
+    const image_channels *image, long chan, long template_len, long start, long n,
+    double *mean, double *inv_std, unsigned char *valid, int num_threads)
+{
+  /*
+    Purpose: as sliding_moments_range for one channel of an image given as
+             pointers to each channel, converting blocks of samples to float
+    Args:
+      image:        Image given as pointers to each channel, windows are
+                    counted from image->origin so that only the first window
+                    of a stream skips the check of the mean
+      chan:         Channel to use
+      Others as for sliding_moments_range
+    Returns:
+      0 on success, -1 if a conversion workspace could not be allocated
+  */
+    long b, n_blocks = (n + MOMENT_BLOCK - 1) / MOMENT_BLOCK;
+    int status = 0;
+
+    #pragma omp parallel for num_threads(num_threads) if(n_blocks > 1) reduction(+:status)
+    for (b = 0; b < n_blocks; ++b){
+        long offset = b * MOMENT_BLOCK;
+        long block_len = (offset + MOMENT_BLOCK > n) ? n - offset : MOMENT_BLOCK;
+        long span = block_len + template_len - 1;
+        float *buffer = NULL;
+        const float *samples;
+
+        if (!(image->dtype == IMAGE_FLOAT32 && image->strides[chan] == 1 &&
+              start + offset + span <= image->lengths[chan])) {
+            buffer = (float *) malloc((size_t) span * sizeof(float));
+            if (buffer == NULL) {
+                status -= 1;
+                continue;
+            }
+        }
+        samples = image_channel_span(image, chan, start + offset, span, buffer);
+        sliding_moments_block(
+            samples, template_len, block_len, image->origin + start + offset, &mean[offset],
+            &inv_std[offset], &valid[offset]);
+        free(buffer);
+    }
+    if (status < 0) {
+        printf("Error allocating workspace for sliding moments\n");
+        return -1;
+    }
+    return 0;
+}
+
+static sliding_moments *sliding_moments_new(long image_len, long template_len)
+{
+    /* Allocate moments for every window, NULL on failure */
+    long n_corr = image_len - template_len + 1;
+    sliding_moments *moments;
+
+    if (n_corr < 1 || template_len < 1) {
+        printf("ERROR: image_len %ld is shorter than template_len %ld\n", image_len, template_len);
+        return NULL;
+    }
+    moments = (sliding_moments *) calloc(1, sizeof(sliding_moments));
+    if (moments == NULL) {
+        printf("Error allocating sliding moments\n");
+        return NULL;
+    }
+    moments->image_len = image_len;
+    moments->template_len = template_len;
+    moments->mean = (double *) malloc((size_t) n_corr * sizeof(double));
+    moments->inv_std = (double *) malloc((size_t) n_corr * sizeof(double));
+    moments->valid = (unsigned char *) malloc((size_t) n_corr * sizeof(unsigned char));
+    if (moments->mean == NULL || moments->inv_std == NULL || moments->valid == NULL) {
+        printf("Error allocating sliding moments\n");
+        sliding_moments_destroy(moments);
+        return NULL;
+    }
+    return moments;
+}
+
+sliding_moments *sliding_moments_create(
+    float *image, long image_len, long template_len, int num_threads)
+{
+  /*
+  Purpose: compute and keep the moments of every window of a single-channel
+           image, for re-use by every set of templates of template_len
+           correlated against it (see multi_normxcorr_fftw)
+  Args:
+    image:          Image (single channel)
+    image_len:      Length of image
+    template_len:   Length of templates
+    num_threads:    Number of threads to use
+  Returns:
+    Pointer to the moments, or NULL if allocation failed. Free with
+    sliding_moments_destroy.
+  Notes:
+    Needs 17 bytes for each of the image_len - template_len + 1 windows.
+  */
+    sliding_moments *moments = sliding_moments_new(image_len, template_len);
+
+    if (moments == NULL) {
+        return NULL;
+    }
+    sliding_moments_range(
+        image, template_len, 0, image_len - template_len + 1, moments->mean,
+        moments->inv_std, moments->valid, (num_threads < 1) ? 1 : num_threads);
+    return moments;
+}
+
+sliding_moments *sliding_moments_create_image(
+    const image_channels *image, long chan, long image_len, long template_len,
+    int num_threads)
+{
+  /*
+  Purpose: as sliding_moments_create for one channel of an image given as
+           pointers to each channel (see image_channel_span)
+  */
+    sliding_moments *moments = sliding_moments_new(image_len, template_len);
+
+    if (moments == NULL) {
+        return NULL;
+    }
+    if (sliding_moments_image(
+            image, chan, template_len, 0, image_len - template_len + 1,
+            moments->mean, moments->inv_std, moments->valid,
+            (num_threads < 1) ? 1 : num_threads) != 0) {
+        sliding_moments_destroy(moments);
+        return NULL;
+    }
+    return moments;
+}
+
+void sliding_moments_destroy(sliding_moments *moments)
+{
+    if (moments == NULL) {
+        return;
+    }
+    free(moments->mean);
+    free(moments->inv_std);
+    free(moments->valid);
+    free(moments);
+}
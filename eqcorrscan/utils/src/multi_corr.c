@@ -18,20 +18,220 @@
  * =====================================================================================
  */
 
+#if defined(__linux__) || defined(__linux)
+    /* sched_setaffinity and the CPU_* macros for pinning threads */
+    #ifndef _GNU_SOURCE
+        #define _GNU_SOURCE
+    #endif
+    #include <sched.h>
+#endif
 #include <libutils.h>
+#if defined(N_THREADS) && (defined(__linux__) || defined(__linux))
+    #define PIN_THREADS 1
+#endif
 
 
 static inline int set_ncc(
-    long t, long i, int chan, int n_chans, long template_len, long image_len,
+    long t, long i, int chan, int n_chans, long out_start, long out_len,
     float value, int *used_chans, int *pad_array, float *ncc, int stack_option);
 
+static void fftwf_cleanup_if_idle(int cleanup_threads);
+
+static void packed_image_destroy(image_channels *channels);
+
+static inline void stats_add(double *field, double value){
+    // Stats are shared by every thread of a call
+    #pragma omp atomic
+    *field += value;
+}
+
+static inline void stats_count(long long *field, long long value){
+    #pragma omp atomic
+    *field += value;
+}
+
+/* Number of live correlation contexts - fftwf_cleanup invalidates every plan, so
+ * we must only call it when nothing is holding plans. Guarded by the fftw_planner
+ * critical section. */
+static int live_contexts = 0;
+/* fftwf_cleanup also forgets all wisdom, set once wisdom is worth keeping, either
+ * imported or accumulated by measuring plans. */
+static int keep_wisdom = 0;
+/* Whether fftwf_init_threads has been called since the last cleanup */
+static int fftw_threads_ready = 0;
+/* Placement of correlation threads on NUMA machines, see set_numa_layout */
+static int numa_domains = 1;
+static int pin_workers = 0;
+
+// Actions for the workers of a context, see context_team
+#define TEAM_TOUCH 1        // first-touch the workspaces of each worker
+#define TEAM_REPLICATE 2    // copy the template spectra into each replica
+#define TEAM_PIN 4          // pin each worker to its CPU
+#define TEAM_UNPIN 8        // restore the affinity of the process
+
+int set_numa_layout(int n_domains, int pin){
+  /*
+    Purpose: set how correlation threads and their memory are placed on machines
+             with several NUMA domains (sockets). Applies to contexts created
+             afterwards.
+    Args:
+      n_domains:  Number of domains to split the outer threads of a context
+                  into, in contiguous blocks. Contexts with cached template
+                  spectra keep a copy of the spectra for each domain, written
+                  by a thread of that domain so the copy is local to it. Values
+                  below 1 are taken as 1.
+      pin:        Pin every worker to a CPU while correlating (Linux with
+                  OpenMP only). Worker w of n is pinned to CPU w * m / n of the
+                  m CPUs the process may use, so the inner threads of an outer
+                  thread sit together and outer threads spread over the
+                  machine. The affinity of the process is restored when each
+                  call returns.
+    Returns:
+      1 if workers will be pinned, otherwise 0.
+  */
+    numa_domains = (n_domains < 1) ? 1 : n_domains;
+    #ifdef PIN_THREADS
+    pin_workers = (pin != 0);
+    #else
+    pin_workers = 0;
+    #endif
+    return pin_workers;
+}
+
+static inline int spectra_domain(const multi_normxcorr_fftw_context *ctx, int tid){
+    // Replica of the template spectra used by outer thread tid
+    return (int) (((long) tid * ctx->n_replicas) / ctx->num_threads_outer);
+}
+
+static inline fftwf_complex *context_spectra(
+    const multi_normxcorr_fftw_context *ctx, int tid, long chan)
+{
+    int r = spectra_domain(ctx, tid);
+
+    if (r == 0) {
+        return ctx->template_spectra[chan];
+    }
+    return ctx->spectra_replicas[(size_t) (r - 1) * ctx->n_channels + chan];
+}
+
+#ifdef PIN_THREADS
+static void pin_worker(int worker, int n_workers, const cpu_set_t *allowed){
+    // Pin the calling thread to the CPU of worker, or to all allowed CPUs if worker < 0
+    cpu_set_t set;
+    int cpu, seen = -1, target;
+
+    if (worker < 0) {
+        sched_setaffinity(0, sizeof(cpu_set_t), allowed);
+        return;
+    }
+    target = (int) (((long) worker * CPU_COUNT(allowed)) / n_workers);
+    CPU_ZERO(&set);
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, allowed) && ++seen == target) {
+            CPU_SET(cpu, &set);
+            break;
+        }
+    }
+    if (CPU_COUNT(&set) == 1) {
+        sched_setaffinity(0, sizeof(cpu_set_t), &set);
+    }
+}
+#endif
+
+static void context_team(multi_normxcorr_fftw_context *ctx, int actions, void *allowed){
+  /*
+    Run every worker of a context once, with the same nesting of outer and
+    inner threads as multi_normxcorr_fftw_channels, so that each thread does
+    the actions for the workspaces it is given when correlating.
+    actions:        TEAM_* flags. Pinning happens first and unpinning last.
+    allowed:        cpu_set_t of the CPUs the process may use, needed to pin
+                    or unpin, ignored without PIN_THREADS.
+  */
+    size_t N2 = (size_t) ctx->fft_len / 2 + 1;
+    size_t n_spectra = N2 * ctx->n_templates;
+    #ifdef PIN_THREADS
+    int n_workers = ctx->num_threads_outer * ctx->num_threads_inner;
+    #else
+    (void) allowed;
+    #endif
+    #pragma omp parallel num_threads(ctx->num_threads_outer)
+    {
+        int tid = 0;
+
+        #ifdef N_THREADS
+        tid = omp_get_thread_num();
+        #endif
+        #pragma omp parallel num_threads(ctx->num_threads_inner)
+        {
+            int w = tid * ctx->num_threads_inner;
+
+            #ifdef N_THREADS
+            w += omp_get_thread_num();
+            #endif
+            #ifdef PIN_THREADS
+            if (actions & TEAM_PIN) {
+                pin_worker(w, n_workers, (const cpu_set_t *) allowed);
+            }
+            #endif
+            if (actions & TEAM_TOUCH) {
+                /* The template workspaces belong to the outer thread, used by
+                 * its first worker */
+                if (w == tid * ctx->num_threads_inner) {
+                    if (ctx->template_ext[tid] != NULL) {
+                        memset(ctx->template_ext[tid], 0, (size_t) ctx->fft_len * ctx->n_templates * sizeof(float));
+                    }
+                    if (ctx->outa[tid] != NULL) {
+                        memset(ctx->outa[tid], 0, n_spectra * sizeof(fftwf_complex));
+                    }
+                }
+                memset(ctx->image_ext[w], 0, (size_t) ctx->fft_len * sizeof(float));
+                memset(ctx->ccc[w], 0, (size_t) ctx->fft_len * ctx->n_templates * sizeof(float));
+                memset(ctx->outb[w], 0, N2 * sizeof(fftwf_complex));
+                memset(ctx->out[w], 0, n_spectra * sizeof(fftwf_complex));
+                memset(ctx->mean[w], 0, (size_t) ctx->fft_len * sizeof(double));
+                memset(ctx->inv_std[w], 0, (size_t) ctx->fft_len * sizeof(double));
+                memset(ctx->valid[w], 0, (size_t) ctx->fft_len * sizeof(unsigned char));
+            }
+            if ((actions & TEAM_REPLICATE) && ctx->spectra_replicas != NULL &&
+                w == tid * ctx->num_threads_inner && tid > 0 &&
+                spectra_domain(ctx, tid) != spectra_domain(ctx, tid - 1)) {
+                /* The first outer thread of each domain writes its replica */
+                long chan;
+
+                for (chan = 0; chan < ctx->n_channels; ++chan) {
+                    memcpy(context_spectra(ctx, tid, chan), ctx->template_spectra[chan],
+                           n_spectra * sizeof(fftwf_complex));
+                }
+            }
+            #ifdef PIN_THREADS
+            if (actions & TEAM_UNPIN) {
+                pin_worker(-1, n_workers, (const cpu_set_t *) allowed);
+            }
+            #endif
+        }
+    }
+}
+
+static void context_place(multi_normxcorr_fftw_context *ctx, int actions){
+    // Run the actions for the workers of a context, pinned while doing them if set
+    #ifdef PIN_THREADS
+    cpu_set_t allowed;
+
+    if (pin_workers && sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0) {
+        context_team(ctx, actions | TEAM_PIN | TEAM_UNPIN, &allowed);
+        return;
+    }
+    #endif
+    context_team(ctx, actions, NULL);
+}
+
 // Functions
 
 // Single-channel functions
 int normxcorr_fftw_threaded(float *templates, long template_len, long n_templates,
                             float *image, long image_len, float *ncc, long fft_len,
                             int *used_chans, int *pad_array, int *variance_warning,
-                            int *missed_corr) {
+                            int *missed_corr, int planner) {
   /*
   Purpose: compute frequency domain normalised cross-correlation of real data using fftw
   Author: Calum J. Chamberlain
@@ -45,6 +245,7 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
     ncc:            Output for cross-correlation - should be pointer to memory -
                     must be n_templates x image_len - template_len + 1
     fft_len:        Size for fft (n1)
+    planner:        FFTW planner rigour (PLANNER_ESTIMATE ... PLANNER_EXHAUSTIVE)
   */
     long N2 = fft_len / 2 + 1;
     long i, t, startind;
@@ -58,16 +259,26 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
     fftwf_complex * outa = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * N2 * n_templates);
     fftwf_complex * outb = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * N2);
     fftwf_complex * out = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * N2 * n_templates);
-    // Initialize threads
-    #ifdef N_THREADS
-        fftwf_init_threads();
-        fftwf_plan_with_nthreads(N_THREADS);
-    #endif
     // Plan
+    unsigned int flags = fftw_planner_flags(planner);
+    fftwf_plan pa, pb, px;
 
-    fftwf_plan pa = fftwf_plan_dft_r2c_2d(n_templates, fft_len, template_ext, outa, FFTW_ESTIMATE);
-    fftwf_plan pb = fftwf_plan_dft_r2c_1d(fft_len, image_ext, outb, FFTW_ESTIMATE);
-    fftwf_plan px = fftwf_plan_dft_c2r_2d(n_templates, fft_len, out, ccc, FFTW_ESTIMATE);
+    #pragma omp critical(fftw_planner)
+    {
+        // Initialize threads
+        #ifdef N_THREADS
+            if (fftw_threads_ready == 0) {
+                fftw_threads_ready = fftwf_init_threads();
+            }
+            fftwf_plan_with_nthreads(N_THREADS);
+        #endif
+        pa = fftwf_plan_dft_r2c_2d(n_templates, fft_len, template_ext, outa, flags);
+        pb = fftwf_plan_dft_r2c_1d(fft_len, image_ext, outb, flags);
+        px = fftwf_plan_dft_c2r_2d(n_templates, fft_len, out, ccc, flags);
+    }
+    // Planning other than FFTW_ESTIMATE overwrites the arrays
+    memset(template_ext, 0, (size_t) fft_len * n_templates * sizeof(float));
+    memset(image_ext, 0, (size_t) fft_len * sizeof(float));
 
     // zero padding - and flip template
     for (t = 0; t < n_templates; ++t){
@@ -90,11 +301,7 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
     }
     //  Compute dot product
     for (t = 0; t < n_templates; ++t){
-        for (i = 0; i < N2; ++i)
-        {
-            out[(t * N2) + i][0] = outa[(t * N2) + i][0] * outb[i][0] - outa[(t * N2) + i][1] * outb[i][1];
-            out[(t * N2) + i][1] = outa[(t * N2) + i][0] * outb[i][1] + outa[(t * N2) + i][1] * outb[i][0];
-        }
+        multiply_spectra(&outa[t * N2], outb, &out[t * N2], N2);
     }
     //  Compute inverse fft
     fftwf_execute(px);
@@ -115,7 +322,7 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
     if (var >= ACCEPTED_DIFF) {
         for (t = 0; t < n_templates; ++t){
             float c = ((ccc[(t * fft_len) + startind] / (fft_len * n_templates)) - norm_sums[t] * mean) / stdev;
-            status += set_ncc(t, 0, 0, 1, template_len, image_len, (float) c, used_chans, pad_array, ncc, 0);
+            status += set_ncc(t, 0, 0, 1, 0, image_len - template_len + 1, (float) c, used_chans, pad_array, ncc, 0);
         }
         if (var <= WARN_DIFF){
             variance_warning[0] = 1;
@@ -140,7 +347,7 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
         if (var >= ACCEPTED_DIFF && flatline_count < template_len - 1 && stdev * mean >= ACCEPTED_DIFF) {
             for (t = 0; t < n_templates; ++t){
                 float c = ((ccc[(t * fft_len) + i + startind] / (fft_len * n_templates)) - norm_sums[t] * mean ) / stdev;
-                status += set_ncc(t, i, 0, 1, template_len, image_len, (float) c, used_chans, pad_array, ncc, 0);
+                status += set_ncc(t, i, 0, 1, 0, image_len - template_len + 1, (float) c, used_chans, pad_array, ncc, 0);
             }
             if (var <= WARN_DIFF){
                 variance_warning[0] += 1;
@@ -158,8 +365,7 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
     fftwf_free(outb);
     fftwf_free(ccc);
 
-    fftwf_cleanup();
-    fftwf_cleanup_threads();
+    fftwf_cleanup_if_idle(1);
 
     free(template_ext);
     free(image_ext);
@@ -171,7 +377,7 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
 int normxcorr_fftw(float *templates, long template_len, long n_templates,
                    float *image, long image_len, float *ncc, long fft_len,
                    int *used_chans, int *pad_array, int *variance_warning,
-                   int *missed_corr){
+                   int *missed_corr, int planner){
   /*
   Purpose: compute frequency domain normalised cross-correlation of real data using fftw
   Author: Calum J. Chamberlain
@@ -185,6 +391,7 @@ int normxcorr_fftw(float *templates, long template_len, long n_templates,
     ncc:            Output for cross-correlation - should be pointer to memory -
                     must be n_templates x image_len - template_len + 1
     fft_len:        Size for fft (n1)
+    planner:        FFTW planner rigour (PLANNER_ESTIMATE ... PLANNER_EXHAUSTIVE)
   Notes:
     This is a wrapper around `normxcorr_fftw_main`, allocating required memory and plans
     for that function. We have taken this outside the main function because creating plans
@@ -199,10 +406,20 @@ int normxcorr_fftw(float *templates, long template_len, long n_templates,
     fftwf_complex * outa = (fftwf_complex*) fftwf_malloc(N2 * n_templates * sizeof(fftwf_complex));
     fftwf_complex * outb = (fftwf_complex*) fftwf_malloc(N2 * sizeof(fftwf_complex));
     fftwf_complex * out = (fftwf_complex*) fftwf_malloc(N2 * n_templates * sizeof(fftwf_complex));
+    unsigned int flags = fftw_planner_flags(planner);
+    fftwf_plan pa, pb, px;
     // Plan
-    fftwf_plan pa = fftwf_plan_dft_r2c_2d(n_templates, fft_len, template_ext, outa, FFTW_ESTIMATE);
-    fftwf_plan pb = fftwf_plan_dft_r2c_1d(fft_len, image_ext, outb, FFTW_ESTIMATE);
-    fftwf_plan px = fftwf_plan_dft_c2r_2d(n_templates, fft_len, out, ccc, FFTW_ESTIMATE);
+    #pragma omp critical(fftw_planner)
+    {
+        #ifdef N_THREADS
+        if (fftw_threads_ready) {
+            fftwf_plan_with_nthreads(1);
+        }
+        #endif
+        pa = fftwf_plan_dft_r2c_2d(n_templates, fft_len, template_ext, outa, flags);
+        pb = fftwf_plan_dft_r2c_1d(fft_len, image_ext, outb, flags);
+        px = fftwf_plan_dft_c2r_2d(n_templates, fft_len, out, ccc, flags);
+    }
 
     // Initialise to zero
     memset(template_ext, 0, (size_t) fft_len * n_templates * sizeof(float));
@@ -227,8 +444,7 @@ int normxcorr_fftw(float *templates, long template_len, long n_templates,
     fftwf_free(template_ext);
     fftwf_free(image_ext);
 
-    fftwf_cleanup();
-    fftwf_cleanup_threads();
+    fftwf_cleanup_if_idle(1);
 
     return status;
 }
@@ -278,22 +494,72 @@ int normxcorr_fftw_main(
     missed_corr:    Pointer to array to store warnings for unused correlations
     stack_option:   Whether to stack correlograms (1) or leave as individual channels (0),
   */
-    long i, t, chunk, n_chunks, chunk_len, startind, step_len;
     int status = 0;
+    void *channel_data = image;
+    long channel_len = image_len, channel_stride = 1;
+    image_channels channel = {&channel_data, &channel_len, &channel_stride, IMAGE_FLOAT32, 0};
     float * norm_sums = (float *) calloc(n_templates, sizeof(float));
+    double * mean = (double *) malloc(fft_len * sizeof(double));
+    double * inv_std = (double *) malloc(fft_len * sizeof(double));
+    unsigned char * valid = (unsigned char *) malloc(fft_len * sizeof(unsigned char));
 
-    if (norm_sums == NULL) {
-        printf("ERROR: Error allocating norm_sums in normxcorr_fftw_main\n");
+    if (norm_sums == NULL || mean == NULL || inv_std == NULL || valid == NULL) {
+        printf("ERROR: Error allocating workspace in normxcorr_fftw_main\n");
+        free(norm_sums);
+        free(mean);
+        free(inv_std);
+        free(valid);
         return -1;
     }
 
     if (stack_option > 1) {
         printf("ERROR: stack_option %i is not known\n", stack_option);
+        free(norm_sums);
+        free(mean);
+        free(inv_std);
+        free(valid);
         return -1;
     }
 
+    normxcorr_fftw_template_spectra(
+        templates, template_len, n_templates, fft_len, template_ext, outa,
+        norm_sums, pa);
+
+    // Single workspace, chunks are processed in turn
+    status = normxcorr_fftw_chunks(
+        template_len, n_templates, &channel, 0, image_len, chan, n_chans, ncc, 0,
+        image_len - template_len + 1, fft_len, &image_ext, norm_sums, &ccc, outa, &outb, &out, &mean, &inv_std,
+        &valid, NULL, 1, pb, px, used_chans, pad_array, num_threads,
+        variance_warning, missed_corr, stack_option, NULL);
+    free(norm_sums);
+    free(mean);
+    free(inv_std);
+    free(valid);
+    return status;
+}
+
+void normxcorr_fftw_template_spectra(
+    float *templates, long template_len, long n_templates, long fft_len,
+    float *template_ext, fftwf_complex *outa, float *norm_sums, fftwf_plan pa)
+{
+  /*
+    Compute the spectra of a set of templates (flipped and zero-padded to fft_len)
+    template_len:   Length of template
+    n_templates:    Number of templates
+    fft_len:        Size for fft
+    template_ext:   Input FFTW array for template transform (must be allocated,
+                    contents are overwritten)
+    outa:           Output FFTW array for template transform (must be allocated)
+    norm_sums:      Output for the sums of the normalised templates - must be
+                    n_templates long
+    pa:             Forward plan for templates
+  */
+    long i, t;
+
+    memset(template_ext, 0, (size_t) fft_len * n_templates * sizeof(float));
     // zero padding - and flip template
     for (t = 0; t < n_templates; ++t){
+        norm_sums[t] = 0;
         for (i = 0; i < template_len; ++i)
         {
             template_ext[(t * fft_len) + i] = templates[((t + 1) * template_len) - (i + 1)];
@@ -303,6 +569,50 @@ int normxcorr_fftw_main(
 
     //  Compute fft of template
     fftwf_execute_dft_r2c(pa, template_ext, outa);
+}
+
+int normxcorr_fftw_chunks(
+    long template_len, long n_templates, const image_channels *image,
+    long image_chan, long image_len, int chan, int n_chans, float *ncc, long out_start, long out_len,
+    long fft_len, float **image_ext,
+    float *norm_sums, float **ccc, fftwf_complex *outa, fftwf_complex **outb,
+    fftwf_complex **out, double **mean, double **inv_std, unsigned char **valid,
+    sliding_moments *moments, int num_workers, fftwf_plan pb, fftwf_plan px, int *used_chans,
+    int *pad_array, int num_threads, int *variance_warning, int *missed_corr,
+    int stack_option, correlation_stats *stats)
+{
+  /*
+    Overlap-save correlation of a single-channel image against pre-computed
+    template spectra (see normxcorr_fftw_template_spectra).
+    Arguments are as for normxcorr_fftw_main, with:
+    image, image_chan:
+                    Channel image_chan of image is correlated, converting
+                    samples to float for each chunk (see image_channel_span)
+    out_start, out_len:
+                    Window of the correlograms held in ncc (see
+                    normxcorr_fftw_internal) - only chunks contributing to this
+                    window are computed.
+    image_ext, ccc, outb, out:
+                    Per-worker FFTW arrays - num_workers of each
+    norm_sums:      Sums of the normalised templates - n_templates long
+    outa:           Template spectra (must be computed)
+    mean, inv_std, valid:
+                    Per-worker normalisation workspaces, each fft_len long
+    moments:        Moments of every window of image (see sliding_moments_create),
+                    or NULL to compute them for each chunk in the workspaces
+    num_workers:    Number of workspaces - chunks are run in parallel over
+                    these, pb and px must be safe to execute concurrently
+    num_threads:    Number of threads available - used within chunks if
+                    there are too few chunks to use the workers
+    stats:          Timings and counts are added to this, or NULL
+  Returns:
+    -1 if any chunk failed, otherwise the number of out-of-range correlations
+  */
+    long chunk, n_chunks, chunk_len, step_len, first_chunk, last_chunk, t;
+    long max_pad = 0, n_transformed = 0, n_skipped = 0;
+    int status = 0, failed = 0, n_workers = num_workers, chunk_threads = num_threads;
+    int warnings = 0, unused_corr = 0;
+    double t_moments = 0.0;
 
     if (fft_len >= image_len){
         n_chunks = 1;
@@ -314,39 +624,124 @@ int normxcorr_fftw_main(
         n_chunks = (image_len - chunk_len) / step_len + ((image_len - chunk_len) % step_len > 0);
         if (n_chunks * step_len < image_len){n_chunks += 1;}
     }
-    for (chunk = 0; chunk < n_chunks; ++chunk){
-        startind = chunk * step_len;
-        if (startind + chunk_len > image_len){
-            chunk_len = image_len - startind;}
+    /* Padding moves correlations earlier, so chunks from up to max_pad samples
+     * after the window contribute to it. */
+    for (t = 0; t < n_templates; ++t){
+        max_pad = (pad_array[t] > max_pad) ? pad_array[t] : max_pad;
+    }
+    first_chunk = out_start / step_len;
+    last_chunk = (out_start + out_len + max_pad + step_len - 1) / step_len;
+    last_chunk = (last_chunk > n_chunks) ? n_chunks : last_chunk;
+
+    /* Chunks write to disjoint parts of ncc (or stack atomically), so they can
+     * be run in parallel, each worker with its own workspace.  Only thread
+     * within a chunk if there are not enough chunks to go round. */
+    n_workers = (last_chunk - first_chunk < n_workers) ? last_chunk - first_chunk : n_workers;
+    n_workers = (n_workers < 1) ? 1 : n_workers;
+    if (n_workers > 1) {
+        chunk_threads = 1;
+    }
+
+    #pragma omp parallel for num_threads(n_workers) schedule(dynamic) \
+        reduction(+:status,warnings,unused_corr,n_transformed,n_skipped,t_moments) \
+        reduction(|:failed)
+    for (chunk = first_chunk; chunk < last_chunk; ++chunk){
+        int wid = 0;
+        int chunk_warnings = 0, chunk_unused = 0, n_valid = 0;
+        long i, n_corr, count_start, count_end, startind = chunk * step_len, this_len = chunk_len;
+        const double *chunk_mean, *chunk_inv_std;
+        const unsigned char *chunk_valid;
+
+        #ifdef N_THREADS
+        if (n_workers > 1) {
+            wid = omp_get_thread_num();
+        }
+        #endif
+        if (startind + this_len > image_len){
+            this_len = image_len - startind;}
+        if (this_len < template_len){
+            // No complete windows in this chunk, all covered by the previous chunk
+            continue;}
+
+        n_corr = this_len - template_len + 1;
+
+        if (moments != NULL) {
+            chunk_mean = &moments->mean[startind];
+            chunk_inv_std = &moments->inv_std[startind];
+            chunk_valid = &moments->valid[startind];
+        } else {
+            double t0 = (stats != NULL) ? wall_time() : 0.0;
+            if (sliding_moments_image(
+                    image, image_chan, template_len, startind, n_corr, mean[wid],
+                    inv_std[wid], valid[wid], chunk_threads) != 0) {
+                failed = 1;
+                continue;
+            }
+            if (stats != NULL) {
+                t_moments += wall_time() - t0;
+            }
+            chunk_mean = mean[wid];
+            chunk_inv_std = inv_std[wid];
+            chunk_valid = valid[wid];
+        }
+        for (i = 0; i < n_corr; ++i){
+            n_valid += (chunk_valid[i] & MOMENT_VALID) != 0;
+        }
+        /* Chunks can be computed for more than one window, only count warnings
+         * for the correlations in this window. */
+        count_start = (out_start > startind) ? out_start - startind : 0;
+        count_end = (out_start + out_len - startind < n_corr) ? out_start + out_len - startind : n_corr;
+        for (i = count_start; i < count_end; ++i){
+            chunk_unused += !(chunk_valid[i] & MOMENT_VALID);
+            chunk_warnings += (chunk_valid[i] & MOMENT_LOW_VARIANCE) != 0;
+        }
 
-        memset(image_ext, 0, (size_t) fft_len * sizeof(float));
-        for (i = 0; i < chunk_len; ++i){image_ext[i] = image[startind + i];}
-        status += normxcorr_fftw_internal(
-            template_len, n_templates, &image[startind], chunk_len, chan,
-            n_chans, &ncc[0], image_len, fft_len, template_ext,
-            image_ext, norm_sums, ccc, outa, outb, out, pb, px, used_chans,
-            pad_array, num_threads, variance_warning, missed_corr,
-            stack_option, startind);
+        /* If nothing can be normalised (e.g. a zero-filled gap) skip the
+         * transforms and leave the output as is */
+        if (n_valid > 0) {
+            const float *samples = image_channel_span(
+                image, image_chan, startind, this_len, image_ext[wid]);
+            if (samples != image_ext[wid]) {
+                memcpy(image_ext[wid], samples, (size_t) this_len * sizeof(float));
+            }
+            memset(&image_ext[wid][this_len], 0, (size_t) (fft_len - this_len) * sizeof(float));
+            status += normxcorr_fftw_internal(
+                template_len, n_templates, this_len, chan, n_chans, &ncc[0],
+                out_start, out_len, fft_len, NULL, image_ext[wid], norm_sums,
+                ccc[wid], outa, outb[wid], out[wid], chunk_mean, chunk_inv_std,
+                chunk_valid, pb, px, used_chans, pad_array, chunk_threads,
+                stack_option, startind, stats);
+            n_transformed += 1;
+        } else {
+            n_skipped += 1;
+        }
+        warnings += chunk_warnings;
+        unused_corr += chunk_unused;
     }
-    free(norm_sums);
-    return status;
+    variance_warning[0] += warnings;
+    missed_corr[0] += unused_corr;
+    if (stats != NULL) {
+        stats_add(&stats->moments, t_moments);
+        stats_count(&stats->n_chunks, n_transformed);
+        stats_count(&stats->n_skipped_chunks, n_skipped);
+    }
+    /* Failures are kept apart from out-of-range counts so they are never masked */
+    return (failed) ? -1 : status;
 }
 
 int normxcorr_fftw_internal(
-    long template_len, long n_templates, float *image, long image_len,
-    int chan, int n_chans, float *ncc, long ncc_len, long fft_len,
+    long template_len, long n_templates, long image_len, int chan, int n_chans,
+    float *ncc, long out_start, long out_len, long fft_len,
     float *template_ext, float *image_ext, float *norm_sums, float *ccc,
     fftwf_complex *outa, fftwf_complex *outb, fftwf_complex *out,
+    const double *mean, const double *inv_std, const unsigned char *valid,
     fftwf_plan pb, fftwf_plan px, int *used_chans, int *pad_array,
-    int num_threads, int *variance_warning, int *missed_corr,
-    int stack_option, long offset)
+    int num_threads, int stack_option, long offset, correlation_stats *stats)
 {
   /*
     Internal function for chunking cross-correlations
     template_len:   Length of template
     n_templates:    Number of templates
-    image:          Image signal (to scan through) - in this case this is a pointer to the starting index of the
-                    image for this chunk
     image_len:      Length of image chunk (not complete length of image)
     chan:           Channel number - used for stacking, otherwise set to 0
     n_chans:        Number of channels - used for stacking, otherwise set to 1
@@ -358,181 +753,277 @@ int normxcorr_fftw_internal(
         0:          Output individual channel correlograms, ncc must be
                     (n_templates x image_len - template_len + 1) long and initialised
                     to zero before passing into this function.
-    ncc_len:        Total length of the ncc (not just the chunk).
+    out_start:      First sample of the correlograms held in ncc (zero for the whole
+                    correlogram).
+    out_len:        Number of samples per correlogram held in ncc (for the whole ncc
+                    this is the full image_len - template_len + 1).
     fft_len:        Size for fft
     template_ext:   Input FFTW array for template transform (must be allocated)
-    image_ext:      Input FFTW array for image transform (must be allocated)
+    image_ext:      Input FFTW array for image transform (must be filled with the
+                    chunk and zero-padded)
     norm_sums:      Normalised, summed templates
     ccc:            Output FFTW array for reverse transform (must be allocated)
     outa:           Output FFTW array for template transform (must be computed)
     outb:           Output FFTW array for image transform (must be allocated)
     out:            Input array for reverse transform (must be allocated)
+    mean:           Mean of each window of the chunk (see sliding_moments_range),
+                    image_len - template_len + 1 long
+    inv_std:        1 / standard deviation of each window, as for mean
+    valid:          Flags of each window, as for mean
     pb:             Forward plan for image
     px:             Reverse plan
     used_chans:     Array to fill with number of channels used per template - must
                     be n_templates long
     pad_array:      Array of pads, should be n_templates long
     num_threads:    Number of threads to parallel internal calculations over
-    variance_warning: Pointer to array to store warnings for variance issues
-    missed_corr:    Pointer to array to store warnings for unused correlations
     stack_option:   Whether to stacked correlograms (1) or leave as individual channels (0),
+                    or STACK_PRIVATE to stack into an ncc only written by this thread.
     offset:         Offset for position of chunk in ncc (for a pad of zero).
+    stats:          Timings of each stage are added to this, or NULL
   */
-    long i, t, startind;
-    long N2 = fft_len / 2 + 1;
-    int status = 0, unused_corr = 0;
-    int * flatline_count = (int *) calloc(image_len - template_len + 1, sizeof(int));
-    double *mean, *var;
-    double new_samp, old_samp, sum=0.0;
+    long t, tb, startind, n_template_blocks;
+    long N2 = fft_len / 2 + 1, n_corr = image_len - template_len + 1;
+    int status = 0;
+    double t0 = 0.0, t1, t_norm = 0.0, t_stack = 0.0;
 
     // Compute fft of image
+    if (stats != NULL) {
+        t0 = wall_time();
+    }
     fftwf_execute_dft_r2c(pb, image_ext, outb);
+    if (stats != NULL) {
+        t1 = wall_time();
+        stats_add(&stats->image_fft, t1 - t0);
+        t0 = t1;
+    }
 
     //  Compute dot product
-    #pragma omp parallel for num_threads(num_threads) private(i)
+    #pragma omp parallel for num_threads(num_threads)
     for (t = 0; t < n_templates; ++t){
-        for (i = 0; i < N2; ++i)
-        {
-            out[(t * N2) + i][0] = outa[(t * N2) + i][0] * outb[i][0] - outa[(t * N2) + i][1] * outb[i][1];
-            out[(t * N2) + i][1] = outa[(t * N2) + i][0] * outb[i][1] + outa[(t * N2) + i][1] * outb[i][0];
-        }
+        multiply_spectra(&outa[t * N2], outb, &out[t * N2], N2);
+    }
+    if (stats != NULL) {
+        t1 = wall_time();
+        stats_add(&stats->multiply, t1 - t0);
+        t0 = t1;
     }
 
     //  Compute inverse fft
     fftwf_execute_dft_c2r(px, out, ccc);
- 
-    // Allocate mean and var arrays
-    mean = (double*) malloc((image_len - template_len + 1) * sizeof(double));
-    if (mean == NULL) {
-        printf("ERROR: Error allocating mean in normxcorr_fftw_internal\n");
-        free(norm_sums);
-        return 1;
-    }
-    var = (double*) malloc((image_len - template_len + 1) * sizeof(double));
-    if (var == NULL) {
-        printf("ERROR: Error allocating var in normxcorr_fftw_internal\n");
-        free(norm_sums);
-        free(mean);
-        return 1;
-    }
-    
-    // Procedures for normalisation
-    // Compute starting mean, will update this
-    sum = 0.0;
-    for (i=0; i < template_len; ++i){
-        sum += (double) image[i];
-    }
-    mean[0] = sum / template_len;
-
-    // Compute starting standard deviation
-    sum = 0.0;
-    for (i=0; i < template_len; ++i){
-        sum += pow((double) image[i] - mean[0], 2) / (template_len);
+    if (stats != NULL) {
+        stats_add(&stats->inverse_fft, wall_time() - t0);
     }
-    var[0] = sum;
 
+    // Center and divide by length to generate scaled convolution
     // Used for centering - taking only the valid part of the cross-correlation
     startind = template_len - 1;
-    if (var[0] >= ACCEPTED_DIFF) {
-        double stdev = sqrt(var[0]);
-        for (t = 0; t < n_templates; ++t){
-            double c = ((ccc[(t * fft_len) + startind] / (fft_len * n_templates)) - norm_sums[t] * mean[0]);
-            c /= stdev;
-            status += set_ncc(t, offset, chan, n_chans, template_len, ncc_len,
-                              (float) c, used_chans, pad_array, ncc, stack_option);
-        }
-        if (var[0] <= WARN_DIFF){
-            variance_warning[0] = 1;
-        }
-    } else {
-        unused_corr += 1;
-    }
-
-    // pre-compute the mean and var so we can parallelise the calculation
-    for(i = 1; i < (image_len - template_len + 1); ++i){
-        // Need to cast to double otherwise we end up with annoying floating
-        // point errors when the variance is massive - collecting fp errors.
-        new_samp = (double) image[i + template_len - 1];
-        old_samp = (double) image[i - 1];
-        mean[i] = mean[i - 1] + (new_samp - old_samp) / template_len;
-        var[i] = var[i - 1] + (new_samp - old_samp) * (new_samp - mean[i] + old_samp - mean[i - 1]) / (template_len);
-        if (new_samp == (double) image[i + template_len - 2]) {
-            flatline_count[i] = flatline_count[i - 1] + 1;
-        }
-        else {
-            flatline_count[i] = 0;
-        }
-    }
-
-    // Center and divide by length to generate scaled convolution
-    #pragma omp parallel for reduction(+:status,unused_corr) num_threads(num_threads) private(t)
-    for(i = 1; i < (image_len - template_len + 1); ++i){
-        if (var[i] >= ACCEPTED_DIFF && flatline_count[i] < template_len - 1) {
-            double stdev = sqrt(var[i]);
-            double meanstd = fabs(mean[i] * stdev);
-            if (meanstd >= ACCEPTED_DIFF){
-                for (t = 0; t < n_templates; ++t){
-                    double c = ((ccc[(t * fft_len) + i + startind] / (fft_len * n_templates)) - norm_sums[t] * mean[i]);
-                    c /= stdev;
-                    status += set_ncc(t, i + offset, chan, n_chans, template_len,
-                                      ncc_len, (float) c, used_chans,
-                                      pad_array, ncc, stack_option);
+    n_template_blocks = (n_templates + NORM_BLOCK_TEMPLATES - 1) / NORM_BLOCK_TEMPLATES;
+    /* Work in blocks of samples x templates so that the mean, 1 / stdev and mask
+     * for a block of samples stay in cache while every template in the block
+     * reads and writes its own contiguous row. The block is normalised and
+     * then written so that the two can be timed apart. */
+    #pragma omp parallel for reduction(+:status,t_norm,t_stack) num_threads(num_threads) schedule(dynamic)
+    for (tb = 0; tb < n_template_blocks; ++tb){
+        long ib, tt, t_end = (tb + 1) * NORM_BLOCK_TEMPLATES;
+        t_end = (t_end > n_templates) ? n_templates : t_end;
+        for (ib = 0; ib < n_corr; ib += NORM_BLOCK_SAMPLES){
+            long block_len = (ib + NORM_BLOCK_SAMPLES > n_corr) ? n_corr - ib : NORM_BLOCK_SAMPLES;
+            double b0 = 0.0, b1 = 0.0;
+
+            if (stats != NULL) {
+                b0 = wall_time();
+            }
+            for (tt = tb * NORM_BLOCK_TEMPLATES; tt < t_end; ++tt){
+                if (used_chans[tt] != 0){
+                    normalise_correlations(
+                        &ccc[(tt * fft_len) + startind + ib], &mean[ib], &inv_std[ib],
+                        norm_sums[tt], 1.0 / ((double) fft_len * n_templates), block_len);
                 }
             }
-            else {
-                unused_corr += 1;
+            if (stats != NULL) {
+                b1 = wall_time();
+                t_norm += b1 - b0;
             }
-            if (var[i] <= WARN_DIFF){
-                variance_warning[0] += 1;
+            for (tt = tb * NORM_BLOCK_TEMPLATES; tt < t_end; ++tt){
+                if (used_chans[tt] != 0){
+                    status += set_ncc_block(
+                        tt, ib + offset, block_len, chan, n_chans, out_start, out_len,
+                        &ccc[(tt * fft_len) + startind + ib], &valid[ib], pad_array, ncc,
+                        stack_option);
+                }
+            }
+            if (stats != NULL) {
+                t_stack += wall_time() - b1;
             }
-        } else {
-            unused_corr += 1;
         }
     }
-    missed_corr[0] += unused_corr;
+    if (stats != NULL) {
+        stats_add(&stats->normalise, t_norm);
+        stats_add(&stats->stack, t_stack);
+    }
+    return status;
+}
 
-    //  Clean up
-    free(mean);
-    free(var);
-    free(flatline_count);
+static inline float clip_ncc(float value, int *status){
+    /* Zero NaNs and clip to +/- 1, values well out of range are zeroed and
+     * counted in status. Nothing is printed here as this runs in parallel
+     * loops, callers report the counts of each channel (see
+     * correlation_stats). */
+    if (isnanf(value)) {
+        // set NaNs to zero
+        value = 0.0;
+    }
+    else if (fabsf(value) > 1.01) {
+        // this will raise a warning when we return to Python
+        value = 0.0;
+        *status += 1;
+    }
+    else if (value > 1.0) {
+        value = 1.0;
+    }
+    else if (value < -1.0) {
+        value = -1.0;
+    }
+    return value;
+}
+
+int set_ncc_block(
+    long t, long i, long n, int chan, int n_chans, long out_start, long out_len,
+    const float *values, const unsigned char *valid, int *pad_array, float *ncc,
+    int stack_option){
+    /* As set_ncc for n consecutive correlations of template t, starting at i,
+     * skipping those not flagged in valid. The caller must check used_chans.
+     * Shared with the time-domain correlations. */
+    int status = 0;
+    long j, j_start, j_end;
+    long first = i - pad_array[t] - out_start;  // position in the window of i
+    size_t row = (t * n_chans * (size_t) out_len) + (chan * (size_t) out_len);
+
+    // Only the part of the block in the window, this also excludes i < pad
+    j_start = (first < 0) ? -first : 0;
+    j_end = (out_len - first < n) ? out_len - first : n;
+    for (j = j_start; j < j_end; ++j){
+        size_t ncc_index;
+        float value;
+        if (!(valid[j] & MOMENT_VALID)) {
+            continue;
+        }
+        ncc_index = row + first + j;
+        value = clip_ncc(values[j], &status);
+        if (stack_option == 1){
+            #pragma omp atomic
+            ncc[ncc_index] += value;
+        } else if (stack_option == STACK_PRIVATE){
+            ncc[ncc_index] += value;
+        } else if (stack_option == 0){ncc[ncc_index] = value;}
+    }
     return status;
 }
 
 static inline int set_ncc(
-    long t, long i, int chan, int n_chans, long template_len, long image_len,
+    long t, long i, int chan, int n_chans, long out_start, long out_len,
     float value, int *used_chans, int *pad_array, float *ncc, int stack_option){
-
+    /* ncc holds samples out_start to out_start + out_len of each correlogram,
+     * anything outside of this window is skipped. */
     int status = 0;
+    long out_i = i - pad_array[t] - out_start;
 
-    if (used_chans[t] && (i >= pad_array[t])) {
-        size_t ncc_index = (t * n_chans * ((size_t) image_len - template_len + 1)) +
-            (chan * ((size_t) image_len - template_len + 1) + i - pad_array[t]);
+    if (used_chans[t] && (i >= pad_array[t]) && out_i >= 0 && out_i < out_len) {
+        size_t ncc_index = (t * n_chans * (size_t) out_len) +
+            (chan * (size_t) out_len + out_i);
 
-        if (isnanf(value)) {
-            // set NaNs to zero
-            value = 0.0;
-        }
-        else if (fabsf(value) > 1.01) {
-            // this will raise a warning when we return to Python
-            printf("WARNING: Correlation out of range at:\n\tncc_index: %ld\n\ttemplate: %ld\n\tchannel: %i\n\tindex: %ld\n\tvalue: %f\nSETTING TO ZERO.",
-                   ncc_index, t, chan, i, value);
-            value = 0.0;
-            status = 1;
-        }
-        else if (value > 1.0) {
-            value = 1.0;
-        }
-        else if (value < -1.0) {
-            value = -1.0;
-        }
+        value = clip_ncc(value, &status);
         if (stack_option == 1){
             #pragma omp atomic
             ncc[ncc_index] += value;
+        } else if (stack_option == STACK_PRIVATE){
+            ncc[ncc_index] += value;
         } else if (stack_option == 0){ncc[ncc_index] = value;}
     }
     return status;
 }
 
+static void convert_ncc(
+    const float *values, void *ncc, size_t index, long n, int ncc_format){
+    /* Write n correlations into ncc, of ncc_format, from index */
+    long j;
+
+    if (ncc_format == NCC_FLOAT16) {
+        unsigned short *out = &((unsigned short *) ncc)[index];
+        for (j = 0; j < n; ++j) {
+            out[j] = float_to_half(values[j]);
+        }
+    } else if (ncc_format == NCC_INT16) {
+        short *out = &((short *) ncc)[index];
+        for (j = 0; j < n; ++j) {
+            float value = values[j] * NCC_INT16_SCALE;
+            value = (value > NCC_INT16_SCALE) ? NCC_INT16_SCALE : value;
+            value = (value < -NCC_INT16_SCALE) ? -NCC_INT16_SCALE : value;
+            out[j] = (short) lrintf(value);
+        }
+    } else {
+        memcpy(&((float *) ncc)[index], values, (size_t) n * sizeof(float));
+    }
+}
+
+static size_t ncc_format_size(int ncc_format){
+    return (ncc_format == NCC_FLOAT32) ? sizeof(float) : sizeof(short);
+}
+
+unsigned int fftw_planner_flags(int planner) {
+    /* Map planner rigour from Python to FFTW flags, falling back to FFTW_ESTIMATE
+     * (contexts flag this with CORR_WARN_UNKNOWN_PLANNER). Measured plans are
+     * stored as wisdom that we keep for later calls. */
+    if (planner != PLANNER_ESTIMATE) {
+        #pragma omp atomic write
+        keep_wisdom = 1;
+    }
+    switch (planner) {
+        case PLANNER_MEASURE:
+            return FFTW_MEASURE;
+        case PLANNER_PATIENT:
+            return FFTW_PATIENT;
+        case PLANNER_EXHAUSTIVE:
+            return FFTW_EXHAUSTIVE;
+        case PLANNER_ESTIMATE:
+            return FFTW_ESTIMATE;
+        default:
+            return FFTW_ESTIMATE;
+    }
+}
+
+int import_fftw_wisdom(char *filename) {
+    /* Import single-precision wisdom from a file. Returns 0 on success, 1 on failure */
+    int ret;
+
+    #pragma omp critical(fftw_planner)
+    {
+        ret = fftwf_import_wisdom_from_filename(filename);
+        if (ret == 1) {keep_wisdom = 1;}
+    }
+    return (ret == 1) ? 0 : 1;
+}
+
+int export_fftw_wisdom(char *filename) {
+    /* Export all single-precision wisdom accumulated by this process to a file.
+     * Returns 0 on success, 1 on failure */
+    int ret;
+
+    #pragma omp critical(fftw_planner)
+    {
+        ret = fftwf_export_wisdom_to_filename(filename);
+    }
+    return (ret == 1) ? 0 : 1;
+}
+
+void forget_fftw_wisdom(void) {
+    #pragma omp critical(fftw_planner)
+    {
+        fftwf_forget_wisdom();
+        keep_wisdom = 0;
+    }
+}
+
 void free_fftwf_arrays(int size, float **template_ext, float **image_ext, float **ccc,
         fftwf_complex **outa, fftwf_complex **outb, fftwf_complex **out) {
     int i;
@@ -576,48 +1067,71 @@ void free_fftw_arrays(int size, double **template_ext, double **image_ext, doubl
 }
 
 
-int multi_normxcorr_fftw(float *templates, long n_templates, long template_len, long n_channels,
-                         float *image, long image_len, float *ncc, long fft_len, int *used_chans,
-                         int *pad_array, int num_threads_inner, int *variance_warning, int *missed_corr,
-                         int stack_option)
+static void fftwf_cleanup_if_idle(int cleanup_threads) {
+    #pragma omp critical(fftw_planner)
     {
-    int i, chan, n_chans, num_threads_outer=1;
-    int r = 0;
+        if (live_contexts == 0 && keep_wisdom == 0) {
+            if (cleanup_threads || fftw_threads_ready) {
+                fftwf_cleanup_threads();
+                fftw_threads_ready = 0;
+            }
+            fftwf_cleanup();
+        }
+    }
+}
+
+static multi_normxcorr_fftw_context *multi_normxcorr_fftw_context_new(
+    float *templates, long n_templates, long template_len, long n_channels,
+    long fft_len, int *used_chans, int *pad_array, int num_threads_inner,
+    int num_threads_outer, int planner, int cache_spectra)
+{
+  /*
+    Allocate workspaces and plans for multi-channel correlations.
+
+    If cache_spectra is set the spectra of all templates on all channels are
+    computed here and kept, otherwise they are computed channel-by-channel when
+    the context is run (needs the templates to be passed to
+    multi_normxcorr_fftw_run). If cache_spectra is set and templates is NULL
+    the spectra and norm_sums are allocated but left for the caller to fill
+    (see multi_normxcorr_fftw_load).
+  */
+    int i, n_workers;
+    long chan;
     size_t N2 = (size_t) fft_len / 2 + 1;
-    float **template_ext = NULL;
-    float **image_ext = NULL;
-    float **ccc = NULL;
-    int * results = (int *) calloc(n_channels, sizeof(int));
-    fftwf_complex **outa = NULL;
-    fftwf_complex **outb = NULL;
-    fftwf_complex **out = NULL;
-    fftwf_plan pa, pb, px;
+    unsigned int flags = fftw_planner_flags(planner);
+    multi_normxcorr_fftw_context *ctx;
+
+    ctx = (multi_normxcorr_fftw_context *) calloc(1, sizeof(multi_normxcorr_fftw_context));
+    if (ctx == NULL) {
+        printf("Error allocating correlation context\n");
+        return NULL;
+    }
 
     #ifdef N_THREADS
     /* num_threads_outer cannot be greater than the number of channels */
     num_threads_outer = (num_threads_outer > n_channels) ? n_channels : num_threads_outer;
+    num_threads_outer = (num_threads_outer < 1) ? 1 : num_threads_outer;
+    num_threads_inner = (num_threads_inner < 1) ? 1 : num_threads_inner;
+
+    if (planner < PLANNER_ESTIMATE || planner > PLANNER_EXHAUSTIVE) {
+        ctx->warnings |= CORR_WARN_UNKNOWN_PLANNER;
+    }
 
-    /* Outer loop parallelism seems to cause issues on OSX */
+    /* Outer loop parallelism seems to cause issues on OSX - warnings are
+     * returned with the stats of each call (see correlation_stats) */
     if (OUTER_SAFE != 1 && num_threads_outer > 1){
-        printf("WARNING\tMULTI_NORMXCORR_FFTW\tOuter loop threading disabled for this system\n");
+        ctx->warnings |= CORR_WARN_OUTER_DISABLED;
         num_threads_inner *= num_threads_outer;
-        printf("WARNING\tMULTI_NORMXCORR_FFTW\tSetting inner threading to %i and outer threading to 1\n", num_threads_inner);
         num_threads_outer = 1;
     }
-    if (num_threads_inner > 1) {
-        /* initialise FFTW threads */
-        fftwf_init_threads();
-        fftwf_plan_with_nthreads(num_threads_inner);
-
-        if (num_threads_outer > 1) {
-            /* explicitly enable nested OpenMP loops */
-            omp_set_nested(1);
-        }
+    if (num_threads_inner > 1 && num_threads_outer > 1) {
+        /* explicitly enable nested OpenMP loops */
+        omp_set_nested(1);
     }
 
     /* warn if the total number of threads is higher than the number of cores */
     if (num_threads_outer * num_threads_inner > N_THREADS) {
-        printf("WARNING: requesting more threads than available - this could negatively impact performance\n");
+        ctx->warnings |= CORR_WARN_OVERSUBSCRIBED;
     }
     #else
     /* threading/OpenMP is disabled */
@@ -625,177 +1139,2122 @@ int multi_normxcorr_fftw(float *templates, long n_templates, long template_len,
     num_threads_inner = 1;
     #endif
 
-    /* Check that stack-type is within range (0-1) */
-    if (stack_option > 1) {
-        printf("ERROR: stack_option %i is not supported\n", stack_option);
-        return -1;
-    }
-
-    /* allocate memory for all threads here */
-    template_ext = (float**) malloc(num_threads_outer * sizeof(float*));
-    if (template_ext == NULL) {
-        printf("Error allocating template_ext\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
+    ctx->n_templates = n_templates;
+    ctx->template_len = template_len;
+    ctx->n_channels = n_channels;
+    ctx->fft_len = fft_len;
+    ctx->num_threads_inner = num_threads_inner;
+    ctx->num_threads_outer = num_threads_outer;
+    ctx->n_replicas = 1;
+
+    /* keep our own copy of the layout - the caller's arrays may not outlive us */
+    ctx->used_chans = (int *) malloc((size_t) n_channels * n_templates * sizeof(int));
+    ctx->pad_array = (int *) malloc((size_t) n_channels * n_templates * sizeof(int));
+    if (ctx->used_chans == NULL || ctx->pad_array == NULL) {
+        printf("Error allocating channel layout\n");
+        multi_normxcorr_fftw_destroy(ctx);
+        return NULL;
     }
-    image_ext = (float**) malloc(num_threads_outer * sizeof(float*));
-    if (image_ext == NULL) {
-        printf("Error allocating image_ext\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
-    }
-    ccc = (float**) malloc(num_threads_outer * sizeof(float*));
-    if (ccc == NULL) {
-        printf("Error allocating ccc\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
-    }
-    outa = (fftwf_complex**) malloc(num_threads_outer * sizeof(fftwf_complex*));
-    if (outa == NULL) {
-        printf("Error allocating outa\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
-    }
-    outb = (fftwf_complex**) malloc(num_threads_outer * sizeof(fftwf_complex*));
-    if (outb == NULL) {
-        printf("Error allocating outb\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
-    }
-    out = (fftwf_complex**) malloc(num_threads_outer * sizeof(fftwf_complex*));
-    if (out == NULL) {
-        printf("Error allocating out\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
+    memcpy(ctx->used_chans, used_chans, (size_t) n_channels * n_templates * sizeof(int));
+    memcpy(ctx->pad_array, pad_array, (size_t) n_channels * n_templates * sizeof(int));
+
+    /* allocate memory for all threads here - each outer thread has
+     * num_threads_inner workers to run overlap-save chunks in parallel, worker
+     * w of outer thread t uses workspace t * num_threads_inner + w */
+    n_workers = num_threads_outer * num_threads_inner;
+    ctx->template_ext = (float**) calloc(n_workers, sizeof(float*));
+    ctx->image_ext = (float**) calloc(n_workers, sizeof(float*));
+    ctx->ccc = (float**) calloc(n_workers, sizeof(float*));
+    ctx->outa = (fftwf_complex**) calloc(n_workers, sizeof(fftwf_complex*));
+    ctx->outb = (fftwf_complex**) calloc(n_workers, sizeof(fftwf_complex*));
+    ctx->out = (fftwf_complex**) calloc(n_workers, sizeof(fftwf_complex*));
+    ctx->mean = (double**) calloc(n_workers, sizeof(double*));
+    ctx->inv_std = (double**) calloc(n_workers, sizeof(double*));
+    ctx->valid = (unsigned char**) calloc(n_workers, sizeof(unsigned char*));
+    if (ctx->template_ext == NULL || ctx->image_ext == NULL || ctx->ccc == NULL ||
+        ctx->outa == NULL || ctx->outb == NULL || ctx->out == NULL ||
+        ctx->mean == NULL || ctx->inv_std == NULL || ctx->valid == NULL) {
+        printf("Error allocating workspace pointers\n");
+        multi_normxcorr_fftw_destroy(ctx);
+        return NULL;
     }
 
     // All memory allocated with `fftw_malloc` to ensure 16-byte aligned.
-    for (i = 0; i < num_threads_outer; i++) {
-        /* initialise all to NULL so that freeing on error works */
-        template_ext[i] = NULL;
-        image_ext[i] = NULL;
-        ccc[i] = NULL;
-        outa[i] = NULL;
-        outb[i] = NULL;
-        out[i] = NULL;
-
-        /* allocate template_ext arrays */
-        template_ext[i] = (float*) fftwf_malloc((size_t) fft_len * n_templates * sizeof(float));
-        if (template_ext[i] == NULL) {
-            printf("Error allocating template_ext[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
+    for (i = 0; i < n_workers; i++) {
+        /* Template workspaces are only needed by every outer thread when spectra
+         * are computed on-the-fly, otherwise only for creating the cache. */
+        if ((!cache_spectra && i < num_threads_outer) || i == 0) {
+            ctx->template_ext[i] = (float*) fftwf_malloc((size_t) fft_len * n_templates * sizeof(float));
+            if (ctx->template_ext[i] == NULL) {
+                printf("Error allocating template_ext[%d]\n", i);
+                multi_normxcorr_fftw_destroy(ctx);
+                return NULL;
+            }
         }
-
-        /* allocate image_ext arrays */
-        image_ext[i] = (float*) fftwf_malloc(fft_len * sizeof(float));
-        if (image_ext[i] == NULL) {
+        if (!cache_spectra && i < num_threads_outer) {
+            ctx->outa[i] = (fftwf_complex*) fftwf_malloc(N2 * n_templates * sizeof(fftwf_complex));
+            if (ctx->outa[i] == NULL) {
+                printf("Error allocating outa[%d]\n", i);
+                multi_normxcorr_fftw_destroy(ctx);
+                return NULL;
+            }
+        }
+        ctx->image_ext[i] = (float*) fftwf_malloc(fft_len * sizeof(float));
+        if (ctx->image_ext[i] == NULL) {
             printf("Error allocating image_ext[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
+            multi_normxcorr_fftw_destroy(ctx);
+            return NULL;
         }
-
-        /* allocate ccc arrays */
-        ccc[i] = (float*) fftwf_malloc((size_t) fft_len * n_templates * sizeof(float));
-        if (ccc[i] == NULL) {
+        ctx->ccc[i] = (float*) fftwf_malloc((size_t) fft_len * n_templates * sizeof(float));
+        if (ctx->ccc[i] == NULL) {
             printf("Error allocating ccc[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
+            multi_normxcorr_fftw_destroy(ctx);
+            return NULL;
         }
-
-        /* allocate outa arrays */
-        outa[i] = (fftwf_complex*) fftwf_malloc((size_t) N2 * n_templates * sizeof(fftwf_complex));
-        if (outa[i] == NULL) {
-            printf("Error allocating outa[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
+        ctx->outb[i] = (fftwf_complex*) fftwf_malloc(N2 * sizeof(fftwf_complex));
+        if (ctx->outb[i] == NULL) {
+            printf("Error allocating outb[%d]\n", i);
+            multi_normxcorr_fftw_destroy(ctx);
+            return NULL;
         }
+        ctx->out[i] = (fftwf_complex*) fftwf_malloc(N2 * n_templates * sizeof(fftwf_complex));
+        if (ctx->out[i] == NULL) {
+            printf("Error allocating out[%d]\n", i);
+            multi_normxcorr_fftw_destroy(ctx);
+            return NULL;
+        }
+        ctx->mean[i] = (double*) malloc(fft_len * sizeof(double));
+        ctx->inv_std[i] = (double*) malloc(fft_len * sizeof(double));
+        ctx->valid[i] = (unsigned char*) malloc(fft_len * sizeof(unsigned char));
+        if (ctx->mean[i] == NULL || ctx->inv_std[i] == NULL || ctx->valid[i] == NULL) {
+            printf("Error allocating normalisation workspace[%d]\n", i);
+            multi_normxcorr_fftw_destroy(ctx);
+            return NULL;
+        }
+    }
 
-        /* allocate outb arrays */
-        outb[i] = (fftwf_complex*) fftwf_malloc((size_t) N2 * sizeof(fftwf_complex));
-        if (outb[i] == NULL) {
-            printf("Error allocating outb[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
+    if (cache_spectra) {
+        ctx->norm_sums = (float *) calloc((size_t) n_channels * n_templates, sizeof(float));
+        ctx->template_spectra = (fftwf_complex **) calloc(n_channels, sizeof(fftwf_complex*));
+        if (ctx->norm_sums == NULL || ctx->template_spectra == NULL) {
+            printf("Error allocating template spectra\n");
+            multi_normxcorr_fftw_destroy(ctx);
+            return NULL;
+        }
+        /* One allocation per channel to keep every spectrum aligned as the plan expects */
+        for (chan = 0; chan < n_channels; ++chan) {
+            ctx->template_spectra[chan] = (fftwf_complex*) fftwf_malloc(N2 * n_templates * sizeof(fftwf_complex));
+            if (ctx->template_spectra[chan] == NULL) {
+                printf("Error allocating template spectra for channel %ld\n", chan);
+                multi_normxcorr_fftw_destroy(ctx);
+                return NULL;
+            }
+        }
+        /* Further copies for the outer threads of other NUMA domains, filled
+         * by those threads once the spectra are known (see context_team) */
+        ctx->n_replicas = (numa_domains < num_threads_outer) ? numa_domains : num_threads_outer;
+        if (ctx->n_replicas > 1) {
+            ctx->spectra_replicas = (fftwf_complex **) calloc(
+                (size_t) (ctx->n_replicas - 1) * n_channels, sizeof(fftwf_complex*));
+            if (ctx->spectra_replicas == NULL) {
+                printf("Error allocating template spectra replicas\n");
+                multi_normxcorr_fftw_destroy(ctx);
+                return NULL;
+            }
+            for (chan = 0; chan < (ctx->n_replicas - 1) * n_channels; ++chan) {
+                ctx->spectra_replicas[chan] = (fftwf_complex*) fftwf_malloc(N2 * n_templates * sizeof(fftwf_complex));
+                if (ctx->spectra_replicas[chan] == NULL) {
+                    printf("Error allocating template spectra replica %ld\n", chan);
+                    multi_normxcorr_fftw_destroy(ctx);
+                    return NULL;
+                }
+            }
         }
+    }
 
-        /* allocate out arrays */
-        out[i] = (fftwf_complex*) fftwf_malloc((size_t) N2 * n_templates * sizeof(fftwf_complex));
-        if (out[i] == NULL) {
-            printf("Error allocating out[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
+    /* Memory held, reported with the stats of calls that create contexts */
+    ctx->bytes = (long long) n_workers * (
+        (long long) fft_len * (sizeof(float) * (n_templates + 1) + 2 * sizeof(double) + 1) +
+        (long long) N2 * sizeof(fftwf_complex) * (n_templates + 1));
+    if (cache_spectra) {
+        ctx->bytes += (long long) n_channels * n_templates * (
+            ctx->n_replicas * N2 * sizeof(fftwf_complex) + sizeof(float));
+    } else {
+        ctx->bytes += (long long) num_threads_outer * n_templates * (
+            fft_len * sizeof(float) + N2 * sizeof(fftwf_complex));
+    }
+
+    /* Workspaces are zeroed by the threads that use them, so their pages are
+     * placed in the memory of that thread's NUMA domain rather than all in the
+     * domain of the calling thread */
+    context_place(ctx, TEAM_TOUCH);
+
+    // We create the plans here since they are not thread safe. Any wisdom that has
+    // been imported is used here, so plans are re-used rather than re-measured.
+    #pragma omp critical(fftw_planner)
+    {
+        #ifdef N_THREADS
+        /* The FFTW thread count is global planner state - set it for every plan */
+        if (num_threads_inner > 1 && fftw_threads_ready == 0) {
+            /* initialise FFTW threads */
+            fftw_threads_ready = fftwf_init_threads();
+        }
+        if (fftw_threads_ready) {
+            fftwf_plan_with_nthreads(num_threads_inner);
+        }
+        #endif
+        ctx->pa = fftwf_plan_dft_r2c_2d(
+            n_templates, fft_len, ctx->template_ext[0],
+            (cache_spectra) ? ctx->template_spectra[0] : ctx->outa[0], flags);
+        #ifdef N_THREADS
+        /* Inner threads are spent on running chunks concurrently */
+        if (fftw_threads_ready) {
+            fftwf_plan_with_nthreads(1);
         }
+        #endif
+        ctx->pb = fftwf_plan_dft_r2c_1d(fft_len, ctx->image_ext[0], ctx->outb[0], flags);
+        ctx->px = fftwf_plan_dft_c2r_2d(n_templates, fft_len, ctx->out[0], ctx->ccc[0], flags);
+        live_contexts += 1;
     }
 
-    // We create the plans here since they are not thread safe.
-    pa = fftwf_plan_dft_r2c_2d(n_templates, fft_len, template_ext[0], outa[0], FFTW_ESTIMATE);
-    pb = fftwf_plan_dft_r2c_1d(fft_len, image_ext[0], outb[0], FFTW_ESTIMATE);
-    px = fftwf_plan_dft_c2r_2d(n_templates, fft_len, out[0], ccc[0], FFTW_ESTIMATE);
+    if (cache_spectra) {
+        for (chan = 0; chan < n_channels && templates != NULL; ++chan) {
+            normxcorr_fftw_template_spectra(
+                &templates[(size_t) n_templates * template_len * chan], template_len,
+                n_templates, fft_len, ctx->template_ext[0], ctx->template_spectra[chan],
+                &ctx->norm_sums[(size_t) n_templates * chan], ctx->pa);
+        }
+        /* The template workspace is not needed once the spectra are cached */
+        fftwf_free(ctx->template_ext[0]);
+        ctx->template_ext[0] = NULL;
+        if (templates != NULL && ctx->spectra_replicas != NULL) {
+            context_place(ctx, TEAM_REPLICATE);
+        }
+    }
+    return ctx;
+}
 
-    /* loop over the channels */
-    /* #pragma omp parallel for num_threads(num_threads_outer) */
+static int multi_normxcorr_fftw_channels(
+    multi_normxcorr_fftw_context *ctx, float *templates, const image_channels *image,
+    long image_len, float **stacks, long out_start, long out_len,
+    int *pad_array, int *variance_warning, int *missed_corr, int stack_option,
+    sliding_moments **moments, int *results, void *compact, int ncc_format,
+    long ncc_len, correlation_stats *stats)
+{
+  /*
+    Loop over the channels of a context for one window of the correlograms (see
+    normxcorr_fftw_internal).  Uses the cached template spectra if the context has
+    them, otherwise templates must be given and are transformed here.
+    stacks:         Output - for STACK_PRIVATE one per outer thread, otherwise
+                    only stacks[0] is used by all threads.
+    moments:        Moments of each channel, or NULL to compute them per chunk
+    results:        Out-of-range correlations are added to this for each channel
+                    (failures are not counted here, see Returns)
+    compact:        If not NULL, unstacked output of ncc_format for ncc_len
+                    correlations. Each channel is correlated into the stack of
+                    its thread, which is then converted into compact.
+    stats:          Timings and counts are added to this, or NULL
+  Returns:
+    0 on success, -1 if any channel failed
+  */
+    long i;
+    long n_templates = ctx->n_templates, template_len = ctx->template_len;
+    long n_channels = ctx->n_channels, fft_len = ctx->fft_len;
+    int failed = 0;
+
+    /* loop over the channels - stacking into a shared ncc is made safe by the
+     * atomic update in set_ncc, everything else is per-channel or per-thread */
+    #pragma omp parallel for num_threads(ctx->num_threads_outer) schedule(dynamic) \
+        reduction(|:failed)
     for (i = 0; i < n_channels; ++i){
         int tid = 0; /* each thread has its own workspace */
+        int chan, n_chans, w, n_out_of_range;
+        float *norm_sums, *ncc;
 
         #ifdef N_THREADS
         /* get the id of this thread */
         tid = omp_get_thread_num();
         #endif
-        /* initialise memory to zero */
-        memset(template_ext[tid], 0, (size_t) fft_len * n_templates * sizeof(float));
-        // Done internally now. memset(image_ext[tid], 0, (size_t) fft_len * sizeof(float));
 
-        if (stack_option == 1){
+        if (stack_option == 0 && compact == NULL){
+            chan = i;
+            n_chans = n_channels;
+        } else {
             chan = 0;
             n_chans = 1;
+        }
+        ncc = (stack_option == STACK_PRIVATE || compact != NULL) ? stacks[tid] : stacks[0];
+        if (compact != NULL) {
+            memset(ncc, 0, (size_t) n_templates * out_len * sizeof(float));
+        }
+        w = tid * ctx->num_threads_inner;
+        if (ctx->template_spectra != NULL) {
+            norm_sums = &ctx->norm_sums[(size_t) i * n_templates];
         } else {
-            chan = i;
-            n_chans = n_channels;
+            double t0 = (stats != NULL) ? wall_time() : 0.0;
+            norm_sums = (float *) calloc(n_templates, sizeof(float));
+            if (norm_sums == NULL) {
+                printf("Error allocating norm_sums for channel %li\n", i);
+                failed = 1;
+                continue;
+            }
+            normxcorr_fftw_template_spectra(
+                &templates[(size_t) n_templates * template_len * i], template_len,
+                n_templates, fft_len, ctx->template_ext[tid], ctx->outa[tid],
+                norm_sums, ctx->pa);
+            if (stats != NULL) {
+                stats_add(&stats->template_fft, wall_time() - t0);
+            }
         }
         /* call the routine */
-        results[i] = normxcorr_fftw_main(&templates[(size_t) n_templates * template_len * i], template_len,
-                                 n_templates, &image[(size_t) image_len * i], image_len, chan, n_chans, ncc, fft_len,
-                                 template_ext[tid], image_ext[tid], ccc[tid], outa[tid], outb[tid], out[tid],
-                                 pa, pb, px, &used_chans[(size_t) i * n_templates],
-                                 &pad_array[(size_t) i * n_templates], num_threads_inner, &variance_warning[i],
-                                 &missed_corr[i], stack_option);
-        if (results[i] != 0){
-            printf("WARNING: %i out-of-range correlations on channel %i\n", results[i], i);
+        n_out_of_range = normxcorr_fftw_chunks(
+            template_len, n_templates, image, i, image_len,
+            chan, n_chans, ncc, out_start, out_len, fft_len, &ctx->image_ext[w],
+            norm_sums, &ctx->ccc[w],
+            (ctx->template_spectra != NULL) ? context_spectra(ctx, tid, i) : ctx->outa[tid],
+            &ctx->outb[w], &ctx->out[w], &ctx->mean[w], &ctx->inv_std[w],
+            &ctx->valid[w], (moments != NULL) ? moments[i] : NULL,
+            ctx->num_threads_inner, ctx->pb, ctx->px,
+            &ctx->used_chans[(size_t) i * n_templates],
+            &pad_array[(size_t) i * n_templates], ctx->num_threads_inner,
+            &variance_warning[i], &missed_corr[i], stack_option, stats);
+        if (n_out_of_range < 0) {
+            failed = 1;
+        } else {
+            results[i] += n_out_of_range;
+        }
+        if (compact != NULL) {
+            long t;
+            double t0 = (stats != NULL) ? wall_time() : 0.0;
+            for (t = 0; t < n_templates; ++t) {
+                convert_ncc(&ncc[t * out_len], compact,
+                            ((size_t) t * n_channels + i) * ncc_len + out_start,
+                            out_len, ncc_format);
+            }
+            if (stats != NULL) {
+                stats_add(&stats->stack, wall_time() - t0);
+            }
+        }
+        if (ctx->template_spectra == NULL) {
+            free(norm_sums);
+        }
+    }
+    return (failed) ? -1 : 0;
+}
+
+static void context_drop_spectra(multi_normxcorr_fftw_context *ctx)
+{
+    /* Free spectra from context_hoist_spectra */
+    long chan;
+
+    if (ctx->template_spectra != NULL) {
+        for (chan = 0; chan < ctx->n_channels; ++chan) {
+            fftwf_free(ctx->template_spectra[chan]);
+        }
+    }
+    free(ctx->template_spectra);
+    free(ctx->norm_sums);
+    ctx->template_spectra = NULL;
+    ctx->norm_sums = NULL;
+}
+
+static int context_hoist_spectra(
+    multi_normxcorr_fftw_context *ctx, float *templates, correlation_stats *stats)
+{
+  /*
+    Spectra of every channel for one call of a context without cached spectra.
+    When correlograms are computed in tiles of time every tile would otherwise
+    transform every template on every channel again. The spectra are held by
+    the context until context_drop_spectra.
+  */
+    long chan, n_templates = ctx->n_templates, n_channels = ctx->n_channels;
+    long template_len = ctx->template_len, fft_len = ctx->fft_len;
+    size_t N2 = (size_t) fft_len / 2 + 1;
+    int failed = 0;
+
+    ctx->norm_sums = (float *) calloc((size_t) n_channels * n_templates, sizeof(float));
+    ctx->template_spectra = (fftwf_complex **) calloc(n_channels, sizeof(fftwf_complex*));
+    if (ctx->norm_sums == NULL || ctx->template_spectra == NULL) {
+        printf("Error allocating template spectra\n");
+        context_drop_spectra(ctx);
+        return -1;
+    }
+    #pragma omp parallel for num_threads(ctx->num_threads_outer) schedule(dynamic) \
+        reduction(|:failed)
+    for (chan = 0; chan < n_channels; ++chan) {
+        int tid = 0;
+        double t0 = (stats != NULL) ? wall_time() : 0.0;
+
+        #ifdef N_THREADS
+        tid = omp_get_thread_num();
+        #endif
+        ctx->template_spectra[chan] = (fftwf_complex*) fftwf_malloc(N2 * n_templates * sizeof(fftwf_complex));
+        if (ctx->template_spectra[chan] == NULL) {
+            failed = 1;
+            continue;
+        }
+        normxcorr_fftw_template_spectra(
+            &templates[(size_t) n_templates * template_len * chan], template_len,
+            n_templates, fft_len, ctx->template_ext[tid], ctx->template_spectra[chan],
+            &ctx->norm_sums[(size_t) n_templates * chan], ctx->pa);
+        if (stats != NULL) {
+            stats_add(&stats->template_fft, wall_time() - t0);
+        }
+    }
+    if (failed) {
+        printf("Error allocating template spectra\n");
+        context_drop_spectra(ctx);
+        return -1;
+    }
+    if (stats != NULL) {
+        stats->bytes_allocated += (long long) n_channels * n_templates * (
+            N2 * sizeof(fftwf_complex) + sizeof(float));
+    }
+    return 0;
+}
+
+static void reduce_stacks(float **stacks, int n_stacks, long len, int num_threads)
+{
+    /* Pairwise (tree) sum of n_stacks arrays of len into stacks[0] */
+    int stride, s;
+    long j;
+
+    for (stride = 1; stride < n_stacks; stride *= 2) {
+        for (s = 0; s + stride < n_stacks; s += 2 * stride) {
+            float *a = stacks[s], *b = stacks[s + stride];
+            #pragma omp parallel for num_threads(num_threads)
+            for (j = 0; j < len; ++j) {
+                a[j] += b[j];
+            }
+        }
+    }
+}
+
+static long stack_tile_len(
+    multi_normxcorr_fftw_context *ctx, long image_len, long ncc_len,
+    int *pad_array, long stack_memory)
+{
+  /*
+    Number of correlogram samples each outer thread can stack privately within
+    stack_memory bytes. Returns 0 if tiles would be so short that the chunks
+    recomputed at tile edges cost more than atomic stacking.
+  */
+    long i, tile_len, step_len, max_pad = 0;
+    long n_stacks = ctx->num_threads_outer;
+
+    if (stack_memory <= 0) {
+        return 0;
+    }
+    /* stacks[0] is the output itself when the whole correlogram fits */
+    if ((double) (n_stacks - 1) * ctx->n_templates * ncc_len * sizeof(float) <= (double) stack_memory) {
+        return ncc_len;
+    }
+    step_len = (ctx->fft_len >= image_len) ? image_len - ctx->template_len + 1 : ctx->fft_len - ctx->template_len + 1;
+    for (i = 0; i < ctx->n_channels * ctx->n_templates; ++i) {
+        max_pad = (pad_array[i] > max_pad) ? pad_array[i] : max_pad;
+    }
+    tile_len = stack_memory / ((long) sizeof(float) * n_stacks * ctx->n_templates);
+    tile_len -= tile_len % step_len;
+    if (tile_len < 4 * (step_len + max_pad)) {
+        return 0;
+    }
+    return tile_len;
+}
+
+static long buffer_tile_len(
+    multi_normxcorr_fftw_context *ctx, long image_len, long ncc_len,
+    long stack_memory)
+{
+  /*
+    Number of correlogram samples each outer thread holds at a time when the
+    output is not ncc itself (only peaks are kept or ncc is not float): as
+    many whole chunks as fit within stack_memory bytes, and at least one chunk.
+  */
+    long tile_len, step_len;
+
+    step_len = (ctx->fft_len >= image_len) ? image_len - ctx->template_len + 1 : ctx->fft_len - ctx->template_len + 1;
+    tile_len = (stack_memory > 0) ? stack_memory / ((long) sizeof(float) * ctx->num_threads_outer * ctx->n_templates) : 0;
+    tile_len -= tile_len % step_len;
+    if (tile_len < step_len) {
+        tile_len = step_len;
+    }
+    return (tile_len > ncc_len) ? ncc_len : tile_len;
+}
+
+static int multi_normxcorr_fftw_run(
+    multi_normxcorr_fftw_context *ctx, float *templates, const image_channels *image,
+    long image_len, void *ncc, long ncc_len, int *pad_array,
+    int *variance_warning, int *missed_corr, int stack_option, int ncc_format,
+    long stack_memory, sliding_moments **moments, ncc_peaks *peaks,
+    long first_template, correlation_stats *stats)
+{
+  /*
+    Correlate all channels of an image using a context.
+    ncc_len:        Number of samples of each correlogram to compute, from the
+                    start, at most image_len - template_len + 1.
+    stack_memory:   Bytes that can be used for thread-private stacks when
+                    stack_option is 1. Each outer thread stacks into its own
+                    correlogram, and these are summed once all channels are
+                    done; if they do not fit the correlograms are stacked in
+                    tiles of time. If tiles would be too short, or stack_memory
+                    is zero, threads stack directly into ncc using atomics.
+    moments:        Moments of each channel of image (see sliding_moments_create),
+                    or NULL (or NULL channels) to compute them for each chunk.
+    ncc_format:     NCC_FLOAT32, NCC_FLOAT16 or NCC_INT16 (unstacked only). For
+                    the compact formats correlations are computed in float for
+                    tiles of time (see buffer_tile_len) and converted into ncc.
+    peaks:          If not NULL ncc is not used, stacked correlograms are
+                    computed in tiles of time (see buffer_tile_len) and only
+                    their peaks are kept, from first_template in peaks.
+    stats:          Timings and counts are added to this, or NULL. Out-of-range
+                    correlations are counted for each channel rather than
+                    printed.
+  */
+    long i, t, tile_start, tile_len = 0;
+    int s, status = 0, r = 0, hoisted = 0;
+    long n_templates = ctx->n_templates, template_len = ctx->template_len;
+    long n_channels = ctx->n_channels;
+    int n_stacks = ctx->num_threads_outer;
+    int * results;
+    float ** stacks;
+    float * ncc_float = (float *) ncc;
+    double t0 = 0.0;
+    #ifdef PIN_THREADS
+    cpu_set_t allowed;
+    int pinned = 0;
+    #endif
+
+    /* Check that stack-type is within range (0-1) */
+    if (stack_option > 1 || stack_option < 0) {
+        printf("ERROR: stack_option %i is not supported\n", stack_option);
+        return -1;
+    }
+    if (ncc_format < NCC_FLOAT32 || ncc_format > NCC_INT16 ||
+        (ncc_format == NCC_INT16 && stack_option == 1)) {
+        printf("ERROR: ncc_format %i is not supported for stack_option %i\n",
+               ncc_format, stack_option);
+        return -1;
+    }
+    if (ctx->template_spectra == NULL && templates == NULL) {
+        printf("ERROR: templates are required for a context without cached spectra\n");
+        return -1;
+    }
+    if (image_len < template_len) {
+        printf("ERROR: image_len %ld is shorter than template_len %ld\n", image_len, template_len);
+        return -1;
+    }
+    if (image == NULL || image->dtype < IMAGE_FLOAT32 || image->dtype > IMAGE_FLOAT64) {
+        printf("ERROR: image is NULL or of unknown type\n");
+        return -1;
+    }
+    for (i = 0; i < n_channels; ++i) {
+        if (image->data[i] == NULL && image->lengths[i] > 0) {
+            printf("ERROR: NULL data for channel %li\n", i);
+            return -1;
+        }
+    }
+    if (ncc_len < 1 || ncc_len > image_len - template_len + 1) {
+        printf("ERROR: %ld correlations requested, image only has %ld\n",
+               ncc_len, image_len - template_len + 1);
+        return -1;
+    }
+    if (peaks != NULL && (stack_option != 1 || first_template + n_templates > peaks->n_templates)) {
+        printf("ERROR: peaks are only found for stacked correlations of %ld templates\n",
+               peaks->n_templates);
+        return -1;
+    }
+    for (i = 0; moments != NULL && i < n_channels; ++i) {
+        if (moments[i] != NULL && (moments[i]->image_len != image_len ||
+                                   moments[i]->template_len != template_len)) {
+            printf("ERROR: moments for channel %li are for image_len %ld and template_len %ld\n",
+                   i, moments[i]->image_len, moments[i]->template_len);
+            return -1;
+        }
+    }
+
+    results = (int *) calloc(n_channels, sizeof(int));
+    stacks = (float **) calloc(n_stacks, sizeof(float*));
+    if (results == NULL || stacks == NULL) {
+        printf("Error allocating results\n");
+        free(results);
+        free(stacks);
+        return -1;
+    }
+    if (pad_array == NULL) {
+        pad_array = ctx->pad_array;
+    }
+    stacks[0] = ncc_float;
+    #ifdef PIN_THREADS
+    /* Pinned for the call, assuming OpenMP keeps giving the same threads the
+     * same places in teams of the same shape */
+    if (pin_workers && sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0) {
+        pinned = 1;
+        context_team(ctx, TEAM_PIN, &allowed);
+    }
+    #endif
+    if (stack_option == 1 && n_stacks > 1) {
+        tile_len = stack_tile_len(ctx, image_len, ncc_len, pad_array, stack_memory);
+    }
+
+    if (peaks != NULL || (stack_option == 1 && ncc_format != NCC_FLOAT32)) {
+        /* Private stacks for tiles of the correlogram, only their peaks are
+         * kept or they are converted into ncc */
+        tile_len = buffer_tile_len(ctx, image_len, ncc_len, stack_memory);
+        if (stats != NULL) {
+            stats->bytes_allocated += (long long) n_stacks * n_templates * tile_len * sizeof(float);
+        }
+        for (s = 0; s < n_stacks; ++s) {
+            stacks[s] = (float *) malloc((size_t) n_templates * tile_len * sizeof(float));
+            if (stacks[s] == NULL) {
+                printf("Error allocating stack %i\n", s);
+                status = -1;
+                break;
+            }
+        }
+        if (status == 0 && tile_len < ncc_len && ctx->template_spectra == NULL) {
+            status = context_hoist_spectra(ctx, templates, stats);
+            hoisted = (status == 0);
+        }
+        for (tile_start = 0; status == 0 && tile_start < ncc_len; tile_start += tile_len) {
+            long this_len = (tile_start + tile_len > ncc_len) ? ncc_len - tile_start : tile_len;
+
+            for (s = 0; s < n_stacks; ++s) {
+                memset(stacks[s], 0, (size_t) n_templates * this_len * sizeof(float));
+            }
+            status = multi_normxcorr_fftw_channels(
+                ctx, templates, image, image_len, stacks, tile_start, this_len,
+                pad_array, variance_warning, missed_corr, STACK_PRIVATE, moments, results,
+                NULL, NCC_FLOAT32, ncc_len, stats);
+            if (stats != NULL) {
+                t0 = wall_time();
+            }
+            reduce_stacks(stacks, n_stacks, n_templates * this_len,
+                          n_stacks * ctx->num_threads_inner);
+            if (stats != NULL) {
+                double t1 = wall_time();
+                stats->stack += t1 - t0;
+                t0 = t1;
+            }
+            if (status == 0 && peaks != NULL) {
+                status = ncc_peaks_update(
+                    peaks, first_template, n_templates, stacks[0], this_len,
+                    n_stacks * ctx->num_threads_inner);
+                if (stats != NULL) {
+                    stats->peaks += wall_time() - t0;
+                }
+            } else if (status == 0) {
+                #pragma omp parallel for num_threads(n_stacks * ctx->num_threads_inner)
+                for (t = 0; t < n_templates; ++t) {
+                    convert_ncc(&stacks[0][t * this_len], ncc,
+                                (size_t) t * ncc_len + tile_start, this_len, ncc_format);
+                }
+                if (stats != NULL) {
+                    stats->stack += wall_time() - t0;
+                }
+            }
+        }
+        for (s = 0; s < n_stacks; ++s) {
+            free(stacks[s]);
+        }
+    } else if (ncc_format != NCC_FLOAT32) {
+        /* Each channel is correlated into the stack of its thread for tiles of
+         * the correlograms, and converted into ncc */
+        tile_len = buffer_tile_len(ctx, image_len, ncc_len, stack_memory);
+        if (stats != NULL) {
+            stats->bytes_allocated += (long long) n_stacks * n_templates * tile_len * sizeof(float);
+        }
+        for (s = 0; s < n_stacks; ++s) {
+            stacks[s] = (float *) malloc((size_t) n_templates * tile_len * sizeof(float));
+            if (stacks[s] == NULL) {
+                printf("Error allocating stack %i\n", s);
+                status = -1;
+                break;
+            }
+        }
+        if (status == 0 && tile_len < ncc_len && ctx->template_spectra == NULL) {
+            status = context_hoist_spectra(ctx, templates, stats);
+            hoisted = (status == 0);
+        }
+        for (tile_start = 0; status == 0 && tile_start < ncc_len; tile_start += tile_len) {
+            long this_len = (tile_start + tile_len > ncc_len) ? ncc_len - tile_start : tile_len;
+
+            status = multi_normxcorr_fftw_channels(
+                ctx, templates, image, image_len, stacks, tile_start, this_len,
+                pad_array, variance_warning, missed_corr, 0, moments, results,
+                ncc, ncc_format, ncc_len, stats);
+        }
+        for (s = 0; s < n_stacks; ++s) {
+            free(stacks[s]);
+        }
+    } else if (stack_option == 1 && n_stacks == 1) {
+        /* Chunks of one channel never overlap, so stack without atomics */
+        status = multi_normxcorr_fftw_channels(
+            ctx, templates, image, image_len, stacks, 0, ncc_len, pad_array,
+            variance_warning, missed_corr, STACK_PRIVATE, moments, results,
+            NULL, NCC_FLOAT32, ncc_len, stats);
+    } else if (tile_len >= ncc_len) {
+        /* Private stacks for the whole correlogram, the first is the output */
+        if (stats != NULL) {
+            stats->bytes_allocated += (long long) (n_stacks - 1) * n_templates * ncc_len * sizeof(float);
         }
+        for (s = 1; s < n_stacks; ++s) {
+            stacks[s] = (float *) calloc((size_t) n_templates * ncc_len, sizeof(float));
+            if (stacks[s] == NULL) {
+                printf("Error allocating stack %i\n", s);
+                status = -1;
+                break;
+            }
+        }
+        if (status == 0) {
+            status = multi_normxcorr_fftw_channels(
+                ctx, templates, image, image_len, stacks, 0, ncc_len, pad_array,
+                variance_warning, missed_corr, STACK_PRIVATE, moments, results,
+                NULL, NCC_FLOAT32, ncc_len, stats);
+            if (stats != NULL) {
+                t0 = wall_time();
+            }
+            reduce_stacks(stacks, n_stacks, n_templates * ncc_len,
+                          n_stacks * ctx->num_threads_inner);
+            if (stats != NULL) {
+                stats->stack += wall_time() - t0;
+            }
+        }
+        for (s = 1; s < n_stacks; ++s) {
+            free(stacks[s]);
+        }
+    } else if (tile_len > 0) {
+        /* Private stacks for tiles of the correlogram, summed into ncc */
+        if (stats != NULL) {
+            stats->bytes_allocated += (long long) n_stacks * n_templates * tile_len * sizeof(float);
+        }
+        for (s = 0; s < n_stacks; ++s) {
+            stacks[s] = (float *) malloc((size_t) n_templates * tile_len * sizeof(float));
+            if (stacks[s] == NULL) {
+                printf("Error allocating stack %i\n", s);
+                status = -1;
+                break;
+            }
+        }
+        if (status == 0 && ctx->template_spectra == NULL) {
+            status = context_hoist_spectra(ctx, templates, stats);
+            hoisted = (status == 0);
+        }
+        for (tile_start = 0; status == 0 && tile_start < ncc_len; tile_start += tile_len) {
+            long this_len = (tile_start + tile_len > ncc_len) ? ncc_len - tile_start : tile_len;
+
+            for (s = 0; s < n_stacks; ++s) {
+                memset(stacks[s], 0, (size_t) n_templates * this_len * sizeof(float));
+            }
+            status = multi_normxcorr_fftw_channels(
+                ctx, templates, image, image_len, stacks, tile_start, this_len,
+                pad_array, variance_warning, missed_corr, STACK_PRIVATE, moments, results,
+                NULL, NCC_FLOAT32, ncc_len, stats);
+            if (stats != NULL) {
+                t0 = wall_time();
+            }
+            reduce_stacks(stacks, n_stacks, n_templates * this_len,
+                          n_stacks * ctx->num_threads_inner);
+            #pragma omp parallel for num_threads(n_stacks * ctx->num_threads_inner)
+            for (t = 0; t < n_templates; ++t) {
+                long j;
+                float *out = &ncc_float[t * ncc_len + tile_start];
+                const float *tile = &stacks[0][t * this_len];
+
+                for (j = 0; j < this_len; ++j) {
+                    out[j] += tile[j];
+                }
+            }
+            if (stats != NULL) {
+                stats->stack += wall_time() - t0;
+            }
+        }
+        for (s = 0; s < n_stacks; ++s) {
+            free(stacks[s]);
+        }
+    } else {
+        status = multi_normxcorr_fftw_channels(
+            ctx, templates, image, image_len, stacks, 0, ncc_len, pad_array,
+            variance_warning, missed_corr, stack_option, moments, results,
+            NULL, NCC_FLOAT32, ncc_len, stats);
+    }
+    free(stacks);
+    if (hoisted) {
+        context_drop_spectra(ctx);
     }
+    #ifdef PIN_THREADS
+    if (pinned) {
+        context_team(ctx, TEAM_UNPIN, &allowed);
+    }
+    #endif
 
-    // Conduct error handling
+    // Conduct error handling - out-of-range correlations are left for the caller to report
     for (i = 0; i < n_channels; ++i){
+        if (stats != NULL && results[i] > 0) {
+            stats->n_out_of_range += results[i];
+            if (stats->out_of_range != NULL) {
+                stats->out_of_range[i] += results[i];
+            }
+        }
         r += results[i];
     }
-//        if (results[i] != 999 && results[i] != 0){
-//            // Some error internally, must catch this
-//            r += results[i];
-//        } else if (results[i] == 999 && r == 0){
-//            // First time unused correlation raised and no prior errors
-//            r = results[i];
-//        } else if (r == 999 && results[i] == 999){
-//            // Unused correlations raised multiple times
-//            r = 999;
-//        } else if (r == 999 && results[i] != 999){
-//            // Some error internally.
-//            r += results[i];
-//        } else if (r != 0){
-//            // Any other error
-//            r += results[i];
-//        }
-//    }
     free(results);
-    /* free fftw memory */
-    free_fftwf_arrays(num_threads_outer, template_ext, image_ext, ccc, outa, outb, out);
-    fftwf_destroy_plan(pa);
-    fftwf_destroy_plan(pb);
-    fftwf_destroy_plan(px);
-    if (num_threads_inner > 1) {
-        fftwf_cleanup_threads();
+    if (stats != NULL) {
+        stats->warnings |= ctx->warnings;
+    }
+    if (status != 0) {
+        return status;
+    }
+    return r;
+}
+
+multi_normxcorr_fftw_context *multi_normxcorr_fftw_create(
+    float *templates, long n_templates, long template_len, long n_channels,
+    long fft_len, int *used_chans, int *pad_array, int num_threads_inner,
+    int num_threads_outer, int planner)
+{
+  /*
+  Purpose: create a persistent context for repeated multi-channel correlations of the
+           same templates against different images (e.g. successive days of data).
+           Template spectra and FFTW plans are computed once and kept until
+           multi_normxcorr_fftw_destroy is called.
+  Args:
+    templates:      Normalised templates (stacked as for multi_normxcorr_fftw)
+    n_templates:    Number of templates
+    template_len:   Length of templates
+    n_channels:     Number of channels
+    fft_len:        Size for fft
+    used_chans:     Used channels (stacked as per templates) - copied
+    pad_array:      Default pads (stacked as per templates) - copied
+    num_threads_inner: Number of threads to parallel internal calculations over
+    num_threads_outer: Number of threads to parallel over channels - each needs
+                    its own workspace
+    planner:        FFTW planner rigour (PLANNER_ESTIMATE ... PLANNER_EXHAUSTIVE)
+  Returns:
+    Pointer to the context, or NULL if allocation failed.
+  Notes:
+    The template spectra for every channel are held in memory:
+    n_channels x n_templates x (fft_len / 2 + 1) complex floats.
+  */
+    return multi_normxcorr_fftw_context_new(
+        templates, n_templates, template_len, n_channels, fft_len, used_chans,
+        pad_array, num_threads_inner, num_threads_outer, planner, 1);
+}
+
+int multi_normxcorr_fftw_save(
+    multi_normxcorr_fftw_context *ctx, const char *filename, const char *key)
+{
+  /*
+  Purpose: write the template spectra of a context to a file, so that a context
+           can be made from them by multi_normxcorr_fftw_load without
+           transforming the templates again.
+  Args:
+    ctx:        Context from multi_normxcorr_fftw_create
+    filename:   File to write (overwritten)
+    key:        Identifier of the templates (e.g. a hash of their data), at most
+                SPECTRA_KEY_LEN - 1 characters, or NULL
+  Returns:
+    0 on success, -1 if the context has no cached spectra or writing failed.
+  Notes:
+    Files are written in the machine's own byte order and float format, and
+    hold n_channels x n_templates x (fft_len / 2 + 1) complex floats.
+  */
+    long chan;
+    size_t n = (size_t) ctx->n_channels * ctx->n_templates;
+    size_t N2 = (size_t) ctx->fft_len / 2 + 1;
+    spectra_file_header header;
+    FILE *f;
+    int status = 0;
+
+    if (ctx->template_spectra == NULL) {
+        printf("ERROR: context has no cached spectra to save\n");
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPECTRA_FILE_MAGIC, sizeof(SPECTRA_FILE_MAGIC));
+    header.version = SPECTRA_FILE_VERSION;
+    header.byte_order = 1;
+    header.n_templates = ctx->n_templates;
+    header.template_len = ctx->template_len;
+    header.n_channels = ctx->n_channels;
+    header.fft_len = ctx->fft_len;
+    if (key != NULL) {
+        strncpy(header.key, key, SPECTRA_KEY_LEN - 1);
+    }
+    f = fopen(filename, "wb");
+    if (f == NULL) {
+        printf("ERROR: could not open %s for writing\n", filename);
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(ctx->used_chans, sizeof(int), n, f) != n ||
+        fwrite(ctx->pad_array, sizeof(int), n, f) != n ||
+        fwrite(ctx->norm_sums, sizeof(float), n, f) != n) {
+        status = -1;
+    }
+    for (chan = 0; status == 0 && chan < ctx->n_channels; ++chan) {
+        if (fwrite(ctx->template_spectra[chan], sizeof(fftwf_complex),
+                   N2 * ctx->n_templates, f) != N2 * ctx->n_templates) {
+            status = -1;
+        }
+    }
+    if (fclose(f) != 0) {
+        status = -1;
+    }
+    if (status != 0) {
+        printf("ERROR: could not write spectra to %s\n", filename);
+    }
+    return status;
+}
+
+multi_normxcorr_fftw_context *multi_normxcorr_fftw_load(
+    const char *filename, const char *key, long fft_len, int num_threads_inner,
+    int num_threads_outer, int planner)
+{
+  /*
+  Purpose: create a context from template spectra written by
+           multi_normxcorr_fftw_save, without transforming the templates.
+  Args:
+    filename:       File to read
+    key:            Identifier the file must have been saved with, or NULL to
+                    accept any
+    fft_len:        FFT length the spectra must have, or 0 to accept any
+    num_threads_inner: As for multi_normxcorr_fftw_create
+    num_threads_outer: As for multi_normxcorr_fftw_create
+    planner:        As for multi_normxcorr_fftw_create
+  Returns:
+    Pointer to the context, or NULL if the file could not be read, was written
+    by another version or machine, or does not match key or fft_len.
+  */
+    long chan;
+    size_t n, N2;
+    spectra_file_header header;
+    multi_normxcorr_fftw_context *ctx;
+    int *used_chans, *pad_array, status = 0;
+    FILE *f;
+
+    f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("ERROR: could not open %s\n", filename);
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, SPECTRA_FILE_MAGIC, sizeof(SPECTRA_FILE_MAGIC)) != 0 ||
+        header.version != SPECTRA_FILE_VERSION || header.byte_order != 1) {
+        printf("ERROR: %s is not a spectra file of version %i\n", filename, SPECTRA_FILE_VERSION);
+        fclose(f);
+        return NULL;
+    }
+    header.key[SPECTRA_KEY_LEN - 1] = '\0';
+    if ((key != NULL && strncmp(header.key, key, SPECTRA_KEY_LEN - 1) != 0) ||
+        (fft_len > 0 && header.fft_len != fft_len) || header.n_templates < 1 ||
+        header.n_channels < 1 || header.template_len < 1 ||
+        header.fft_len < header.template_len) {
+        printf("ERROR: spectra in %s do not match the templates\n", filename);
+        fclose(f);
+        return NULL;
+    }
+    n = (size_t) (header.n_channels * header.n_templates);
+    N2 = (size_t) header.fft_len / 2 + 1;
+    used_chans = (int *) malloc(n * sizeof(int));
+    pad_array = (int *) malloc(n * sizeof(int));
+    if (used_chans == NULL || pad_array == NULL ||
+        fread(used_chans, sizeof(int), n, f) != n ||
+        fread(pad_array, sizeof(int), n, f) != n) {
+        printf("ERROR: could not read the channel layout from %s\n", filename);
+        free(used_chans);
+        free(pad_array);
+        fclose(f);
+        return NULL;
+    }
+    /* Plans are made before the spectra are read, measuring plans overwrites
+     * their arrays */
+    ctx = multi_normxcorr_fftw_context_new(
+        NULL, (long) header.n_templates, (long) header.template_len,
+        (long) header.n_channels, (long) header.fft_len, used_chans, pad_array,
+        num_threads_inner, num_threads_outer, planner, 1);
+    free(used_chans);
+    free(pad_array);
+    if (ctx == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    if (fread(ctx->norm_sums, sizeof(float), n, f) != n) {
+        status = -1;
+    }
+    for (chan = 0; status == 0 && chan < ctx->n_channels; ++chan) {
+        if (fread(ctx->template_spectra[chan], sizeof(fftwf_complex),
+                  N2 * ctx->n_templates, f) != N2 * ctx->n_templates) {
+            status = -1;
+        }
+    }
+    fclose(f);
+    if (status != 0) {
+        printf("ERROR: %s is truncated\n", filename);
+        multi_normxcorr_fftw_destroy(ctx);
+        return NULL;
+    }
+    if (ctx->spectra_replicas != NULL) {
+        context_place(ctx, TEAM_REPLICATE);
+    }
+    return ctx;
+}
+
+static image_channels *packed_image_new(float *image, long n_channels, long image_len)
+{
+    /* Pointers to each channel of a packed image (stacked [ch_1, ch_2, ..., ch_n]),
+     * NULL if allocation failed. Free with packed_image_destroy. */
+    long chan;
+    image_channels *channels = (image_channels *) calloc(1, sizeof(image_channels));
+
+    if (channels != NULL) {
+        channels->data = (void **) malloc((size_t) n_channels * sizeof(void *));
+        channels->lengths = (long *) malloc((size_t) n_channels * sizeof(long));
+        channels->strides = (long *) malloc((size_t) n_channels * sizeof(long));
+    }
+    if (channels == NULL || channels->data == NULL || channels->lengths == NULL ||
+        channels->strides == NULL) {
+        printf("Error allocating image channels\n");
+        packed_image_destroy(channels);
+        return NULL;
+    }
+    for (chan = 0; chan < n_channels; ++chan) {
+        channels->data[chan] = (image != NULL) ? &image[(size_t) chan * image_len] : NULL;
+        channels->lengths[chan] = image_len;
+        channels->strides[chan] = 1;
     }
-    fftwf_cleanup();
+    channels->dtype = IMAGE_FLOAT32;
+    return channels;
+}
+
+static void packed_image_destroy(image_channels *channels)
+{
+    if (channels == NULL) {
+        return;
+    }
+    free(channels->data);
+    free(channels->lengths);
+    free(channels->strides);
+    free(channels);
+}
+
+int multi_normxcorr_fftw_execute_image(
+    multi_normxcorr_fftw_context *ctx, const image_channels *image, long image_len,
+    void *ncc, int *pad_array, int *variance_warning, int *missed_corr,
+    int stack_option, int ncc_format, long stack_memory, sliding_moments **moments,
+    correlation_stats *stats)
+{
+  /*
+  Purpose: correlate an image (all channels) against the templates held in a context
+  Args:
+    ctx:            Context from multi_normxcorr_fftw_create
+    image:          Pointers to each channel of the image, converted to float as
+                    they are correlated (see image_channel_span)
+    image_len:      Length of image per channel - can change between calls, samples
+                    past the length of a channel are zero
+    ncc:            Output, as for multi_normxcorr_fftw (must be zeroed)
+    pad_array:      Pads (stacked as per templates), or NULL to use the pads the context
+                    was created with
+    variance_warning: Pointer to array to store warnings for variance issues
+    missed_corr:    Pointer to array to store warnings for unused correlations
+    stack_option:   Whether to stack correlograms (1) or leave as individual channels (0)
+    ncc_format:     Type of ncc, as for multi_normxcorr_fftw
+    stack_memory:   Bytes that can be used for thread-private stacks (see
+                    multi_normxcorr_fftw_run), zero to always stack atomically
+    moments:        Moments of each channel of image for template_len (see
+                    sliding_moments_create_image), or NULL to compute them here
+    stats:          Timings and counts of the call are added to this, or NULL
+  */
+    int r;
+    double t0 = wall_time();
 
+    if (ctx == NULL) {
+        printf("ERROR: NULL correlation context\n");
+        return -1;
+    }
+    r = multi_normxcorr_fftw_run(
+        ctx, NULL, image, image_len, ncc, image_len - ctx->template_len + 1,
+        pad_array, variance_warning, missed_corr, stack_option, ncc_format,
+        stack_memory, moments, NULL, 0, stats);
+    if (stats != NULL) {
+        stats->total += wall_time() - t0;
+    }
     return r;
 }
+
+int multi_normxcorr_fftw_execute(
+    multi_normxcorr_fftw_context *ctx, float *image, long image_len, void *ncc,
+    int *pad_array, int *variance_warning, int *missed_corr, int stack_option,
+    int ncc_format, long stack_memory, sliding_moments **moments,
+    correlation_stats *stats)
+{
+  /*
+  Purpose: as multi_normxcorr_fftw_execute_image for a packed float image
+  Args:
+    image:          Image (stacked [ch_1, ch_2, ..., ch_n])
+    Others as for multi_normxcorr_fftw_execute_image
+  */
+    int r;
+    image_channels *channels;
+
+    if (ctx == NULL) {
+        printf("ERROR: NULL correlation context\n");
+        return -1;
+    }
+    channels = packed_image_new(image, ctx->n_channels, image_len);
+    if (channels == NULL) {
+        return -1;
+    }
+    r = multi_normxcorr_fftw_execute_image(
+        ctx, channels, image_len, ncc, pad_array, variance_warning, missed_corr,
+        stack_option, ncc_format, stack_memory, moments, stats);
+    packed_image_destroy(channels);
+    return r;
+}
+
+int multi_normxcorr_fftw_execute_peaks_image(
+    multi_normxcorr_fftw_context *ctx, const image_channels *image, long image_len,
+    int *pad_array, int *variance_warning, int *missed_corr, long stack_memory,
+    sliding_moments **moments, ncc_peaks *peaks, correlation_stats *stats)
+{
+  /*
+  Purpose: correlate an image (all channels) against the templates held in a
+           context, keeping only the peaks of the stacked correlograms
+  Args:
+    ctx:            Context from multi_normxcorr_fftw_create
+    image:          Pointers to each channel of the image (see
+                    multi_normxcorr_fftw_execute_image)
+    image_len:      Length of image per channel
+    pad_array:      Pads (stacked as per templates), or NULL to use the pads the context
+                    was created with
+    variance_warning: Pointer to array to store warnings for variance issues
+    missed_corr:    Pointer to array to store warnings for unused correlations
+    stack_memory:   Bytes that can be used for stacking tiles of the correlograms
+    moments:        Moments of each channel of image for template_len (see
+                    sliding_moments_create_image), or NULL to compute them here
+    peaks:          From ncc_peaks_create for the templates of the context, call
+                    ncc_peaks_finish once done
+    stats:          Timings and counts of the call are added to this, or NULL
+  */
+    int r;
+    double t0 = wall_time();
+
+    if (ctx == NULL || peaks == NULL) {
+        printf("ERROR: NULL correlation context or peaks\n");
+        return -1;
+    }
+    r = multi_normxcorr_fftw_run(
+        ctx, NULL, image, image_len, NULL, image_len - ctx->template_len + 1,
+        pad_array, variance_warning, missed_corr, 1, NCC_FLOAT32, stack_memory,
+        moments, peaks, 0, stats);
+    if (stats != NULL) {
+        stats->total += wall_time() - t0;
+    }
+    return r;
+}
+
+int multi_normxcorr_fftw_execute_peaks(
+    multi_normxcorr_fftw_context *ctx, float *image, long image_len,
+    int *pad_array, int *variance_warning, int *missed_corr, long stack_memory,
+    sliding_moments **moments, ncc_peaks *peaks, correlation_stats *stats)
+{
+  /*
+  Purpose: as multi_normxcorr_fftw_execute_peaks_image for a packed float image
+  Args:
+    image:          Image (stacked [ch_1, ch_2, ..., ch_n])
+    Others as for multi_normxcorr_fftw_execute_peaks_image
+  */
+    int r;
+    image_channels *channels;
+
+    if (ctx == NULL || peaks == NULL) {
+        printf("ERROR: NULL correlation context or peaks\n");
+        return -1;
+    }
+    channels = packed_image_new(image, ctx->n_channels, image_len);
+    if (channels == NULL) {
+        return -1;
+    }
+    r = multi_normxcorr_fftw_execute_peaks_image(
+        ctx, channels, image_len, pad_array, variance_warning, missed_corr,
+        stack_memory, moments, peaks, stats);
+    packed_image_destroy(channels);
+    return r;
+}
+
+void multi_normxcorr_fftw_destroy(multi_normxcorr_fftw_context *ctx)
+{
+    /* Free everything held by a context - safe on partially constructed contexts */
+    long chan;
+    int i, had_plans, n_workers;
+
+    if (ctx == NULL) {
+        return;
+    }
+    n_workers = ctx->num_threads_outer * ctx->num_threads_inner;
+    if (ctx->template_ext != NULL && ctx->image_ext != NULL && ctx->ccc != NULL &&
+        ctx->outa != NULL && ctx->outb != NULL && ctx->out != NULL) {
+        free_fftwf_arrays(n_workers, ctx->template_ext, ctx->image_ext,
+                          ctx->ccc, ctx->outa, ctx->outb, ctx->out);
+    } else {
+        free(ctx->template_ext);
+        free(ctx->image_ext);
+        free(ctx->ccc);
+        free(ctx->outa);
+        free(ctx->outb);
+        free(ctx->out);
+    }
+    for (i = 0; i < n_workers; i++) {
+        if (ctx->mean != NULL) {free(ctx->mean[i]);}
+        if (ctx->inv_std != NULL) {free(ctx->inv_std[i]);}
+        if (ctx->valid != NULL) {free(ctx->valid[i]);}
+    }
+    free(ctx->mean);
+    free(ctx->inv_std);
+    free(ctx->valid);
+    if (ctx->template_spectra != NULL) {
+        for (chan = 0; chan < ctx->n_channels; ++chan) {
+            fftwf_free(ctx->template_spectra[chan]);
+        }
+        free(ctx->template_spectra);
+    }
+    if (ctx->spectra_replicas != NULL) {
+        for (chan = 0; chan < (ctx->n_replicas - 1) * ctx->n_channels; ++chan) {
+            fftwf_free(ctx->spectra_replicas[chan]);
+        }
+        free(ctx->spectra_replicas);
+    }
+    had_plans = (ctx->px != NULL);
+    #pragma omp critical(fftw_planner)
+    {
+        if (ctx->pa != NULL) {fftwf_destroy_plan(ctx->pa);}
+        if (ctx->pb != NULL) {fftwf_destroy_plan(ctx->pb);}
+        if (ctx->px != NULL) {fftwf_destroy_plan(ctx->px);}
+        if (had_plans) {live_contexts -= 1;}
+    }
+    if (had_plans) {
+        fftwf_cleanup_if_idle(ctx->num_threads_inner > 1);
+    }
+    free(ctx->norm_sums);
+    free(ctx->used_chans);
+    free(ctx->pad_array);
+    free(ctx);
+}
+
+multi_normxcorr_fftw_stream *multi_normxcorr_fftw_stream_create(
+    float *templates, long n_templates, long template_len, long n_channels,
+    long fft_len, int *used_chans, int *pad_array, int num_threads_inner,
+    int num_threads_outer, int planner)
+{
+  /*
+  Purpose: create a streaming correlator, for correlating successive blocks of
+           data (e.g. from a real-time feed) as they arrive.
+  Args:
+    As for multi_normxcorr_fftw_create - pads are fixed for the life of the
+    stream.
+  Returns:
+    Pointer to the stream, or NULL if allocation failed.
+  Notes:
+    The last template_len - 1 + max(pad_array) samples of each channel are kept
+    so that every push can be correlated with overlap-save from where the last
+    one stopped; the template spectra are held as for
+    multi_normxcorr_fftw_create.
+  */
+    long i;
+    multi_normxcorr_fftw_stream *stream;
+
+    stream = (multi_normxcorr_fftw_stream *) calloc(1, sizeof(multi_normxcorr_fftw_stream));
+    if (stream == NULL) {
+        printf("Error allocating correlation stream\n");
+        return NULL;
+    }
+    for (i = 0; i < n_channels * n_templates; ++i) {
+        stream->max_pad = (pad_array[i] > stream->max_pad) ? pad_array[i] : stream->max_pad;
+    }
+    stream->history_len = template_len - 1 + stream->max_pad;
+    stream->history = (float *) malloc((size_t) n_channels * (stream->history_len + 1) * sizeof(float));
+    if (stream->history == NULL) {
+        printf("Error allocating stream history\n");
+        multi_normxcorr_fftw_stream_destroy(stream);
+        return NULL;
+    }
+    stream->ctx = multi_normxcorr_fftw_context_new(
+        templates, n_templates, template_len, n_channels, fft_len, used_chans,
+        pad_array, num_threads_inner, num_threads_outer, planner, 1);
+    if (stream->ctx == NULL) {
+        multi_normxcorr_fftw_stream_destroy(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+int multi_normxcorr_fftw_stream_push(
+    multi_normxcorr_fftw_stream *stream, float *block, long block_len,
+    float *ncc, long *n_out, int *variance_warning, int *missed_corr,
+    int stack_option, long stack_memory, correlation_stats *stats)
+{
+  /*
+  Purpose: correlate the next block of samples of every channel, returning only
+           correlations that could not be computed before
+  Args:
+    stream:         Stream from multi_normxcorr_fftw_stream_create
+    block:          New samples (stacked [ch_1, ch_2, ..., ch_n])
+    block_len:      Number of new samples per channel - can change between pushes
+    ncc:            Output, as for multi_normxcorr_fftw with block_len for the
+                    correlogram length (must be zeroed). Rows are n_out long.
+    n_out:          Output for the number of correlations per correlogram, this is
+                    block_len once template_len + max(pad) samples have been pushed
+                    and fewer before.
+    variance_warning: Pointer to array to store warnings for variance issues
+    missed_corr:    Pointer to array to store warnings for unused correlations
+    stack_option:   Whether to stack correlograms (1) or leave as individual channels (0)
+    stack_memory:   Bytes that can be used for thread-private stacks (see
+                    multi_normxcorr_fftw_run)
+    stats:          Timings and counts of the push are added to this, or NULL
+  Notes:
+    Correlations are only returned once every channel has data for them, so
+    correlation i of the stream (counted from the first sample pushed) is
+    returned once i + template_len + max(pad) samples have been pushed.
+  */
+    int r = 0;
+    long chan, n_done, n_ready, n_keep, image_len;
+    long n_channels, history_len;
+    float *image;
+    double t0 = wall_time();
+
+    *n_out = 0;
+    if (stream == NULL || stream->ctx == NULL) {
+        printf("ERROR: NULL correlation stream\n");
+        return -1;
+    }
+    if (block_len < 1) {
+        return 0;
+    }
+    n_channels = stream->ctx->n_channels;
+    history_len = stream->history_len;
+    image_len = stream->n_held + block_len;
+
+    /* The history followed by the new samples for each channel */
+    if (block_len > stream->capacity) {
+        image = (float *) realloc(stream->image, (size_t) n_channels * (history_len + block_len) * sizeof(float));
+        if (image == NULL) {
+            printf("Error allocating stream workspace\n");
+            return -1;
+        }
+        stream->image = image;
+        stream->capacity = block_len;
+        if (stats != NULL) {
+            stats->bytes_allocated += (long long) n_channels * (history_len + block_len) * sizeof(float);
+        }
+    }
+    image = stream->image;
+    for (chan = 0; chan < n_channels; ++chan) {
+        memcpy(&image[(size_t) chan * image_len], &stream->history[(size_t) chan * history_len],
+               (size_t) stream->n_held * sizeof(float));
+        memcpy(&image[(size_t) chan * image_len + stream->n_held], &block[(size_t) chan * block_len],
+               (size_t) block_len * sizeof(float));
+    }
+
+    /* Correlation i needs samples up to i + history_len of every channel, the
+     * held samples start at the first correlation not yet returned */
+    n_done = stream->n_pushed - history_len;
+    n_done = (n_done > 0) ? n_done : 0;
+    n_ready = stream->n_pushed + block_len - history_len;
+    n_ready = (n_ready > 0) ? n_ready : 0;
+    if (n_ready > n_done) {
+        image_channels *channels = packed_image_new(image, n_channels, image_len);
+        if (channels == NULL) {
+            return -1;
+        }
+        /* The held samples start at sample n_done of the stream */
+        channels->origin = n_done;
+        r = multi_normxcorr_fftw_run(
+            stream->ctx, NULL, channels, image_len, ncc, n_ready - n_done, NULL,
+            variance_warning, missed_corr, stack_option, NCC_FLOAT32,
+            stack_memory, NULL, NULL, 0, stats);
+        packed_image_destroy(channels);
+        if (r < 0) {
+            return r;
+        }
+        *n_out = n_ready - n_done;
+    }
+
+    /* Keep the end of each channel for the next push */
+    n_keep = (image_len < history_len) ? image_len : history_len;
+    for (chan = 0; chan < n_channels; ++chan) {
+        memcpy(&stream->history[(size_t) chan * history_len],
+               &image[(size_t) chan * image_len + image_len - n_keep],
+               (size_t) n_keep * sizeof(float));
+    }
+    stream->n_held = n_keep;
+    stream->n_pushed += block_len;
+    if (stats != NULL) {
+        stats->total += wall_time() - t0;
+    }
+    return r;
+}
+
+void multi_normxcorr_fftw_stream_destroy(multi_normxcorr_fftw_stream *stream)
+{
+    /* Free everything held by a stream - safe on partially constructed streams */
+    if (stream == NULL) {
+        return;
+    }
+    multi_normxcorr_fftw_destroy(stream->ctx);
+    free(stream->history);
+    free(stream->image);
+    free(stream);
+}
+
+// Batches of short correlations
+static int compare_batch_keys(const void *a, const void *b){
+    // Order jobs by FFT length (time-domain jobs first), then by job
+    const long long *ka = (const long long *) a, *kb = (const long long *) b;
+
+    if (ka[0] != kb[0]) {
+        return (ka[0] < kb[0]) ? -1 : 1;
+    }
+    return (ka[1] < kb[1]) ? -1 : (ka[1] > kb[1]);
+}
+
+static long batch_fft_len(long window_len){
+    // Smallest power of two that holds the window, correlations do not wrap
+    long fft_len = 16;
+
+    while (fft_len < window_len) {
+        fft_len *= 2;
+    }
+    return fft_len;
+}
+
+static long batch_prepare(
+    const float *templates, const float *windows, const long long *job,
+    float *norm_template, double *norm_sum, float *shifted, double *mean,
+    double *inv_std, unsigned char *valid)
+{
+  /*
+    Normalise the template of a job, (template - mean) / (std * template_len),
+    and compute the moments of the windows of its image. The image is written
+    into shifted less the mean of its first window, so that float correlations
+    do not lose precision on data with a large mean (see
+    multi_normxcorr_time_blocked), and the moments are shifted to match.
+    Returns the number of correlations that can be normalised.
+  */
+    const float *tmpl = &templates[job[BATCH_TEMPLATE]];
+    const float *window = &windows[job[BATCH_WINDOW]];
+    long template_len = (long) job[BATCH_TEMPLATE_LEN], window_len = (long) job[BATCH_WINDOW_LEN];
+    long n_lags = window_len - template_len + 1, i, n_valid = 0;
+    double t_mean = 0.0, t_var = 0.0, shift;
+
+    for (i = 0; i < template_len; ++i){
+        t_mean += tmpl[i];
+    }
+    t_mean /= template_len;
+    for (i = 0; i < template_len; ++i){
+        t_var += ((double) tmpl[i] - t_mean) * ((double) tmpl[i] - t_mean);
+    }
+    t_var /= template_len;
+    *norm_sum = 0.0;
+    if (!(t_var > 0.0) || !isfinite(t_var)) {
+        return 0;
+    }
+    for (i = 0; i < template_len; ++i){
+        norm_template[i] = (float) (((double) tmpl[i] - t_mean) / (sqrt(t_var) * template_len));
+        *norm_sum += norm_template[i];
+    }
+    sliding_moments_range(window, template_len, 0, n_lags, mean, inv_std, valid, 1);
+    for (i = 0; i < n_lags; ++i){
+        n_valid += (valid[i] & MOMENT_VALID) ? 1 : 0;
+    }
+    shift = mean[0];
+    for (i = 0; i < window_len; ++i){
+        shifted[i] = (float) ((double) window[i] - shift);
+    }
+    for (i = 0; i < n_lags; ++i){
+        mean[i] -= shift;
+    }
+    return n_valid;
+}
+
+static int batch_finish(
+    float *ccc, long n_lags, long n_valid, const double *mean,
+    const double *inv_std, const unsigned char *valid, double norm_sum,
+    double scale, int interpolate, float *cc_max, double *lag)
+{
+  /*
+    Normalise, clip and find the maximum of the correlations of a job, see
+    normxcorr_batch. Returns the number of out-of-range correlations.
+  */
+    long k, peak = 0;
+    int status = 0;
+
+    if (n_valid == 0) {
+        memset(ccc, 0, (size_t) n_lags * sizeof(float));
+        *cc_max = 0.0f;
+        *lag = 0.0;
+        return 0;
+    }
+    normalise_correlations(ccc, mean, inv_std, norm_sum, scale, n_lags);
+    for (k = 0; k < n_lags; ++k){
+        ccc[k] = (valid[k] & MOMENT_VALID) ? clip_ncc(ccc[k], &status) : 0.0f;
+        if (ccc[k] > ccc[peak]) {
+            peak = k;
+        }
+    }
+    *cc_max = ccc[peak];
+    *lag = (double) peak;
+    if (interpolate && peak > 0 && peak < n_lags - 1) {
+        /* Vertex of the parabola through the peak and its neighbours */
+        double before = ccc[peak - 1], after = ccc[peak + 1];
+        double curvature = before - 2.0 * ccc[peak] + after;
+
+        if (curvature < 0.0) {
+            double offset = 0.5 * (before - after) / curvature;
+            double value = ccc[peak] - 0.25 * (before - after) * offset;
+
+            *lag += offset;
+            *cc_max = (float) ((value > 1.0) ? 1.0 : value);
+        }
+    }
+    return status;
+}
+
+int normxcorr_batch(
+    float *templates, float *windows, long long *jobs, long long n_jobs,
+    float *cc_max, double *lags, float *ccc, int interpolate, int num_threads,
+    int method)
+{
+  /*
+  Purpose: normalised cross-correlations of many short templates with short
+           windows of data, e.g. for refining picks or clustering events.
+           Templates are normalised here. Short jobs are correlated in the
+           time-domain, longer jobs in batches of BATCH_FFT_JOBS transforms of
+           the same length, with plans made once per length.
+  Args:
+    templates:      Packed template samples
+    windows:        Packed window samples
+    jobs:           n_jobs x BATCH_JOB_FIELDS offsets and lengths of the template
+                    and window of each job. Jobs can share templates and windows.
+    n_jobs:         Number of jobs
+    cc_max:         Output, maximum correlation of each job
+    lags:           Output, lag of the maximum of each job in samples from the
+                    start of the window
+    ccc:            Output for all correlations of each job in turn, window_len -
+                    template_len + 1 for each job, or NULL
+    interpolate:    Refine maxima by fitting a parabola to the peak and the
+                    correlations either side
+    num_threads:    Number of threads to parallel jobs over
+    method:         BATCH_AUTO to pick the time-domain or FFT for each job by
+                    BATCH_TIME_RATIO, or BATCH_TIME or BATCH_FFT for all jobs
+  Returns:
+    0 on success, -1 on failure, otherwise the number of out-of-range
+    correlations (these are zeroed).
+  Notes:
+    Correlations that cannot be normalised (flat templates or windows) are
+    zero, jobs without any have a maximum of zero at lag zero. Windows are
+    normalised as in multi_normxcorr_fftw, so correlations match it within
+    float precision.
+  */
+    long long j, n_tasks = 0, n_fft = 0, *keys, *task_start, *ccc_offsets = NULL;
+    long max_template = 1, max_window = 1, max_fft = 0;
+    int s, n_sizes = 0, n_failed = 0, n_clipped = 0;
+    long *sizes = NULL;
+    fftwf_plan *forward = NULL, *inverse = NULL;
+
+    if (method < BATCH_AUTO || method > BATCH_FFT) {
+        printf("ERROR: batch method %i is not supported\n", method);
+        return -1;
+    }
+    for (j = 0; j < n_jobs; ++j){
+        const long long *job = &jobs[j * BATCH_JOB_FIELDS];
+        if (job[BATCH_TEMPLATE_LEN] < 1 || job[BATCH_WINDOW_LEN] < job[BATCH_TEMPLATE_LEN] ||
+            job[BATCH_TEMPLATE] < 0 || job[BATCH_WINDOW] < 0) {
+            printf("ERROR: job %lld has a window shorter than its template\n", j);
+            return -1;
+        }
+    }
+    if (n_jobs < 1) {
+        return 0;
+    }
+    num_threads = (num_threads < 1) ? 1 : num_threads;
+
+    /* Sort jobs into tasks: each time-domain job is a task, FFT jobs of the
+     * same length are grouped into tasks of up to BATCH_FFT_JOBS */
+    keys = (long long *) malloc((size_t) n_jobs * 2 * sizeof(long long));
+    task_start = (long long *) malloc((size_t) (n_jobs + 1) * sizeof(long long));
+    if (ccc != NULL) {
+        ccc_offsets = (long long *) malloc((size_t) n_jobs * sizeof(long long));
+    }
+    if (keys == NULL || task_start == NULL || (ccc != NULL && ccc_offsets == NULL)) {
+        printf("Error allocating jobs in normxcorr_batch\n");
+        free(keys);
+        free(task_start);
+        free(ccc_offsets);
+        return -1;
+    }
+    for (j = 0; j < n_jobs; ++j){
+        const long long *job = &jobs[j * BATCH_JOB_FIELDS];
+        long template_len = (long) job[BATCH_TEMPLATE_LEN], window_len = (long) job[BATCH_WINDOW_LEN];
+        long n_lags = window_len - template_len + 1, fft_len = batch_fft_len(window_len);
+        int use_fft = (method == BATCH_FFT) || (method == BATCH_AUTO &&
+            (double) template_len * n_lags > BATCH_TIME_RATIO * fft_len * log2((double) fft_len));
+
+        keys[2 * j] = (use_fft) ? fft_len : 0;
+        keys[2 * j + 1] = j;
+        if (ccc != NULL) {
+            ccc_offsets[j] = (j == 0) ? 0 : ccc_offsets[j - 1] + (jobs[(j - 1) * BATCH_JOB_FIELDS + BATCH_WINDOW_LEN] -
+                                                                  jobs[(j - 1) * BATCH_JOB_FIELDS + BATCH_TEMPLATE_LEN] + 1);
+        }
+        max_template = (template_len > max_template) ? template_len : max_template;
+        max_window = (fft_len > max_window) ? fft_len : max_window;
+        if (use_fft) {
+            max_fft = (fft_len > max_fft) ? fft_len : max_fft;
+            n_fft += 1;
+        }
+    }
+    qsort(keys, (size_t) n_jobs, 2 * sizeof(long long), compare_batch_keys);
+    for (j = 0; j < n_jobs; ++j){
+        if (keys[2 * j] == 0 || j == 0 || keys[2 * j] != keys[2 * (j - 1)] ||
+            j - task_start[n_tasks - 1] == BATCH_FFT_JOBS) {
+            task_start[n_tasks++] = j;
+        }
+        if (keys[2 * j] != 0 && (n_sizes == 0 || keys[2 * j] != keys[2 * (j - 1)])) {
+            n_sizes += 1;
+        }
+    }
+    task_start[n_tasks] = n_jobs;
+    if (n_sizes > 0) {
+        sizes = (long *) malloc(n_sizes * sizeof(long));
+        forward = (fftwf_plan *) calloc(n_sizes, sizeof(fftwf_plan));
+        inverse = (fftwf_plan *) calloc(n_sizes, sizeof(fftwf_plan));
+        if (sizes == NULL || forward == NULL || inverse == NULL) {
+            printf("Error allocating plans in normxcorr_batch\n");
+            free(keys);
+            free(task_start);
+            free(ccc_offsets);
+            free(sizes);
+            free(forward);
+            free(inverse);
+            return -1;
+        }
+        for (j = 0, s = 0; j < n_jobs; ++j){
+            if (keys[2 * j] != 0 && (s == 0 || keys[2 * j] != sizes[s - 1])) {
+                sizes[s++] = (long) keys[2 * j];
+            }
+        }
+    }
+
+    #pragma omp parallel num_threads(num_threads) reduction(+:n_failed,n_clipped)
+    {
+        long long task;
+        int n_slots = (n_fft > 0) ? BATCH_FFT_JOBS : 1;
+        size_t N2_max = (size_t) max_fft / 2 + 1;
+        float *norm_template = (float *) malloc(max_template * sizeof(float));
+        float *shifted = (float *) malloc(max_window * sizeof(float));
+        float *dots = (float *) malloc(max_window * sizeof(float));
+        double *mean = (double *) malloc((size_t) n_slots * max_window * sizeof(double));
+        double *inv_std = (double *) malloc((size_t) n_slots * max_window * sizeof(double));
+        unsigned char *valid = (unsigned char *) malloc((size_t) n_slots * max_window * sizeof(unsigned char));
+        float *real_in = NULL, *real_out = NULL;
+        fftwf_complex *spectra = NULL, *product = NULL;
+        int ok = (norm_template != NULL && shifted != NULL && dots != NULL &&
+                  mean != NULL && inv_std != NULL && valid != NULL);
+
+        if (n_fft > 0) {
+            /* Templates of a batch, then windows, are transformed together */
+            real_in = (float *) fftwf_malloc((size_t) 2 * BATCH_FFT_JOBS * max_fft * sizeof(float));
+            real_out = (float *) fftwf_malloc((size_t) BATCH_FFT_JOBS * max_fft * sizeof(float));
+            spectra = (fftwf_complex *) fftwf_malloc(2 * BATCH_FFT_JOBS * N2_max * sizeof(fftwf_complex));
+            product = (fftwf_complex *) fftwf_malloc(BATCH_FFT_JOBS * N2_max * sizeof(fftwf_complex));
+            ok = ok && real_in != NULL && real_out != NULL && spectra != NULL && product != NULL;
+        }
+        if (!ok) {
+            n_failed += 1;
+        }
+        if (n_sizes > 0) {
+            /* Plans are executed on the workspaces of every thread, these are
+             * all from fftwf_malloc so have the alignment of the planned arrays */
+            #pragma omp single
+            {
+                if (ok) {
+                    #pragma omp critical(fftw_planner)
+                    {
+                        #ifdef N_THREADS
+                        if (fftw_threads_ready) {
+                            fftwf_plan_with_nthreads(1);
+                        }
+                        #endif
+                        int size;
+
+                        for (size = 0; size < n_sizes; ++size) {
+                            int n = (int) sizes[size], n2 = (int) sizes[size] / 2 + 1;
+                            forward[size] = fftwf_plan_many_dft_r2c(
+                                1, &n, 2 * BATCH_FFT_JOBS, real_in, NULL, 1, n,
+                                spectra, NULL, 1, n2, FFTW_ESTIMATE);
+                            inverse[size] = fftwf_plan_many_dft_c2r(
+                                1, &n, BATCH_FFT_JOBS, product, NULL, 1, n2,
+                                real_out, NULL, 1, n, FFTW_ESTIMATE);
+                        }
+                        live_contexts += 1;
+                    }
+                }
+            }
+            ok = ok && forward[0] != NULL;
+        }
+
+        #pragma omp for schedule(dynamic)
+        for (task = 0; task < n_tasks; ++task){
+            long long first = task_start[task], n = task_start[task + 1] - first, b;
+            long fft_len = (long) keys[2 * first];
+
+            if (!ok) {
+                continue;
+            }
+            if (fft_len == 0) {
+                // Time-domain
+                long long job_id = keys[2 * first + 1];
+                const long long *job = &jobs[job_id * BATCH_JOB_FIELDS];
+                long template_len = (long) job[BATCH_TEMPLATE_LEN];
+                long n_lags = (long) (job[BATCH_WINDOW_LEN] - job[BATCH_TEMPLATE_LEN] + 1);
+                float *out = (ccc != NULL) ? &ccc[ccc_offsets[job_id]] : dots;
+                double norm_sum;
+                long n_valid = batch_prepare(
+                    templates, windows, job, norm_template, &norm_sum, shifted, mean,
+                    inv_std, valid);
+
+                if (n_valid > 0) {
+                    correlate_templates(norm_template, template_len, 1, shifted, n_lags, out, n_lags);
+                }
+                n_clipped += batch_finish(
+                    out, n_lags, n_valid, mean, inv_std, valid, norm_sum, 1.0,
+                    interpolate, &cc_max[job_id], &lags[job_id]);
+            } else {
+                // Batched FFTs
+                long N2 = fft_len / 2 + 1, n_valid[BATCH_FFT_JOBS], i;
+                double norm_sums[BATCH_FFT_JOBS];
+                int size = 0;
+
+                while (sizes[size] != fft_len) {
+                    ++size;
+                }
+                memset(real_in, 0, (size_t) 2 * BATCH_FFT_JOBS * fft_len * sizeof(float));
+                for (b = 0; b < n; ++b){
+                    const long long *job = &jobs[keys[2 * (first + b) + 1] * BATCH_JOB_FIELDS];
+                    long template_len = (long) job[BATCH_TEMPLATE_LEN];
+
+                    n_valid[b] = batch_prepare(
+                        templates, windows, job, norm_template, &norm_sums[b],
+                        &real_in[(BATCH_FFT_JOBS + b) * fft_len],
+                        &mean[b * max_window], &inv_std[b * max_window],
+                        &valid[b * max_window]);
+                    /* Templates are reversed so that the product of spectra
+                     * correlates, as in normxcorr_fftw */
+                    for (i = 0; i < template_len && n_valid[b] > 0; ++i){
+                        real_in[b * fft_len + i] = norm_template[template_len - 1 - i];
+                    }
+                }
+                fftwf_execute_dft_r2c(forward[size], real_in, spectra);
+                for (b = 0; b < n; ++b){
+                    multiply_spectra(&spectra[b * N2], &spectra[(BATCH_FFT_JOBS + b) * N2],
+                                     &product[b * N2], N2);
+                }
+                fftwf_execute_dft_c2r(inverse[size], product, real_out);
+                for (b = 0; b < n; ++b){
+                    long long job_id = keys[2 * (first + b) + 1];
+                    const long long *job = &jobs[job_id * BATCH_JOB_FIELDS];
+                    long template_len = (long) job[BATCH_TEMPLATE_LEN];
+                    long n_lags = (long) (job[BATCH_WINDOW_LEN] - job[BATCH_TEMPLATE_LEN] + 1);
+                    float *out = (ccc != NULL) ? &ccc[ccc_offsets[job_id]] : dots;
+
+                    memcpy(out, &real_out[b * fft_len + template_len - 1], (size_t) n_lags * sizeof(float));
+                    n_clipped += batch_finish(
+                        out, n_lags, n_valid[b], &mean[b * max_window],
+                        &inv_std[b * max_window], &valid[b * max_window],
+                        norm_sums[b], 1.0 / fft_len, interpolate, &cc_max[job_id],
+                        &lags[job_id]);
+                }
+            }
+        }
+        free(norm_template);
+        free(shifted);
+        free(dots);
+        free(mean);
+        free(inv_std);
+        free(valid);
+        fftwf_free(real_in);
+        fftwf_free(real_out);
+        fftwf_free(spectra);
+        fftwf_free(product);
+    }
+
+    if (n_sizes > 0) {
+        int had_plans = (forward[0] != NULL);
+
+        #pragma omp critical(fftw_planner)
+        {
+            for (s = 0; s < n_sizes; ++s) {
+                if (forward[s] != NULL) {fftwf_destroy_plan(forward[s]);}
+                if (inverse[s] != NULL) {fftwf_destroy_plan(inverse[s]);}
+            }
+            if (had_plans) {live_contexts -= 1;}
+        }
+        if (had_plans) {
+            fftwf_cleanup_if_idle(0);
+        }
+    }
+    free(keys);
+    free(task_start);
+    free(ccc_offsets);
+    free(sizes);
+    free(forward);
+    free(inverse);
+    if (n_failed > 0) {
+        printf("Error allocating workspaces in normxcorr_batch\n");
+        return -1;
+    }
+    return n_clipped;
+}
+
+static long template_batch_size(
+    long n_templates, long n_channels, long fft_len, int num_threads_inner,
+    int num_threads_outer, long memory_limit, int *warnings)
+{
+  /*
+    Number of templates that can be correlated at once within memory_limit bytes
+    of workspace, or n_templates if there is no limit. If one template does not
+    fit, CORR_WARN_MEMORY_LIMIT is set in warnings (if not NULL).
+  */
+    long batch_size;
+    double per_template, n_outer, n_workers;
+    size_t N2 = (size_t) fft_len / 2 + 1;
+
+    if (memory_limit <= 0) {
+        return n_templates;
+    }
+    n_outer = (num_threads_outer > n_channels) ? n_channels : num_threads_outer;
+    n_outer = (n_outer < 1) ? 1 : n_outer;
+    n_workers = n_outer * ((num_threads_inner < 1) ? 1 : num_threads_inner);
+    /* Each outer thread transforms templates in template_ext into outa, each
+     * worker multiplies into out and transforms into ccc. Correlations in tiles
+     * of time also hold the spectra of every channel (see context_hoist_spectra) */
+    per_template = (n_outer + n_workers) * (fft_len * sizeof(float) + N2 * sizeof(fftwf_complex)) +
+                   n_channels * (N2 * sizeof(fftwf_complex) + sizeof(float));
+    batch_size = (long) (memory_limit / per_template);
+    if (batch_size < 1) {
+        if (warnings != NULL) {
+            *warnings |= CORR_WARN_MEMORY_LIMIT;
+        }
+        batch_size = 1;
+    }
+    return (batch_size > n_templates) ? n_templates : batch_size;
+}
+
+static int multi_normxcorr_fftw_batches(
+    float *templates, long n_templates, long template_len, long n_channels,
+    const image_channels *image, long image_len, void *ncc, long fft_len, int *used_chans,
+    int *pad_array, int num_threads_inner, int num_threads_outer,
+    int *variance_warning, int *missed_corr, int stack_option, int ncc_format,
+    int planner, long stack_memory, long memory_limit, sliding_moments **moments,
+    ncc_peaks *peaks, correlation_stats *stats)
+{
+  /*
+    Correlate in batches of templates that fit in memory_limit, either into ncc
+    or keeping only the peaks (see multi_normxcorr_fftw_run). Contexts and
+    moments made here are counted in the bytes_allocated of stats.
+  */
+    int r = 0, status;
+    long t, batch_start, batch_len, batch_size, n_batches, chan;
+    long ncc_len = image_len - template_len + 1;
+    long ncc_stride = ncc_len * ((stack_option == 1) ? 1 : n_channels);
+    double moments_size = (double) n_channels * ncc_len * (2 * sizeof(double) + sizeof(unsigned char));
+    float *batch_templates = NULL;
+    int *batch_used = NULL, *batch_pads = NULL, *batch_warnings = NULL, *batch_missed = NULL;
+    sliding_moments **batch_moments = NULL;
+    multi_normxcorr_fftw_context *ctx = NULL;
+    double t0 = wall_time(), t_moments;
+
+    /* Check that stack-type is within range (0-1) */
+    if (stack_option > 1) {
+        printf("ERROR: stack_option %i is not supported\n", stack_option);
+        return -1;
+    }
+
+    batch_size = template_batch_size(
+        n_templates, n_channels, fft_len, num_threads_inner, num_threads_outer,
+        memory_limit, (stats != NULL) ? &stats->warnings : NULL);
+    if (batch_size >= n_templates) {
+        /* One-shot: do not cache spectra for all channels, transform per-channel instead */
+        ctx = multi_normxcorr_fftw_context_new(
+            templates, n_templates, template_len, n_channels, fft_len, used_chans,
+            pad_array, num_threads_inner, num_threads_outer, planner, 0);
+        if (ctx == NULL) {
+            return -1;
+        }
+        if (stats != NULL) {
+            stats->bytes_allocated += ctx->bytes;
+        }
+        r = multi_normxcorr_fftw_run(
+            ctx, templates, image, image_len, ncc, ncc_len, pad_array,
+            variance_warning, missed_corr, stack_option, ncc_format, stack_memory,
+            moments, peaks, 0, stats);
+        multi_normxcorr_fftw_destroy(ctx);
+        if (stats != NULL) {
+            stats->total += wall_time() - t0;
+        }
+        return r;
+    }
+
+    /* Otherwise every batch would recompute the moments of every channel */
+    if (moments == NULL && ncc_len > 0 && moments_size <= memory_limit / 2) {
+        t_moments = wall_time();
+        batch_moments = (sliding_moments **) calloc(n_channels, sizeof(sliding_moments*));
+        for (chan = 0; batch_moments != NULL && chan < n_channels; ++chan) {
+            batch_moments[chan] = sliding_moments_create_image(
+                image, chan, image_len, template_len,
+                num_threads_inner * num_threads_outer);
+            if (batch_moments[chan] == NULL) {
+                r = -1;
+                break;
+            }
+        }
+        if (batch_moments == NULL) {
+            printf("Error allocating moments\n");
+            r = -1;
+        }
+        if (stats != NULL) {
+            stats->moments += wall_time() - t_moments;
+            stats->bytes_allocated += (long long) moments_size;
+        }
+        moments = batch_moments;
+        batch_size = template_batch_size(
+            n_templates, n_channels, fft_len, num_threads_inner,
+            num_threads_outer, memory_limit - (long) moments_size,
+            (stats != NULL) ? &stats->warnings : NULL);
+    }
+
+    /* Balance the batches so that there are at most two sizes to plan for */
+    n_batches = (n_templates + batch_size - 1) / batch_size;
+    batch_size = (n_templates + n_batches - 1) / n_batches;
+    batch_templates = (float *) malloc((size_t) batch_size * n_channels * template_len * sizeof(float));
+    batch_used = (int *) malloc((size_t) batch_size * n_channels * sizeof(int));
+    batch_pads = (int *) malloc((size_t) batch_size * n_channels * sizeof(int));
+    batch_warnings = (int *) calloc(n_channels, sizeof(int));
+    batch_missed = (int *) calloc(n_channels, sizeof(int));
+    if (batch_templates == NULL || batch_used == NULL || batch_pads == NULL ||
+        batch_warnings == NULL || batch_missed == NULL) {
+        printf("Error allocating template batches\n");
+        r = -1;
+    }
+
+    for (batch_start = 0; r >= 0 && batch_start < n_templates; batch_start += batch_len) {
+        batch_len = (batch_start + batch_size > n_templates) ? n_templates - batch_start : batch_size;
+        /* Gather this batch of templates for every channel */
+        for (chan = 0; chan < n_channels; ++chan) {
+            size_t src = (size_t) chan * n_templates + batch_start;
+            size_t dst = (size_t) chan * batch_len;
+            memcpy(&batch_templates[dst * template_len], &templates[src * template_len],
+                   (size_t) batch_len * template_len * sizeof(float));
+            for (t = 0; t < batch_len; ++t) {
+                batch_used[dst + t] = used_chans[src + t];
+                batch_pads[dst + t] = pad_array[src + t];
+            }
+        }
+        if (ctx != NULL && ctx->n_templates != batch_len) {
+            multi_normxcorr_fftw_destroy(ctx);
+            ctx = NULL;
+        }
+        if (ctx == NULL) {
+            ctx = multi_normxcorr_fftw_context_new(
+                batch_templates, batch_len, template_len, n_channels, fft_len,
+                batch_used, batch_pads, num_threads_inner, num_threads_outer,
+                planner, 0);
+            if (ctx == NULL) {
+                r = -1;
+                break;
+            }
+            if (stats != NULL) {
+                stats->bytes_allocated += ctx->bytes;
+            }
+        } else {
+            memcpy(ctx->used_chans, batch_used, (size_t) batch_len * n_channels * sizeof(int));
+            memcpy(ctx->pad_array, batch_pads, (size_t) batch_len * n_channels * sizeof(int));
+        }
+        /* Warnings are per channel, only keep them from the first batch */
+        status = multi_normxcorr_fftw_run(
+            ctx, batch_templates, image, image_len,
+            (ncc != NULL) ? (char *) ncc + (size_t) batch_start * ncc_stride * ncc_format_size(ncc_format) : NULL,
+            ncc_len, batch_pads, (batch_start == 0) ? variance_warning : batch_warnings,
+            (batch_start == 0) ? missed_corr : batch_missed, stack_option,
+            ncc_format, stack_memory, moments, peaks, batch_start, stats);
+        r = (status < 0) ? status : r + status;
+    }
+    multi_normxcorr_fftw_destroy(ctx);
+    for (chan = 0; batch_moments != NULL && chan < n_channels; ++chan) {
+        sliding_moments_destroy(batch_moments[chan]);
+    }
+    free(batch_moments);
+    free(batch_templates);
+    free(batch_used);
+    free(batch_pads);
+    free(batch_warnings);
+    free(batch_missed);
+    if (stats != NULL) {
+        stats->total += wall_time() - t0;
+    }
+    return r;
+}
+
+int multi_normxcorr_fftw_image(
+    float *templates, long n_templates, long template_len, long n_channels,
+    const image_channels *image, long image_len, void *ncc, long fft_len,
+    int *used_chans, int *pad_array, int num_threads_inner, int num_threads_outer,
+    int *variance_warning, int *missed_corr, int stack_option, int ncc_format,
+    int planner, long stack_memory, long memory_limit, sliding_moments **moments,
+    correlation_stats *stats)
+{
+  /*
+  Purpose: as multi_normxcorr_fftw for an image given as a pointer to each
+           channel, so channels do not need to be copied into one float array
+  Args:
+    image:          Pointers to each channel, with their lengths and strides (in
+                    samples), of IMAGE_FLOAT32, IMAGE_INT32 or IMAGE_FLOAT64.
+                    Samples are converted to float as each chunk is correlated,
+                    samples past the length of a channel are zero.
+    image_len:      Length of image, correlations are for image_len -
+                    template_len + 1 windows of every channel
+    moments:        Moments of each channel of image for template_len (see
+                    sliding_moments_create_image), or NULL to compute them here.
+    Others as for multi_normxcorr_fftw
+  */
+    return multi_normxcorr_fftw_batches(
+        templates, n_templates, template_len, n_channels, image, image_len, ncc,
+        fft_len, used_chans, pad_array, num_threads_inner, num_threads_outer,
+        variance_warning, missed_corr, stack_option, ncc_format, planner,
+        stack_memory, memory_limit, moments, NULL, stats);
+}
+
+int multi_normxcorr_fftw(float *templates, long n_templates, long template_len, long n_channels,
+                         float *image, long image_len, void *ncc, long fft_len, int *used_chans,
+                         int *pad_array, int num_threads_inner, int num_threads_outer,
+                         int *variance_warning, int *missed_corr, int stack_option,
+                         int ncc_format, int planner, long stack_memory, long memory_limit,
+                         sliding_moments **moments, correlation_stats *stats)
+    {
+  /*
+  Purpose: correlate every channel of an image with every template
+  Args:
+    templates:      Normalised templates (stacked [ch_1-t_1, ch_1-t_2, ..., ch_2-t_1, ...])
+    n_templates:    Number of templates
+    template_len:   Length of templates
+    n_channels:     Number of channels
+    image:          Image (stacked [ch_1, ch_2, ..., ch_n])
+    image_len:      Length of image per channel
+    ncc:            Output, (n_templates x image_len - template_len + 1) if stacked,
+                    otherwise (n_templates x n_channels x image_len - template_len + 1).
+                    Must be zeroed.
+    fft_len:        Size for fft
+    used_chans:     Used channels (stacked as per templates)
+    pad_array:      Pads (stacked as per templates)
+    num_threads_inner: Number of threads to parallel chunks of each channel over
+    num_threads_outer: Number of threads to parallel over channels
+    variance_warning: Pointer to array to store warnings for variance issues
+    missed_corr:    Pointer to array to store warnings for unused correlations
+    stack_option:   Whether to stack correlograms (1) or leave as individual channels (0)
+    ncc_format:     Type of ncc: NCC_FLOAT32 (float), NCC_FLOAT16 (IEEE half, as unsigned
+                    short) or, for individual channels only, NCC_INT16 (short, correlations
+                    scaled by NCC_INT16_SCALE). Correlations are always computed and
+                    stacked as floats.
+    planner:        FFTW planner rigour (PLANNER_ESTIMATE ... PLANNER_EXHAUSTIVE)
+    stack_memory:   Bytes that can be used for thread-private stacks (see
+                    multi_normxcorr_fftw_run), and for the float correlograms of
+                    tiles of time that are converted for NCC_FLOAT16 and NCC_INT16
+    memory_limit:   Bytes that can be used for workspaces, templates are correlated
+                    in batches that fit in this. Zero for no limit.
+    moments:        Moments of each channel of image for template_len (see
+                    sliding_moments_create), or NULL to compute them here. When
+                    templates are batched they are computed once for all batches
+                    if they take no more than half of memory_limit.
+    stats:          Timings of each stage, counts of chunks, skipped chunks and
+                    out-of-range correlations, and bytes allocated are added to
+                    this (see correlation_stats), or NULL. Nothing is printed
+                    while correlating, out-of-range correlations are returned
+                    here and in the return value.
+  Returns:
+    0 on success, -1 on failure, otherwise the number of out-of-range
+    correlations (these are zeroed).
+  */
+    int r;
+    image_channels *channels = packed_image_new(image, n_channels, image_len);
+
+    if (channels == NULL) {
+        return -1;
+    }
+    r = multi_normxcorr_fftw_batches(
+        templates, n_templates, template_len, n_channels, channels, image_len, ncc,
+        fft_len, used_chans, pad_array, num_threads_inner, num_threads_outer,
+        variance_warning, missed_corr, stack_option, ncc_format, planner,
+        stack_memory, memory_limit, moments, NULL, stats);
+    packed_image_destroy(channels);
+    return r;
+}
+
+int multi_normxcorr_fftw_peaks(float *templates, long n_templates, long template_len,
+                               long n_channels, float *image, long image_len, long fft_len,
+                               int *used_chans, int *pad_array, int num_threads_inner,
+                               int num_threads_outer, int *variance_warning, int *missed_corr,
+                               int planner, long stack_memory, long memory_limit,
+                               sliding_moments **moments, ncc_peaks *peaks,
+                               correlation_stats *stats)
+{
+  /*
+  Purpose: correlate every channel of an image with every template and keep only
+           the peaks of the stacked correlograms - these are computed in tiles of
+           time so the full correlograms are never held in memory
+  Args:
+    As for multi_normxcorr_fftw, without ncc and stack_option, and
+    stack_memory:   Bytes that can be used for stacking tiles of the correlograms,
+                    tiles are at least one fft_len long
+    peaks:          From ncc_peaks_create for n_templates, call ncc_peaks_finish
+                    once done
+  */
+    int r;
+    image_channels *channels;
+
+    if (peaks == NULL) {
+        printf("ERROR: NULL peaks\n");
+        return -1;
+    }
+    channels = packed_image_new(image, n_channels, image_len);
+    if (channels == NULL) {
+        return -1;
+    }
+    r = multi_normxcorr_fftw_peaks_image(
+        templates, n_templates, template_len, n_channels, channels, image_len,
+        fft_len, used_chans, pad_array, num_threads_inner, num_threads_outer,
+        variance_warning, missed_corr, planner, stack_memory, memory_limit,
+        moments, peaks, stats);
+    packed_image_destroy(channels);
+    return r;
+}
+
+int multi_normxcorr_fftw_peaks_image(
+    float *templates, long n_templates, long template_len, long n_channels,
+    const image_channels *image, long image_len, long fft_len, int *used_chans,
+    int *pad_array, int num_threads_inner, int num_threads_outer,
+    int *variance_warning, int *missed_corr, int planner, long stack_memory,
+    long memory_limit, sliding_moments **moments, ncc_peaks *peaks,
+    correlation_stats *stats)
+{
+  /*
+  Purpose: as multi_normxcorr_fftw_peaks for an image given as a pointer to
+           each channel (see multi_normxcorr_fftw_image)
+  */
+    if (peaks == NULL) {
+        printf("ERROR: NULL peaks\n");
+        return -1;
+    }
+    return multi_normxcorr_fftw_batches(
+        templates, n_templates, template_len, n_channels, image, image_len, NULL,
+        fft_len, used_chans, pad_array, num_threads_inner, num_threads_outer,
+        variance_warning, missed_corr, 1, NCC_FLOAT32, planner, stack_memory,
+        memory_limit, moments, peaks, stats);
+}
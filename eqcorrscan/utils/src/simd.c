@@ -0,0 +1,729 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  simd.c
+ *
+ *        Purpose:  Vectorised kernels for frequency and time-domain
+ *                  correlations and peak finding, the instruction set is
+ *                  selected at runtime
+ *
+ *        Created:  14/10/26
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Calum Chamberlain
+ *   Organization:  EQcorrscan
+ *      Copyright:  EQcorrscan developers.
+ *        License:  GNU Lesser General Public License, Version 3
+ *                  (https://www.gnu.org/copyleft/lesser.html)
+ *
+ * =====================================================================================
+ */
+
+#include <libutils.h>
+
+/* x86 kernels are compiled for their own target so that the library as a whole
+ * only needs the baseline instruction set, and are only called if the CPU has
+ * them. NEON is part of the aarch64 baseline. Other compilers and architectures
+ * only get the scalar kernels. */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #define SIMD_X86 1
+    #include <immintrin.h>
+    #define TARGET_AVX2 __attribute__((target("avx2,fma")))
+    #define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    #define SIMD_ARM 1
+    #include <arm_neon.h>
+#endif
+
+// Selected instruction set, -1 until first used
+static int simd_level = -1;
+
+
+static int simd_supported(void) {
+    /* Best instruction set supported by this CPU (and OS) */
+    #ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SIMD_AVX2;
+    }
+    #endif
+    #ifdef SIMD_ARM
+    return SIMD_NEON;
+    #endif
+    return SIMD_SCALAR;
+}
+
+int get_simd_level(void) {
+    /* Instruction set used by the kernels - selecting the best the first time.
+     * The first call can come from inside a parallel region, so the level is
+     * only selected by one thread and is read and written atomically. */
+    int level;
+
+    #pragma omp atomic read
+    level = simd_level;
+    if (level < 0) {
+        #pragma omp critical(simd_level)
+        {
+            #pragma omp atomic read
+            level = simd_level;
+            if (level < 0) {
+                level = simd_supported();
+                #pragma omp atomic write
+                simd_level = level;
+            }
+        }
+    }
+    return level;
+}
+
+int set_simd_level(int level) {
+  /*
+    Purpose: force the instruction set used by the kernels, e.g. for testing
+    Args:
+      level:  One of SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 or SIMD_NEON, or negative
+              to select the best available
+    Returns:
+      The level in use - falls back to the scalar kernels if level is not supported,
+      callers should check this against the level asked for
+  */
+    int best = simd_supported();
+
+    if (level < 0) {
+        level = best;
+    } else if (level != SIMD_SCALAR && level != best &&
+               !(best == SIMD_AVX512 && level == SIMD_AVX2)) {
+        level = SIMD_SCALAR;
+    }
+    #pragma omp atomic write
+    simd_level = level;
+    return level;
+}
+
+
+// Complex multiplication of spectra
+static void multiply_spectra_scalar(
+    const fftwf_complex *a, const fftwf_complex *b, fftwf_complex *out, long n)
+{
+    long i;
+
+    for (i = 0; i < n; ++i){
+        out[i][0] = a[i][0] * b[i][0] - a[i][1] * b[i][1];
+        out[i][1] = a[i][0] * b[i][1] + a[i][1] * b[i][0];
+    }
+}
+
+#ifdef SIMD_X86
+TARGET_AVX2 static void multiply_spectra_avx2(
+    const fftwf_complex *a, const fftwf_complex *b, fftwf_complex *out, long n)
+{
+    long i = 0;
+    const float *fa = (const float *) a, *fb = (const float *) b;
+    float *fo = (float *) out;
+
+    // Four interleaved complex values per register
+    for (; i + 4 <= n; i += 4){
+        __m256 va = _mm256_loadu_ps(&fa[2 * i]);
+        __m256 vb = _mm256_loadu_ps(&fb[2 * i]);
+        __m256 b_re = _mm256_moveldup_ps(vb);
+        __m256 b_im = _mm256_movehdup_ps(vb);
+        __m256 a_swap = _mm256_permute_ps(va, 0xB1);
+        // (ar * br - ai * bi, ai * br + ar * bi)
+        _mm256_storeu_ps(&fo[2 * i], _mm256_fmaddsub_ps(va, b_re, _mm256_mul_ps(a_swap, b_im)));
+    }
+    multiply_spectra_scalar(&a[i], &b[i], &out[i], n - i);
+}
+
+TARGET_AVX512 static void multiply_spectra_avx512(
+    const fftwf_complex *a, const fftwf_complex *b, fftwf_complex *out, long n)
+{
+    long i = 0;
+    const float *fa = (const float *) a, *fb = (const float *) b;
+    float *fo = (float *) out;
+
+    for (; i + 8 <= n; i += 8){
+        __m512 va = _mm512_loadu_ps(&fa[2 * i]);
+        __m512 vb = _mm512_loadu_ps(&fb[2 * i]);
+        __m512 b_re = _mm512_moveldup_ps(vb);
+        __m512 b_im = _mm512_movehdup_ps(vb);
+        __m512 a_swap = _mm512_permute_ps(va, 0xB1);
+        _mm512_storeu_ps(&fo[2 * i], _mm512_fmaddsub_ps(va, b_re, _mm512_mul_ps(a_swap, b_im)));
+    }
+    multiply_spectra_scalar(&a[i], &b[i], &out[i], n - i);
+}
+#endif
+
+#ifdef SIMD_ARM
+static void multiply_spectra_neon(
+    const fftwf_complex *a, const fftwf_complex *b, fftwf_complex *out, long n)
+{
+    long i = 0;
+    const float *fa = (const float *) a, *fb = (const float *) b;
+    float *fo = (float *) out;
+
+    // De-interleaving loads give separate real and imaginary registers
+    for (; i + 4 <= n; i += 4){
+        float32x4x2_t va = vld2q_f32(&fa[2 * i]);
+        float32x4x2_t vb = vld2q_f32(&fb[2 * i]);
+        float32x4x2_t vo;
+        vo.val[0] = vfmsq_f32(vmulq_f32(va.val[0], vb.val[0]), va.val[1], vb.val[1]);
+        vo.val[1] = vfmaq_f32(vmulq_f32(va.val[0], vb.val[1]), va.val[1], vb.val[0]);
+        vst2q_f32(&fo[2 * i], vo);
+    }
+    multiply_spectra_scalar(&a[i], &b[i], &out[i], n - i);
+}
+#endif
+
+void multiply_spectra(
+    const fftwf_complex *a, const fftwf_complex *b, fftwf_complex *out, long n)
+{
+  /*
+    Purpose: element-wise complex multiplication, out = a * b
+    Args:
+      a:      First spectrum (e.g. a template spectrum)
+      b:      Second spectrum (e.g. an image spectrum)
+      out:    Output, can be the same as a or b
+      n:      Number of complex values
+  */
+    switch (get_simd_level()) {
+    #ifdef SIMD_X86
+    case SIMD_AVX512:
+        multiply_spectra_avx512(a, b, out, n);
+        break;
+    case SIMD_AVX2:
+        multiply_spectra_avx2(a, b, out, n);
+        break;
+    #endif
+    #ifdef SIMD_ARM
+    case SIMD_NEON:
+        multiply_spectra_neon(a, b, out, n);
+        break;
+    #endif
+    default:
+        multiply_spectra_scalar(a, b, out, n);
+    }
+}
+
+
+// Normalisation of correlations
+static void normalise_correlations_scalar(
+    float *ccc, const double *mean, const double *inv_std, double norm_sum,
+    double scale, long n)
+{
+    long i;
+
+    for (i = 0; i < n; ++i){
+        ccc[i] = (float) (((double) ccc[i] * scale - norm_sum * mean[i]) * inv_std[i]);
+    }
+}
+
+#ifdef SIMD_X86
+TARGET_AVX2 static void normalise_correlations_avx2(
+    float *ccc, const double *mean, const double *inv_std, double norm_sum,
+    double scale, long n)
+{
+    long i = 0;
+    __m256d vscale = _mm256_set1_pd(scale), vsum = _mm256_set1_pd(norm_sum);
+
+    // Work in double precision as the mean can be large
+    for (; i + 4 <= n; i += 4){
+        __m256d c = _mm256_cvtps_pd(_mm_loadu_ps(&ccc[i]));
+        __m256d m = _mm256_loadu_pd(&mean[i]);
+        c = _mm256_fmsub_pd(c, vscale, _mm256_mul_pd(vsum, m));
+        c = _mm256_mul_pd(c, _mm256_loadu_pd(&inv_std[i]));
+        _mm_storeu_ps(&ccc[i], _mm256_cvtpd_ps(c));
+    }
+    normalise_correlations_scalar(&ccc[i], &mean[i], &inv_std[i], norm_sum, scale, n - i);
+}
+
+TARGET_AVX512 static void normalise_correlations_avx512(
+    float *ccc, const double *mean, const double *inv_std, double norm_sum,
+    double scale, long n)
+{
+    long i = 0;
+    __m512d vscale = _mm512_set1_pd(scale), vsum = _mm512_set1_pd(norm_sum);
+
+    for (; i + 8 <= n; i += 8){
+        __m512d c = _mm512_cvtps_pd(_mm256_loadu_ps(&ccc[i]));
+        __m512d m = _mm512_loadu_pd(&mean[i]);
+        c = _mm512_fmsub_pd(c, vscale, _mm512_mul_pd(vsum, m));
+        c = _mm512_mul_pd(c, _mm512_loadu_pd(&inv_std[i]));
+        _mm256_storeu_ps(&ccc[i], _mm512_cvtpd_ps(c));
+    }
+    normalise_correlations_scalar(&ccc[i], &mean[i], &inv_std[i], norm_sum, scale, n - i);
+}
+#endif
+
+#ifdef SIMD_ARM
+static void normalise_correlations_neon(
+    float *ccc, const double *mean, const double *inv_std, double norm_sum,
+    double scale, long n)
+{
+    long i = 0;
+    float64x2_t vscale = vdupq_n_f64(scale), vsum = vdupq_n_f64(norm_sum);
+
+    for (; i + 4 <= n; i += 4){
+        float32x4_t c = vld1q_f32(&ccc[i]);
+        float64x2_t lo = vcvt_f64_f32(vget_low_f32(c));
+        float64x2_t hi = vcvt_high_f64_f32(c);
+        lo = vfmsq_f64(vmulq_f64(lo, vscale), vsum, vld1q_f64(&mean[i]));
+        hi = vfmsq_f64(vmulq_f64(hi, vscale), vsum, vld1q_f64(&mean[i + 2]));
+        lo = vmulq_f64(lo, vld1q_f64(&inv_std[i]));
+        hi = vmulq_f64(hi, vld1q_f64(&inv_std[i + 2]));
+        vst1q_f32(&ccc[i], vcvt_high_f32_f64(vcvt_f32_f64(lo), hi));
+    }
+    normalise_correlations_scalar(&ccc[i], &mean[i], &inv_std[i], norm_sum, scale, n - i);
+}
+#endif
+
+void normalise_correlations(
+    float *ccc, const double *mean, const double *inv_std, double norm_sum,
+    double scale, long n)
+{
+  /*
+    Purpose: normalise one template's correlations in-place,
+             ccc = (ccc * scale - norm_sum * mean) * inv_std
+    Args:
+      ccc:      Un-normalised correlations from the reverse transform
+      mean:     Running mean of the image for each correlation
+      inv_std:  Reciprocal of the running standard deviation of the image
+      norm_sum: Sum of the normalised template
+      scale:    Scaling of the reverse transform (1 / transform length)
+      n:        Number of correlations
+  */
+    switch (get_simd_level()) {
+    #ifdef SIMD_X86
+    case SIMD_AVX512:
+        normalise_correlations_avx512(ccc, mean, inv_std, norm_sum, scale, n);
+        break;
+    case SIMD_AVX2:
+        normalise_correlations_avx2(ccc, mean, inv_std, norm_sum, scale, n);
+        break;
+    #endif
+    #ifdef SIMD_ARM
+    case SIMD_NEON:
+        normalise_correlations_neon(ccc, mean, inv_std, norm_sum, scale, n);
+        break;
+    #endif
+    default:
+        normalise_correlations_scalar(ccc, mean, inv_std, norm_sum, scale, n);
+    }
+}
+
+
+// Sliding dot products of blocks of templates with an image
+static void correlate_templates_scalar(
+    const float *templates, long template_len, int n_templates, const float *image,
+    long n_lags, float *out, long out_stride)
+{
+    int t;
+    long k, p;
+
+    for (t = 0; t < n_templates; ++t){
+        const float *tmp = &templates[(long) t * template_len];
+        for (k = 0; k < n_lags; ++k){
+            float sum = 0.0f;
+            for (p = 0; p < template_len; ++p){
+                sum += tmp[p] * image[k + p];
+            }
+            out[(long) t * out_stride + k] = sum;
+        }
+    }
+}
+
+#ifdef SIMD_X86
+TARGET_AVX2 static void correlate_templates_avx2(
+    const float *templates, long template_len, int n_templates, const float *image,
+    long n_lags, float *out, long out_stride)
+{
+    int t = 0;
+    long k, p;
+
+    /* Four templates by sixteen lags of accumulators, each image load is used
+     * by four templates and each template sample by sixteen lags */
+    for (; t + TIME_BLOCK_REGISTERS <= n_templates; t += TIME_BLOCK_REGISTERS){
+        const float *t0 = &templates[(long) t * template_len];
+        const float *t1 = t0 + template_len, *t2 = t1 + template_len, *t3 = t2 + template_len;
+        float *o0 = &out[(long) t * out_stride];
+        float *o1 = o0 + out_stride, *o2 = o1 + out_stride, *o3 = o2 + out_stride;
+
+        for (k = 0; k + 16 <= n_lags; k += 16){
+            __m256 a00 = _mm256_setzero_ps(), a01 = _mm256_setzero_ps();
+            __m256 a10 = _mm256_setzero_ps(), a11 = _mm256_setzero_ps();
+            __m256 a20 = _mm256_setzero_ps(), a21 = _mm256_setzero_ps();
+            __m256 a30 = _mm256_setzero_ps(), a31 = _mm256_setzero_ps();
+            for (p = 0; p < template_len; ++p){
+                __m256 x0 = _mm256_loadu_ps(&image[k + p]);
+                __m256 x1 = _mm256_loadu_ps(&image[k + p + 8]);
+                __m256 w = _mm256_broadcast_ss(&t0[p]);
+                a00 = _mm256_fmadd_ps(w, x0, a00);
+                a01 = _mm256_fmadd_ps(w, x1, a01);
+                w = _mm256_broadcast_ss(&t1[p]);
+                a10 = _mm256_fmadd_ps(w, x0, a10);
+                a11 = _mm256_fmadd_ps(w, x1, a11);
+                w = _mm256_broadcast_ss(&t2[p]);
+                a20 = _mm256_fmadd_ps(w, x0, a20);
+                a21 = _mm256_fmadd_ps(w, x1, a21);
+                w = _mm256_broadcast_ss(&t3[p]);
+                a30 = _mm256_fmadd_ps(w, x0, a30);
+                a31 = _mm256_fmadd_ps(w, x1, a31);
+            }
+            _mm256_storeu_ps(&o0[k], a00);
+            _mm256_storeu_ps(&o0[k + 8], a01);
+            _mm256_storeu_ps(&o1[k], a10);
+            _mm256_storeu_ps(&o1[k + 8], a11);
+            _mm256_storeu_ps(&o2[k], a20);
+            _mm256_storeu_ps(&o2[k + 8], a21);
+            _mm256_storeu_ps(&o3[k], a30);
+            _mm256_storeu_ps(&o3[k + 8], a31);
+        }
+        correlate_templates_scalar(
+            t0, template_len, TIME_BLOCK_REGISTERS, &image[k], n_lags - k, &o0[k],
+            out_stride);
+    }
+    // Remaining templates one at a time
+    for (; t < n_templates; ++t){
+        const float *t0 = &templates[(long) t * template_len];
+        float *o0 = &out[(long) t * out_stride];
+
+        for (k = 0; k + 8 <= n_lags; k += 8){
+            __m256 a0 = _mm256_setzero_ps();
+            for (p = 0; p < template_len; ++p){
+                a0 = _mm256_fmadd_ps(
+                    _mm256_broadcast_ss(&t0[p]), _mm256_loadu_ps(&image[k + p]), a0);
+            }
+            _mm256_storeu_ps(&o0[k], a0);
+        }
+        correlate_templates_scalar(
+            t0, template_len, 1, &image[k], n_lags - k, &o0[k], out_stride);
+    }
+}
+
+TARGET_AVX512 static void correlate_templates_avx512(
+    const float *templates, long template_len, int n_templates, const float *image,
+    long n_lags, float *out, long out_stride)
+{
+    int t = 0;
+    long k, p;
+
+    for (; t + TIME_BLOCK_REGISTERS <= n_templates; t += TIME_BLOCK_REGISTERS){
+        const float *t0 = &templates[(long) t * template_len];
+        const float *t1 = t0 + template_len, *t2 = t1 + template_len, *t3 = t2 + template_len;
+        float *o0 = &out[(long) t * out_stride];
+        float *o1 = o0 + out_stride, *o2 = o1 + out_stride, *o3 = o2 + out_stride;
+
+        for (k = 0; k + 32 <= n_lags; k += 32){
+            __m512 a00 = _mm512_setzero_ps(), a01 = _mm512_setzero_ps();
+            __m512 a10 = _mm512_setzero_ps(), a11 = _mm512_setzero_ps();
+            __m512 a20 = _mm512_setzero_ps(), a21 = _mm512_setzero_ps();
+            __m512 a30 = _mm512_setzero_ps(), a31 = _mm512_setzero_ps();
+            for (p = 0; p < template_len; ++p){
+                __m512 x0 = _mm512_loadu_ps(&image[k + p]);
+                __m512 x1 = _mm512_loadu_ps(&image[k + p + 16]);
+                __m512 w = _mm512_set1_ps(t0[p]);
+                a00 = _mm512_fmadd_ps(w, x0, a00);
+                a01 = _mm512_fmadd_ps(w, x1, a01);
+                w = _mm512_set1_ps(t1[p]);
+                a10 = _mm512_fmadd_ps(w, x0, a10);
+                a11 = _mm512_fmadd_ps(w, x1, a11);
+                w = _mm512_set1_ps(t2[p]);
+                a20 = _mm512_fmadd_ps(w, x0, a20);
+                a21 = _mm512_fmadd_ps(w, x1, a21);
+                w = _mm512_set1_ps(t3[p]);
+                a30 = _mm512_fmadd_ps(w, x0, a30);
+                a31 = _mm512_fmadd_ps(w, x1, a31);
+            }
+            _mm512_storeu_ps(&o0[k], a00);
+            _mm512_storeu_ps(&o0[k + 16], a01);
+            _mm512_storeu_ps(&o1[k], a10);
+            _mm512_storeu_ps(&o1[k + 16], a11);
+            _mm512_storeu_ps(&o2[k], a20);
+            _mm512_storeu_ps(&o2[k + 16], a21);
+            _mm512_storeu_ps(&o3[k], a30);
+            _mm512_storeu_ps(&o3[k + 16], a31);
+        }
+        correlate_templates_scalar(
+            t0, template_len, TIME_BLOCK_REGISTERS, &image[k], n_lags - k, &o0[k],
+            out_stride);
+    }
+    for (; t < n_templates; ++t){
+        const float *t0 = &templates[(long) t * template_len];
+        float *o0 = &out[(long) t * out_stride];
+
+        for (k = 0; k + 16 <= n_lags; k += 16){
+            __m512 a0 = _mm512_setzero_ps();
+            for (p = 0; p < template_len; ++p){
+                a0 = _mm512_fmadd_ps(
+                    _mm512_set1_ps(t0[p]), _mm512_loadu_ps(&image[k + p]), a0);
+            }
+            _mm512_storeu_ps(&o0[k], a0);
+        }
+        correlate_templates_scalar(
+            t0, template_len, 1, &image[k], n_lags - k, &o0[k], out_stride);
+    }
+}
+#endif
+
+#ifdef SIMD_ARM
+static void correlate_templates_neon(
+    const float *templates, long template_len, int n_templates, const float *image,
+    long n_lags, float *out, long out_stride)
+{
+    int t = 0;
+    long k, p;
+
+    for (; t + TIME_BLOCK_REGISTERS <= n_templates; t += TIME_BLOCK_REGISTERS){
+        const float *t0 = &templates[(long) t * template_len];
+        const float *t1 = t0 + template_len, *t2 = t1 + template_len, *t3 = t2 + template_len;
+        float *o0 = &out[(long) t * out_stride];
+        float *o1 = o0 + out_stride, *o2 = o1 + out_stride, *o3 = o2 + out_stride;
+
+        for (k = 0; k + 8 <= n_lags; k += 8){
+            float32x4_t a00 = vdupq_n_f32(0.0f), a01 = vdupq_n_f32(0.0f);
+            float32x4_t a10 = vdupq_n_f32(0.0f), a11 = vdupq_n_f32(0.0f);
+            float32x4_t a20 = vdupq_n_f32(0.0f), a21 = vdupq_n_f32(0.0f);
+            float32x4_t a30 = vdupq_n_f32(0.0f), a31 = vdupq_n_f32(0.0f);
+            for (p = 0; p < template_len; ++p){
+                float32x4_t x0 = vld1q_f32(&image[k + p]);
+                float32x4_t x1 = vld1q_f32(&image[k + p + 4]);
+                a00 = vfmaq_n_f32(a00, x0, t0[p]);
+                a01 = vfmaq_n_f32(a01, x1, t0[p]);
+                a10 = vfmaq_n_f32(a10, x0, t1[p]);
+                a11 = vfmaq_n_f32(a11, x1, t1[p]);
+                a20 = vfmaq_n_f32(a20, x0, t2[p]);
+                a21 = vfmaq_n_f32(a21, x1, t2[p]);
+                a30 = vfmaq_n_f32(a30, x0, t3[p]);
+                a31 = vfmaq_n_f32(a31, x1, t3[p]);
+            }
+            vst1q_f32(&o0[k], a00);
+            vst1q_f32(&o0[k + 4], a01);
+            vst1q_f32(&o1[k], a10);
+            vst1q_f32(&o1[k + 4], a11);
+            vst1q_f32(&o2[k], a20);
+            vst1q_f32(&o2[k + 4], a21);
+            vst1q_f32(&o3[k], a30);
+            vst1q_f32(&o3[k + 4], a31);
+        }
+        correlate_templates_scalar(
+            t0, template_len, TIME_BLOCK_REGISTERS, &image[k], n_lags - k, &o0[k],
+            out_stride);
+    }
+    for (; t < n_templates; ++t){
+        const float *t0 = &templates[(long) t * template_len];
+        float *o0 = &out[(long) t * out_stride];
+
+        for (k = 0; k + 4 <= n_lags; k += 4){
+            float32x4_t a0 = vdupq_n_f32(0.0f);
+            for (p = 0; p < template_len; ++p){
+                a0 = vfmaq_n_f32(a0, vld1q_f32(&image[k + p]), t0[p]);
+            }
+            vst1q_f32(&o0[k], a0);
+        }
+        correlate_templates_scalar(
+            t0, template_len, 1, &image[k], n_lags - k, &o0[k], out_stride);
+    }
+}
+#endif
+
+void correlate_templates(
+    const float *templates, long template_len, int n_templates, const float *image,
+    long n_lags, float *out, long out_stride)
+{
+  /*
+    Purpose: un-normalised time-domain correlations of a block of templates
+             with the same image, out[t][k] = sum_p templates[t][p] * image[k + p]
+    Args:
+      templates:    n_templates x template_len templates
+      template_len: Length of each template
+      n_templates:  Number of templates
+      image:        Image, n_lags + template_len - 1 long
+      n_lags:       Number of correlations for each template
+      out:          Output, row t starts at t * out_stride
+      out_stride:   Distance between rows of out, at least n_lags
+  */
+    switch (get_simd_level()) {
+    #ifdef SIMD_X86
+    case SIMD_AVX512:
+        correlate_templates_avx512(
+            templates, template_len, n_templates, image, n_lags, out, out_stride);
+        break;
+    case SIMD_AVX2:
+        correlate_templates_avx2(
+            templates, template_len, n_templates, image, n_lags, out, out_stride);
+        break;
+    #endif
+    #ifdef SIMD_ARM
+    case SIMD_NEON:
+        correlate_templates_neon(
+            templates, template_len, n_templates, image, n_lags, out, out_stride);
+        break;
+    #endif
+    default:
+        correlate_templates_scalar(
+            templates, template_len, n_templates, image, n_lags, out, out_stride);
+    }
+}
+
+/* Peaks of a correlogram: samples above threshold in absolute value that are
+ * higher or lower than both neighbours, with zero beyond either end. Only the
+ * interior is vectorised, the first and last samples and tails are scalar. */
+static long long find_peaks_span_scalar(
+    const float *arr, long long len, long long start, long long end, float thresh,
+    long long *indexes)
+{
+    long long i, n = 0;
+
+    for (i = start; i < end; ++i){
+        float value = arr[i];
+        float prev_value = (i > 0) ? arr[i - 1] : 0.0f;
+        float next_value = (i < len - 1) ? arr[i + 1] : 0.0f;
+
+        if (fabsf(value) > thresh && (next_value - value) * (prev_value - value) > 0){
+            if (indexes != NULL) {
+                indexes[n] = i;
+            }
+            n += 1;
+        }
+    }
+    return n;
+}
+
+#ifdef SIMD_X86
+TARGET_AVX2 static long long find_peaks_span_avx2(
+    const float *arr, long long len, long long start, long long end, float thresh,
+    long long *indexes)
+{
+    long long i, n, lo = (start > 1) ? start : 1, hi = (end < len - 1) ? end : len - 1;
+    const __m256 thresholds = _mm256_set1_ps(thresh), zero = _mm256_setzero_ps();
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+
+    n = find_peaks_span_scalar(arr, len, start, (lo < end) ? lo : end, thresh, indexes);
+    for (i = lo; i + 8 <= hi; i += 8){
+        __m256 value = _mm256_loadu_ps(&arr[i]);
+        __m256 prev_value = _mm256_loadu_ps(&arr[i - 1]);
+        __m256 next_value = _mm256_loadu_ps(&arr[i + 1]);
+        __m256 above = _mm256_cmp_ps(_mm256_andnot_ps(sign, value), thresholds, _CMP_GT_OQ);
+        __m256 turn = _mm256_cmp_ps(
+            _mm256_mul_ps(_mm256_sub_ps(next_value, value), _mm256_sub_ps(prev_value, value)),
+            zero, _CMP_GT_OQ);
+        unsigned int bits = (unsigned int) _mm256_movemask_ps(_mm256_and_ps(above, turn));
+
+        if (indexes == NULL) {
+            n += __builtin_popcount(bits);
+            continue;
+        }
+        while (bits){
+            indexes[n++] = i + __builtin_ctz(bits);
+            bits &= bits - 1;
+        }
+    }
+    return n + find_peaks_span_scalar(
+        arr, len, i, end, thresh, (indexes != NULL) ? &indexes[n] : NULL);
+}
+
+TARGET_AVX512 static long long find_peaks_span_avx512(
+    const float *arr, long long len, long long start, long long end, float thresh,
+    long long *indexes)
+{
+    long long i, n, lo = (start > 1) ? start : 1, hi = (end < len - 1) ? end : len - 1;
+    const __m512 thresholds = _mm512_set1_ps(thresh), zero = _mm512_setzero_ps();
+
+    n = find_peaks_span_scalar(arr, len, start, (lo < end) ? lo : end, thresh, indexes);
+    for (i = lo; i + 16 <= hi; i += 16){
+        __m512 value = _mm512_loadu_ps(&arr[i]);
+        __m512 prev_value = _mm512_loadu_ps(&arr[i - 1]);
+        __m512 next_value = _mm512_loadu_ps(&arr[i + 1]);
+        __mmask16 above = _mm512_cmp_ps_mask(_mm512_abs_ps(value), thresholds, _CMP_GT_OQ);
+        unsigned int bits = (unsigned int) _mm512_mask_cmp_ps_mask(
+            above,
+            _mm512_mul_ps(_mm512_sub_ps(next_value, value), _mm512_sub_ps(prev_value, value)),
+            zero, _CMP_GT_OQ);
+
+        if (indexes == NULL) {
+            n += __builtin_popcount(bits);
+            continue;
+        }
+        while (bits){
+            indexes[n++] = i + __builtin_ctz(bits);
+            bits &= bits - 1;
+        }
+    }
+    return n + find_peaks_span_scalar(
+        arr, len, i, end, thresh, (indexes != NULL) ? &indexes[n] : NULL);
+}
+#endif
+
+#ifdef SIMD_ARM
+static long long find_peaks_span_neon(
+    const float *arr, long long len, long long start, long long end, float thresh,
+    long long *indexes)
+{
+    long long i, n, lo = (start > 1) ? start : 1, hi = (end < len - 1) ? end : len - 1;
+    const float32x4_t thresholds = vdupq_n_f32(thresh), zero = vdupq_n_f32(0.0f);
+    unsigned int lanes[4];
+    int k;
+
+    n = find_peaks_span_scalar(arr, len, start, (lo < end) ? lo : end, thresh, indexes);
+    for (i = lo; i + 4 <= hi; i += 4){
+        float32x4_t value = vld1q_f32(&arr[i]);
+        float32x4_t prev_value = vld1q_f32(&arr[i - 1]);
+        float32x4_t next_value = vld1q_f32(&arr[i + 1]);
+        uint32x4_t peak = vandq_u32(
+            vcgtq_f32(vabsq_f32(value), thresholds),
+            vcgtq_f32(vmulq_f32(vsubq_f32(next_value, value), vsubq_f32(prev_value, value)), zero));
+
+        if (vmaxvq_u32(peak) == 0) {
+            continue;
+        }
+        vst1q_u32(lanes, peak);
+        for (k = 0; k < 4; ++k){
+            if (lanes[k]) {
+                if (indexes != NULL) {
+                    indexes[n] = i + k;
+                }
+                n += 1;
+            }
+        }
+    }
+    return n + find_peaks_span_scalar(
+        arr, len, i, end, thresh, (indexes != NULL) ? &indexes[n] : NULL);
+}
+#endif
+
+long long find_peaks_span(
+    const float *arr, long long len, long long start, long long end, float thresh,
+    long long *indexes)
+{
+  /*
+    Purpose: find the peaks of samples start to end of an array, as
+             find_peaks, and write their positions
+    Args:
+      arr:      Whole array, samples either side of the span are read
+      len:      Length of arr
+      start:    First sample to check
+      end:      One past the last sample to check
+      thresh:   Peaks must be above this in absolute value
+      indexes:  Output of the positions of peaks in arr, in order, at most
+                end - start long. NULL to only count peaks.
+    Returns:
+      Number of peaks
+  */
+    switch (get_simd_level()) {
+    #ifdef SIMD_X86
+    case SIMD_AVX512:
+        return find_peaks_span_avx512(arr, len, start, end, thresh, indexes);
+    case SIMD_AVX2:
+        return find_peaks_span_avx2(arr, len, start, end, thresh, indexes);
+    #endif
+    #ifdef SIMD_ARM
+    case SIMD_NEON:
+        return find_peaks_span_neon(arr, len, start, end, thresh, indexes);
+    #endif
+    default:
+        return find_peaks_span_scalar(arr, len, start, end, thresh, indexes);
+    }
+}
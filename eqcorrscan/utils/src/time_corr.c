@@ -103,3 +103,175 @@ int multi_normxcorr_time_threaded(float *templates, int template_len, int n_temp
 	}
 	return 0;
 }
+
+int multi_normxcorr_time_blocked(
+    float *templates, long n_templates, long template_len, long n_channels,
+    float *image, long image_len, float *ncc, int *used_chans, int *pad_array,
+    int num_threads, int *variance_warning, int *missed_corr, int stack_option)
+{
+  /*
+    Purpose: time-domain equivalent of multi_normxcorr_fftw - correlations of
+             multiple templates with a multi-channel image, in tiles of
+             TIME_BLOCK_LAGS lags by TIME_BLOCK_TEMPLATES templates
+    Args:
+      templates:        n_channels x n_templates x template_len normalised
+                        templates, (template - mean) / (std * template_len)
+      n_templates:      Number of templates
+      template_len:     Length of templates
+      n_channels:       Number of channels
+      image:            n_channels x image_len image
+      image_len:        Length of image
+      ncc:              Output, n_templates x (n_channels if not stacked) x
+                        (image_len - template_len + 1), must be zeroed
+      used_chans:       n_channels x n_templates, whether to use each channel
+      pad_array:        n_channels x n_templates pads for each channel
+      num_threads:      Number of threads to parallel tiles over
+      variance_warning: Output count of low variance windows of each channel
+      missed_corr:      Output count of windows that could not be normalised
+      stack_option:     1 to sum correlations over channels, 0 to keep them
+    Returns:
+      0 on success, -1 on allocation failure, > 0 if correlations were
+      out of range
+    Notes:
+      The image is normalised by the same sliding moments as
+      multi_normxcorr_fftw, so correlations match within float precision.
+      Only worthwhile for short templates - for long templates the FFT routines
+      are faster.
+  */
+    long n_corr = image_len - template_len + 1;
+    long n_tiles = (n_corr + TIME_BLOCK_LAGS - 1) / TIME_BLOCK_LAGS;
+    long n_groups = (n_templates + TIME_BLOCK_TEMPLATES - 1) / TIME_BLOCK_TEMPLATES;
+    long chan, i;
+    int status = 0, set_option = 0, n_out_chans = (int) n_channels;
+    double *norm_sums;
+
+    if (n_corr < 1 || template_len < 1) {
+        printf("ERROR: image_len %ld is shorter than template_len %ld\n", image_len, template_len);
+        return -1;
+    }
+    if (stack_option != 0 && stack_option != 1) {
+        printf("ERROR: stack_option %i not supported\n", stack_option);
+        return -1;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (stack_option == 1) {
+        /* Tiles of different channels never run at the same time, and within a
+         * channel each tile and template group writes its own templates and
+         * lags (a template has one pad), so no atomics are needed */
+        set_option = STACK_PRIVATE;
+        n_out_chans = 1;
+    }
+    norm_sums = (double *) malloc((size_t) n_templates * n_channels * sizeof(double));
+    if (norm_sums == NULL) {
+        printf("Error allocating norm_sums in multi_normxcorr_time_blocked\n");
+        return -1;
+    }
+    for (i = 0; i < n_templates * n_channels; ++i){
+        long p;
+        norm_sums[i] = 0.0;
+        for (p = 0; p < template_len; ++p){
+            norm_sums[i] += templates[i * template_len + p];
+        }
+    }
+
+    for (chan = 0; chan < n_channels && status >= 0; ++chan){
+        const float *chan_image = &image[(size_t) chan * image_len];
+        const float *chan_templates = &templates[(size_t) chan * n_templates * template_len];
+        int *chan_used = &used_chans[chan * n_templates];
+        int *chan_pads = &pad_array[chan * n_templates];
+        int out_chan = (stack_option == 1) ? 0 : (int) chan;
+        int n_low = 0, n_missed = 0, n_failed = 0, n_clipped = 0;
+
+        #pragma omp parallel num_threads(num_threads) reduction(+:n_low,n_missed,n_failed,n_clipped)
+        {
+            long task;
+            double *mean = (double *) malloc(TIME_BLOCK_LAGS * sizeof(double));
+            double *inv_std = (double *) malloc(TIME_BLOCK_LAGS * sizeof(double));
+            unsigned char *valid = (unsigned char *) malloc(TIME_BLOCK_LAGS * sizeof(unsigned char));
+            float *shifted = (float *) malloc((TIME_BLOCK_LAGS + template_len - 1) * sizeof(float));
+            float *dots = (float *) malloc(TIME_BLOCK_TEMPLATES * TIME_BLOCK_LAGS * sizeof(float));
+            int ok = (mean != NULL && inv_std != NULL && valid != NULL &&
+                      shifted != NULL && dots != NULL);
+
+            if (!ok) {
+                n_failed += 1;
+            }
+            #pragma omp for schedule(dynamic)
+            for (task = 0; task < n_tiles * n_groups; ++task){
+                long tile = task / n_groups, group = task % n_groups;
+                long start = tile * TIME_BLOCK_LAGS;
+                long n_lags = (start + TIME_BLOCK_LAGS > n_corr) ? n_corr - start : TIME_BLOCK_LAGS;
+                long t_start = group * TIME_BLOCK_TEMPLATES;
+                long t_len = (t_start + TIME_BLOCK_TEMPLATES > n_templates) ?
+                    n_templates - t_start : TIME_BLOCK_TEMPLATES;
+                long k, t, n_valid = 0, n_used = 0;
+                double shift;
+
+                if (!ok) {
+                    continue;
+                }
+                for (t = t_start; t < t_start + t_len; ++t){
+                    n_used += (chan_used[t] != 0);
+                }
+                // Moments of the tile, counted once per tile over template groups
+                if (n_used == 0 && group != 0) {
+                    continue;
+                }
+                sliding_moments_range(
+                    chan_image, template_len, start, n_lags, mean, inv_std, valid, 1);
+                for (k = 0; k < n_lags; ++k){
+                    n_valid += (valid[k] & MOMENT_VALID) ? 1 : 0;
+                    if (group == 0) {
+                        n_low += (valid[k] & MOMENT_LOW_VARIANCE) ? 1 : 0;
+                        n_missed += (valid[k] & MOMENT_VALID) ? 0 : 1;
+                    }
+                }
+                if (n_used == 0 || n_valid == 0) {
+                    continue;
+                }
+                /* Remove an offset from the tile so that the float dot products do
+                 * not lose precision on data with a large mean - the templates sum
+                 * to norm_sum so this is undone by shifting the mean. */
+                shift = mean[0];
+                for (k = 0; k < n_lags + template_len - 1; ++k){
+                    shifted[k] = (float) ((double) chan_image[start + k] - shift);
+                }
+                for (k = 0; k < n_lags; ++k){
+                    mean[k] -= shift;
+                }
+                correlate_templates(
+                    &chan_templates[t_start * template_len], template_len,
+                    (int) t_len, shifted, n_lags, dots, n_lags);
+                for (t = 0; t < t_len; ++t){
+                    float *row = &dots[t * n_lags];
+                    if (!chan_used[t_start + t]) {
+                        continue;
+                    }
+                    normalise_correlations(
+                        row, mean, inv_std, norm_sums[chan * n_templates + t_start + t],
+                        1.0, n_lags);
+                    n_clipped += set_ncc_block(
+                        t_start + t, start, n_lags, out_chan, n_out_chans, 0, n_corr,
+                        row, valid, chan_pads, ncc, set_option);
+                }
+            }
+            free(mean);
+            free(inv_std);
+            free(valid);
+            free(shifted);
+            free(dots);
+        }
+        if (n_failed) {
+            printf("Error allocating workspaces in multi_normxcorr_time_blocked\n");
+            status = -1;
+        } else {
+            status += n_clipped;
+        }
+        variance_warning[chan] += n_low;
+        missed_corr[chan] += n_missed;
+    }
+    free(norm_sums);
+    return status;
+}
@@ -208,6 +208,8 @@ def get_extensions(no_mkl=False):
     sources = [os.path.join('eqcorrscan', 'utils', 'src', 'multi_corr.c'),
                os.path.join('eqcorrscan', 'utils', 'src', 'time_corr.c'),
                os.path.join('eqcorrscan', 'utils', 'src', 'find_peaks.c'),
+               os.path.join('eqcorrscan', 'utils', 'src', 'simd.c'),
+               os.path.join('eqcorrscan', 'utils', 'src', 'moments.c'),
                os.path.join('eqcorrscan', 'utils', 'src',
                             'distance_cluster.c')]
     exp_symbols = export_symbols("eqcorrscan/utils/src/libutils.def")
@@ -353,6 +355,49 @@ class CustomBuildExt(build_ext):
             self.libraries = _libraries
 
 
+class BuildBenchmark(Command):
+    """
+    Build the standalone benchmark of the C kernels, eqcorrscan_bench.
+
+    Compiled from the sources of libutils with the same flags, run the
+    executable with --help for the options.
+    """
+    description = "build the eqcorrscan_bench benchmark of the C kernels"
+    user_options = [
+        ('build-dir=', 'b', "directory for the benchmark [default: bench]")]
+
+    def initialize_options(self):
+        self.build_dir = None
+
+    def finalize_options(self):
+        if self.build_dir is None:
+            self.build_dir = 'bench'
+
+    def run(self):
+        from distutils.ccompiler import new_compiler
+        from distutils.sysconfig import customize_compiler
+
+        # The extension as configured by setup_package, including --no-mkl
+        ext = self.distribution.ext_modules[0]
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        libraries = list(ext.libraries)
+        if compiler.compiler_type == 'msvc':
+            libraries = ['lib' + lib for lib in libraries] + ['psapi']
+        sources = ext.sources + [
+            os.path.join('eqcorrscan', 'utils', 'src', 'bench', 'benchmark.c')]
+        objects = compiler.compile(
+            sources, output_dir=os.path.join(self.build_dir, 'obj'),
+            include_dirs=ext.include_dirs,
+            extra_postargs=ext.extra_compile_args)
+        compiler.link_executable(
+            objects, 'eqcorrscan_bench', output_dir=self.build_dir,
+            libraries=libraries, library_dirs=ext.library_dirs,
+            extra_postargs=ext.extra_link_args)
+        print("Built {0}".format(os.path.join(
+            self.build_dir, compiler.executable_filename('eqcorrscan_bench'))))
+
+
 def setup_package():
 
     # Figure out whether to add ``*_requires = ['numpy']``.
@@ -395,7 +440,8 @@ def setup_package():
         'tests_require': ['pytest>=2.0.0', 'pytest-cov', 'pytest-pep8',
                           'pytest-xdist', 'pytest-rerunfailures',
                           'obspy>=1.1.0'],
-        'cmdclass': {'build_ext': CustomBuildExt}
+        'cmdclass': {'build_ext': CustomBuildExt,
+                     'build_bench': BuildBenchmark}
     }
 
     if using_setuptools: